@@ -0,0 +1,486 @@
+#include "lib/Directory.h"
+#include "lib/Filesystem.h"
+#include "lib/blocks/StackBasedBlockManager.h"
+#include "lib/inodes/LinearINodeManager.h"
+#include "lib/storage/FileStorage.h"
+#include "lib/storage/MemoryStorage.h"
+
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <cstring>
+#include <getopt.h>
+#include <memory>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Microbenchmarks for the library layer, without a FUSE mount:
+//
+//   make bench && bin/bench --benchmark_filter=Directory
+//
+// Filesystem benchmarks run on two stacks: the in-memory one (fuse
+// without -f) and a disk file on tmpfs with the page cache and journal
+// (fuse -f).  Only one filesystem exists at a time, since the one with
+// a triple-indirect file in it takes over a gigabyte.
+
+// Anonymous namespace for file-local helpers:
+namespace {
+  const char*    SCRATCH = "/dev/shm/sigsegv-bench"; // Should be on tmpfs.
+  const uint64_t NBLOCKS = 400000;
+
+  // Where each level of block pointers starts, in blocks, and the end
+  // of the file used to measure them.
+  const uint64_t PER_BLOCK = Block::SIZE / sizeof(Block::ID);
+  const uint64_t LEVELS[5] = {
+    0,
+    INode::DIRECT_POINTERS,
+    INode::DIRECT_POINTERS + PER_BLOCK,
+    INode::DIRECT_POINTERS + PER_BLOCK + PER_BLOCK * PER_BLOCK,
+    INode::DIRECT_POINTERS + PER_BLOCK + PER_BLOCK * PER_BLOCK + 4096
+  };
+
+  enum Backend {MEMORY, TMPFS};
+  const char* BACKENDS[2] = {"memory", "tmpfs"};
+
+  struct Volume {
+    Backend     backend;
+    Filesystem* fs;
+    INode::ID   big;   // A file reaching into the triple indirect blocks.
+    uint64_t    names; // For unique file names.
+  };
+
+  std::unique_ptr<Volume> current;
+
+  void unmount() {
+    if(current) {
+      delete current->fs;
+      current.reset();
+      unlink(SCRATCH);
+    }
+  }
+
+  Volume& volume(Backend backend) {
+    if(current && current->backend == backend) {
+      return *current;
+    }
+
+    unmount();
+    std::string count = std::to_string(NBLOCKS);
+    std::vector<const char*> args = {"bench", "-n", count.c_str(), "-q", "-q", "-q"};
+    if(backend == TMPFS) {
+      args.push_back("-f");
+      args.push_back(SCRATCH);
+    }
+
+    args.push_back(NULL);
+    optind = 1;
+
+    current.reset(new Volume);
+    current->backend = backend;
+    current->fs      = new Filesystem(args.size() - 1, (char**) &args[0], true);
+    current->big     = 0;
+    current->names   = 0;
+    return *current;
+  }
+
+  INode::ID create(Filesystem& fs, const std::string& dir, const std::string& name, FileType type = FileType::REGULAR) {
+    Directory parent = fs.getDirectory(dir);
+    INode::ID id = fs.newINodeID();
+    INode inode(type, 0644);
+    if(type == FileType::DIRECTORY) {
+      inode.links = 2;
+      fs.save(id, inode);
+      fs.save(Directory(id, parent.id()));
+    }
+    else {
+      fs.save(id, inode);
+    }
+
+    parent.insert(name, id);
+    fs.save(parent);
+    return id;
+  }
+
+  void remove(Filesystem& fs, const std::string& dir, const std::string& name) {
+    Directory parent = fs.getDirectory(dir);
+    INode::ID id = parent.search(name);
+    parent.remove(name);
+    fs.save(parent);
+    fs.unlink(id);
+  }
+
+  // Made the first time it's needed, since writing it takes a while.
+  INode::ID bigFile(Volume& volume) {
+    if(volume.big == 0) {
+      std::vector<char> chunk(256 * Block::SIZE, 'x');
+      uint64_t size = LEVELS[4] * Block::SIZE;
+      volume.big = create(*volume.fs, "/", "big");
+      for(uint64_t offset = 0; offset < size; offset += chunk.size()) {
+        volume.fs->write(volume.big, &chunk[0], std::min<uint64_t>(chunk.size(), size - offset), offset);
+      }
+    }
+
+    return volume.big;
+  }
+
+  std::string name(uint64_t n) {
+    return "f" + std::to_string(n);
+  }
+}
+
+// Raw Storage backends ------------------------------------------------
+
+static void BM_Storage(benchmark::State& state) {
+  const uint64_t count = 65536;
+  bool file   = state.range(0);
+  bool write  = state.range(1);
+  bool random = state.range(2);
+  uint64_t run = state.range(3);
+
+  std::unique_ptr<Storage> storage;
+  if(file) {
+    storage.reset(new FileStorage(SCRATCH, count));
+    Block block;
+    std::memset(block.data, 0, Block::SIZE);
+    storage->set(count - 1, block);
+  }
+  else {
+    storage.reset(new MemoryStorage(count));
+  }
+
+  std::vector<Block> blocks(run);
+  std::mt19937_64 rng(42);
+  uint64_t next = 0;
+  for(auto _: state) {
+    Block::ID id = random ? rng() % (count - run) : next;
+    next = (next + run) % (count - run);
+    if(write) storage->setRange(id, &blocks[0], run);
+    else      storage->getRange(id, &blocks[0], run);
+  }
+
+  state.SetBytesProcessed(state.iterations() * run * Block::SIZE);
+  state.SetLabel(std::string(file ? "tmpfs " : "memory ") + (random ? "random " : "sequential ") + (write ? "write" : "read"));
+  storage.reset();
+  unlink(SCRATCH);
+}
+BENCHMARK(BM_Storage)->ArgNames({"file", "write", "random", "blocks"})
+  ->ArgsProduct({{0, 1}, {0, 1}, {0, 1}, {1, 64}});
+
+// Block and INode managers ------------------------------------------
+
+struct Managers {
+  MemoryStorage          disk;
+  StackBasedBlockManager blocks;
+  LinearINodeManager     inodes;
+  Filesystem             fs; // Only used for mkfs.
+
+  Managers(uint64_t nblocks): disk(nblocks), blocks(disk), inodes(disk), fs(blocks, inodes) {
+    fs.mkfs(nblocks, nblocks / 10);
+  }
+};
+
+static void BM_BlockReserveRelease(benchmark::State& state) {
+  Managers managers(65536);
+  std::vector<Block::ID> ids(state.range(0));
+  for(auto _: state) {
+    for(Block::ID& id: ids) id = managers.blocks.reserve();
+    if(ids.size() == 1) managers.blocks.release(ids[0]);
+    else                managers.blocks.release(ids);
+  }
+
+  state.SetItemsProcessed(state.iterations() * ids.size());
+}
+BENCHMARK(BM_BlockReserveRelease)->ArgName("batch")->Arg(1)->Arg(256);
+
+static void BM_INodeGet(benchmark::State& state) {
+  Managers managers(65536);
+  std::mt19937_64 rng(42);
+  INode inode;
+  for(auto _: state) {
+    managers.inodes.get(1 + rng() % 10000, inode);
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_INodeGet);
+
+static void BM_INodeSet(benchmark::State& state) {
+  Managers managers(65536);
+  std::mt19937_64 rng(42);
+  INode inode(FileType::REGULAR, 0644);
+  for(auto _: state) {
+    managers.inodes.set(1 + rng() % 10000, inode);
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_INodeSet);
+
+static void BM_INodeReserveRelease(benchmark::State& state) {
+  Managers managers(65536);
+  for(auto _: state) {
+    managers.inodes.release(managers.inodes.reserve());
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_INodeReserveRelease);
+
+// Directory (de)serialization ----------------------------------------
+
+static Directory directory(uint64_t size) {
+  Directory dir(1, 1);
+  for(uint64_t i = 0; i < size; ++i) {
+    dir.insert(name(i), i + 2);
+  }
+
+  return dir;
+}
+
+static void BM_DirectorySerialize(benchmark::State& state) {
+  Directory dir = directory(state.range(0));
+  for(auto _: state) {
+    benchmark::DoNotOptimize(dir.serialize());
+  }
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DirectorySerialize)->ArgName("entries")->RangeMultiplier(10)->Range(10, 1000000);
+
+static void BM_DirectoryParse(benchmark::State& state) {
+  std::vector<char> data = directory(state.range(0)).serialize();
+  for(auto _: state) {
+    Directory dir(1, &data[0], data.size());
+    benchmark::DoNotOptimize(dir.id());
+  }
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DirectoryParse)->ArgName("entries")->RangeMultiplier(10)->Range(10, 1000000);
+
+static void BM_DirectorySearch(benchmark::State& state) {
+  Directory dir = directory(state.range(0));
+  std::vector<std::string> names;
+  for(uint64_t i = 0; i < 1024; ++i) names.push_back(name(i * 7919 % state.range(0)));
+
+  uint64_t i = 0;
+  for(auto _: state) {
+    benchmark::DoNotOptimize(dir.search(names[i++ % names.size()]));
+  }
+}
+BENCHMARK(BM_DirectorySearch)->ArgName("entries")->RangeMultiplier(10)->Range(10, 1000000);
+
+static void BM_DirectoryInsertRemove(benchmark::State& state) {
+  Directory dir = directory(state.range(0));
+  for(auto _: state) {
+    dir.insert("new", 1);
+    dir.remove("new");
+  }
+}
+BENCHMARK(BM_DirectoryInsertRemove)->ArgName("entries")->RangeMultiplier(10)->Range(10, 1000000);
+
+// Whole filesystem ---------------------------------------------------
+
+static void BM_Create(benchmark::State& state) {
+  Volume& vol = volume(Backend(state.range(0)));
+  Filesystem& fs = *vol.fs;
+  std::string dir = "create" + std::to_string(vol.names++);
+  create(fs, "/", dir, FileType::DIRECTORY);
+
+  // A directory per 256 files keeps this from measuring directory size.
+  uint64_t n = 0;
+  for(auto _: state) {
+    if(n % 256 == 0) create(fs, "/" + dir, "d" + std::to_string(n / 256), FileType::DIRECTORY);
+    create(fs, "/" + dir + "/d" + std::to_string(n / 256), name(n));
+    n += 1;
+  }
+
+  for(uint64_t i = 0; i < n; ++i) {
+    remove(fs, "/" + dir + "/d" + std::to_string(i / 256), name(i));
+    if(i % 256 == 255 || i == n - 1) remove(fs, "/" + dir, "d" + std::to_string(i / 256));
+  }
+
+  remove(fs, "/", dir);
+  state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_Stat(benchmark::State& state) {
+  Volume& vol = volume(Backend(state.range(0)));
+  Filesystem& fs = *vol.fs;
+  std::string dir = "stat" + std::to_string(vol.names++);
+  create(fs, "/", dir, FileType::DIRECTORY);
+  for(uint64_t i = 0; i < 256; ++i) create(fs, "/" + dir, name(i));
+
+  uint64_t n = 0;
+  for(auto _: state) {
+    benchmark::DoNotOptimize(fs.getINode("/" + dir + "/" + name(n++ % 256)));
+  }
+
+  for(uint64_t i = 0; i < 256; ++i) remove(fs, "/" + dir, name(i));
+  remove(fs, "/", dir);
+  state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_Unlink(benchmark::State& state) {
+  Volume& vol = volume(Backend(state.range(0)));
+  Filesystem& fs = *vol.fs;
+  std::string dir = "unlink" + std::to_string(vol.names++);
+  create(fs, "/", dir, FileType::DIRECTORY);
+
+  uint64_t total = state.max_iterations;
+  for(uint64_t i = 0; i < total; ++i) {
+    if(i % 256 == 0) create(fs, "/" + dir, "d" + std::to_string(i / 256), FileType::DIRECTORY);
+    create(fs, "/" + dir + "/d" + std::to_string(i / 256), name(i));
+  }
+
+  uint64_t n = 0;
+  for(auto _: state) {
+    remove(fs, "/" + dir + "/d" + std::to_string(n / 256), name(n));
+    n += 1;
+  }
+
+  for(uint64_t i = 0; i < total; i += 256) remove(fs, "/" + dir, "d" + std::to_string(i / 256));
+  remove(fs, "/", dir);
+  state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_Lookup(benchmark::State& state) {
+  Volume& vol = volume(Backend(state.range(0)));
+  Filesystem& fs = *vol.fs;
+  uint64_t entries = state.range(1);
+  std::string dir = "lookup" + std::to_string(vol.names++);
+  create(fs, "/", dir, FileType::DIRECTORY);
+
+  // Building the directory one entry at a time is quadratic; write it
+  // out in one go instead.
+  Directory listing = fs.getDirectory("/" + dir);
+  for(uint64_t i = 0; i < entries; ++i) {
+    INode::ID id = fs.newINodeID();
+    fs.save(id, INode(FileType::REGULAR, 0644));
+    listing.insert(name(i), id);
+  }
+
+  fs.save(listing);
+  uint64_t n = 0;
+  for(auto _: state) {
+    benchmark::DoNotOptimize(fs.getINodeID("/" + dir + "/" + name(n++ * 7919 % entries)));
+  }
+
+  for(uint64_t i = 0; i < entries; ++i) {
+    fs.unlink(listing.search(name(i)));
+    listing.remove(name(i));
+  }
+
+  fs.save(listing);
+  remove(fs, "/", dir);
+  state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_SequentialWrite(benchmark::State& state) {
+  Volume& vol = volume(Backend(state.range(0)));
+  Filesystem& fs = *vol.fs;
+  std::string file = "seqw" + std::to_string(vol.names++);
+  INode::ID id = create(fs, "/", file);
+  const uint64_t limit = 64 << 20;
+
+  std::vector<char> chunk(state.range(1), 'w');
+  uint64_t offset = 0;
+  for(auto _: state) {
+    if(offset + chunk.size() > limit) {
+      state.PauseTiming();
+      fs.truncate(id, 0);
+      offset = 0;
+      state.ResumeTiming();
+    }
+
+    fs.write(id, &chunk[0], chunk.size(), offset);
+    offset += chunk.size();
+  }
+
+  remove(fs, "/", file);
+  state.SetBytesProcessed(state.iterations() * chunk.size());
+}
+
+static void BM_SequentialRead(benchmark::State& state) {
+  Volume& vol = volume(Backend(state.range(0)));
+  Filesystem& fs = *vol.fs;
+  std::string file = "seqr" + std::to_string(vol.names++);
+  INode::ID id = create(fs, "/", file);
+  const uint64_t size = 64 << 20;
+
+  std::vector<char> chunk(state.range(1), 'r');
+  for(uint64_t offset = 0; offset < size; offset += chunk.size()) {
+    fs.write(id, &chunk[0], chunk.size(), offset);
+  }
+
+  Readahead readahead;
+  uint64_t offset = 0;
+  for(auto _: state) {
+    fs.read(id, &chunk[0], chunk.size(), offset, &readahead);
+    offset = (offset + chunk.size()) % size;
+  }
+
+  remove(fs, "/", file);
+  state.SetBytesProcessed(state.iterations() * chunk.size());
+}
+
+// 4 KB at random blocks mapped through one level of pointers (0 for
+// direct, 3 for triple indirect).
+static void BM_RandomRead(benchmark::State& state) {
+  Volume& vol = volume(Backend(state.range(0)));
+  int level = state.range(1);
+  INode::ID id = bigFile(vol);
+
+  std::vector<char> buffer(Block::SIZE);
+  std::mt19937_64 rng(42);
+  for(auto _: state) {
+    uint64_t block = LEVELS[level] + rng() % (LEVELS[level + 1] - LEVELS[level]);
+    vol.fs->read(id, &buffer[0], Block::SIZE, block * Block::SIZE);
+  }
+
+  state.SetBytesProcessed(state.iterations() * Block::SIZE);
+}
+
+static void BM_RandomWrite(benchmark::State& state) {
+  Volume& vol = volume(Backend(state.range(0)));
+  int level = state.range(1);
+  INode::ID id = bigFile(vol);
+
+  std::vector<char> buffer(Block::SIZE, 'z');
+  std::mt19937_64 rng(42);
+  for(auto _: state) {
+    uint64_t block = LEVELS[level] + rng() % (LEVELS[level + 1] - LEVELS[level]);
+    vol.fs->write(id, &buffer[0], Block::SIZE, block * Block::SIZE);
+  }
+
+  state.SetBytesProcessed(state.iterations() * Block::SIZE);
+}
+
+// Registered per backend, so that each filesystem is only made once.
+static void filesystemBenchmarks(Backend backend) {
+  std::string suffix = std::string("/") + BACKENDS[backend];
+  benchmark::RegisterBenchmark(("BM_Create" + suffix).c_str(), BM_Create)->Arg(backend);
+  benchmark::RegisterBenchmark(("BM_Stat" + suffix).c_str(), BM_Stat)->Arg(backend);
+  benchmark::RegisterBenchmark(("BM_Unlink" + suffix).c_str(), BM_Unlink)->Arg(backend)->Iterations(20000);
+  benchmark::RegisterBenchmark(("BM_Lookup" + suffix).c_str(), BM_Lookup)
+    ->Args({backend, 10})->Args({backend, 1000})->Args({backend, 100000});
+  benchmark::RegisterBenchmark(("BM_SequentialWrite" + suffix).c_str(), BM_SequentialWrite)
+    ->Args({backend, 4096})->Args({backend, 65536});
+  benchmark::RegisterBenchmark(("BM_SequentialRead" + suffix).c_str(), BM_SequentialRead)
+    ->Args({backend, 4096})->Args({backend, 65536});
+  for(int level = 0; level < 4; ++level) {
+    benchmark::RegisterBenchmark(("BM_RandomRead" + suffix).c_str(), BM_RandomRead)->Args({backend, level});
+    benchmark::RegisterBenchmark(("BM_RandomWrite" + suffix).c_str(), BM_RandomWrite)->Args({backend, level});
+  }
+}
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  filesystemBenchmarks(MEMORY);
+  filesystemBenchmarks(TMPFS);
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  unmount();
+  return 0;
+}
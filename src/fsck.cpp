@@ -1,4 +1,1370 @@
-int main() {
-  // Main function for FSCK (if we get around to it).
-  return 0;
+#include "lib/Directory.h"
+#include "lib/Filesystem.h"
+#include "lib/INode.h"
+#include "lib/Superblock.h"
+#include "lib/blocks/FragmentManager.h"
+#include "lib/blocks/StackBasedBlockManager.h"
+#include "lib/inodes/LinearINodeManager.h"
+#include "lib/inodes/SnapshotINodeManager.h"
+#include "lib/storage/ChecksumStorage.h"
+#include "lib/storage/FileStorage.h"
+#include "lib/storage/Journal.h"
+#include "lib/storage/LogStorage.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+// Checks (and with -y, repairs) an unmounted filesystem.
+//
+// Pass 1 reads the INode table in big chunks, one chunk per thread at a
+// time, and walks every file's pointer tree.  Each data block it meets
+// sets a bit in a shared bitmap; a block whose bit was already set is
+// shared (by a snapshot, a reflink or dedup), so it's only counted, and
+// an indirect block is only descended into the first time.  Nothing
+// else is read, so the time taken grows with the metadata, not with the
+// data.  Later passes parse the directories, walk the snapshots and the
+// fragment chain, and compare what was found against the link counts,
+// the reference count table, the orphan list and the free list.
+
+typedef std::chrono::steady_clock Clock;
+
+// Exit codes, as for e2fsck.
+const int CLEAN       = 0;
+const int FIXED       = 1;
+const int UNFIXED     = 4;
+const int OPERATIONAL = 8;
+
+// Same layout as the ones in StackBasedBlockManager and FragmentManager.
+struct FreeListConfig {
+  uint64_t  magic;
+  Block::ID top_block;
+  uint64_t  top_index;
+  uint64_t  last_index;
+  Block::ID last_block;
+  Block::ID first_block;
+  Block::ID lazy_block;
+};
+
+struct FragmentHeader {
+  uint64_t  magic;
+  Block::ID next;
+  INode::ID owners[FragmentManager::COUNT + 1];
+};
+
+const uint64_t FRAGMENT_MAGIC = 0x5347534654414953;
+const uint64_t POINTERS       = Block::SIZE / sizeof(Block::ID);
+const uint64_t PER_BLOCK      = Block::SIZE / INode::SIZE;
+const uint64_t MAX_BLOCKS     = INode::DIRECT_POINTERS + POINTERS + POINTERS * POINTERS + POINTERS * POINTERS * POINTERS;
+const uint64_t REFCOUNTS      = Block::SIZE / sizeof(uint16_t);
+const uint16_t INDEXED        = 0x8000;
+const uint16_t COUNT          = 0x7fff;
+
+const uint64_t TABLE_CHUNK    = 64;   // INode table blocks per read.
+const uint64_t LIST_CHUNK     = 256;  // Free list or reference count blocks per read.
+const uint64_t EXAMPLES       = 10;   // Problems of each kind shown without -v.
+
+// One bit per block, safe to set from any thread.
+class Bitmap {
+public:
+  Bitmap(uint64_t size): words((size + 63) / 64), bits(new std::atomic<uint64_t>[words]) {
+    for(uint64_t i = 0; i < words; ++i) bits[i].store(0, std::memory_order_relaxed);
+  }
+
+  // Returns whether the bit was already set.
+  bool set(uint64_t i) {
+    uint64_t mask = uint64_t(1) << (i % 64);
+    return bits[i / 64].fetch_or(mask, std::memory_order_relaxed) & mask;
+  }
+
+  bool get(uint64_t i) const {
+    return bits[i / 64].load(std::memory_order_relaxed) & (uint64_t(1) << (i % 64));
+  }
+
+  uint64_t word(uint64_t w) const {
+    return bits[w].load(std::memory_order_relaxed);
+  }
+
+private:
+  uint64_t words;
+  std::unique_ptr<std::atomic<uint64_t>[]> bits;
+};
+
+// A packed tail, to be checked against the fragment chain.
+struct Tail {
+  INode::ID owner;
+  Block::ID block;
+  uint32_t  index;
+  uint64_t  size;
+};
+
+struct Worker {
+  std::vector<Block::ID> extra;       // Blocks met again after the first time.
+  std::vector<INode::ID> directories;
+  std::vector<Tail>      tails;       // Live ones only.
+  std::set<Block::ID>    snapshot_tails;
+  std::vector<std::pair<INode::ID, INode::ID>> dotdots; // Directory and its "..".
+  std::set<INode::ID>    bad_entries; // Directories with entries to drop.
+  uint64_t files;
+  uint64_t blocks;
+  std::thread thread;
+  std::exception_ptr error;
+
+  Worker(): files(0), blocks(0) {}
+};
+
+static void usage(const char* message = NULL) {
+  if(message) std::cerr << message << "\n\n";
+  std::cerr << "USAGE: fsck [options] <disk-file>\n";
+  std::cerr << "  --yes     -y        Fix what can be fixed (the default is to only report).\n";
+  std::cerr << "  --no      -n        Change nothing, not even the journal (the default).\n";
+  std::cerr << "  --threads -t <num>  Worker threads (defaults to one per CPU).\n";
+  std::cerr << "  --verbose -v        List every problem, not just the first few of each kind.\n";
+  std::cerr << "Exits with 0 if the filesystem is clean, 1 if every problem was fixed,\n";
+  std::cerr << "4 if problems are left and 8 if it couldn't be checked.\n";
+  exit(OPERATIONAL);
+}
+
+class Checker {
+public:
+  Checker(Storage& storage, uint64_t nthreads, bool repair, bool verbose);
+
+  void check();
+  void fix();
+  void summary(double seconds);
+  int  status() const;
+
+private:
+  Storage*       storage;
+  bool           repair;
+  bool           verbose;
+  Block          super_block;
+  Superblock*    superblock;
+  std::vector<Worker> workers;
+
+  Block::ID      data_start;
+  Block::ID      data_end;    // Blocks in [data_start, data_end) can be allocated.
+  uint64_t       ninodes;
+  uint64_t       inode_ready; // Table blocks mkfs (or a mount since) has written.
+  uint64_t       refcount_ready;
+  std::unique_ptr<Bitmap> used;   // Blocks that something points to.
+  std::unique_ptr<Bitmap> listed; // Blocks on the free list.
+  std::vector<uint8_t>  types;
+  std::vector<uint16_t> links;
+  std::unique_ptr<std::atomic<uint32_t>[]>  names;   // Entries naming each INode.
+  std::unique_ptr<std::atomic<INode::ID>[]> parents; // Directory naming each directory.
+
+  std::vector<Block::ID> extra;     // Sorted; one per reference past the first.
+  std::set<Block::ID>    fragment_blocks;
+  std::set<INode::ID>    orphans;
+  std::set<INode::ID>    cleared;   // INodes with a bad type.
+  std::set<INode::ID>    bad_entries;
+  std::map<INode::ID, uint16_t> link_fixes;
+  std::vector<INode::ID> unattached;
+  std::atomic<bool>      damaged_directory;
+  bool                   rebuild_free_list;
+  bool                   rewrite_orphans;
+  std::vector<std::pair<Block::ID, uint32_t>> owner_fixes; // Fragment block and index.
+
+  uint64_t       nfree_inodes;
+  uint64_t       nfree_blocks;
+  uint64_t       found;
+  std::map<std::string, uint64_t> kinds;
+  std::set<std::string>           repaired;
+  std::mutex     mutex;
+
+  void problem(const std::string& kind, const std::string& detail);
+  void fixedAll(const std::string& kind);
+  void pass(int n, const char* name, Clock::time_point start);
+  void parallel(uint64_t count, uint64_t chunk, const std::function<void(Worker&, uint64_t, uint64_t)>& fn);
+  bool inData(Block::ID id) const;
+  void readFreeList(uint64_t first, Block* blocks, uint64_t count);
+
+  void scanTable(Worker& worker, const Block& table, INode::ID first, bool live);
+  void scanINode(Worker& worker, INode::ID id, const INode& inode, bool live);
+  void walk(Worker& worker, INode::ID id, const INode& inode, Block::ID bid, int level, uint64_t base, std::vector<Block::ID>* leaves);
+  bool contents(INode::ID id, const INode& inode, std::vector<char>& data);
+  void checkDirectory(Worker& worker, INode::ID id);
+
+  void checkINodes();
+  void checkDirectories();
+  void checkSnapshots();
+  void checkFragments();
+  void checkLinks();
+  void checkReferences();
+  void checkFreeList();
+
+  void fixINodes();
+  void fixDirectories();
+  void fixFreeList();
+};
+
+Checker::Checker(Storage& storage, uint64_t nthreads, bool repair, bool verbose):
+  storage(&storage),
+  repair(repair),
+  verbose(verbose),
+  superblock((Superblock*) super_block.data),
+  workers(nthreads),
+  data_start(0),
+  data_end(0),
+  ninodes(0),
+  inode_ready(0),
+  refcount_ready(0),
+  damaged_directory(false),
+  rebuild_free_list(false),
+  rewrite_orphans(false),
+  nfree_inodes(0),
+  nfree_blocks(0),
+  found(0)
+{
+  // Nothing else to do.
+}
+
+void Checker::problem(const std::string& kind, const std::string& detail) {
+  std::lock_guard<std::mutex> lock(mutex);
+  found += 1;
+  uint64_t seen = kinds[kind]++;
+  if(verbose || seen < EXAMPLES) {
+    std::cout << "  " << kind << ": " << detail << '\n';
+  }
+  else if(seen == EXAMPLES) {
+    std::cout << "  " << kind << ": (more not shown; use -v to list them all)\n";
+  }
+}
+
+// Marks every problem of this kind as fixed.
+void Checker::fixedAll(const std::string& kind) {
+  if(kinds.count(kind) != 0) repaired.insert(kind);
+}
+
+void Checker::pass(int n, const char* name, Clock::time_point start) {
+  std::chrono::duration<double> took = Clock::now() - start;
+  std::cout << "Pass " << n << ": " << name << " (" << std::fixed << std::setprecision(2) << took.count() << " s)\n";
+  std::cout.unsetf(std::ios::floatfield);
+}
+
+// Hands out [0, count) in chunks to the worker threads.
+void Checker::parallel(uint64_t count, uint64_t chunk, const std::function<void(Worker&, uint64_t, uint64_t)>& fn) {
+  std::atomic<uint64_t> next(0);
+  for(Worker& worker: workers) {
+    worker.thread = std::thread([&, chunk, count]() {
+      try {
+        uint64_t first;
+        while((first = next.fetch_add(chunk)) < count) {
+          fn(worker, first, std::min(count, first + chunk));
+        }
+      }
+      catch(...) {
+        worker.error = std::current_exception();
+      }
+    });
+  }
+
+  for(Worker& worker: workers) {
+    worker.thread.join();
+  }
+
+  for(Worker& worker: workers) {
+    if(worker.error) {
+      std::exception_ptr error = worker.error;
+      worker.error = nullptr;
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+bool Checker::inData(Block::ID id) const {
+  return id >= data_start && id < data_end;
+}
+
+// Reads free list blocks, counting up from the last one.  Those that
+// were never written since mkfs hold what it would have put in them.
+void Checker::readFreeList(uint64_t first, Block* blocks, uint64_t count) {
+  FreeListConfig* config = (FreeListConfig*) superblock->data_config;
+  Block::ID id = config->last_block + first;
+  uint64_t  n  = 0;
+  while(n < count && id + n < config->lazy_block) {
+    Block::ID* entries = (Block::ID*) blocks[n].data;
+    Block::ID  base    = data_start + (config->first_block - (id + n)) * POINTERS;
+    for(uint64_t i = 0; i < POINTERS; ++i) {
+      entries[i] = base + (POINTERS - 1 - i);
+    }
+
+    n += 1;
+  }
+
+  if(n < count) {
+    storage->getRange(id + n, &blocks[n], count - n);
+  }
+}
+
+void Checker::check() {
+  storage->get(0, super_block);
+  if(superblock->magic != 3199905246 || superblock->block_size != Block::SIZE) {
+    throw std::runtime_error("Not a filesystem (bad superblock magic or block size).");
+  }
+
+  uint64_t nblocks = superblock->block_count;
+  const std::pair<Block::ID, uint64_t> regions[] = {
+    {superblock->inode_block_start,    superblock->inode_block_count},
+    {superblock->data_block_start,     superblock->data_block_count},
+    {superblock->journal_block_start,  superblock->journal_block_count},
+    {superblock->refcount_block_start, superblock->refcount_block_count},
+    {superblock->dedup_block_start,    superblock->dedup_block_count},
+    {superblock->checksum_block_start, superblock->checksum_block_count}
+  };
+
+  for(const auto& region: regions) {
+    if(region.first > nblocks || region.second > nblocks - region.first) {
+      throw std::runtime_error("Superblock describes regions past the end of the disk.");
+    }
+  }
+
+  if(superblock->inode_block_count == 0 || superblock->data_block_count == 0) {
+    throw std::runtime_error("Superblock has no INode table or no data region.");
+  }
+
+  data_start = superblock->data_block_start;
+  data_end   = data_start + superblock->data_block_count;
+  ninodes    = superblock->inode_block_count * PER_BLOCK;
+
+  // The tables are zero past what's been initialized.
+  inode_ready    = superblock->inode_block_ready;
+  refcount_ready = superblock->refcount_block_ready;
+  if(inode_ready == 0 || inode_ready > superblock->inode_block_count) {
+    inode_ready = superblock->inode_block_count;
+  }
+  if(refcount_ready == 0 || refcount_ready > superblock->refcount_block_count) {
+    refcount_ready = superblock->refcount_block_count;
+  }
+
+  used.reset(new Bitmap(nblocks - data_start));
+  listed.reset(new Bitmap(nblocks - data_start));
+
+  types.assign(ninodes, FileType::FREE);
+  links.assign(ninodes, 0);
+  names.reset(new std::atomic<uint32_t>[ninodes]);
+  parents.reset(new std::atomic<INode::ID>[ninodes]);
+  for(uint64_t i = 0; i < ninodes; ++i) {
+    names[i].store(0, std::memory_order_relaxed);
+    parents[i].store(0, std::memory_order_relaxed);
+  }
+
+  Clock::time_point start = Clock::now();
+  checkINodes();
+  pass(1, "INodes and block pointers", start);
+
+  start = Clock::now();
+  checkDirectories();
+  pass(2, "directory structure", start);
+
+  start = Clock::now();
+  checkSnapshots();
+
+  // Every reference from a file has been seen now.
+  for(Worker& worker: workers) {
+    extra.insert(extra.end(), worker.extra.begin(), worker.extra.end());
+    worker.extra.clear();
+    worker.extra.shrink_to_fit();
+  }
+
+  std::sort(extra.begin(), extra.end());
+  checkFragments();
+  pass(3, "snapshots and fragments", start);
+
+  start = Clock::now();
+  checkLinks();
+  checkReferences();
+  pass(4, "link and reference counts", start);
+
+  start = Clock::now();
+  checkFreeList();
+  pass(5, "free list", start);
+}
+
+void Checker::checkINodes() {
+  Block::ID table = superblock->inode_block_start;
+  parallel(inode_ready, TABLE_CHUNK, [&](Worker& worker, uint64_t first, uint64_t last) {
+    // One big read per chunk keeps the disk streaming.
+    std::vector<Block> blocks(last - first);
+    storage->getRange(table + first, &blocks[0], last - first);
+    for(uint64_t b = first; b < last; ++b) {
+      scanTable(worker, blocks[b - first], b * PER_BLOCK, true);
+    }
+  });
+
+  INode::ID root = 1;
+  if(types[root] != FileType::DIRECTORY) {
+    throw std::runtime_error("The root INode is not a directory.");
+  }
+}
+
+void Checker::scanTable(Worker& worker, const Block& table, INode::ID first, bool live) {
+  const INode* inodes = (const INode*) table.data;
+  for(uint64_t i = 0; i < PER_BLOCK; ++i) {
+    scanINode(worker, first + i, inodes[i], live);
+  }
+}
+
+void Checker::scanINode(Worker& worker, INode::ID id, const INode& inode, bool live) {
+  if(inode.type == FileType::FREE || inode.type == FileType::RESERVED) {
+    return;
+  }
+
+  std::string where = (live ? "INode " : "Snapshot INode ") + std::to_string(id);
+  if(inode.type != FileType::REGULAR && inode.type != FileType::DIRECTORY && inode.type != FileType::SYMLINK) {
+    problem("Bad INode type", where + " has type " + std::to_string(inode.type));
+    if(live) {
+      std::lock_guard<std::mutex> lock(mutex);
+      cleared.insert(id);
+    }
+
+    return;
+  }
+
+  if(live) {
+    types[id] = inode.type;
+    links[id] = inode.links;
+    worker.files += 1;
+    if(inode.type == FileType::DIRECTORY) {
+      worker.directories.push_back(id);
+    }
+  }
+
+  if(inode.flags & INode::INLINE_DATA) {
+    if(inode.size > INode::INLINE_SIZE) {
+      problem("Bad size", where + " keeps " + std::to_string(inode.size) + " bytes inline");
+    }
+
+    return;
+  }
+
+  if(inode.blocks > MAX_BLOCKS) {
+    problem("Bad size", where + " claims " + std::to_string(inode.blocks) + " blocks");
+    return;
+  }
+
+  uint64_t room = inode.blocks * Block::SIZE;
+  if(inode.flags & INode::TAIL_PACKED) {
+    room += FragmentManager::MAX_TAIL;
+    if(inode.size <= inode.blocks * Block::SIZE || inode.tail_index == 0 || inode.tail_index > FragmentManager::COUNT) {
+      problem("Bad tail", where + " has a packed tail at fragment " + std::to_string(inode.tail_index) + " but size " + std::to_string(inode.size));
+    }
+    else if(live) {
+      worker.tails.push_back(Tail{id, inode.tail_block, inode.tail_index, inode.size - inode.blocks * Block::SIZE});
+    }
+    else {
+      worker.snapshot_tails.insert(inode.tail_block);
+    }
+  }
+
+  if(inode.size > room) {
+    problem("Bad size", where + " is " + std::to_string(inode.size) + " bytes long but has " + std::to_string(inode.blocks) + " blocks");
+  }
+
+  for(uint64_t j = 0; j < INode::DIRECT_POINTERS && j < inode.blocks; ++j) {
+    walk(worker, id, inode, inode.block_pointers[j], 0, j, NULL);
+  }
+
+  uint64_t base = INode::DIRECT_POINTERS;
+  uint64_t span = POINTERS;
+  for(int level = 1; level <= 3 && base < inode.blocks; ++level) {
+    walk(worker, id, inode, inode.block_pointers[INode::DIRECT_POINTERS + level - 1], level, base, NULL);
+    base += span;
+    span *= POINTERS;
+  }
+}
+
+// Marks a subtree of a file's blocks as used.  With leaves set, only
+// collects the data blocks in order instead (pass 1 already complained
+// about anything wrong with them); bad ones come back as zero.
+void Checker::walk(Worker& worker, INode::ID id, const INode& inode, Block::ID bid, int level, uint64_t base, std::vector<Block::ID>* leaves) {
+  if(bid == 0 || !inData(bid)) {
+    if(leaves != NULL) {
+      if(level == 0) leaves->push_back(0);
+    }
+    else if(bid != 0) {
+      problem("Bad block pointer", "INode " + std::to_string(id) + " points to block " + std::to_string(bid) + ", outside the data region");
+    }
+    else if(!(inode.flags & INode::SPARSE) && (level > 0 || !(inode.flags & INode::COMPRESSED))) {
+      // Only compressed clusters and punched holes leave pointers empty;
+      // a hole over a whole indirect block's range takes that too.
+      problem("Missing block", "INode " + std::to_string(id) + " has no block for offset " + std::to_string(base * Block::SIZE));
+    }
+
+    return;
+  }
+
+  bool first = true;
+  if(leaves == NULL) {
+    worker.blocks += 1;
+    if(used->set(bid - data_start)) {
+      worker.extra.push_back(bid);
+      first = false;
+    }
+  }
+
+  if(level == 0) {
+    if(leaves != NULL) leaves->push_back(bid);
+    return;
+  }
+
+  // A subtree shared with a snapshot is only counted once.
+  if(!first) {
+    return;
+  }
+
+  uint64_t span = 1;
+  for(int i = 1; i < level; ++i) {
+    span *= POINTERS;
+  }
+
+  Block block;
+  storage->get(bid, block);
+  const Block::ID* refs = (const Block::ID*) block.data;
+  for(uint64_t i = 0; i < POINTERS && base + i * span < inode.blocks; ++i) {
+    walk(worker, id, inode, refs[i], level - 1, base + i * span, leaves);
+  }
+}
+
+// Reads a directory's contents.  Returns false if that's not possible.
+bool Checker::contents(INode::ID id, const INode& inode, std::vector<char>& data) {
+  if(inode.flags & INode::INLINE_DATA) {
+    data.assign(inode.inline_data, inode.inline_data + std::min<uint64_t>(inode.size, uint64_t(INode::INLINE_SIZE)));
+    return true;
+  }
+
+  if((inode.flags & INode::COMPRESSED) || inode.blocks > MAX_BLOCKS) {
+    return false;
+  }
+
+  Worker unused;
+  std::vector<Block::ID> leaves;
+  for(uint64_t j = 0; j < INode::DIRECT_POINTERS && j < inode.blocks; ++j) {
+    walk(unused, id, inode, inode.block_pointers[j], 0, j, &leaves);
+  }
+
+  uint64_t base = INode::DIRECT_POINTERS;
+  uint64_t span = POINTERS;
+  for(int level = 1; level <= 3 && base < inode.blocks; ++level) {
+    walk(unused, id, inode, inode.block_pointers[INode::DIRECT_POINTERS + level - 1], level, base, &leaves);
+    base += span;
+    span *= POINTERS;
+  }
+
+  uint64_t size = std::min<uint64_t>(inode.size, leaves.size() * Block::SIZE);
+  data.assign(size, 0);
+  for(uint64_t i = 0; i * Block::SIZE < size; ++i) {
+    if(leaves[i] == 0) continue;
+
+    Block block;
+    storage->get(leaves[i], block);
+    std::memcpy(&data[i * Block::SIZE], block.data, std::min(uint64_t(Block::SIZE), size - i * Block::SIZE));
+  }
+
+  if((inode.flags & INode::TAIL_PACKED) && inode.size > size && inData(inode.tail_block)) {
+    uint64_t offset = inode.tail_index * FragmentManager::SIZE;
+    uint64_t tail   = std::min<uint64_t>(inode.size - size, Block::SIZE - std::min(offset, uint64_t(Block::SIZE)));
+    Block block;
+    storage->get(inode.tail_block, block);
+    data.insert(data.end(), block.data + offset, block.data + offset + tail);
+  }
+
+  return true;
+}
+
+void Checker::checkDirectories() {
+  std::vector<INode::ID> directories;
+  for(Worker& worker: workers) {
+    directories.insert(directories.end(), worker.directories.begin(), worker.directories.end());
+    worker.directories.clear();
+  }
+
+  // Each thread takes a few at a time; big directories would stall a
+  // bigger chunk.
+  parallel(directories.size(), 16, [&](Worker& worker, uint64_t first, uint64_t last) {
+    for(uint64_t i = first; i < last; ++i) {
+      checkDirectory(worker, directories[i]);
+    }
+  });
+
+  for(Worker& worker: workers) {
+    bad_entries.insert(worker.bad_entries.begin(), worker.bad_entries.end());
+  }
+
+  // ".." has to name the directory that names this one.
+  for(Worker& worker: workers) {
+    for(const auto& dotdot: worker.dotdots) {
+      INode::ID parent = parents[dotdot.first].load();
+      if(dotdot.first == 1) parent = 1;
+      if(parent != 0 && dotdot.second != parent) {
+        problem("Wrong \"..\"", "Directory " + std::to_string(dotdot.first) + " says its parent is " + std::to_string(dotdot.second) + ", not " + std::to_string(parent));
+        bad_entries.insert(dotdot.first);
+      }
+    }
+
+    worker.dotdots.clear();
+  }
+
+  // Every named directory has to lead back up to the root.
+  std::vector<uint8_t> state(ninodes, 0); // 1: on the current path, 2: reaches the root.
+  state[1] = 2;
+  for(INode::ID dir: directories) {
+    std::vector<INode::ID> path;
+    INode::ID at = dir;
+    while(state[at] == 0 && parents[at].load() != 0) {
+      state[at] = 1;
+      path.push_back(at);
+      at = parents[at].load();
+    }
+
+    bool reaches = (state[at] == 2);
+    for(INode::ID id: path) {
+      state[id] = reaches ? 2 : 3;
+    }
+
+    if(!reaches && parents[dir].load() != 0) {
+      problem("Disconnected directory", "Directory " + std::to_string(dir) + " can't be reached from the root");
+    }
+  }
+}
+
+void Checker::checkDirectory(Worker& worker, INode::ID id) {
+  Block table;
+  storage->get(superblock->inode_block_start + id / PER_BLOCK, table);
+  const INode& inode = ((const INode*) table.data)[id % PER_BLOCK];
+
+  std::string where = "Directory " + std::to_string(id);
+  std::vector<char> data;
+  if(!contents(id, inode, data)) {
+    problem("Unreadable directory", where + " is compressed or too big");
+    damaged_directory = true;
+    return;
+  }
+
+  bool dot    = false;
+  bool dotdot = false;
+  std::unordered_set<std::string> seen;
+  size_t index = 0;
+  while(index < data.size()) {
+    // Same format as Directory::serialize, but checked as it goes.
+    const char* end = (const char*) (index + sizeof(INode::ID) < data.size() ? std::memchr(&data[index + sizeof(INode::ID)], '\0', data.size() - index - sizeof(INode::ID)) : NULL);
+    if(end == NULL) {
+      problem("Truncated directory", where + " ends part way through an entry at byte " + std::to_string(index));
+      worker.bad_entries.insert(id);
+      break;
+    }
+
+    INode::ID child;
+    std::memcpy(&child, &data[index], sizeof(INode::ID));
+    std::string name((const char*) &data[index + sizeof(INode::ID)], end);
+    index += sizeof(INode::ID) + name.size() + 1;
+
+    if(name.empty() || !seen.insert(name).second) {
+      problem("Bad entry", where + " has an empty or repeated name \"" + name + "\"");
+      worker.bad_entries.insert(id);
+      continue;
+    }
+
+    if(name == ".") {
+      dot = true;
+      if(child != id) {
+        problem("Wrong \".\"", where + " says \".\" is " + std::to_string(child));
+        worker.bad_entries.insert(id);
+      }
+
+      continue;
+    }
+
+    if(name == "..") {
+      dotdot = true;
+      worker.dotdots.push_back(std::make_pair(id, child));
+      continue;
+    }
+
+    if(child <= 1 || child >= ninodes || types[child] == FileType::FREE || types[child] == FileType::RESERVED) {
+      problem("Dangling entry", where + " names " + std::to_string(child) + " as \"" + name + "\", which isn't in use");
+      worker.bad_entries.insert(id);
+      continue;
+    }
+
+    names[child].fetch_add(1);
+    if(types[child] == FileType::DIRECTORY) {
+      INode::ID none = 0;
+      if(!parents[child].compare_exchange_strong(none, id)) {
+        problem("Directory linked twice", "Directory " + std::to_string(child) + " is in both " + std::to_string(none) + " and " + std::to_string(id));
+      }
+    }
+  }
+
+  if(!dot || !dotdot) {
+    problem("Missing \".\" or \"..\"", where + " is missing \"" + (dot ? ".." : ".") + "\"");
+    worker.bad_entries.insert(id);
+  }
+}
+
+// Snapshots keep copies of the INode table in blocks of their own, and
+// share everything they point to with the live filesystem.
+void Checker::checkSnapshots() {
+  std::vector<Block::ID> tables;
+  for(uint64_t s = 0; s < Superblock::MAX_SNAPSHOTS; ++s) {
+    const Superblock::Snapshot& snapshot = superblock->snapshots[s];
+    if(snapshot.name[0] == '\0') continue;
+
+    std::string where = "Snapshot " + std::string(snapshot.name, strnlen(snapshot.name, sizeof(snapshot.name)));
+    uint64_t seen = 0;
+    for(Block::ID id = snapshot.index; id != 0 && seen < superblock->inode_block_count;) {
+      if(!inData(id) || used->set(id - data_start)) {
+        problem("Bad snapshot", where + " has a bad or shared index block " + std::to_string(id));
+        break;
+      }
+
+      Block block;
+      const SnapshotIndex* index = (const SnapshotIndex*) block.data;
+      storage->get(id, block);
+      for(uint64_t i = 0; i < SnapshotIndex::COUNT && seen < superblock->inode_block_count; ++i, ++seen) {
+        Block::ID copy = index->tables[i];
+        if(copy == 0) continue;
+
+        if(!inData(copy) || used->set(copy - data_start)) {
+          problem("Bad snapshot", where + " has a bad or shared INode table block " + std::to_string(copy));
+          continue;
+        }
+
+        tables.push_back(copy);
+        tables.push_back(seen);
+      }
+
+      id = index->next;
+    }
+  }
+
+  parallel(tables.size() / 2, 16, [&](Worker& worker, uint64_t first, uint64_t last) {
+    for(uint64_t i = first; i < last; ++i) {
+      Block table;
+      storage->get(tables[2 * i], table);
+      scanTable(worker, table, tables[2 * i + 1] * PER_BLOCK, false);
+    }
+  });
+}
+
+void Checker::checkFragments() {
+  std::map<Block::ID, FragmentHeader> chain;
+  Block::ID id = superblock->fragment_head;
+  while(id != 0) {
+    if(!inData(id) || chain.count(id) != 0) {
+      problem("Bad fragment chain", "Fragment chain goes to block " + std::to_string(id));
+      break;
+    }
+
+    Block block;
+    storage->get(id, block);
+    const FragmentHeader* header = (const FragmentHeader*) block.data;
+    if(header->magic != FRAGMENT_MAGIC) {
+      problem("Bad fragment chain", "Block " + std::to_string(id) + " in the fragment chain isn't a fragment block");
+      break;
+    }
+
+    if(used->set(id - data_start)) {
+      problem("Shared fragment block", "Fragment block " + std::to_string(id) + " is also used by a file");
+    }
+
+    chain[id] = *header;
+    fragment_blocks.insert(id);
+    id = header->next;
+  }
+
+  // Snapshots can hold on to blocks that have left the chain.
+  std::set<Block::ID> shared;
+  for(Worker& worker: workers) {
+    for(Block::ID tail: worker.snapshot_tails) {
+      if(!inData(tail)) continue;
+      shared.insert(tail);
+      if(fragment_blocks.insert(tail).second) {
+        used->set(tail - data_start);
+      }
+    }
+  }
+
+  std::set<std::pair<Block::ID, uint32_t>> owned;
+  for(Worker& worker: workers) {
+    for(const Tail& tail: worker.tails) {
+      auto itr = chain.find(tail.block);
+      std::string where = "INode " + std::to_string(tail.owner);
+      uint64_t count = (tail.size + FragmentManager::SIZE - 1) / FragmentManager::SIZE;
+      if(itr == chain.end()) {
+        problem("Bad tail", where + " keeps its tail in block " + std::to_string(tail.block) + ", which isn't a fragment block");
+        continue;
+      }
+
+      if(tail.index + count - 1 > FragmentManager::COUNT) {
+        problem("Bad tail", where + " has a tail that runs off the end of block " + std::to_string(tail.block));
+        continue;
+      }
+
+      for(uint64_t f = tail.index; f < tail.index + count; ++f) {
+        owned.insert(std::make_pair(tail.block, f));
+        if(itr->second.owners[f] != tail.owner) {
+          problem("Bad tail", where + " has a tail in fragment " + std::to_string(f) + " of block " + std::to_string(tail.block) + ", which belongs to " + std::to_string(itr->second.owners[f]));
+        }
+      }
+    }
+
+    worker.tails.clear();
+  }
+
+  // Fragments whose owner has let go of them.  Blocks that a snapshot
+  // uses keep their owners until it's deleted (see FragmentManager).
+  for(const auto& entry: chain) {
+    if(shared.count(entry.first) != 0) continue;
+    for(uint32_t f = 1; f <= FragmentManager::COUNT; ++f) {
+      if(entry.second.owners[f] != 0 && owned.count(std::make_pair(entry.first, f)) == 0) {
+        problem("Leaked fragment", "Fragment " + std::to_string(f) + " of block " + std::to_string(entry.first) + " belongs to " + std::to_string(entry.second.owners[f]) + ", which doesn't use it");
+        owner_fixes.push_back(std::make_pair(entry.first, f));
+      }
+    }
+  }
+}
+
+void Checker::checkLinks() {
+  uint64_t count = superblock->orphan_count;
+  if(count > Superblock::MAX_ORPHANS) count = Superblock::MAX_ORPHANS;
+  if(superblock->orphan_count > Superblock::MAX_ORPHANS) {
+    problem("Bad orphan list", "The superblock lists " + std::to_string(superblock->orphan_count) + " orphans");
+    rewrite_orphans = true;
+  }
+
+  for(uint64_t i = 0; i < count; ++i) {
+    INode::ID id = superblock->orphans[i];
+    if(id <= 1 || id >= ninodes || types[id] == FileType::FREE || types[id] == FileType::RESERVED || !orphans.insert(id).second) {
+      problem("Bad orphan list", "Orphan " + std::to_string(id) + " is out of range, not in use or listed twice");
+      rewrite_orphans = true;
+    }
+  }
+
+  for(INode::ID id = 2; id < ninodes; ++id) {
+    if(types[id] == FileType::FREE || types[id] == FileType::RESERVED) {
+      nfree_inodes += 1;
+      continue;
+    }
+
+    uint32_t count = names[id].load();
+    if(orphans.count(id) != 0) {
+      if(count != 0) {
+        problem("Bad orphan list", "Orphan " + std::to_string(id) + " still has " + std::to_string(count) + " names");
+        rewrite_orphans = true;
+        orphans.erase(id);
+        link_fixes[id] = count;
+      }
+
+      continue;
+    }
+
+    if(count == 0) {
+      problem("Unattached INode", "INode " + std::to_string(id) + " is in use but has no name");
+      unattached.push_back(id);
+    }
+    else if(count != links[id]) {
+      problem("Wrong link count", "INode " + std::to_string(id) + " has " + std::to_string(links[id]) + " links, but " + std::to_string(count) + " names");
+      link_fixes[id] = std::min<uint32_t>(count, UINT16_MAX);
+    }
+  }
+}
+
+// Every reference to a block past the first should show up in its count.
+// Fragment blocks count the snapshot INodes with tails in them instead,
+// so they're skipped.
+void Checker::checkReferences() {
+  Block::ID table = superblock->refcount_block_start;
+  uint64_t  count = std::min(superblock->refcount_block_count, (data_end - data_start + REFCOUNTS - 1) / REFCOUNTS);
+  std::map<uint64_t, Block> unready; // Fixed blocks past refcount_ready.
+  parallel(count, LIST_CHUNK, [&](Worker&, uint64_t first, uint64_t last) {
+    std::vector<Block> blocks(last - first);
+    uint64_t ready = std::max(first, std::min(last, refcount_ready));
+    if(ready > first) {
+      storage->getRange(table + first, &blocks[0], ready - first);
+    }
+    for(uint64_t b = ready; b < last; ++b) {
+      std::memset(blocks[b - first].data, 0, Block::SIZE);
+    }
+
+    Block::ID lo = data_start + first * REFCOUNTS;
+    auto itr = std::lower_bound(extra.begin(), extra.end(), lo);
+    for(uint64_t b = first; b < last; ++b) {
+      uint16_t* counts = (uint16_t*) blocks[b - first].data;
+      bool dirty = false;
+      for(uint64_t i = 0; i < REFCOUNTS; ++i) {
+        Block::ID id = data_start + b * REFCOUNTS + i;
+        if(id >= data_end) break;
+
+        uint64_t refs = 0;
+        while(itr != extra.end() && *itr == id) {
+          refs += 1;
+          ++itr;
+        }
+
+        bool     in_use   = used->get(id - data_start);
+        uint16_t expected = in_use ? std::min<uint64_t>(refs, COUNT) | (counts[i] & INDEXED) : 0;
+        if(counts[i] != expected && fragment_blocks.count(id) == 0) {
+          problem("Wrong reference count", "Block " + std::to_string(id) + " has count " + std::to_string(counts[i] & COUNT) + (counts[i] & INDEXED ? " (indexed)" : "") + ", but " + std::to_string(refs) + " extra references" + (in_use ? "" : " and isn't in use"));
+          counts[i] = expected;
+          dirty = true;
+        }
+      }
+
+      if(dirty && repair && b >= refcount_ready) {
+        std::lock_guard<std::mutex> lock(mutex);
+        unready[b] = blocks[b - first];
+      }
+      else if(dirty && repair) {
+        storage->set(table + b, blocks[b - first]);
+      }
+    }
+  });
+
+  if(unready.empty()) {
+    return;
+  }
+
+  // Initialize the table up to the last block that needed fixing, as
+  // RefCountTable would have.
+  uint64_t end = unready.rbegin()->first + 1;
+  Block zero;
+  std::memset(zero.data, 0, Block::SIZE);
+  for(uint64_t b = refcount_ready; b < end; ++b) {
+    auto itr = unready.find(b);
+    storage->set(table + b, (itr != unready.end()) ? itr->second : zero);
+  }
+
+  refcount_ready = end;
+  superblock->refcount_block_ready = end;
+  storage->set(0, super_block);
+}
+
+void Checker::checkFreeList() {
+  FreeListConfig* config = (FreeListConfig*) superblock->data_config;
+  uint64_t nblocks = superblock->block_count;
+  if(config->last_block < data_end || config->first_block >= nblocks || config->last_block > config->first_block) {
+    throw std::runtime_error("Free list header is corrupt; can't check free space.");
+  }
+
+  uint64_t last = config->last_index;
+  uint64_t top  = (config->top_block - config->last_block) * POINTERS + config->top_index;
+  if(config->top_block < config->last_block || config->top_block > config->first_block || config->top_index >= POINTERS || last >= POINTERS || top < last) {
+    problem("Bad free list", "The top of the free list is out of place");
+    rebuild_free_list = true;
+    top = last;
+  }
+
+  // Position last holds a block that is never handed out.
+  uint64_t nodes = top / POINTERS + 1;
+  std::atomic<uint64_t> nlisted(0);
+  parallel(nodes, LIST_CHUNK, [&](Worker&, uint64_t first, uint64_t end) {
+    std::vector<Block> blocks(end - first);
+    readFreeList(first, &blocks[0], end - first);
+
+    uint64_t count = 0;
+    for(uint64_t n = first; n < end; ++n) {
+      const Block::ID* entries = (const Block::ID*) blocks[n - first].data;
+      for(uint64_t i = 0; i < POINTERS; ++i) {
+        uint64_t position = n * POINTERS + i;
+        if(position <= last || position > top) continue;
+
+        Block::ID id = entries[i];
+        if(!inData(id)) {
+          problem("Bad free list", "Free list entry " + std::to_string(position) + " is block " + std::to_string(id) + ", outside the data region");
+        }
+        else if(listed->set(id - data_start)) {
+          problem("Bad free list", "Block " + std::to_string(id) + " is on the free list twice");
+        }
+        else if(used->get(id - data_start)) {
+          problem("Block in use and free", "Block " + std::to_string(id) + " is in use but also on the free list");
+        }
+        else {
+          count += 1;
+          continue;
+        }
+
+        rebuild_free_list = true;
+      }
+    }
+
+    nlisted += count;
+  });
+
+  nfree_blocks = nlisted.load();
+
+  // Whatever is neither in use nor free has leaked.
+  uint64_t words = (data_end - data_start + 63) / 64;
+  std::atomic<uint64_t> leaked(0);
+  parallel(words, 1 << 16, [&](Worker&, uint64_t first, uint64_t last) {
+    uint64_t count = 0;
+    for(uint64_t w = first; w < last; ++w) {
+      uint64_t lost = ~(used->word(w) | listed->word(w));
+      if(w == words - 1 && (data_end - data_start) % 64 != 0) {
+        lost &= (uint64_t(1) << ((data_end - data_start) % 64)) - 1;
+      }
+
+      while(lost != 0) {
+        int bit = __builtin_ctzll(lost);
+        lost &= lost - 1;
+        count += 1;
+        if(verbose) problem("Leaked block", "Block " + std::to_string(data_start + w * 64 + bit) + " is neither in use nor free");
+      }
+    }
+
+    leaked += count;
+  });
+
+  if(leaked.load() > 0) {
+    if(!verbose) problem("Leaked blocks", std::to_string(leaked.load()) + " blocks are neither in use nor free");
+    rebuild_free_list = true;
+  }
+}
+
+void Checker::fix() {
+  if(!repair || found == 0) return;
+
+  std::cout << "Repairing...\n";
+  fixedAll("Wrong reference count");
+
+  fixINodes();
+  if(rebuild_free_list) {
+    fixFreeList();
+  }
+
+  // Fragments that nobody owns any more can be reused.
+  std::map<Block::ID, std::vector<uint32_t>> owners;
+  for(const auto& fix: owner_fixes) {
+    owners[fix.first].push_back(fix.second);
+  }
+
+  for(const auto& entry: owners) {
+    Block block;
+    FragmentHeader* header = (FragmentHeader*) block.data;
+    storage->get(entry.first, block);
+    for(uint32_t f: entry.second) {
+      header->owners[f] = 0;
+    }
+
+    storage->set(entry.first, block);
+  }
+
+  fixedAll("Leaked fragment");
+  storage->set(0, super_block);
+
+  fixDirectories();
+  storage->sync();
+}
+
+// Drops the entries that pass 2 complained about.  Everything else has
+// been fixed by now, so the directories are saved through a Filesystem,
+// which copies blocks shared with a snapshot and frees what's left over.
+void Checker::fixDirectories() {
+  if(bad_entries.empty()) return;
+
+  StackBasedBlockManager block_manager(*storage);
+  LinearINodeManager     inode_manager(*storage);
+  Filesystem             fs(block_manager, inode_manager);
+  std::lock_guard<OperationMutex> lock(fs.mutex);
+
+  bool all = true;
+  for(INode::ID id: bad_entries) {
+    INode inode = fs.getINode(id);
+    std::vector<char> data;
+    if(!contents(id, inode, data)) {
+      all = false;
+      continue;
+    }
+
+    INode::ID parent = (id == 1) ? 1 : parents[id].load();
+    Directory directory(id, parent != 0 ? parent : id);
+    std::unordered_set<std::string> seen;
+    size_t index = 0;
+    while(index < data.size()) {
+      const char* end = (const char*) (index + sizeof(INode::ID) < data.size() ? std::memchr(&data[index + sizeof(INode::ID)], '\0', data.size() - index - sizeof(INode::ID)) : NULL);
+      if(end == NULL) break;
+
+      INode::ID child;
+      std::memcpy(&child, &data[index], sizeof(INode::ID));
+      std::string name((const char*) &data[index + sizeof(INode::ID)], end);
+      index += sizeof(INode::ID) + name.size() + 1;
+
+      bool special = (name == "." || name == "..");
+      bool valid   = special || (child > 1 && child < ninodes && types[child] != FileType::FREE && types[child] != FileType::RESERVED && cleared.count(child) == 0);
+      if(name.empty() || !valid || !seen.insert(name).second) continue;
+      if(!special) directory.insert(name, child);
+    }
+
+    fs.save(directory);
+  }
+
+  if(all) {
+    fixedAll("Bad entry");
+    fixedAll("Dangling entry");
+    fixedAll("Truncated directory");
+    fixedAll("Wrong \".\"");
+    fixedAll("Wrong \"..\"");
+    fixedAll("Missing \".\" or \"..\"");
+  }
+}
+
+// Fixes link counts and bad types, and queues unattached INodes as
+// orphans so that the next mount frees them.
+void Checker::fixINodes() {
+  bool all = true;
+  if(damaged_directory && !unattached.empty()) {
+    std::cout << "  Not freeing unattached INodes: a directory couldn't be read.\n";
+    unattached.clear();
+    all = false;
+  }
+
+  std::map<Block::ID, std::vector<std::pair<uint64_t, uint16_t>>> changes;
+  for(const auto& fix: link_fixes) {
+    changes[fix.first / PER_BLOCK].push_back(std::make_pair(fix.first % PER_BLOCK, fix.second));
+  }
+
+  for(INode::ID id: unattached) {
+    if(orphans.size() >= Superblock::MAX_ORPHANS) {
+      std::cout << "  The orphan list is full; run fsck again to free the rest.\n";
+      all = false;
+      break;
+    }
+
+    orphans.insert(id);
+    rewrite_orphans = true;
+    changes[id / PER_BLOCK].push_back(std::make_pair(id % PER_BLOCK, 0));
+  }
+
+  for(const auto& change: changes) {
+    Block::ID table = superblock->inode_block_start + change.first;
+    Block block;
+    storage->get(table, block);
+    for(const auto& slot: change.second) {
+      ((INode*) block.data)[slot.first].links = slot.second;
+    }
+
+    storage->set(table, block);
+  }
+
+  // The blocks of cleared INodes go back on the free list below.
+  for(INode::ID id: cleared) {
+    Block::ID table = superblock->inode_block_start + id / PER_BLOCK;
+    Block block;
+    storage->get(table, block);
+    ((INode*) block.data)[id % PER_BLOCK] = INode();
+    storage->set(table, block);
+    orphans.erase(id);
+    rewrite_orphans = true;
+    rebuild_free_list = true;
+  }
+
+  fixedAll("Wrong link count");
+  fixedAll("Bad INode type");
+  if(all) fixedAll("Unattached INode");
+
+  if(rewrite_orphans) {
+    superblock->orphan_count = 0;
+    for(INode::ID id: orphans) {
+      superblock->orphans[superblock->orphan_count++] = id;
+    }
+
+    fixedAll("Bad orphan list");
+  }
+}
+
+// Writes out a new free list holding every block that isn't in use,
+// lowest first to be handed out, as mkfs does.  The list blocks and the
+// entry at the bottom of the list stay where they are.
+void Checker::fixFreeList() {
+  FreeListConfig* config = (FreeListConfig*) superblock->data_config;
+  uint64_t last  = config->last_index;
+  uint64_t nfree = 0;
+  for(uint64_t w = 0; w * 64 < data_end - data_start; ++w) {
+    nfree += __builtin_popcountll(~used->word(w));
+  }
+
+  // The last word's spare bits count as free.
+  uint64_t spare = (64 - (data_end - data_start) % 64) % 64;
+  nfree -= spare;
+
+  uint64_t top = last + nfree;
+  if(top / POINTERS > config->first_block - config->last_block) {
+    throw std::runtime_error("Free list doesn't have room for every free block.");
+  }
+
+  // Position last + 1 gets the highest block, position top the lowest.
+  Block::ID next = data_end;
+  auto take = [&]() {
+    do {
+      next -= 1;
+    } while(used->get(next - data_start));
+    return next;
+  };
+
+  uint64_t nodes = top / POINTERS + 1;
+  std::vector<Block> blocks;
+  for(uint64_t first = 0; first < nodes; first += LIST_CHUNK) {
+    uint64_t count = std::min(LIST_CHUNK, nodes - first);
+    blocks.resize(count);
+    readFreeList(first, &blocks[0], count);
+    for(uint64_t n = first; n < first + count; ++n) {
+      Block::ID* entries = (Block::ID*) blocks[n - first].data;
+      for(uint64_t i = 0; i < POINTERS; ++i) {
+        uint64_t position = n * POINTERS + i;
+        if(position > last && position <= top) entries[i] = take();
+      }
+    }
+
+    storage->setRange(config->last_block + first, &blocks[0], count);
+  }
+
+  config->top_block  = config->last_block + top / POINTERS;
+  config->top_index  = top % POINTERS;
+  config->lazy_block = 0; // Everything up to the top is on disk now.
+  nfree_blocks = nfree;
+  fixedAll("Bad free list");
+  fixedAll("Block in use and free");
+  fixedAll("Leaked block");
+  fixedAll("Leaked blocks");
+}
+
+void Checker::summary(double seconds) {
+  uint64_t files  = 0;
+  uint64_t blocks = 0;
+  for(Worker& worker: workers) {
+    files  += worker.files;
+    blocks += worker.blocks;
+  }
+
+  uint64_t used_blocks = 0;
+  for(uint64_t w = 0; w * 64 < data_end - data_start; ++w) {
+    used_blocks += __builtin_popcountll(used->word(w));
+  }
+
+  uint64_t fixed = 0;
+  if(found > 0) {
+    std::cout << "Problems:\n";
+    for(const auto& kind: kinds) {
+      bool done = repaired.count(kind.first) != 0;
+      fixed += done ? kind.second : 0;
+      std::cout << "  " << std::setw(8) << kind.second << "  " << kind.first << (done ? " (fixed)" : "") << '\n';
+    }
+  }
+
+  std::cout << files << " INodes in use (" << nfree_inodes << " free of " << ninodes << "), ";
+  std::cout << used_blocks << " data blocks in use (" << blocks << " references, " << nfree_blocks << " free of " << (data_end - data_start) << ")\n";
+  std::cout << found << " problems found";
+  if(repair) std::cout << ", " << fixed << " fixed";
+  std::cout << " in " << std::fixed << std::setprecision(2) << seconds << " s\n";
+}
+
+int Checker::status() const {
+  if(found == 0) return CLEAN;
+  if(repaired.size() == kinds.size()) return FIXED;
+  return UNFIXED;
+}
+
+int main(int argc, char** argv) {
+  bool     repair   = false;
+  bool     verbose  = false;
+  uint64_t nthreads = std::max(1u, std::thread::hardware_concurrency());
+
+  const char* short_options = "ynt:v";
+  const struct option long_options[] = {
+    {"yes",     no_argument,       NULL, 'y'},
+    {"no",      no_argument,       NULL, 'n'},
+    {"threads", required_argument, NULL, 't'},
+    {"verbose", no_argument,       NULL, 'v'},
+    {NULL, 0, NULL, 0}
+  };
+
+  int opt;
+  while((opt = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+    switch(opt) {
+    case 'y':
+      repair = true;
+      break;
+    case 'n':
+      repair = false;
+      break;
+    case 't':
+      nthreads = std::strtoull(optarg, NULL, 10);
+      if(nthreads == 0) usage("Need at least one thread.");
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind != argc - 1) usage("Expected exactly one disk file.");
+  const char* disk_file = argv[optind];
+
+  struct stat info;
+  if(stat(disk_file, &info) != 0 || info.st_size < (off_t) Block::SIZE) {
+    std::cerr << disk_file << ": no such disk file, or it's too small.\n";
+    return OPERATIONAL;
+  }
+
+  Clock::time_point start = Clock::now();
+  try {
+    // The same stack the filesystem uses, minus the page cache.
+    uint64_t        nblocks = info.st_size / Block::SIZE;
+    FileStorage     disk(disk_file, nblocks);
+    ChecksumStorage checksums(disk, ChecksumStorage::Verify::WARN);
+    LogStorage      log_storage(checksums);
+    checksums.load();
+    log_storage.load();
+
+    Block block;
+    Superblock* superblock = (Superblock*) block.data;
+    log_storage.get(0, block);
+    if(superblock->block_count > nblocks) {
+      std::cerr << disk_file << ": the superblock says the disk has " << superblock->block_count << " blocks, but the file only holds " << nblocks << ".\n";
+      return OPERATIONAL;
+    }
+
+    if(repair) {
+      Journal journal(log_storage);
+      journal.replay();
+    }
+    else if(superblock->journal_block_count > 0) {
+      std::cout << "Not replaying the journal (no -y); an unclean shutdown may show up as problems.\n";
+    }
+
+    Checker checker(log_storage, nthreads, repair, verbose);
+    checker.check();
+    checker.fix();
+
+    ChecksumStorage::Stats stats = checksums.stats();
+    if(stats.mismatches > 0) {
+      std::cout << stats.mismatches << " of " << stats.verified << " metadata blocks read didn't match their checksums.\n";
+    }
+
+    std::chrono::duration<double> took = Clock::now() - start;
+    checker.summary(took.count());
+    return checker.status();
+  }
+  catch(std::exception& ex) {
+    std::cerr << disk_file << ": " << ex.what() << '\n';
+    return OPERATIONAL;
+  }
 }
@@ -1,5 +1,8 @@
 #include "lib/Filesystem.h"
 #include "lib/FSExceptions.h"
+#include "lib/Ioctl.h"
+#include "lib/Stats.h"
+#include "lib/Trace.h"
 
 #if defined(__linux__)
   #include <sys/statfs.h>
@@ -8,7 +11,9 @@
 
 #include <cstring>
 #include <cinttypes>
+#include <fcntl.h>
 #include <fuse.h>
+#include <unistd.h>
 
 // Global Filesystem
 Filesystem* fs;
@@ -26,16 +31,58 @@ Filesystem* fs;
 
 #define UNUSED(x) ((void) (x))
 
+// Like handle(), but holds the filesystem lock so that operations don't
+// run into each other (or into the background reclaimer).  The time
+// spent, waiting for the lock included, is recorded under op.
+static int locked(Stats::Op op, std::function<int(void)> callback) {
+  Stats::Timer timer(op);
+  TRACE_SPAN(Stats::name(op));
+  std::unique_lock<OperationMutex> lock(fs->mutex, std::defer_lock);
+  {
+    TRACE_SPAN("fuse.lock");
+    lock.lock();
+  }
+
+  int result = handle(callback);
+  if(result < 0) Stats::fail(op);
+  return result;
+}
+
+// The stats file lives in a directory that isn't on disk.  Both get
+// inode numbers from the top of the range, which real INodes never use.
+static const char* STATS_DIR  = "/.sigsegv";
+static const char* STATS_FILE = "/.sigsegv/stats";
+static const ino_t STATS_DIR_INO  = ino_t(-2);
+static const ino_t STATS_FILE_INO = ino_t(-3);
+
+static bool isStatsDir(const char* path) {
+  return std::strcmp(path, STATS_DIR) == 0;
+}
+
+static bool isStatsFile(const char* path) {
+  return std::strcmp(path, STATS_FILE) == 0;
+}
+
+// Ioctls that act on the whole filesystem are only for root and for
+// whoever mounted it.
+static bool privileged() {
+  uid_t uid = fuse_get_context()->uid;
+  return uid == 0 || uid == getuid();
+}
+
 extern "C" {
 
   // Declarations to resolve linker errors
   int   fs_chmod(const char*, mode_t);
   int   fs_chown(const char*, uid_t, gid_t);
+  void  fs_destroy(void*);
+  int   fs_fallocate(const char*, int, off_t, off_t, fuse_file_info*);
   int   fs_flush(const char*, fuse_file_info*);
   int   fs_fsync(const char*, int, fuse_file_info*);
   int   fs_getattr(const char*, struct stat*);
   int   fs_getxattr(const char*, const char*, char*, size_t);
   void* fs_init(struct fuse_conn_info *);
+  int   fs_ioctl(const char*, int, void*, fuse_file_info*, unsigned int, void*);
   int   fs_link(const char*, const char*);
   int   fs_listxattr(const char*, char*, size_t);
   int   fs_mkdir(const char*, mode_t);
@@ -59,7 +106,7 @@ extern "C" {
 
   int fs_access(const char *path, int mode) {
     debug1("access", "%s", path);
-    return handle([=]{
+    return locked(Stats::FUSE_ACCESS, [=]{
       INode::ID id = fs->getINodeID(path);
       INode inode  = fs->getINode(id);
 
@@ -99,7 +146,7 @@ extern "C" {
 
   int fs_chmod(const char* path, mode_t mode) {
     debug2("chmod", "%s to %03o", path, mode);
-    return handle([=]{
+    return locked(Stats::FUSE_CHMOD, [=]{
       INode::ID id = fs->getINodeID(path);
       INode inode  = fs->getINode(id);
 
@@ -112,7 +159,7 @@ extern "C" {
 
   int fs_chown(const char* path, uid_t uid, gid_t gid) {
     debug2("chown", "%s to %d:%d", path, uid, gid);
-    return handle([=]{
+    return locked(Stats::FUSE_CHOWN, [=]{
       INode::ID id = fs->getINodeID(path);
       INode inode  = fs->getINode(id);
 
@@ -126,28 +173,87 @@ extern "C" {
     });
   }
 
+  void fs_destroy(void* data) {
+    debug2("destroy", "%p", data);
+    UNUSED(data);
+
+    try {
+      std::lock_guard<OperationMutex> lock(fs->mutex);
+      fs->sync();
+    }
+    catch(std::exception& ex) {
+      std::cerr << "[\e[1;31msystem error  \e[0m]: " << ex.what() << '\n';
+    }
+  }
+
+  // Only punching holes is supported; there's no point reserving blocks
+  // ahead of time when every write may have to copy them anyway.
+  int fs_fallocate(const char* path, int mode, off_t offset, off_t length, fuse_file_info* info) {
+    debug2("fallocate", "%s %x %" PRId64 "b at %" PRId64, path, mode, (int64_t) length, (int64_t) offset);
+    return locked(Stats::FUSE_FALLOCATE, [=]{
+#ifdef FALLOC_FL_PUNCH_HOLE
+      if(mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+        return -EOPNOTSUPP;
+      }
+
+      INode::ID id = fs->getINodeID(path, info);
+      INode inode  = fs->getINode(id);
+      if(inode.type != FileType::REGULAR) {
+        throw NotAFile(path);
+      }
+
+      fs->punch(id, offset, length);
+      fs->changed(id, info);
+      return 0;
+#else
+      UNUSED(path);
+      UNUSED(mode);
+      UNUSED(offset);
+      UNUSED(length);
+      UNUSED(info);
+      return -EOPNOTSUPP;
+#endif
+    });
+  }
+
+  // Closing a file doesn't make it durable (that's what fsync is for),
+  // so its dirty blocks stay cached until the flusher gets to them; a
+  // process that opens a file, appends a line and closes it again costs
+  // no I/O of its own.
   int fs_flush(const char* path, fuse_file_info* info) {
     debug1("flush", "%s", path);
     UNUSED(info);
 
-    // TODO...
+    Stats::Timer timer(Stats::FUSE_FLUSH);
     return 0;
   }
 
-  int fs_fsync(const char* path, int unknown, fuse_file_info* info) {
+  int fs_fsync(const char* path, int datasync, fuse_file_info* info) {
     debug1("fsync", "%s", path);
-    UNUSED(unknown);
-    UNUSED(info);
 
-    // TODO...
-    return 0;
+    return locked(Stats::FUSE_FSYNC, [=]{
+      if(isStatsFile(path)) return 0;
+      fs->sync(fs->getINodeID(path, info), datasync != 0);
+      return 0;
+    });
   }
 
   int fs_getattr(const char* path, struct stat* info) {
     debug1("getattr", "%s", path);
     UNUSED(info);
 
-    return handle([=]{
+    return locked(Stats::FUSE_GETATTR, [=]{
+      if(isStatsDir(path) || isStatsFile(path)) {
+        bool dir = isStatsDir(path);
+        info->st_atime   = info->st_ctime = info->st_mtime = time(NULL);
+        info->st_size    = dir ? 0 : Stats::report().size();
+        info->st_nlink   = dir ? 2 : 1;
+        info->st_mode    = dir ? (S_IFDIR | 0555) : (S_IFREG | 0444);
+        info->st_ino     = dir ? STATS_DIR_INO : STATS_FILE_INO;
+        info->st_blksize = Block::SIZE;
+        return 0;
+      }
+
       INode::ID id = fs->getINodeID(path);
       INode inode  = fs->getINode(id);
 
@@ -196,9 +302,65 @@ extern "C" {
     return NULL;
   }
 
+  int fs_ioctl(const char* path, int cmd, void* arg, fuse_file_info* info, unsigned int flags, void* data) {
+    debug2("ioctl", "%s %x", path, cmd);
+    UNUSED(arg);
+    UNUSED(info);
+    UNUSED(flags);
+
+    // Trimming does its I/O without the filesystem lock (see trim).
+    if((unsigned int) cmd == SIGSEGV_IOC_TRIM) {
+      Stats::Timer timer(Stats::FUSE_IOCTL);
+      int result = handle([=]{
+        if(!privileged()) return -EPERM;
+        ((TrimRequest*) data)->discarded = fs->trim(true);
+        return 0;
+      });
+
+      if(result < 0) Stats::fail(Stats::FUSE_IOCTL);
+      return result;
+    }
+
+    return locked(Stats::FUSE_IOCTL, [=]{
+      SnapshotRequest* request = (SnapshotRequest*) data;
+      CloneRequest*    clone   = (CloneRequest*) data;
+      GrowRequest*     grow    = (GrowRequest*) data;
+      switch((unsigned int) cmd) {
+      case SIGSEGV_IOC_SNAPSHOT:
+        if(!privileged()) return -EPERM;
+        fs->snapshot(std::string(request->name, strnlen(request->name, sizeof(request->name))));
+        return 0;
+      case SIGSEGV_IOC_DELETE_SNAPSHOT:
+        if(!privileged()) return -EPERM;
+        fs->deleteSnapshot(std::string(request->name, strnlen(request->name, sizeof(request->name))));
+        return 0;
+      case SIGSEGV_IOC_CLONE_RANGE: {
+        // The kernel has checked the destination, but not the source.
+        // Naming it by INode skips the search permission checks on its
+        // directories, so only its owner (or root) may clone from it.
+        INode source = fs->getINode(clone->src_ino);
+        uid_t uid = fuse_get_context()->uid;
+        if((uid != 0 && uid != source.uid) || source.links == 0) {
+          throw AccessDenied();
+        }
+
+        INode::ID id  = fs->getINodeID(path, info);
+        clone->length = fs->clone(clone->src_ino, clone->src_offset, id, clone->dst_offset, clone->length);
+        return 0;
+      }
+      case SIGSEGV_IOC_GROW:
+        if(!privileged()) return -EPERM;
+        grow->block_count = fs->grow(grow->block_count);
+        return 0;
+      default:
+        return -ENOTTY;
+      }
+    });
+  }
+
   int fs_link(const char* target, const char* link) {
     debug2("link", "%s -> %s", link, target);
-    return handle([=]{
+    return locked(Stats::FUSE_LINK, [=]{
       INode::ID id = fs->getINodeID(target);
       INode inode  = fs->getINode(id);
 
@@ -232,7 +394,7 @@ extern "C" {
 
   int fs_mkdir(const char* path, mode_t mode) {
     debug2("mkdir", "%s %03o", path, mode);
-    return handle([=]{
+    return locked(Stats::FUSE_MKDIR, [=]{
       std::string pname = fs->dirname(path);
       std::string dname = fs->basename(path);
 
@@ -261,7 +423,7 @@ extern "C" {
       return -ENOTSUP;
     }
 
-    return handle([=]{
+    return locked(Stats::FUSE_MKNOD, [=]{
       std::string dname = fs->dirname(path);
       std::string fname = fs->basename(path);
 
@@ -282,25 +444,51 @@ extern "C" {
 
   int fs_open(const char* path, fuse_file_info* info) {
     debug1("open", "%s", path);
-    return handle([=] {
+    return locked(Stats::FUSE_OPEN, [=]{
+      if(isStatsFile(path)) {
+        if((info->flags & O_ACCMODE) != O_RDONLY) {
+          throw AccessDenied(path);
+        }
+
+        // Every open gets its own snapshot, read straight from memory.
+        info->fh        = fs->open(0);
+        info->direct_io = 1;
+        ((OpenFile*) info->fh)->contents = Stats::report();
+        return 0;
+      }
+
       // Cache the INode number
-      info->fh = fs->getINodeID(path);
+      INode::ID id = fs->getINodeID(path);
+      if(id == 0) throw NoSuchEntry(path);
+
+      // Keep the kernel's page cache unless we changed the file ourselves
+      info->keep_cache = fs->keepCache(id);
+      info->fh = fs->open(id);
       return 0;
     });
   }
 
   int fs_read(const char* path, char* buffer, size_t size, off_t offset, fuse_file_info* info) {
     debug2("read", "%s %" PRIu64 "b at %" PRId64, path, (uint64_t) size, offset);
-    UNUSED(info);
+    return locked(Stats::FUSE_READ, [=]{
+      if(isStatsFile(path)) {
+        const std::string& contents = ((OpenFile*) info->fh)->contents;
+        if(uint64_t(offset) >= contents.size()) return 0;
+
+        size_t count = std::min(size, contents.size() - offset);
+        std::memcpy(buffer, contents.data() + offset, count);
+        return (int) count;
+      }
 
-    return handle([=]{
       INode::ID id = fs->getINodeID(path, info);
       INode inode  = fs->getINode(id);
       if(inode.type != FileType::REGULAR) {
         throw NotAFile(path);
       }
 
-      return fs->read(id, buffer, size, offset);
+      int result = fs->read(id, buffer, size, offset, fs->readahead(info));
+      Stats::add(Stats::READ_BYTES, result);
+      return result;
     });
   }
 
@@ -309,7 +497,17 @@ extern "C" {
     UNUSED(offset);
     UNUSED(info);
 
-    return handle([=]{
+    return locked(Stats::FUSE_READDIR, [=]{
+      if(isStatsDir(path)) {
+        const char* names[] = {".", "..", "stats"};
+        for(const char* name: names) {
+          int result = filler(buffer, name, NULL, 0);
+          if(result != 0) return result;
+        }
+
+        return 0;
+      }
+
       Directory dir = fs->getDirectory(path);
       for(const auto itr: dir.entries()) {
         int result = filler(buffer, itr.first.c_str(), NULL, 0);
@@ -322,22 +520,26 @@ extern "C" {
 
   int fs_readlink(const char* path, char* buffer, size_t size) {
     debug2("readlink", "%s", path);
-    return handle([=]{
+    return locked(Stats::FUSE_READLINK, [=]{
       INode::ID id = fs->getINodeID(path);
       INode inode  = fs->getINode(id);
       if(inode.type != FileType::SYMLINK) {
         throw NotASymlink(path);
       }
 
-      fs->read(id, buffer, size, 0);
+      // The target is stored with its NUL, but may have been cut short.
+      int count = fs->read(id, buffer, size - 1, 0);
+      buffer[count] = '\0';
       return 0;
     });
   }
 
   int fs_release(const char* path, fuse_file_info* info) {
     debug1("release", "%s", path);
-    info->fh = 0;
-    return 0;
+    return locked(Stats::FUSE_RELEASE, [&]{
+      fs->release(info);
+      return 0;
+    });
   }
 
   int fs_removexattr(const char* path, const char* attr) {
@@ -349,7 +551,7 @@ extern "C" {
 
   int fs_rename(const char* oldname, const char* newname) {
     debug2("rename", "%s -> %s", oldname, newname);
-    return handle([=]{
+    return locked(Stats::FUSE_RENAME, [=]{
       std::string dname = fs->dirname(newname);
       std::string fname = fs->basename(newname);
 
@@ -396,7 +598,7 @@ extern "C" {
 
   int fs_rmdir(const char* path) {
     debug2("rmdir", "%s", path);
-    return handle([=]{
+    return locked(Stats::FUSE_RMDIR, [=]{
       std::string pname = fs->dirname(path);
       std::string dname = fs->basename(path);
 
@@ -425,7 +627,7 @@ extern "C" {
 
   int fs_statfs(const char* path, struct statvfs* info) {
     debug1("statfs", "%s", path);
-    return handle([=]{
+    return locked(Stats::FUSE_STATFS, [=]{
       fs->statfs(info);
       return 0;
     });
@@ -433,7 +635,7 @@ extern "C" {
 
   int fs_symlink(const char* target, const char* link) {
     debug2("symlink", "%s -> %s", link, target);
-    return handle([=]{
+    return locked(Stats::FUSE_SYMLINK, [=]{
       std::string dname = fs->dirname(link);
       std::string fname = fs->basename(link);
 
@@ -456,20 +658,22 @@ extern "C" {
 
   int fs_truncate(const char* path, off_t offset) {
     debug2("truncate", "%s to %" PRId64 "b", path, (int64_t) offset);
-    return handle([=]{
+    return locked(Stats::FUSE_TRUNCATE, [=]{
       INode::ID id = fs->getINodeID(path);
       INode inode  = fs->getINode(id);
       if(inode.type != FileType::REGULAR) {
         throw NotAFile(path);
       }
 
-      return fs->truncate(id, offset);
+      int result = fs->truncate(id, offset);
+      fs->changed(id, NULL);
+      return result;
     });
   }
 
   int fs_unlink(const char* path) {
     debug2("unlink", "%s", path);
-    return handle([=]{
+    return locked(Stats::FUSE_UNLINK, [=]{
       std::string dname = fs->dirname(path);
       std::string fname = fs->basename(path);
 
@@ -488,7 +692,7 @@ extern "C" {
   // This supersedes the old utime() interface. New applications should use this.
   int fs_utime(const char* path, utimbuf* buffer) {
     debug2("utime", "%s", path);
-    return handle([=]{
+    return locked(Stats::FUSE_UTIME, [=]{
       INode::ID id = fs->getINodeID(path);
       INode inode = fs->getINode(id);
       inode.ctime = time(NULL);
@@ -503,16 +707,17 @@ extern "C" {
 
   int fs_write(const char* path, const char* data, size_t size, off_t offset, fuse_file_info* info) {
     debug2("write", "%s %" PRIu64 "b at %" PRId64, path, (uint64_t) size, offset);
-    UNUSED(info);
-
-    return handle([=]{
+    return locked(Stats::FUSE_WRITE, [=]{
       INode::ID id = fs->getINodeID(path, info);
       INode inode  = fs->getINode(id);
       if(inode.type != FileType::REGULAR) {
         throw NotAFile(path);
       }
 
-      return fs->write(id, data, size, offset);
+      int result = fs->write(id, data, size, offset);
+      fs->changed(id, info);
+      Stats::add(Stats::WRITE_BYTES, result);
+      return result;
     });
   }
 }
@@ -527,13 +732,15 @@ int main(int argc, char** argv) {
   // ops.access      = &fs_access;
   ops.chmod       = &fs_chmod;
   ops.chown       = &fs_chown;
-  // ops.destroy     = &fs_destroy;
-  // ops.flush       = &fs_flush;
-  // ops.fsync       = &fs_fsync;
+  ops.destroy     = &fs_destroy;
+  ops.fallocate   = &fs_fallocate;
+  ops.flush       = &fs_flush;
+  ops.fsync       = &fs_fsync;
   // ops.fsyncdir    = &fs_fsyncdir;
   ops.getattr     = &fs_getattr;
   // ops.getxattr    = &fs_getxattr;
   ops.init        = &fs_init;
+  ops.ioctl       = &fs_ioctl;
   ops.link        = &fs_link;
   // ops.listxattr   = &fs_listxattr;
   ops.mkdir       = &fs_mkdir;
@@ -556,7 +763,9 @@ int main(int argc, char** argv) {
   ops.utime       = &fs_utime;
   ops.write       = &fs_write;
 
-  return fs->mount(argv[0], &ops);
+  int status = fs->mount(argv[0], &ops);
+  delete fs;
+  return status;
 }
 
 /*
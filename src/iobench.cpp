@@ -0,0 +1,394 @@
+#include "lib/Filesystem.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// fio-style data path benchmark.  Reads and writes a single file either
+// in-process through Filesystem::read and write, or through a mounted
+// filesystem with pread and pwrite, one job per block pointer region
+// (direct through triple indirect) so the cost of each can be compared.
+
+typedef std::chrono::steady_clock Clock;
+
+// Anonymous namespace for file-local helpers:
+namespace {
+  enum Pattern {SEQUENTIAL, RANDOM, ZIPF};
+
+  // Where each region of block pointers starts, in blocks.
+  const uint64_t PER_BLOCK = Block::SIZE / sizeof(Block::ID);
+  const char*    REGIONS[4] = {"direct", "single", "double", "triple"};
+  const uint64_t STARTS[5] = {
+    0,
+    INode::DIRECT_POINTERS,
+    INode::DIRECT_POINTERS + PER_BLOCK,
+    INode::DIRECT_POINTERS + PER_BLOCK + PER_BLOCK * PER_BLOCK,
+    INode::DIRECT_POINTERS + PER_BLOCK + PER_BLOCK * PER_BLOCK + PER_BLOCK * PER_BLOCK * PER_BLOCK
+  };
+
+  const int BUCKETS = 32; // Powers of two microseconds.
+
+  struct Job {
+    int      region;
+    uint64_t offset; // Bytes.
+    uint64_t slots;  // Block-size-aligned positions in the region.
+  };
+
+  struct Config {
+    uint64_t bs;
+    unsigned threads;
+    Pattern  pattern;
+    double   theta;
+    unsigned writes;  // Percent.
+    double   runtime; // Seconds per job.
+  };
+
+  struct Results {
+    std::vector<uint64_t> latencies[2]; // Nanoseconds, reads then writes.
+    std::exception_ptr    error;
+  };
+
+  // The file under test, wherever it lives.
+  class Target {
+  public:
+    virtual ~Target() {}
+    virtual void read(char* buffer, size_t size, uint64_t offset) = 0;
+    virtual void write(const char* buffer, size_t size, uint64_t offset) = 0;
+  };
+
+  // Calls into the library directly, taking the same lock fuse.cpp does.
+  class LibraryTarget: public Target {
+    std::unique_ptr<Filesystem> fs;
+    INode::ID id;
+  public:
+    LibraryTarget(const std::string& arguments) {
+      std::vector<std::string> words(1, "iobench");
+      std::istringstream stream(arguments);
+      for(std::string word; stream >> word;) words.push_back(word);
+
+      std::vector<char*> args;
+      for(std::string& word: words) args.push_back((char*) word.c_str());
+      args.push_back(NULL);
+      optind = 1;
+      fs.reset(new Filesystem(args.size() - 1, &args[0], true));
+
+      std::lock_guard<OperationMutex> lock(fs->mutex);
+      Directory root = fs->getDirectory("/");
+      id = fs->newINodeID();
+      fs->save(id, INode(FileType::REGULAR, 0644));
+      root.insert("iobench", id);
+      fs->save(root);
+    }
+
+    void read(char* buffer, size_t size, uint64_t offset) {
+      std::lock_guard<OperationMutex> lock(fs->mutex);
+      fs->read(id, buffer, size, offset);
+    }
+
+    void write(const char* buffer, size_t size, uint64_t offset) {
+      std::lock_guard<OperationMutex> lock(fs->mutex);
+      fs->write(id, buffer, size, offset);
+    }
+  };
+
+  // Goes through the kernel to a mounted filesystem.
+  class MountTarget: public Target {
+    std::string path;
+    int fd;
+  public:
+    MountTarget(const std::string& mount_point): path(mount_point + "/iobench." + std::to_string(getpid())) {
+      fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+      if(fd < 0) throw std::runtime_error(path + ": " + strerror(errno));
+    }
+
+    ~MountTarget() {
+      close(fd);
+      unlink(path.c_str());
+    }
+
+    void read(char* buffer, size_t size, uint64_t offset) {
+      if(pread(fd, buffer, size, offset) < 0) throw std::runtime_error(std::string("read: ") + strerror(errno));
+    }
+
+    void write(const char* buffer, size_t size, uint64_t offset) {
+      if(pwrite(fd, buffer, size, offset) != ssize_t(size)) throw std::runtime_error(std::string("write: ") + strerror(errno));
+    }
+  };
+
+  // Zipfian ranks in [0, n), most popular first (Gray et al., "Quickly
+  // Generating Billion-Record Synthetic Databases").
+  class Zipf {
+    uint64_t n;
+    double   theta;
+    double   alpha;
+    double   zetan;
+    double   eta;
+  public:
+    Zipf(uint64_t n, double theta): n(n), theta(theta) {
+      zetan = 0;
+      for(uint64_t i = 1; i <= n; ++i) zetan += 1 / std::pow(double(i), theta);
+      double zeta2 = 1 + std::pow(0.5, theta);
+      alpha = 1 / (1 - theta);
+      eta   = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    uint64_t next(std::mt19937_64& rng) const {
+      double u  = std::uniform_real_distribution<double>(0, 1)(rng);
+      double uz = u * zetan;
+      if(uz < 1) return 0;
+      if(uz < 1 + std::pow(0.5, theta)) return std::min<uint64_t>(1, n - 1);
+      return std::min<uint64_t>(n * std::pow(eta * u - eta + 1, alpha), n - 1);
+    }
+  };
+
+  void run(Target* target, const Config& config, const Job& job, const Zipf* zipf, unsigned t, Clock::time_point end, Results* results) try {
+    std::vector<char> buffer(config.bs, char('a' + t));
+    std::mt19937_64 rng(t + 1);
+    uint64_t cursor = job.slots * t / config.threads;
+    while(Clock::now() < end) {
+      uint64_t slot;
+      switch(config.pattern) {
+      case SEQUENTIAL:
+        slot = cursor;
+        cursor = (cursor + 1) % job.slots;
+        break;
+      case RANDOM:
+        slot = rng() % job.slots;
+        break;
+      default:
+        // Scatter the popular slots instead of packing them at the start.
+        slot = zipf->next(rng) * 2654435761u % job.slots;
+        break;
+      }
+
+      bool write = rng() % 100 < config.writes;
+      uint64_t offset = job.offset + slot * config.bs;
+      Clock::time_point before = Clock::now();
+      if(write) target->write(&buffer[0], config.bs, offset);
+      else      target->read(&buffer[0], config.bs, offset);
+      results->latencies[write].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - before).count());
+    }
+  }
+  catch(...) {
+    results->error = std::current_exception();
+  }
+
+  double percentile(const std::vector<uint64_t>& sorted, double q) {
+    if(sorted.empty()) return 0;
+    return sorted[std::min<size_t>(sorted.size() - 1, q * sorted.size())] / 1000.0;
+  }
+
+  void report(const char* name, std::vector<uint64_t>& latencies, const Config& config, double seconds) {
+    if(latencies.empty()) return;
+
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t sum = 0;
+    uint64_t histogram[BUCKETS] = {0};
+    for(uint64_t latency: latencies) {
+      sum += latency;
+      int bucket = 0;
+      for(uint64_t us = latency / 1000; us > 0 && bucket < BUCKETS - 1; us >>= 1) bucket += 1;
+      histogram[bucket] += 1;
+    }
+
+    std::cout << "  " << name << ": IOPS=" << latencies.size() / seconds
+              << ", BW=" << latencies.size() * config.bs / seconds / 1e6 << "MB/s"
+              << ", lat (us): mean=" << sum / 1000.0 / latencies.size()
+              << " p50=" << percentile(latencies, 0.5) << " p90=" << percentile(latencies, 0.9)
+              << " p99=" << percentile(latencies, 0.99) << " p99.9=" << percentile(latencies, 0.999)
+              << " max=" << latencies.back() / 1000.0 << '\n';
+
+    // Bucket i holds latencies under 2^i microseconds (and at least half that).
+    std::cout << "    histogram (us):";
+    for(int i = 0; i < BUCKETS; ++i) {
+      if(histogram[i] == 0) continue;
+      std::cout << " <" << (uint64_t(1) << i) << '=' << 100.0 * histogram[i] / latencies.size() << '%';
+    }
+
+    std::cout << '\n';
+  }
+}
+
+static void usage(const char* message = NULL) {
+  if(message) std::cerr << message << "\n\n";
+  std::cerr << "USAGE: iobench [options]\n";
+  std::cerr << "  --mount      -m <str>  Go through this mount point instead of calling the library.\n";
+  std::cerr << "  --fs         -F <str>  Filesystem arguments for in-process runs (defaults to \"-n 400000 -q -q -q\").\n";
+  std::cerr << "  --block-size -b <num>  Bytes per request (defaults to 4096).\n";
+  std::cerr << "  --threads    -t <num>  Threads issuing requests, i.e. the queue depth (defaults to 1).\n";
+  std::cerr << "  --pattern    -p <str>  seq, random (default) or zipf.\n";
+  std::cerr << "  --theta      -Z <num>  Zipf skew, between 0 and 1 exclusive (defaults to 0.99).\n";
+  std::cerr << "  --writes     -w <num>  Percentage of requests that are writes (defaults to 0).\n";
+  std::cerr << "  --regions    -r <list> Comma-separated pointer regions: direct, single, double, triple\n";
+  std::cerr << "                         (defaults to all four, one job each).\n";
+  std::cerr << "  --span       -S <num>  Use at most this many blocks of each region (defaults to 65536).\n";
+  std::cerr << "  --runtime    -l <num>  Seconds per job (defaults to 5).\n";
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  Config config;
+  config.bs      = 4096;
+  config.threads = 1;
+  config.pattern = RANDOM;
+  config.theta   = 0.99;
+  config.writes  = 0;
+  config.runtime = 5;
+
+  const char*      mount_point = NULL;
+  std::string      fs_args     = "-n 400000 -q -q -q";
+  uint64_t         span        = 65536;
+  std::vector<int> regions;
+
+  struct option options[] = {
+    {"mount",      required_argument, 0, 'm'},
+    {"fs",         required_argument, 0, 'F'},
+    {"block-size", required_argument, 0, 'b'},
+    {"threads",    required_argument, 0, 't'},
+    {"pattern",    required_argument, 0, 'p'},
+    {"theta",      required_argument, 0, 'Z'},
+    {"writes",     required_argument, 0, 'w'},
+    {"regions",    required_argument, 0, 'r'},
+    {"span",       required_argument, 0, 'S'},
+    {"runtime",    required_argument, 0, 'l'},
+    {0, 0, 0, 0}
+  };
+
+  while(true) {
+    int c = getopt_long(argc, argv, "m:F:b:t:p:Z:w:r:S:l:", options, NULL);
+    if(c == -1) break;
+
+    switch(c) {
+    case 'm':
+      mount_point = optarg;
+      break;
+    case 'F':
+      fs_args = optarg;
+      break;
+    case 'b':
+      config.bs = atoll(optarg);
+      break;
+    case 't':
+      config.threads = atoi(optarg);
+      break;
+    case 'p':
+      if(std::strcmp(optarg, "seq") == 0) config.pattern = SEQUENTIAL;
+      else if(std::strcmp(optarg, "random") == 0) config.pattern = RANDOM;
+      else if(std::strcmp(optarg, "zipf") == 0) config.pattern = ZIPF;
+      else usage("Unknown pattern.");
+      break;
+    case 'Z':
+      config.theta = atof(optarg);
+      break;
+    case 'w':
+      config.writes = atoi(optarg);
+      break;
+    case 'r': {
+      std::istringstream stream(optarg);
+      for(std::string name; std::getline(stream, name, ',');) {
+        int region = std::find(REGIONS, REGIONS + 4, name) - REGIONS;
+        if(region == 4) usage("Unknown region.");
+        regions.push_back(region);
+      }
+      break;
+    }
+    case 'S':
+      span = atoll(optarg);
+      break;
+    case 'l':
+      config.runtime = atof(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind != argc) usage("Unexpected argument.");
+  if(config.bs == 0) usage("Block size must be positive.");
+  if(config.threads == 0) usage("Need at least one thread.");
+  if(config.theta <= 0 || config.theta >= 1) usage("Theta must be between 0 and 1.");
+  if(config.writes > 100) usage("Writes are a percentage.");
+  if(span == 0) usage("Span must be positive.");
+  if(regions.empty()) regions = {0, 1, 2, 3};
+
+  try {
+    // The file has to reach the furthest region before anything is read.
+    std::vector<Job> jobs;
+    uint64_t size = 0;
+    for(int region: regions) {
+      uint64_t blocks = std::min(STARTS[region + 1] - STARTS[region], span);
+      Job job;
+      job.region = region;
+      job.offset = STARTS[region] * Block::SIZE;
+      job.slots  = std::max<uint64_t>(1, blocks * Block::SIZE / config.bs);
+      jobs.push_back(job);
+      size = std::max(size, job.offset + job.slots * config.bs);
+    }
+
+    std::unique_ptr<Target> target;
+    if(mount_point != NULL) target.reset(new MountTarget(mount_point));
+    else target.reset(new LibraryTarget(fs_args));
+
+    std::cerr << "Writing " << size / 1000000 << " MB to set up...\n";
+    std::vector<char> fill(1 << 20, 'x');
+    for(uint64_t offset = 0; offset < size; offset += fill.size()) {
+      target->write(&fill[0], std::min<uint64_t>(fill.size(), size - offset), offset);
+    }
+
+    const char* patterns[3] = {"seq", "random", "zipf"};
+    std::cout << std::fixed << std::setprecision(2);
+    for(const Job& job: jobs) {
+      std::unique_ptr<Zipf> zipf;
+      if(config.pattern == ZIPF) zipf.reset(new Zipf(job.slots, config.theta));
+
+      std::vector<Results> results(config.threads);
+      std::vector<std::thread> pool;
+      Clock::time_point start = Clock::now();
+      Clock::time_point end = start + std::chrono::microseconds(uint64_t(config.runtime * 1e6));
+      for(unsigned t = 0; t < config.threads; ++t) {
+        pool.push_back(std::thread(run, target.get(), std::cref(config), std::cref(job), zipf.get(), t, end, &results[t]));
+      }
+
+      for(std::thread& thread: pool) thread.join();
+      double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count() / 1e9;
+      for(Results& result: results) {
+        if(result.error) std::rethrow_exception(result.error);
+      }
+
+      std::vector<uint64_t> latencies[2];
+      for(Results& result: results) {
+        for(int op = 0; op < 2; ++op) {
+          latencies[op].insert(latencies[op].end(), result.latencies[op].begin(), result.latencies[op].end());
+        }
+      }
+
+      std::cout << REGIONS[job.region] << ": " << patterns[config.pattern] << " bs=" << config.bs
+                << " threads=" << config.threads << " writes=" << config.writes << "%"
+                << " blocks=[" << job.offset / Block::SIZE << ", " << (job.offset + job.slots * config.bs + Block::SIZE - 1) / Block::SIZE << ")\n";
+      report("read", latencies[0], config, seconds);
+      report("write", latencies[1], config, seconds);
+    }
+  }
+  catch(std::exception& ex) {
+    std::cerr << "iobench: " << ex.what() << '\n';
+    return 1;
+  }
+
+  return 0;
+}
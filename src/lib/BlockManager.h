@@ -3,6 +3,8 @@
 #include "Block.h"
 #include "Storage.h"
 
+#include <vector>
+
 #if defined(__linux__)
   #include <sys/statvfs.h>
 #else
@@ -24,4 +26,36 @@ public:
 
   virtual void release(Block::ID block_number) = 0;
   virtual Block::ID reserve() = 0;
+
+  // Passes Storage::settle() on to the storage underneath.
+  virtual void settle() {}
+
+  // Blocks of bookkeeping needed to manage count data blocks.
+  virtual uint64_t listBlocks(uint64_t count) = 0;
+
+  // Adds the blocks from the end of the data region up to data_end,
+  // writing the bookkeeping to new blocks starting at list_start (which
+  // must follow data_end).  Updates the superblock.
+  virtual void grow(Block::ID data_end, Block::ID list_start) = 0;
+
+  // Takes the blocks freed since the last call (or, with all set, every
+  // free block) to be discarded.
+  virtual std::vector<Block::ID> collect(bool) { return std::vector<Block::ID>(); }
+
+  // Passes collected blocks to the storage as discards, in sorted runs,
+  // skipping any that have been handed out again since.  The frees have
+  // to be durable first.  Unlike everything else here, this is safe to
+  // call without the filesystem lock.  Returns the number discarded.
+  virtual uint64_t discard(const std::vector<Block::ID>&) { return 0; }
+
+  // Blocks the next discard(false) would pass on.
+  virtual uint64_t discardable() { return 0; }
+
+  // Frees many blocks at once.  Managers should override this to batch
+  // their own bookkeeping writes.
+  virtual void release(const std::vector<Block::ID>& block_numbers) {
+    for(Block::ID id: block_numbers) {
+      release(id);
+    }
+  }
 };
@@ -0,0 +1,159 @@
+#include "CRC32C.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+  #include <nmmintrin.h>
+  #include <wmmintrin.h>
+  #define CRC32C_HARDWARE
+#endif
+
+// Anonymous namespace for file-local helpers:
+namespace {
+  const uint32_t POLY = 0x82F63B78; // Reflected.
+
+  // Hardware streams are LONG or SHORT bytes each (multiples of eight);
+  // three LONG streams cover a 4 KB block but for 16 bytes.
+  const size_t LONG  = 1360;
+  const size_t SHORT = 64;
+
+  uint64_t read64(const unsigned char* p) {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  struct Tables {
+    uint32_t slice[8][256];
+    uint32_t long_shift;  // x^(8 * LONG - 33) mod P
+    uint32_t short_shift; // x^(8 * SHORT - 33) mod P
+
+    Tables() {
+      for(uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for(int k = 0; k < 8; ++k) {
+          crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+
+        slice[0][i] = crc;
+      }
+
+      for(uint32_t i = 0; i < 256; ++i) {
+        for(int t = 1; t < 8; ++t) {
+          slice[t][i] = (slice[t - 1][i] >> 8) ^ slice[0][slice[t - 1][i] & 0xff];
+        }
+      }
+
+      long_shift  = power(8 * LONG  - 33);
+      short_shift = power(8 * SHORT - 33);
+    }
+
+    // x^n mod P, bit reflected (x^0 is the top bit).
+    static uint32_t power(size_t n) {
+      uint32_t value = 0x80000000;
+      while(n-- > 0) {
+        value = (value & 1) ? (value >> 1) ^ POLY : value >> 1;
+      }
+
+      return value;
+    }
+  };
+
+  const Tables tables;
+
+  uint32_t portable(const unsigned char* p, size_t size, uint32_t crc) {
+    while(size >= 8) {
+      uint64_t word = read64(p) ^ crc;
+      crc = tables.slice[7][word         & 0xff] ^
+            tables.slice[6][(word >>  8) & 0xff] ^
+            tables.slice[5][(word >> 16) & 0xff] ^
+            tables.slice[4][(word >> 24) & 0xff] ^
+            tables.slice[3][(word >> 32) & 0xff] ^
+            tables.slice[2][(word >> 40) & 0xff] ^
+            tables.slice[1][(word >> 48) & 0xff] ^
+            tables.slice[0][word >> 56];
+      p    += 8;
+      size -= 8;
+    }
+
+    while(size-- > 0) {
+      crc = (crc >> 8) ^ tables.slice[0][(crc ^ *p++) & 0xff];
+    }
+
+    return crc;
+  }
+
+#ifdef CRC32C_HARDWARE
+  // crc times x^(8n) mod P, where shift is x^(8n - 33) mod P: the carry-
+  // less product holds crc * shift * x, and crc32 multiplies by x^32.
+  __attribute__((target("sse4.2,pclmul")))
+  uint32_t shift(uint32_t crc, uint32_t shift) {
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(shift), 0);
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+  }
+
+  // Runs three independent streams of n bytes so that the crc32
+  // instruction's three cycle latency is hidden, then folds them together.
+  __attribute__((target("sse4.2,pclmul")))
+  uint64_t streams(const unsigned char*& p, size_t n, uint32_t key, uint64_t crc) {
+    uint64_t a = crc;
+    uint64_t b = 0;
+    uint64_t c = 0;
+    for(size_t i = 0; i < n; i += 8) {
+      a = _mm_crc32_u64(a, read64(p + i));
+      b = _mm_crc32_u64(b, read64(p + n + i));
+      c = _mm_crc32_u64(c, read64(p + 2 * n + i));
+    }
+
+    p += 3 * n;
+    return shift(shift(a, key) ^ b, key) ^ c;
+  }
+
+  __attribute__((target("sse4.2,pclmul")))
+  uint32_t hardware(const unsigned char* p, size_t size, uint32_t crc) {
+    uint64_t value = crc;
+    while(size >= 3 * LONG) {
+      value = streams(p, LONG, tables.long_shift, value);
+      size -= 3 * LONG;
+    }
+
+    while(size >= 3 * SHORT) {
+      value = streams(p, SHORT, tables.short_shift, value);
+      size -= 3 * SHORT;
+    }
+
+    while(size >= 8) {
+      value = _mm_crc32_u64(value, read64(p));
+      p    += 8;
+      size -= 8;
+    }
+
+    uint32_t result = value;
+    while(size-- > 0) {
+      result = _mm_crc32_u8(result, *p++);
+    }
+
+    return result;
+  }
+
+  bool supported() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+  }
+#endif
+}
+
+uint32_t crc32c(const void* data, size_t size, uint32_t crc) {
+#ifdef CRC32C_HARDWARE
+  static const bool fast = supported();
+  if(fast) {
+    return ~hardware((const unsigned char*) data, size, ~crc);
+  }
+#endif
+
+  return ~portable((const unsigned char*) data, size, ~crc);
+}
+
+uint32_t crc32c_portable(const void* data, size_t size, uint32_t crc) {
+  return ~portable((const unsigned char*) data, size, ~crc);
+}
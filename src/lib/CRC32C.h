@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C (Castagnoli) of size bytes at data, continuing from crc.  Uses
+// the SSE4.2 crc32 instruction, three streams at a time recombined with
+// PCLMULQDQ, when the CPU has them, and a slicing-by-8 table otherwise.
+uint32_t crc32c(const void* data, size_t size, uint32_t crc = 0);
+
+// The table version, for testing the fast one against.
+uint32_t crc32c_portable(const void* data, size_t size, uint32_t crc = 0);
@@ -0,0 +1,83 @@
+#include "Codec.h"
+#include "FSExceptions.h"
+
+#ifdef HAVE_LZ4
+  #include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD
+  #include <zstd.h>
+#endif
+
+bool Codec::parse(const std::string& name, CompressionType& type) {
+  if(name == "none") type = CompressionType::NONE;
+  else if(name == "lz4")  type = CompressionType::LZ4;
+  else if(name == "zstd") type = CompressionType::ZSTD;
+  else return false;
+  return true;
+}
+
+bool Codec::available(CompressionType type) {
+  switch(type) {
+  case CompressionType::NONE:
+    return true;
+#ifdef HAVE_LZ4
+  case CompressionType::LZ4:
+    return true;
+#endif
+#ifdef HAVE_ZSTD
+  case CompressionType::ZSTD:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+size_t Codec::compress(CompressionType type, const char* src, size_t size, char* dst, size_t capacity) {
+  switch(type) {
+#ifdef HAVE_LZ4
+  case CompressionType::LZ4: {
+    int result = LZ4_compress_default(src, dst, size, capacity);
+    return (result > 0) ? result : 0;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  case CompressionType::ZSTD: {
+    size_t result = ZSTD_compress(dst, capacity, src, size, 3);
+    return ZSTD_isError(result) ? 0 : result;
+  }
+#endif
+  default:
+    (void) src;
+    (void) size;
+    (void) dst;
+    (void) capacity;
+    return 0;
+  }
+}
+
+void Codec::decompress(CompressionType type, const char* src, size_t csize, char* dst, size_t size) {
+  switch(type) {
+#ifdef HAVE_LZ4
+  case CompressionType::LZ4:
+    if(LZ4_decompress_safe(src, dst, csize, size) != (int) size) {
+      throw IOError("Corrupt LZ4 data.");
+    }
+    return;
+#endif
+#ifdef HAVE_ZSTD
+  case CompressionType::ZSTD:
+    if(ZSTD_decompress(dst, size, src, csize) != size) {
+      throw IOError("Corrupt zstd data.");
+    }
+    return;
+#endif
+  default:
+    (void) src;
+    (void) csize;
+    (void) dst;
+    (void) size;
+    throw IOError("Compression type " + std::to_string((int) type) + " is not supported by this build.");
+  }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+enum class CompressionType: uint8_t {
+  NONE = 0,
+  LZ4  = 1,
+  ZSTD = 2
+};
+
+// Block compression through whichever system libraries the build
+// found (see the Makefile).
+class Codec {
+public:
+  // Parses "none", "lz4" or "zstd".
+  static bool parse(const std::string& name, CompressionType& type);
+  static bool available(CompressionType type);
+
+  // Returns the compressed size, or 0 if it didn't fit in capacity.
+  static size_t compress(CompressionType type, const char* src, size_t size, char* dst, size_t capacity);
+
+  // Throws IOError unless src expands to exactly size bytes.
+  static void decompress(CompressionType type, const char* src, size_t csize, char* dst, size_t size);
+};
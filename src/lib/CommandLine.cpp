@@ -1,9 +1,15 @@
 #include "Filesystem.h"
+#include "FSExceptions.h"
+#include "Superblock.h"
+#include "Trace.h"
 
 #include "blocks/StackBasedBlockManager.h"
 #include "inodes/LinearINodeManager.h"
+#include "inodes/SnapshotINodeManager.h"
 #include "storage/MemoryStorage.h"
 #include "storage/FileStorage.h"
+#include "storage/LogStorage.h"
+#include "storage/PageCache.h"
 
 #include <iostream>
 #include <getopt.h>
@@ -15,9 +21,21 @@ static void usage(const char* message = NULL) {
   std::cerr << "  --block-count -n <num>  Total number of blocks (mkfs only).\n";
   std::cerr << "  --inode-count -i <num>  Minimum number of INodes (mkfs only).\n";
   std::cerr << "  --disk-file   -f <str>  File or device to use for storage.\n";
+  std::cerr << "  --cache-size  -c <num>  Page cache size in blocks (defaults to 8192; 0 disables, in memory only).\n";
+  std::cerr << "  --log         -l        Log-structured data blocks (mkfs only).\n";
+  std::cerr << "  --dedup       -D        Deduplicate identical data blocks (mkfs only).\n";
+  std::cerr << "  --snapshot    -S <str>  Mount the named snapshot (read-only).\n";
+  std::cerr << "  --compress    -z <str>  Compress files on close: lz4, zstd or none.\n";
+  std::cerr << "  --verify      -V <str>  Checksum mismatches on read: off, warn (default) or on (fail).\n";
   std::cerr << "  --debug       -d        Enable FUSE debugging output.\n";
   std::cerr << "  --parallel    -p        Run in multithreaded mode.\n";
   std::cerr << "  --quiet       -q        Reduce verbosity; may be repeated.\n";
+  std::cerr << "  --profile     -P <str>  Kernel caching profile: direct, default or cached.\n";
+  std::cerr << "  --option      -o <str>  Profile override (e.g. attr_timeout=5), discard, or FUSE option.\n";
+  std::cerr << "  --trace       -T <str>  Write a Chrome trace to this file (needs make TRACE=1).\n";
+  std::cerr << "  --record      -R <str>  Record disk I/O to this file for bin/replay.\n";
+  std::cerr << "  --emulate     -E <str>  Emulate a device: hdd, sata, nvme or none, then name=value\n";
+  std::cerr << "                          overrides (e.g. nvme,error_rate=0.001,seed=7).\n";
   exit(1);
 }
 
@@ -26,10 +44,23 @@ Filesystem::Filesystem(int argc, char** argv, bool mkfs) {
   uint64_t block_size  = 4096;
   uint64_t block_count = 0;
   uint64_t inode_count = 0;
+  uint64_t cache_size  = 8192;
+  bool     log_structured = false;
+  bool     dedup          = false;
+  const char* snapshot_name = NULL;
+  const char* compress_name = "none";
+  const char* verify_name   = "warn";
+  const char* profile_name = "default";
+  const char* trace_file   = NULL;
+  const char* record_file  = NULL;
+  const char* simulate_spec = NULL;
+  std::vector<std::string> overrides;
 
   mount_point = NULL;
   parallel    = false;
   debug       = false;
+  read_only   = false;
+  discarding  = false;
   verbosity   = 3;
 
   struct option options[] = {
@@ -37,15 +68,26 @@ Filesystem::Filesystem(int argc, char** argv, bool mkfs) {
     {"block-count", required_argument, 0, 'n'},
     {"inode-count", required_argument, 0, 'i'},
     {"disk-file",   required_argument, 0, 'f'},
+    {"cache-size",  required_argument, 0, 'c'},
+    {"log",               no_argument, 0, 'l'},
+    {"dedup",             no_argument, 0, 'D'},
+    {"snapshot",    required_argument, 0, 'S'},
+    {"compress",    required_argument, 0, 'z'},
+    {"verify",      required_argument, 0, 'V'},
     {"debug",             no_argument, 0, 'd'},
     {"parallel",          no_argument, 0, 'p'},
     {"quiet",             no_argument, 0, 'q'},
+    {"profile",     required_argument, 0, 'P'},
+    {"option",      required_argument, 0, 'o'},
+    {"trace",       required_argument, 0, 'T'},
+    {"record",      required_argument, 0, 'R'},
+    {"emulate",     required_argument, 0, 'E'},
     {0, 0, 0, 0}
   };
 
   while(true) {
     int i = 0;
-    int c = getopt_long(argc, argv, "b:n:i:f:dpq", options, &i);
+    int c = getopt_long(argc, argv, "b:n:i:f:c:lDS:z:V:dpqP:o:T:R:E:", options, &i);
     if(c == -1) break;
 
     switch(c) {
@@ -61,6 +103,24 @@ Filesystem::Filesystem(int argc, char** argv, bool mkfs) {
     case 'f':
       disk_file = optarg;
       break;
+    case 'c':
+      cache_size = atoi(optarg);
+      break;
+    case 'l':
+      log_structured = true;
+      break;
+    case 'D':
+      dedup = true;
+      break;
+    case 'S':
+      snapshot_name = optarg;
+      break;
+    case 'z':
+      compress_name = optarg;
+      break;
+    case 'V':
+      verify_name = optarg;
+      break;
     case 'd':
       debug = true;
       break;
@@ -70,6 +130,21 @@ Filesystem::Filesystem(int argc, char** argv, bool mkfs) {
     case 'q':
       verbosity -= 1;
       break;
+    case 'P':
+      profile_name = optarg;
+      break;
+    case 'o':
+      overrides.push_back(optarg);
+      break;
+    case 'T':
+      trace_file = optarg;
+      break;
+    case 'R':
+      record_file = optarg;
+      break;
+    case 'E':
+      simulate_spec = optarg;
+      break;
     default:
       std::cerr << "Unknown argument: " << argv[i] << '\n';
       exit(1);
@@ -83,11 +158,68 @@ Filesystem::Filesystem(int argc, char** argv, bool mkfs) {
     usage("Too many positional arguments.");
   }
 
+  if(!MountProfile::get(profile_name, profile)) {
+    usage("Unknown mount profile.");
+  }
+
+  for(const std::string& option: overrides) {
+    // Anything the profile doesn't know about goes straight to FUSE.
+    try {
+      if(option == "discard") discarding = true;
+      else if(!profile.set(option)) fuse_options.push_back(option);
+    }
+    catch(InvalidArgument& ex) {
+      usage(ex.what());
+    }
+  }
+
   if(disk_file == NULL) {
     // We always need to initialize memory storage.
     mkfs = true;
   }
 
+  if(!Codec::parse(compress_name, compression)) {
+    usage("Unknown compression type.");
+  }
+
+  if(!Codec::available(compression)) {
+    usage("This build doesn't support that compression type.");
+  }
+
+  if(trace_file != NULL) {
+#ifdef SIGSEGV_TRACE
+    // Before any threads start; see Trace::start().
+    Trace::start(trace_file);
+#else
+    usage("This build doesn't support tracing; rebuild with make TRACE=1.");
+#endif
+  }
+
+  SimulatedStorage::Profile device;
+  if(simulate_spec != NULL && !SimulatedStorage::Profile::parse(simulate_spec, device)) {
+    usage("Unknown device profile or option.");
+  }
+
+  ChecksumStorage::Verify verify;
+  if(!ChecksumStorage::parse(verify_name, verify)) {
+    usage("Unknown verify policy.");
+  }
+
+  if(disk_file != NULL && cache_size == 0 && !mkfs) {
+    // Metadata only reaches the journal through the page cache.
+    usage("Disk files can't be mounted without a page cache (-c 0).");
+  }
+
+  if(snapshot_name != NULL) {
+    if(mkfs) {
+      usage("Snapshots can only be mounted from an existing disk file.");
+    }
+
+    read_only  = true;
+    discarding = false;
+    fuse_options.push_back("ro");
+  }
+
   if(block_size < 256) {
     usage("Block size must be at least 256 bytes.");
   }
@@ -98,18 +230,34 @@ Filesystem::Filesystem(int argc, char** argv, bool mkfs) {
     usage("Block size must be a power of two.");
   }
 
-  if(block_count == 0) {
-    usage("Block count is a required argument.");
-    // if(mkfs) {
-    //   usage("Block count is required for mkfs.");
-    // }
-    // else {
-    //   // TODO: Load the block count from disk!
-    // }
+  // The superblock knows how big the filesystem is (it may have grown),
+  // but a grow() still in the journal can't be seen until after replay.
+  // Until then the disk is opened as big as the file or device is.
+  uint64_t open_count = block_count;
+  if(!mkfs) {
+    Block block;
+    Superblock* superblock = (Superblock*) block.data;
+    try {
+      FileStorage probe(disk_file, 1);
+      probe.get(0, block);
+      open_count = probe.capacity();
+    }
+    catch(std::exception&) {
+      usage("Can't read the superblock from the disk file.");
+    }
+
+    if(superblock->magic != 3199905246 || superblock->block_count == 0) {
+      usage("No filesystem on the disk file; run mkfs first.");
+    }
+
+    block_count = superblock->block_count;
+    if(open_count < block_count) {
+      open_count = block_count;
+    }
+  }
+  else if(block_count == 0) {
+    usage("Block count is required for mkfs and in-memory filesystems.");
   }
-  // else if(!mkfs) {
-  //   usage("Block count option is only valid for mkfs.");
-  // }
 
   uint64_t inode_blocks = 0;
   if(inode_count == 0) {
@@ -127,9 +275,11 @@ Filesystem::Filesystem(int argc, char** argv, bool mkfs) {
     usage("Too many INode blocks.");
   }
 
-  Storage* disk = NULL;
+  Storage* storage = NULL;
+  cache   = NULL;
+  journal = NULL;
   if(disk_file != NULL) {
-    disk = new FileStorage(disk_file, block_count);
+    disk = new FileStorage(disk_file, open_count);
     if(mkfs) {
       Block block;
       std::memset(block.data, 0, Block::SIZE);
@@ -140,6 +290,50 @@ Filesystem::Filesystem(int argc, char** argv, bool mkfs) {
     disk = new MemoryStorage(block_count);
   }
 
+  // The simulator stands in for the device itself, so everything above
+  // it (including the recorder) sees its delays and errors.
+  Storage* device_storage = disk;
+  simulator = NULL;
+  if(simulate_spec != NULL) {
+    simulator      = new SimulatedStorage(*disk, device);
+    device_storage = simulator;
+  }
+
+  // The recorder sees exactly what reaches the device.
+  recorder = NULL;
+  if(record_file != NULL) {
+    recorder       = new RecordingStorage(*device_storage, record_file, open_count);
+    device_storage = recorder;
+  }
+
+  // Log-structured filesystems remap their data blocks; anything else
+  // just passes through.  Checksums cover the blocks as they sit on disk.
+  checksums   = new ChecksumStorage(*device_storage, verify);
+  log_storage = new LogStorage(*checksums);
+  storage     = log_storage;
+  if(disk_file != NULL) {
+    journal = new Journal(*log_storage, checksums);
+    if(!mkfs) {
+      // Finish any metadata updates that were cut off by a crash.
+      log_storage->load();
+      journal->replay();
+
+      Block block;
+      Superblock* superblock = (Superblock*) block.data;
+      log_storage->get(0, block);
+      block_count = superblock->block_count;
+      if(block_count != open_count && !device_storage->resize(block_count)) {
+        throw IOError("The disk file is smaller than the filesystem.");
+      }
+    }
+
+    if(cache_size > 0) {
+      cache   = new PageCache(*log_storage, cache_size, journal);
+      storage = cache;
+      mutex.cache = cache;
+    }
+  }
+
   uint64_t ipb   = Block::SIZE / sizeof(Block::ID);
   max_file_size  = INode::DIRECT_POINTERS;
   max_file_size += INode::SINGLE_INDIRECT_POINTERS * ipb;
@@ -147,7 +341,15 @@ Filesystem::Filesystem(int argc, char** argv, bool mkfs) {
   max_file_size += INode::TRIPLE_INDIRECT_POINTERS * ipb * ipb * ipb;
   max_file_size *= Block::SIZE;
 
-  inode_manager = new LinearINodeManager(*disk);
-  block_manager = new StackBasedBlockManager(*disk);
-  if(mkfs) this->mkfs(block_count, inode_blocks);
+  if(read_only) inode_manager = new SnapshotINodeManager(*storage, snapshot_name);
+  else           inode_manager = new LinearINodeManager(*storage);
+  block_manager = new StackBasedBlockManager(*storage, discarding);
+  references    = new RefCountTable(*block_manager);
+  fingerprints  = new DedupIndex(*block_manager);
+  fragments     = new FragmentManager(*block_manager, *references);
+  stopping      = false;
+  reclaimer     = std::thread(&Filesystem::reclaim, this);
+
+  if(mkfs)            this->mkfs(block_count, inode_blocks, log_structured, dedup);
+  else if(!read_only) this->recover();
 }
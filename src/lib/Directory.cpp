@@ -1,4 +1,5 @@
 #include "Directory.h"
+#include "Trace.h"
 
 #include <cstring>
 
@@ -10,6 +11,7 @@ Directory::Directory(INode::ID id, INode::ID parent): mID(id), mEntries() {
 
 // To be used when loading an existing directory from disk:
 Directory::Directory(INode::ID id, const char* data, size_t size): mID(id), mEntries() {
+  TRACE_SPAN("Directory::parse");
   size_t index = 0;
   while(index < size) {
     INode::ID eid;
@@ -50,6 +52,7 @@ INode::ID Directory::search(const std::string& name) const {
 }
 
 std::vector<char> Directory::serialize() const {
+  TRACE_SPAN("Directory::serialize");
   int bytes = 0;
   for(const auto itr: mEntries) {
     bytes += itr.first.length() + sizeof(INode::ID) + 1;
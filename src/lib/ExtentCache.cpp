@@ -0,0 +1,40 @@
+#include "ExtentCache.h"
+
+const uint64_t Extent::CLUSTER;
+const uint32_t Extent::MAGIC;
+
+ExtentCache::ExtentCache(uint64_t capacity): capacity(capacity) {
+  // Nothing else to do.
+}
+
+const char* ExtentCache::find(Block::ID id) {
+  auto itr = entries.find(id);
+  if(itr == entries.end()) {
+    return NULL;
+  }
+
+  lru.splice(lru.begin(), lru, itr->second);
+  return &itr->second->second[0];
+}
+
+const char* ExtentCache::insert(Block::ID id, std::vector<char>& data) {
+  erase(id);
+  lru.emplace_front(id, std::vector<char>());
+  lru.front().second.swap(data);
+  entries[id] = lru.begin();
+
+  while(entries.size() > capacity) {
+    entries.erase(lru.back().first);
+    lru.pop_back();
+  }
+
+  return &lru.front().second[0];
+}
+
+void ExtentCache::erase(Block::ID id) {
+  auto itr = entries.find(id);
+  if(itr != entries.end()) {
+    lru.erase(itr->second);
+    entries.erase(itr);
+  }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "Block.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Compressed extents.
+//
+// With compression on, a file is split into clusters of CLUSTER blocks.
+// When the file is closed, every full cluster that shrinks by at least
+// one block is replaced by an extent: a Header and the compressed bytes,
+// spread over the blocks that the cluster's first few pointers point
+// to.  The cluster's other pointers are zero, which is how a compressed
+// cluster is told apart from a plain one (files never have holes).
+// Writing into a compressed cluster turns it back into plain blocks.
+struct Extent {
+  static const uint64_t CLUSTER = 8; // Blocks per cluster.
+  static const uint32_t MAGIC   = 0x5a545845;
+
+  struct Header {
+    uint32_t magic;
+    uint8_t  type; // CompressionType
+    uint8_t  __padding[3];
+    uint32_t size; // Compressed bytes after the header.
+  };
+};
+
+// Decompressed clusters, keyed by the first block of their extent.
+// Extents are never written in place, so entries stay good until that
+// block is freed.
+class ExtentCache {
+public:
+  ExtentCache(uint64_t capacity = 256);
+
+  // Returns Extent::CLUSTER blocks of data, or NULL if id isn't cached.
+  // The pointer is good until the next insert or erase.
+  const char* find(Block::ID id);
+  const char* insert(Block::ID id, std::vector<char>& data);
+  void        erase(Block::ID id);
+
+private:
+  typedef std::list<std::pair<Block::ID, std::vector<char>>> List;
+
+  uint64_t capacity;
+  List     lru; // Most recently used first.
+  std::unordered_map<Block::ID, List::iterator> entries;
+};
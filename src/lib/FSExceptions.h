@@ -38,11 +38,20 @@ struct IOError: public FSException {
   IOError(const std::string& message): FSException(std::errc::io_error, message) {}
 };
 
+struct InvalidArgument: public FSException {
+  InvalidArgument(const std::string& message): FSException(std::errc::invalid_argument, message) {}
+};
+
 struct IsADirectory: public FSException {
   IsADirectory(): FSException(std::errc::is_a_directory, "That's a directory!") {}
   IsADirectory(const std::string& path): FSException(std::errc::is_a_directory, "Directory: " + path) {}
 };
 
+struct NameTooLong: public FSException {
+  NameTooLong(): FSException(std::errc::filename_too_long, "Name too long!") {}
+  NameTooLong(const std::string& name): FSException(std::errc::filename_too_long, "Name too long: " + name) {}
+};
+
 struct OutOfDataBlocks: public FSException {
   OutOfDataBlocks(): FSException(std::errc::no_space_on_device, "Out of data blocks!") {}
 };
@@ -66,6 +75,18 @@ struct NotASymlink: public FSException {
   NotASymlink(const std::string& path): FSException(std::errc::invalid_argument, "Not a symlink: " + path) {}
 };
 
+struct ReadOnly: public FSException {
+  ReadOnly(): FSException(std::errc::read_only_file_system, "Read-only filesystem!") {}
+};
+
+struct TooManyLinks: public FSException {
+  TooManyLinks(): FSException(std::errc::too_many_links, "Too many references to a block!") {}
+};
+
+struct TooManySnapshots: public FSException {
+  TooManySnapshots(): FSException(std::errc::no_space_on_device, "Too many snapshots!") {}
+};
+
 struct NoSuchEntry: public FSException {
   NoSuchEntry(): FSException(std::errc::no_such_file_or_directory, "No such entry!") {}
   NoSuchEntry(const std::string& path): FSException(std::errc::no_such_file_or_directory, "No such entry: " + path) {}
@@ -1,10 +1,15 @@
 #include "Filesystem.h"
 #include "FSExceptions.h"
 #include "Superblock.h"
+#include "Trace.h"
+#include "XXHash.h"
+#include "inodes/SnapshotINodeManager.h"
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstring>
+#include <set>
 #include <stack>
 #include <stdexcept>
 #include <cstdlib>
@@ -19,10 +24,50 @@
 
 #include <fuse.h>
 
+const uint64_t Filesystem::DISCARD_DELAY;
+
+OperationMutex::OperationMutex():
+  cache(NULL),
+  depth(0)
+{
+  // Nothing else to do.
+}
+
+void OperationMutex::lock() {
+  mutex.lock();
+  if(depth++ == 0 && cache != NULL) cache->begin();
+}
+
+bool OperationMutex::try_lock() {
+  if(!mutex.try_lock()) return false;
+  if(depth++ == 0 && cache != NULL) cache->begin();
+  return true;
+}
+
+void OperationMutex::unlock() {
+  if(--depth == 0 && cache != NULL) cache->end();
+  mutex.unlock();
+}
 
 Filesystem::Filesystem(BlockManager& block_manager, INodeManager& inode_manager) {
+  this->disk          = NULL;
+  this->simulator     = NULL;
+  this->recorder      = NULL;
+  this->checksums     = NULL;
+  this->cache         = NULL;
+  this->journal       = NULL;
+  this->log_storage   = NULL;
   this->block_manager = &block_manager;
   this->inode_manager = &inode_manager;
+  this->references    = new RefCountTable(block_manager);
+  this->fingerprints  = new DedupIndex(block_manager);
+  this->fragments     = new FragmentManager(block_manager, *references);
+  this->compression   = CompressionType::NONE;
+  this->read_only     = false;
+  this->discarding    = false;
+  this->stopping      = false;
+  this->reclaimer     = std::thread(&Filesystem::reclaim, this);
+  MountProfile::get("default", profile);
 
   uint64_t ipb   = Block::SIZE / sizeof(Block::ID);
   max_file_size  = INode::DIRECT_POINTERS;
@@ -33,10 +78,63 @@ Filesystem::Filesystem(BlockManager& block_manager, INodeManager& inode_manager)
 }
 
 Filesystem::~Filesystem() {
-  // Nothing to do.
+  {
+    // Unfinished orphans are picked up again on the next mount.
+    std::lock_guard<OperationMutex> lock(mutex);
+    stopping = true;
+  }
+
+  orphaned.notify_all();
+  reclaimer.join();
+  if(discarding) {
+    try {
+      trim(false);
+    }
+    catch(std::exception& ex) {
+      std::cerr << "Failed to discard freed blocks: " << ex.what() << '\n';
+    }
+  }
+
+  delete fragments;
+  delete references;
+  delete fingerprints;
+  if(disk != NULL) {
+    ChecksumStorage::Stats stats = checksums->stats();
+    if(verbosity > 1 && stats.verified > 0) {
+      // What verification cost us (writes are checksummed either way).
+      double seconds = stats.nanoseconds / 1e9;
+      double blocks  = stats.verified + stats.written;
+      std::cerr << "Checksums: " << stats.verified << " blocks verified, " << stats.mismatches << " mismatches, "
+                << stats.written << " blocks written; " << seconds * 1000 << " ms at "
+                << ((seconds > 0) ? blocks * Block::SIZE / seconds / 1e9 : 0) << " GB/s\n";
+    }
+
+    if(verbosity > 1 && simulator != NULL) {
+      SimulatedStorage::Stats device = simulator->stats();
+      std::cerr << "Simulated device: " << device.requests << " requests, " << device.errors << " failed ("
+                << device.torn << " torn writes, " << device.lost << " lost to a crash); busy for " << device.nanoseconds / 1e6 << " ms\n";
+    }
+
+    // We built the storage stack ourselves (see CommandLine.cpp).
+    // Deleting the cache writes out anything still dirty.
+    mutex.cache = NULL;
+    delete block_manager;
+    delete inode_manager;
+    delete cache;
+    delete journal;
+    delete log_storage;
+    delete checksums;
+    delete recorder;
+    delete simulator;
+    delete disk;
+  }
+
+#ifdef SIGSEGV_TRACE
+  Trace::stop();
+#endif
 }
 
-void Filesystem::mkfs(uint64_t nblocks, uint64_t niblocks) {
+void Filesystem::mkfs(uint64_t nblocks, uint64_t niblocks, bool log_structured, bool dedup) {
   Block block;
   Superblock* superblock = (Superblock*) block.data;
   std::memset(block.data, 0, Block::SIZE);
@@ -45,14 +143,66 @@ void Filesystem::mkfs(uint64_t nblocks, uint64_t niblocks) {
   superblock->block_size  = Block::SIZE;
   superblock->block_count = nblocks;
 
-  superblock->inode_block_start = 1;
-  superblock->inode_block_count = niblocks;
-  superblock->data_block_start  = niblocks + 1;
-  superblock->data_block_count  = nblocks - niblocks - 1;
+  // Up to 4 MB of metadata journal, unless the disk is tiny.
+  uint64_t njblocks = std::min<uint64_t>(1024, nblocks / 32);
+  if(njblocks < 16) {
+    njblocks = 0;
+  }
+
+  // One 16 bit reference count per data block (for snapshots),
+  // optionally one fingerprint index entry per data block, and one
+  // checksum per block.
+  uint64_t nrblocks = (nblocks - niblocks - njblocks - 1) / (Block::SIZE / sizeof(uint16_t)) + 1;
+  uint64_t ndblocks = dedup ? (nblocks - niblocks - njblocks - 1) / (Block::SIZE / 16) + 1 : 0;
+  uint64_t nkblocks = ChecksumStorage::layout(nblocks);
+
+  superblock->inode_block_start    = 1;
+  superblock->inode_block_count    = niblocks;
+  superblock->journal_block_start  = niblocks + 1;
+  superblock->journal_block_count  = njblocks;
+  superblock->refcount_block_start = niblocks + njblocks + 1;
+  superblock->refcount_block_count = nrblocks;
+  superblock->dedup_block_start    = niblocks + njblocks + nrblocks + 1;
+  superblock->dedup_block_count    = ndblocks;
+  superblock->checksum_block_start = niblocks + njblocks + nrblocks + ndblocks + 1;
+  superblock->checksum_block_count = nkblocks;
+  superblock->data_block_start     = niblocks + njblocks + nrblocks + ndblocks + nkblocks + 1;
+  superblock->data_block_count     = nblocks - niblocks - njblocks - nrblocks - ndblocks - nkblocks - 1;
+
+  if(checksums != NULL) {
+    // Everything below gets checksummed as it's written.
+    checksums->format(superblock->checksum_block_start, nkblocks, nblocks, superblock->journal_block_start, njblocks);
+  }
+
+  if(log_structured) {
+    // The data region becomes a mapping table plus segments, and holds
+    // fewer (logical) data blocks than it has physical ones.
+    if(log_storage == NULL) {
+      throw std::invalid_argument("Log-structured mode needs our own storage stack.");
+    }
+
+    uint64_t count = LogStorage::layout(superblock->data_block_start, superblock->data_block_count,
+      superblock->log_map_start, superblock->log_segment_start, superblock->log_segment_count);
+    if(count == 0) {
+      throw std::length_error("Disk too small for log-structured mode.");
+    }
+
+    superblock->data_block_count = count;
+    log_storage->format(superblock->data_block_start, superblock->log_map_start,
+      superblock->log_segment_start, superblock->log_segment_count);
+  }
+
+  if(journal != NULL) {
+    journal->format(superblock->journal_block_start, njblocks, !log_structured);
+  }
 
   block_manager->set(0, block);
   inode_manager->mkfs();
   block_manager->mkfs();
+  references->mkfs();
+  fingerprints->mkfs();
+  fragments->mkfs();
+  orphans.clear();
 
   INode::ID id = inode_manager->getRoot();
   INode inode(FileType::DIRECTORY, 0777);
@@ -79,8 +229,9 @@ void Filesystem::statfs(struct statvfs* info) {
   info->f_bsize   = superblock->block_size; // File system block size.
   info->f_frsize  = superblock->block_size; // Fundamental file system block size.
   info->f_fsid    = superblock->magic;      // File system ID.
-  info->f_flag    = 0;                      // Bit mask of f_flag values.
+  info->f_flag    = read_only ? ST_RDONLY : 0; // Bit mask of f_flag values.
   info->f_namemax = 256;                    // Maximum filename length.
+  block_manager->statfs(info);
 }
 
 int Filesystem::mount(char* program, fuse_operations* ops) {
@@ -89,27 +240,34 @@ int Filesystem::mount(char* program, fuse_operations* ops) {
     exit(1);
   }
 
-  char s[] = "-s"; // Use a single thread.
-  char d[] = "-d"; // Print debuging output.
-  char f[] = "-f"; // Run in the foreground.
-  char o[] = "-o"; // Other options
-  char p[] = "default_permissions"; // Defer permissions checks to kernel
-  char r[] = "allow_other"; // Allow all users to access files
+  std::vector<std::string> args;
+  args.push_back(program);
+  if(!parallel) args.push_back("-s"); // Use a single thread.
+  if(debug)     args.push_back("-d"); // Print debuging output.
+  args.push_back("-f");               // Run in the foreground.
+  args.push_back(mount_point);
+  args.push_back("-o");
+  args.push_back("default_permissions"); // Defer permissions checks to kernel
+  args.push_back("-o");
+  args.push_back("allow_other");         // Allow all users to access files
+  args.push_back("-o");
+  args.push_back("use_ino");             // Report our INode numbers (see bin/reflink)
+
+  // Kernel caching options from the mount profile, then any extra -o options:
+  std::vector<std::string> options = profile.options();
+  options.insert(options.end(), fuse_options.begin(), fuse_options.end());
+  for(const std::string& option: options) {
+    args.push_back("-o");
+    args.push_back(option);
+  }
 
   int argc = 0;
-  char* argv[12] = {0};
-
-  argv[argc++] = program;
-  if(!parallel) argv[argc++] = s;
-  if(debug)     argv[argc++] = d;
-  argv[argc++] = f;
-  argv[argc++] = mount_point;
-  argv[argc++] = o;
-  argv[argc++] = p;
-  argv[argc++] = o;
-  argv[argc++] = r;
+  std::vector<char*> argv(args.size() + 1, NULL);
+  for(std::string& arg: args) {
+    argv[argc++] = &arg[0];
+  }
 
-  return fuse_main(argc, argv, ops, 0);
+  return fuse_main(argc, &argv[0], ops, 0);
 }
 
 Directory Filesystem::getDirectory(INode::ID id) {
@@ -144,6 +302,7 @@ INode Filesystem::getINode(const std::string& path) {
 }
 
 INode::ID Filesystem::getINodeID(const std::string& path) {
+  TRACE_SPAN("Filesystem::getINodeID");
   INode::ID id = inode_manager->getRoot();
   if(path == "/") return id;
 
@@ -163,13 +322,59 @@ INode::ID Filesystem::getINodeID(const std::string& path) {
 }
 
 INode::ID Filesystem::getINodeID(const char* path, fuse_file_info* info) {
-  return (info->fh != 0) ? info->fh : getINodeID(path);
+  return (info->fh != 0) ? ((OpenFile*) info->fh)->id : getINodeID(path);
 }
 
 INode::ID Filesystem::newINodeID() {
   return inode_manager->reserve();
 }
 
+uint64_t Filesystem::open(INode::ID id) {
+  OpenFile* file = new OpenFile;
+  file->id      = id;
+  file->written = false;
+  if(id != 0) handles[id] += 1;
+  return (uint64_t) file;
+}
+
+/**
+ * Notes that a file was written, truncated or punched, through the
+ * handle in info if there is one.  Its tail is packed and its clusters
+ * compressed when the last handle to it is released.
+ */
+void Filesystem::changed(INode::ID id, fuse_file_info* info) {
+  if(info != NULL && info->fh != 0) {
+    ((OpenFile*) info->fh)->written = true;
+  }
+  else if(handles.count(id) != 0) {
+    dirtied.insert(id);
+  }
+}
+
+void Filesystem::release(fuse_file_info* info) {
+  OpenFile* file = (OpenFile*) info->fh;
+  info->fh = 0;
+
+  INode::ID id = file->id;
+  if(file->written) dirtied.insert(id);
+  delete file;
+  if(id == 0) return;
+
+  // Packing and compressing only pay off once nobody is writing to the
+  // file any more, and are pointless if nobody did.
+  auto itr = handles.find(id);
+  if(itr != handles.end() && --itr->second > 0) return;
+  handles.erase(id);
+  if(dirtied.erase(id) != 0 && !read_only) {
+    pack(id);
+    compress(id);
+  }
+}
+
+Readahead* Filesystem::readahead(fuse_file_info* info) {
+  return (info->fh != 0) ? &((OpenFile*) info->fh)->readahead : NULL;
+}
+
 void Filesystem::save(const Directory& directory) {
   std::vector<char> data = directory.serialize();
   write(directory.id(), &data[0], data.size(), 0);
@@ -196,6 +401,11 @@ void Filesystem::save(INode::ID id, const INode& inode) {
  * - TODO: Incorrect ownership/permissions
  */
 int Filesystem::write(INode::ID file_inode_num, const char *buf, size_t size, size_t offset) {
+  TRACE_SPAN("Filesystem::write");
+  if(read_only) {
+    throw ReadOnly();
+  }
+
   if(offset > max_file_size || size > max_file_size - offset) {
     throw FileTooBig();
   }
@@ -208,14 +418,40 @@ int Filesystem::write(INode::ID file_inode_num, const char *buf, size_t size, si
   file_inode.ctime = file_inode.mtime;
   file_inode.atime = file_inode.mtime;
 
+  // To tell whether fdatasync will need the metadata (see finishWrite).
+  INode    before  = file_inode;
+  uint64_t changes = (cache != NULL) ? cache->changes() : 0;
+
+  // 0. Small files and symlink targets live inside the INode until they
+  // outgrow it.  Directories always use blocks; any that were inlined by
+  // older builds move out on their next write.
+  bool empty = (file_inode.size == 0 && file_inode.blocks == 0);
+  if ((file_inode.flags & INode::INLINE_DATA) || empty) {
+    if (file_inode.type != FileType::DIRECTORY && offset + size <= INode::INLINE_SIZE) {
+      return writeInline(file_inode_num, file_inode, buf, size, offset);
+    }
+
+    if (file_inode.flags & INode::INLINE_DATA) {
+      uninline(file_inode_num, file_inode);
+    }
+  }
+
+  // A packed tail goes back into a block of its own while the file is
+  // being written; it gets packed again when the file is closed.
+  if (file_inode.flags & INode::TAIL_PACKED) {
+    unpack(file_inode_num, file_inode);
+    this->inode_manager->set(file_inode_num, file_inode);
+  }
+
+  // Clusters written to are offered for compression again on close.
+  if (offset / Block::SIZE < file_inode.compress_mark) {
+    file_inode.compress_mark = offset / Block::SIZE / Extent::CLUSTER * Extent::CLUSTER;
+  }
+
   size_t total_written = 0;
   // 1. If we are overwriting any data in the file, do that first.
   while (offset < file_inode.size && size > 0) {
-
-    // Read in block
-    Block block;
-    Block::ID block_num = blockAt(file_inode, offset);
-    this->block_manager->get(block_num, block);
+    expand(file_inode_num, file_inode, offset / Block::SIZE);
 
     /*
       How many bytes to write?
@@ -236,9 +472,23 @@ int Filesystem::write(INode::ID file_inode_num, const char *buf, size_t size, si
       to_write = size;
     }
 
-    // Copy the data and write to disk
-    memcpy(block.data + (offset % Block::SIZE), buf, to_write);
-    this->block_manager->set(block_num, block);
+    // Whole blocks may just point at an existing copy (see dedup)
+    uint64_t hash  = 0;
+    bool     whole = (to_write == Block::SIZE);
+    if (!(whole && dedup(file_inode, offset / Block::SIZE, buf, hash))) {
+
+      // Read in block (copying it first if a snapshot shares it)
+      Block block;
+      Block::ID block_num = mapBlock(file_inode_num, file_inode, offset / Block::SIZE, true);
+      this->block_manager->get(block_num, block);
+
+      // Copy the data and write to disk
+      memcpy(block.data + (offset % Block::SIZE), buf, to_write);
+      setData(file_inode_num, file_inode, block_num, block);
+      if (whole) {
+        remember(block_num, hash);
+      }
+    }
 
     // Update offset, buf pointer, and num bytes left to write
     offset += to_write;
@@ -249,21 +499,328 @@ int Filesystem::write(INode::ID file_inode_num, const char *buf, size_t size, si
   }
 
   if (size == 0) {
+    finishWrite(file_inode_num, file_inode, before, changes);
     return total_written;
   }
 
   // 2. If the offset > file size, insert NULL filler.
   size_t null_filler = offset - file_inode.size;
-  if (null_filler > 0) {
-      total_written += appendData(file_inode, buf, null_filler, file_inode.size, true);
+  try {
+    if (null_filler > 0) {
+      appendData(file_inode_num, file_inode, buf, null_filler, file_inode.size, true);
+    }
+
+    // 3. Write actual data from offset (which should be file size).
+    total_written += appendData(file_inode_num, file_inode, buf, size, offset, false);
   }
+  catch (OutOfDataBlocks&) {
+    // Keep the blocks that were written; the caller sees a short write,
+    // or the error if none of the data made it.  Filler doesn't count.
+    finishWrite(file_inode_num, file_inode, before, changes);
+    if (file_inode.size > offset) {
+      total_written += std::min<size_t>(file_inode.size - offset, size);
+    }
+
+    if (total_written == 0) {
+      throw;
+    }
 
-  // 3. Write actual data from offset (which should be file size).
-  total_written += appendData(file_inode, buf, size, offset, false);
+    return total_written;
+  }
 
   // 4. Write back changes to file_inode
-  this->inode_manager->set(file_inode_num, file_inode);
-  return total_written - null_filler;
+  finishWrite(file_inode_num, file_inode, before, changes);
+  return total_written;
+}
+
+/**
+ * Saves a file's INode at the end of a write.  Overwriting data in place
+ * leaves nothing but the times for fdatasync to commit; anything else
+ * changed the INode (since before) or some other metadata (since the
+ * page cache counted changes).
+ */
+void Filesystem::finishWrite(INode::ID id, const INode& inode, const INode& before, uint64_t changes) {
+  bool moved = inode.size != before.size || inode.blocks != before.blocks || inode.flags != before.flags
+            || memcmp(inode.block_pointers, before.block_pointers, sizeof(before.block_pointers)) != 0;
+  if (moved || (cache != NULL && cache->changes() != changes)) {
+    reshape(id);
+  }
+
+  this->inode_manager->set(id, inode);
+}
+
+/**
+ * Writes into a file whose contents fit inside its INode.
+ * The bytes past the end of inline data are always kept zeroed,
+ * so writing past the end needs no explicit NULL filler.
+ */
+int Filesystem::writeInline(INode::ID id, INode& inode, const char* buf, size_t size, size_t offset) {
+  if (!(inode.flags & INode::INLINE_DATA)) {
+    // The pointers may hold leftovers from the file's previous life.
+    memset(inode.inline_data, 0, INode::INLINE_SIZE);
+    inode.flags |= INode::INLINE_DATA;
+  }
+
+  memcpy(inode.inline_data + offset, buf, size);
+  if (offset + size > inode.size) {
+    inode.size = offset + size;
+  }
+
+  this->inode_manager->set(id, inode);
+  reshape(id);
+  return size;
+}
+
+/**
+ * Moves a file's inline contents out into a data block.
+ * Does not save the INode.
+ */
+void Filesystem::uninline(INode::ID id, INode& inode) {
+  char   data[INode::INLINE_SIZE];
+  size_t size = inode.size;
+  memcpy(data, inode.inline_data, size);
+
+  memset(inode.inline_data, 0, INode::INLINE_SIZE);
+  inode.flags &= ~INode::INLINE_DATA;
+  inode.size   = 0;
+  inode.blocks = 0;
+  appendData(id, inode, data, size, 0, false);
+}
+
+/**
+ * Moves the last partial block of a closed regular file into fragments
+ * shared with other files' tails (see FragmentManager).  Files that are
+ * inline, already packed, block-aligned or have long tails are skipped.
+ */
+void Filesystem::pack(INode::ID id) {
+  INode inode = getINode(id);
+  if (inode.type != FileType::REGULAR) return;
+  if (inode.flags & (INode::INLINE_DATA | INode::TAIL_PACKED)) return;
+
+  uint64_t tail = inode.size % Block::SIZE;
+  if (tail == 0 || tail > FragmentManager::MAX_TAIL) return;
+  if (inode.blocks * Block::SIZE != inode.size - tail + Block::SIZE) return;
+
+  Block block;
+  Block::ID bid = blockAt(inode, inode.size - 1);
+  if (bid == 0) {
+    memset(block.data, 0, Block::SIZE);
+  }
+  else {
+    this->block_manager->get(bid, block);
+  }
+
+  fragments->store(id, block.data, tail, inode.tail_block, inode.tail_index);
+
+  releaseBlocks(inode, inode.blocks - 1);
+  inode.flags |= INode::TAIL_PACKED;
+  this->inode_manager->set(id, inode);
+  reshape(id);
+}
+
+/**
+ * Moves a packed tail back out into a newly allocated last block.
+ * Does not save the INode.
+ */
+void Filesystem::unpack(INode::ID id, INode& inode) {
+  uint64_t tail = inode.size % Block::SIZE;
+  Block block;
+  memset(block.data, 0, Block::SIZE);
+  fragments->load(inode.tail_block, inode.tail_index, block.data, tail);
+
+  Block::ID block_num = allocateNextBlock(inode);
+  setData(id, inode, block_num, block);
+  dropTail(inode);
+}
+
+/**
+ * Frees a packed tail without copying it anywhere.
+ * Does not adjust the file size or save the INode.
+ */
+void Filesystem::dropTail(INode& inode) {
+  uint64_t tail = inode.size % Block::SIZE;
+  fragments->release(inode.tail_block, inode.tail_index, tail);
+
+  inode.flags     &= ~INode::TAIL_PACKED;
+  inode.tail_block = 0;
+  inode.tail_index = 0;
+}
+
+/**
+ * Replaces the full clusters of a closed regular file that were written
+ * since it was last closed (see INode::compress_mark) with compressed
+ * extents.  Clusters that don't shrink by at least a block, or that
+ * share blocks with a snapshot or another file, stay plain.
+ */
+void Filesystem::compress(INode::ID id) {
+  if (compression == CompressionType::NONE) return;
+
+  INode inode = getINode(id);
+  if (inode.type != FileType::REGULAR) return;
+  if (inode.flags & INode::INLINE_DATA) return;
+
+  // Holes would look like the empty end of a compressed cluster.
+  if (inode.flags & INode::SPARSE) return;
+
+  // A partial last block never goes into an extent.
+  uint64_t full = std::min<uint64_t>(inode.size / Block::SIZE, inode.blocks);
+  uint64_t end  = full / Extent::CLUSTER;
+  if (inode.compress_mark >= end * Extent::CLUSTER) return;
+
+  std::vector<char>      raw;
+  std::vector<char>      packed((Extent::CLUSTER - 1) * Block::SIZE);
+  std::vector<Block::ID> freed;
+  for (uint64_t c = inode.compress_mark / Extent::CLUSTER; c < end; ++c) {
+    uint64_t  first = c * Extent::CLUSTER;
+    Block::ID ids[Extent::CLUSTER];
+    bool      plain = true;
+    for (uint64_t i = 0; i < Extent::CLUSTER; ++i) {
+      ids[i] = blockAt(inode, (first + i) * Block::SIZE);
+      if (ids[i] == 0 || references->shared(ids[i])) plain = false;
+    }
+
+    if (!plain) continue;
+
+    raw.resize(Extent::CLUSTER * Block::SIZE);
+    for (uint64_t i = 0; i < Extent::CLUSTER; ++i) {
+      Block block;
+      this->block_manager->get(ids[i], block);
+      memcpy(&raw[i * Block::SIZE], block.data, Block::SIZE);
+    }
+
+    Extent::Header* header = (Extent::Header*) &packed[0];
+    uint64_t size = Codec::compress(compression, &raw[0], raw.size(),
+      &packed[sizeof(Extent::Header)], packed.size() - sizeof(Extent::Header));
+    if (size == 0) continue;
+
+    memset(header, 0, sizeof(Extent::Header));
+    header->magic = Extent::MAGIC;
+    header->type  = (uint8_t) compression;
+    header->size  = size;
+
+    std::vector<Block::ID> blocks;
+    uint64_t count = (sizeof(Extent::Header) + size + Block::SIZE - 1) / Block::SIZE;
+    for (uint64_t i = 0; i < count; ++i) {
+      Block block;
+      memcpy(block.data, &packed[i * Block::SIZE], Block::SIZE);
+      blocks.push_back(this->block_manager->reserve());
+      setData(id, inode, blocks[i], block);
+    }
+
+    for (uint64_t i = 0; i < Extent::CLUSTER; ++i) {
+      Block::ID old = setPointer(inode, first + i, (i < count) ? blocks[i] : 0);
+      if (references->release(old)) freed.push_back(old);
+    }
+
+    // The data is at hand, so the first read needn't decompress it.
+    extents.insert(blocks[0], raw);
+    inode.flags |= INode::COMPRESSED;
+  }
+
+  inode.compress_mark = end * Extent::CLUSTER;
+  this->inode_manager->set(id, inode);
+  this->block_manager->release(freed);
+  reshape(id);
+}
+
+/**
+ * Turns the cluster holding a file's nth block back into plain blocks
+ * if it's compressed.  Does not save the INode.
+ */
+void Filesystem::expand(INode::ID id, INode& inode, uint64_t n) {
+  uint64_t cluster = n / Extent::CLUSTER;
+  if (!compressed(inode, cluster)) return;
+
+  const char* data = extent(inode, cluster);
+  std::vector<char> raw(data, data + Extent::CLUSTER * Block::SIZE);
+
+  // Get every block first; a half expanded cluster would be garbage.
+  std::vector<Block::ID> blocks;
+  try {
+    for (uint64_t i = 0; i < Extent::CLUSTER; ++i) {
+      blocks.push_back(this->block_manager->reserve());
+    }
+  }
+  catch (...) {
+    this->block_manager->release(blocks);
+    throw;
+  }
+
+  std::vector<Block::ID> freed;
+  for (uint64_t i = 0; i < Extent::CLUSTER; ++i) {
+    Block block;
+    memcpy(block.data, &raw[i * Block::SIZE], Block::SIZE);
+    setData(id, inode, blocks[i], block);
+
+    Block::ID old = setPointer(inode, cluster * Extent::CLUSTER + i, blocks[i]);
+    if (old != 0 && references->release(old)) {
+      freed.push_back(old);
+      extents.erase(old);
+    }
+  }
+
+  this->block_manager->release(freed);
+}
+
+/**
+ * Tells whether one of a file's clusters is a compressed extent.
+ */
+bool Filesystem::compressed(const INode& inode, uint64_t cluster) {
+  uint64_t end = (cluster + 1) * Extent::CLUSTER;
+  if (!(inode.flags & INode::COMPRESSED) || end > inode.blocks) {
+    return false;
+  }
+
+  return blockAt(inode, (end - 1) * Block::SIZE) == 0;
+}
+
+/**
+ * Returns the contents of a compressed cluster, decompressing it unless
+ * it's in the extent cache.  The pointer is only good until the next
+ * call.
+ */
+const char* Filesystem::extent(const INode& inode, uint64_t cluster) {
+  uint64_t  first = cluster * Extent::CLUSTER;
+  Block::ID id    = blockAt(inode, first * Block::SIZE);
+  const char* data = extents.find(id);
+  if (data != NULL) {
+    return data;
+  }
+
+  Block block;
+  Extent::Header header;
+  this->block_manager->get(id, block);
+  memcpy(&header, block.data, sizeof(header));
+
+  uint64_t count = (sizeof(Extent::Header) + header.size + Block::SIZE - 1) / Block::SIZE;
+  if (header.magic != Extent::MAGIC || count >= Extent::CLUSTER) {
+    throw IOError("Corrupt compressed extent.");
+  }
+
+  std::vector<char> packed(count * Block::SIZE);
+  memcpy(&packed[0], block.data, Block::SIZE);
+  for (uint64_t i = 1; i < count; ++i) {
+    this->block_manager->get(blockAt(inode, (first + i) * Block::SIZE), block);
+    memcpy(&packed[i * Block::SIZE], block.data, Block::SIZE);
+  }
+
+  std::vector<char> raw(Extent::CLUSTER * Block::SIZE);
+  Codec::decompress((CompressionType) header.type, &packed[sizeof(Extent::Header)], header.size, &raw[0], raw.size());
+  return extents.insert(id, raw);
+}
+
+/**
+ * Writes one block of file data.  Regular file data is tagged with its
+ * INode in the page cache so that fsync can write out just that file's
+ * data (see sync); all other blocks are treated as metadata.
+ */
+void Filesystem::setData(INode::ID id, const INode& inode, Block::ID block_num, const Block& block) {
+  if(cache != NULL && inode.type == FileType::REGULAR) {
+    cache->set(block_num, block, id);
+  }
+  else {
+    this->block_manager->set(block_num, block);
+  }
 }
 
 /**
@@ -273,7 +830,7 @@ int Filesystem::write(INode::ID file_inode_num, const char *buf, size_t size, si
  * Invariant upon entering the function:
  * - Offset == file size, since we are adding to the end of the file.
  */
-size_t Filesystem::appendData(INode& file_inode, const char *buf, size_t size, size_t offset, bool null_filler) {
+size_t Filesystem::appendData(INode::ID file_inode_num, INode& file_inode, const char *buf, size_t size, size_t offset, bool null_filler) {
 
   assert(offset == file_inode.size);
   size_t total_written = 0;
@@ -281,7 +838,7 @@ size_t Filesystem::appendData(INode& file_inode, const char *buf, size_t size, s
   // 1. Fill in the last block already allocated if it has space.
   if (offset % Block::SIZE != 0) {
     Block block;
-    Block::ID block_num = blockAt(file_inode, offset);
+    Block::ID block_num = mapBlock(file_inode_num, file_inode, offset / Block::SIZE, true);
     this->block_manager->get(block_num, block);
 
     /*
@@ -300,7 +857,7 @@ size_t Filesystem::appendData(INode& file_inode, const char *buf, size_t size, s
     } else {
       memcpy(block.data  + (offset % Block::SIZE), buf, to_write);
     }
-    this->block_manager->set(block_num, block);
+    setData(file_inode_num, file_inode, block_num, block);
 
     // Update offset, buf pointer, and num bytes left to write
     offset += to_write;
@@ -321,8 +878,6 @@ size_t Filesystem::appendData(INode& file_inode, const char *buf, size_t size, s
     // Should be block-aligned now
     assert(offset % Block::SIZE == 0);
 
-    // Allocate the next data block
-    Block::ID block_num = allocateNextBlock(file_inode);
     Block block;
 
     /*
@@ -335,13 +890,24 @@ size_t Filesystem::appendData(INode& file_inode, const char *buf, size_t size, s
       to_write = size;
     }
 
-    // Copy the data and write to disk
+    // Copy the data and write to disk, unless a whole block already
+    // exists elsewhere (see dedup)
     if (null_filler) {
       memset(block.data, 0, to_write);
     } else {
       memcpy(block.data, buf, to_write);
     }
-    this->block_manager->set(block_num, block);
+
+    uint64_t hash  = 0;
+    bool     whole = (to_write == Block::SIZE);
+    if (!(whole && dedup(file_inode, file_inode.blocks, block.data, hash))) {
+      // Allocate the next data block
+      Block::ID block_num = allocateNextBlock(file_inode);
+      setData(file_inode_num, file_inode, block_num, block);
+      if (whole) {
+        remember(block_num, hash);
+      }
+    }
 
     // Update offset, buf pointer, and num bytes left to write
     offset += to_write;
@@ -359,149 +925,417 @@ size_t Filesystem::appendData(INode& file_inode, const char *buf, size_t size, s
  * Also allocates any needed new blocks for indirect pointers.
  */
 Block::ID Filesystem::allocateNextBlock(INode& file_inode) {
+  if (file_inode.blocks >= max_file_size / Block::SIZE) {
+    // Can't allocate any more blocks for this file!
+    throw std::out_of_range("Reached max number of blocks allocated for a single file!");
+  }
 
-  size_t scale = Block::SIZE / sizeof(Block::ID);
-  size_t logical_blk_num = file_inode.blocks + 1;
-  Block::ID data_block_num = 0;
+  // A block that starts a new indirect subtree needs new indirect blocks
+  // too.  Make sure they can all be had, so that running out of space
+  // part of the way down doesn't leave indirect blocks mapping nothing.
+  uint64_t n = file_inode.blocks;
+  if (n >= INode::DIRECT_POINTERS) {
+    uint64_t scale = Block::SIZE / sizeof(Block::ID);
+    uint64_t base  = INode::DIRECT_POINTERS;
+    uint64_t span  = scale;
+    while (n >= base + span) {
+      base += span;
+      span *= scale;
+    }
 
-  if (logical_blk_num <= INode::DIRECT_POINTERS) {
+    uint64_t needed = 0;
+    for (uint64_t s = scale; s <= span && (n - base) % s == 0; s *= scale) {
+      needed += 1;
+    }
 
-    // Direct block
+    if (needed > 0) {
+      struct statvfs info;
+      this->block_manager->statfs(&info);
+      if (info.f_bfree < needed + 1) {
+        throw OutOfDataBlocks();
+      }
+    }
+  }
 
-    // 1. Just allocate in inode
-    data_block_num = this->block_manager->reserve();
-    file_inode.block_pointers[file_inode.blocks] = data_block_num;
+  Block::ID data_block_num = mapBlock(0, file_inode, n, true);
 
-  } else if (logical_blk_num <= INode::DIRECT_POINTERS + scale) {
+  // Update the number of allocated data blocks in this inode
+  file_inode.blocks++;
+  return data_block_num;
+}
 
-    // Single-indirect
+/**
+ * Finds the data block holding a file's nth block, first making every
+ * block on the way down to it private to this file: blocks shared with
+ * a snapshot are copied and blocks past the end of the file allocated.
+ * Unless leaf is set, stops above the data block and returns the
+ * indirect block that points to it (0 if the INode does).
+ * Does not save the INode.
+ */
+Block::ID Filesystem::mapBlock(INode::ID id, INode& inode, uint64_t n, bool leaf) {
+  uint64_t scale = Block::SIZE / sizeof(Block::ID);
+  uint64_t base  = n;
+  uint64_t span  = 1;
+  int      level = 0;
+  Block::ID* slot = &inode.block_pointers[n];
+
+  if (n >= INode::DIRECT_POINTERS) {
+    // Find the indirect tree (and the first block it maps).
+    base = INode::DIRECT_POINTERS;
+    span = scale;
+    for (level = 1; n >= base + span; ++level) {
+      if (level == 3) {
+        throw std::out_of_range("Offset greater than maximum file size!");
+      }
 
-    // 1. Check if need block for the direct pointers
-    if (logical_blk_num == INode::DIRECT_POINTERS + 1) {
-      file_inode.block_pointers[INode::DIRECT_POINTERS] = this->block_manager->reserve();
+      base += span;
+      span *= scale;
     }
 
-    // 2. Load in first level block
-    Block direct_ptrs_blk;
-    Block::ID *direct_ptrs = (Block::ID *) &direct_ptrs_blk;
-    this->block_manager->get(file_inode.block_pointers[INode::DIRECT_POINTERS], direct_ptrs_blk);
-
-    // 3. Allocate the direct block
-    logical_blk_num -= INode::DIRECT_POINTERS;
-    data_block_num = this->block_manager->reserve();
-    direct_ptrs[logical_blk_num - 1] = data_block_num;
-    this->block_manager->set(file_inode.block_pointers[INode::DIRECT_POINTERS], direct_ptrs_blk);
+    slot = &inode.block_pointers[INode::DIRECT_POINTERS + level - 1];
+  }
 
-  } else if (logical_blk_num <= INode::DIRECT_POINTERS + scale + (scale * scale)) {
+  if (level == 0 && !leaf) {
+    return 0;
+  }
 
-    // Double-indirect
+  Block::ID bid = own(id, inode, *slot, level, base);
+  *slot = bid;
 
-    // 1. Check if need block for single-indirect pointers
-    if (logical_blk_num == INode::DIRECT_POINTERS + scale + 1) {
-      file_inode.block_pointers[INode::DIRECT_POINTERS + 1] = this->block_manager->reserve();
+  while (level > 0) {
+    span  /= scale;
+    level -= 1;
+    if (level == 0 && !leaf) {
+      return bid;
     }
 
-    // 2. Load in first level block
-    Block single_indirect_ptrs_blk;
-    Block::ID *single_indirect_ptrs = (Block::ID *) &single_indirect_ptrs_blk;
-    this->block_manager->get(file_inode.block_pointers[INode::DIRECT_POINTERS + 1], single_indirect_ptrs_blk);
+    Block block;
+    this->block_manager->get(bid, block);
+    Block::ID* refs = (Block::ID*) &block;
+
+    uint64_t i = (n - base) / span;
+    base += i * span;
 
-    // 3. Check if need block for direct pointers
-    Block::ID block_idx_in_level = logical_blk_num - INode::DIRECT_POINTERS - scale - 1;
-    if (block_idx_in_level % scale == 0) {
-      single_indirect_ptrs[block_idx_in_level / scale] = this->block_manager->reserve();
-      this->block_manager->set(file_inode.block_pointers[INode::DIRECT_POINTERS + 1], single_indirect_ptrs_blk);
+    Block::ID child = own(id, inode, refs[i], level, base);
+    if (child != refs[i]) {
+      refs[i] = child;
+      this->block_manager->set(bid, block);
     }
 
-    // 4. Load in second level block
-    Block direct_ptrs_blk;
-    Block::ID *direct_ptrs = (Block::ID *) &direct_ptrs_blk;
-    this->block_manager->get(single_indirect_ptrs[block_idx_in_level / scale], direct_ptrs_blk);
-
-    // 5. Allocate the direct block
-    data_block_num = this->block_manager->reserve();
-    direct_ptrs[block_idx_in_level % scale] = data_block_num;
-    this->block_manager->set(single_indirect_ptrs[block_idx_in_level / scale], direct_ptrs_blk);
+    bid = child;
+  }
 
-  } else if (logical_blk_num <= INode::DIRECT_POINTERS + scale + (scale * scale) + (scale * scale * scale)) {
-    // Triple-indirect
+  return bid;
+}
 
-    // 1. Check if need block for double-indirect pointers
-    if (logical_blk_num == INode::DIRECT_POINTERS + scale + (scale * scale) + 1) {
-      file_inode.block_pointers[INode::DIRECT_POINTERS + 2] = this->block_manager->reserve();
+/**
+ * Returns a block that only this file uses in place of bid, which sits
+ * level levels above the data blocks and maps the file's blocks starting
+ * at base.  Blocks past the end of the file are new (whatever bid says
+ * is stale), as are indirect blocks a punched hole took away; shared
+ * ones are copied, and a copied indirect block shares its children in
+ * turn.
+ */
+Block::ID Filesystem::own(INode::ID id, const INode& inode, Block::ID bid, int level, uint64_t base) {
+  if (base >= inode.blocks || (bid == 0 && level > 0)) {
+    Block::ID fresh = this->block_manager->reserve();
+    if (level > 0) {
+      Block block;
+      memset(block.data, 0, Block::SIZE);
+      this->block_manager->set(fresh, block);
     }
 
-    // 2. Load in first level block
-    Block double_indirect_ptrs_blk;
-    Block::ID *double_indirect_ptrs = (Block::ID *) &double_indirect_ptrs_blk;
-    this->block_manager->get(file_inode.block_pointers[INode::DIRECT_POINTERS + 2], double_indirect_ptrs_blk);
+    return fresh;
+  }
 
-    // 3. Check if need block for single-indirect pointers
-    Block::ID block_idx_in_level = logical_blk_num - INode::DIRECT_POINTERS - scale - scale * scale - 1;
-    if (block_idx_in_level % (scale * scale) == 0) {
-      double_indirect_ptrs[block_idx_in_level / (scale * scale)] = this->block_manager->reserve();
-      this->block_manager->set(file_inode.block_pointers[INode::DIRECT_POINTERS + 2], double_indirect_ptrs_blk);
-    }
+  if (bid == 0) {
+    // A punched hole (level 0 only) gets a block of zeros.
+    Block block;
+    memset(block.data, 0, Block::SIZE);
+    Block::ID fresh = this->block_manager->reserve();
+    setData(id, inode, fresh, block);
+    return fresh;
+  }
+
+  if (!references->shared(bid)) {
+    return bid;
+  }
 
-    // 4. Load in second level block
-    Block single_indirect_ptrs_blk;
-    Block::ID *single_indirect_ptrs = (Block::ID *) &single_indirect_ptrs_blk;
-    this->block_manager->get(double_indirect_ptrs[block_idx_in_level / (scale * scale)], single_indirect_ptrs_blk);
+  Block block;
+  this->block_manager->get(bid, block);
+  Block::ID copy = this->block_manager->reserve();
+
+  if (level > 0) {
+    uint64_t scale = Block::SIZE / sizeof(Block::ID);
+    uint64_t span  = 1;
+    for (int i = 1; i < level; ++i) {
+      span *= scale;
+    }
 
-    // 5. Check if need block for direct pointers
-    Block::ID block_idx_in_level_two = block_idx_in_level % (scale * scale);
-    if (block_idx_in_level_two % scale == 0) {
-      single_indirect_ptrs[block_idx_in_level_two / scale] = this->block_manager->reserve();
-      this->block_manager->set(double_indirect_ptrs[block_idx_in_level / (scale * scale)], single_indirect_ptrs_blk);
+    Block::ID* refs = (Block::ID*) &block;
+    for (uint64_t i = 0; i < scale && base + i * span < inode.blocks; ++i) {
+      // Zero pointers are holes or the unused part of a compressed cluster.
+      if (refs[i] != 0) references->share(refs[i]);
     }
 
-    // 6. Load in third level block
-    Block direct_ptrs_blk;
-    Block::ID *direct_ptrs = (Block::ID *) &direct_ptrs_blk;
-    this->block_manager->get(single_indirect_ptrs[block_idx_in_level_two / scale], direct_ptrs_blk);
+    this->block_manager->set(copy, block);
+  }
+  else {
+    setData(id, inode, copy, block);
+  }
 
-    // 7. Allocate direct block
-    data_block_num = this->block_manager->reserve();
-    direct_ptrs[block_idx_in_level_two % scale] = data_block_num;
-    this->block_manager->set(single_indirect_ptrs[block_idx_in_level_two / scale], direct_ptrs_blk);
+  references->release(bid);
+  return copy;
+}
 
-  } else {
-    // Can't allocate any more blocks for this file!
-    throw std::out_of_range("Reached max number of blocks allocated for a single file!");
+/**
+ * Points a file's nth block at bid, making the indirect blocks on the
+ * way private first.  Returns the old pointer, leaving its reference
+ * count alone.  Does not save the INode.
+ */
+Block::ID Filesystem::setPointer(INode& inode, uint64_t n, Block::ID bid) {
+  Block::ID old    = 0;
+  Block::ID parent = mapBlock(0, inode, n, false);
+  if (parent == 0) {
+    old = inode.block_pointers[n];
+    inode.block_pointers[n] = bid;
+  }
+  else {
+    uint64_t scale = Block::SIZE / sizeof(Block::ID);
+    Block block;
+    this->block_manager->get(parent, block);
+    Block::ID* refs = (Block::ID*) &block;
+    old = refs[(n - INode::DIRECT_POINTERS) % scale];
+    refs[(n - INode::DIRECT_POINTERS) % scale] = bid;
+    this->block_manager->set(parent, block);
   }
 
-  // Update the number of allocated data blocks in this inode
-  file_inode.blocks++;
-  return data_block_num;
+  return old;
 }
 
-int Filesystem::read(INode::ID file_inode_num, char *buf, size_t size, size_t offset) {
+/**
+ * Points a file's nth block at bid, which gains a reference.  The old
+ * block (if n is inside the file) loses one; n may also be the block
+ * just past the end.  Does not adjust the file size or save the INode.
+ */
+void Filesystem::shareBlock(INode& inode, uint64_t n, Block::ID bid) {
+  references->share(bid);
 
-  // Read the file's inode and do some sanity checks
-  INode file_inode = getINode(file_inode_num);
-  if (offset >= file_inode.size) {
-    return 0; // Can't begin reading from after file
+  Block::ID old = setPointer(inode, n, bid);
+  if (n == inode.blocks) {
+    inode.blocks += 1;
+  }
+  else if (old != 0 && references->release(old)) {
+    this->block_manager->release(old);
   }
+}
 
-  file_inode.atime = time(NULL);
+/**
+ * With deduplication on, looks for a live block holding the same bytes
+ * as data and, if there is one, makes it the file's nth block (which may
+ * be the one just past the end) instead of writing a new block.  Returns
+ * false, with data's fingerprint in hash, if the caller has to write it.
+ * Does not adjust the file size or save the INode.
+ */
+bool Filesystem::dedup(INode& inode, uint64_t n, const char* data, uint64_t& hash) {
+  if (!fingerprints->enabled()) {
+    return false;
+  }
 
-  // Only read until the end of the file
-  if (offset + size > file_inode.size) {
-    size = file_inode.size - offset;
+  hash = xxhash64(data, Block::SIZE);
+  Block::ID match = fingerprints->find(hash);
+  if (match == 0 || !references->indexed(match)) {
+    return false;
   }
 
-  size_t total_read = 0;
-  while (size > 0) {
+  // Fingerprints are only hints; the contents have to match.
+  Block block;
+  this->block_manager->get(match, block);
+  if (memcmp(block.data, data, Block::SIZE) != 0) {
+    return false;
+  }
 
-    // Get datablock of current offset
-    Block::ID cur_block_id = blockAt(file_inode, offset);
-    Block block;
-    this->block_manager->get(cur_block_id, block);
+  if (n < inode.blocks && blockAt(inode, n * Block::SIZE) == match) {
+    return true;
+  }
 
-    /*
-      How many bytes to read?
-      a) Normally read whole blocks at a time.
-      b) If the offset isn't block aligned though
+  try {
+    shareBlock(inode, n, match);
+  }
+  catch (TooManyLinks&) {
+    // Let the caller write a fresh copy; it replaces this one in the index.
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Adds a newly written whole block to the dedup index.
+ */
+void Filesystem::remember(Block::ID bid, uint64_t hash) {
+  if (fingerprints->enabled()) {
+    fingerprints->insert(hash, bid);
+    references->index(bid);
+  }
+}
+
+/**
+ * Copies length bytes from one file to another without copying data
+ * blocks where it can: if both offsets are block aligned, whole blocks
+ * (and a last partial block that ends both files) are shared with the
+ * source and only get copied when one side overwrites them.  The rest
+ * is copied byte by byte.  Returns the number of bytes copied.
+ */
+uint64_t Filesystem::clone(INode::ID src_id, uint64_t src_off, INode::ID dst_id, uint64_t dst_off, uint64_t length) {
+  if (read_only) {
+    throw ReadOnly();
+  }
+
+  INode src = getINode(src_id);
+  INode dst = getINode(dst_id);
+  if (src.type != FileType::REGULAR || dst.type != FileType::REGULAR) {
+    throw NotAFile();
+  }
+
+  if (src_off >= src.size) {
+    return 0;
+  }
+
+  length = std::min<uint64_t>(length, src.size - src_off);
+  if (src_id == dst_id && src_off < dst_off + length && dst_off < src_off + length) {
+    throw InvalidArgument("Overlapping clone ranges.");
+  }
+
+  if (dst_off > max_file_size || length > max_file_size - dst_off) {
+    throw FileTooBig();
+  }
+
+  uint64_t done = 0;
+  bool aligned  = (src_off % Block::SIZE == 0 && dst_off % Block::SIZE == 0);
+  bool plain    = !(src.flags & INode::INLINE_DATA) && !((src.flags | dst.flags) & INode::COMPRESSED);
+  if (aligned && plain && src_off < src.blocks * Block::SIZE) {
+    // Give the destination plain blocks up to where the clone starts.
+    if (dst.size < dst_off) {
+      truncate(dst_id, dst_off);
+      dst = getINode(dst_id);
+    }
+
+    if (dst.flags & INode::INLINE_DATA) {
+      uninline(dst_id, dst);
+    }
+
+    if (dst.flags & INode::TAIL_PACKED) {
+      unpack(dst_id, dst);
+    }
+
+    while (done < length && src_off + done < src.blocks * Block::SIZE) {
+      uint64_t n = length - done;
+      if (n > Block::SIZE) {
+        n = Block::SIZE;
+      }
+
+      if (n < Block::SIZE && (src_off + done + n != src.size || dst_off + done + n < dst.size)) {
+        // A partial block is only shared if it ends both files.
+        break;
+      }
+
+      Block::ID bid = blockAt(src, src_off + done);
+      if (bid == 0) {
+        // Holes are copied as zeros.
+        break;
+      }
+
+      shareBlock(dst, (dst_off + done) / Block::SIZE, bid);
+      dst.size = std::max<uint64_t>(dst.size, dst_off + done + n);
+      done += n;
+    }
+
+    dst.mtime = time(NULL);
+    dst.ctime = dst.mtime;
+    this->inode_manager->set(dst_id, dst);
+    reshape(dst_id);
+  }
+
+  std::vector<char> buffer(std::min<uint64_t>(length - done, 64 * Block::SIZE));
+  while (done < length) {
+    uint64_t n = std::min<uint64_t>(buffer.size(), length - done);
+    n = read(src_id, &buffer[0], n, src_off + done);
+    write(dst_id, &buffer[0], n, dst_off + done);
+    done += n;
+  }
+
+  invalidate(dst_id);
+  return done;
+}
+
+int Filesystem::read(INode::ID file_inode_num, char *buf, size_t size, size_t offset, Readahead* readahead) {
+  TRACE_SPAN("Filesystem::read");
+
+  // Read the file's inode and do some sanity checks
+  INode file_inode = getINode(file_inode_num);
+  if (offset >= file_inode.size) {
+    return 0; // Can't begin reading from after file
+  }
+
+  file_inode.atime = time(NULL);
+
+  // Only read until the end of the file
+  if (offset + size > file_inode.size) {
+    size = file_inode.size - offset;
+  }
+
+  if (file_inode.flags & INode::INLINE_DATA) {
+    memcpy(buf, file_inode.inline_data + offset, size);
+    return size;
+  }
+
+  if (readahead != NULL && cache != NULL && size > 0) {
+    prefetch(file_inode, offset, size, readahead);
+  }
+
+  size_t      total_read = 0;
+  uint64_t    cluster    = UINT64_MAX;
+  const char* unpacked   = NULL;
+  while (size > 0) {
+
+    // Everything past the last full block is in the packed tail.
+    if ((file_inode.flags & INode::TAIL_PACKED) && offset >= file_inode.blocks * Block::SIZE) {
+      char tail[FragmentManager::MAX_TAIL];
+      fragments->load(file_inode.tail_block, file_inode.tail_index, tail, file_inode.size % Block::SIZE);
+      memcpy(buf, tail + (offset % Block::SIZE), size);
+      total_read += size;
+      break;
+    }
+
+    // Compressed clusters come out of the extent cache
+    uint64_t n = offset / Block::SIZE;
+    if ((file_inode.flags & INode::COMPRESSED) && n / Extent::CLUSTER != cluster) {
+      cluster  = n / Extent::CLUSTER;
+      unpacked = compressed(file_inode, cluster) ? extent(file_inode, cluster) : NULL;
+    }
+
+    // Get datablock of current offset
+    Block block;
+    const char* data = block.data;
+    if (unpacked != NULL) {
+      data = unpacked + (n % Extent::CLUSTER) * Block::SIZE;
+    }
+    else {
+      Block::ID cur_block_id = blockAt(file_inode, offset);
+      if (cur_block_id == 0) {
+        // A punched hole.
+        memset(block.data, 0, Block::SIZE);
+      }
+      else {
+        this->block_manager->get(cur_block_id, block);
+      }
+    }
+
+    /*
+      How many bytes to read?
+      a) Normally read whole blocks at a time.
+      b) If the offset isn't block aligned though
          (which could happen for the first block),
          then only read until the end of the block.
       c) Don't read past the end of the file.
@@ -518,7 +1352,7 @@ int Filesystem::read(INode::ID file_inode_num, char *buf, size_t size, size_t of
     }
 
     // Copy data from block into buffer
-    memcpy(buf, block.data + (offset % Block::SIZE), to_read);
+    memcpy(buf, data + (offset % Block::SIZE), to_read);
 
     // Update offset, buf pointer, and num bytes left to read
     offset += to_read;
@@ -560,7 +1394,78 @@ Block::ID Filesystem::blockAt(const INode& inode, uint64_t offset) {
   throw std::out_of_range("Offset greater than maximum file size!");
 }
 
+/**
+ * Finds the indirect block holding the pointer to the data block at the
+ * given offset.  Returns 0 for blocks pointed to by the INode itself.
+ */
+Block::ID Filesystem::pointerBlockAt(const INode& inode, uint64_t offset) {
+  if (offset < INode::DIRECT_POINTERS * Block::SIZE) {
+    return 0;
+  }
+
+  uint64_t size  = Block::SIZE;
+  uint64_t scale = Block::SIZE / sizeof(Block::ID);
+  offset -= INode::DIRECT_POINTERS * Block::SIZE;
+  for (int i = 0; i < 3; ++i) {
+    if (offset < size * scale) {
+      Block::ID bid = inode.block_pointers[INode::DIRECT_POINTERS + i];
+      while (size > Block::SIZE && bid != 0) {
+        Block block;
+        this->block_manager->get(bid, block);
+        bid = ((Block::ID*) &block)[offset / size];
+        offset %= size;
+        size   /= scale;
+      }
+
+      return bid;
+    }
+
+    size   *= scale;
+    offset -= size;
+  }
+
+  throw std::out_of_range("Offset greater than maximum file size!");
+}
+
+/**
+ * Feeds a read into the file's readahead state and queues the blocks it
+ * asks for, plus the indirect block that maps the block after them, to
+ * be loaded into the page cache in the background.
+ */
+void Filesystem::prefetch(const INode& inode, uint64_t offset, uint64_t size, Readahead* readahead) {
+  uint64_t first = offset / Block::SIZE;
+  uint64_t last  = (offset + size - 1) / Block::SIZE;
+  uint64_t start;
+  uint64_t count;
+
+  if (!readahead->access(first, last, start, count) || start >= inode.blocks) {
+    return;
+  }
+
+  count = std::min(count, inode.blocks - start);
+  std::vector<Block::ID> ids;
+  for (uint64_t i = start; i < start + count; ++i) {
+    Block::ID id = blockAt(inode, i * Block::SIZE);
+    if (id != 0) ids.push_back(id);
+  }
+
+  uint64_t end = start + count;
+  if (end < inode.blocks) {
+    Block::ID next = pointerBlockAt(inode, end * Block::SIZE);
+    if (next != 0 && next != pointerBlockAt(inode, (end - 1) * Block::SIZE)) {
+      ids.push_back(next);
+    }
+  }
+
+  cache->prefetch(ids);
+}
+
 Block::ID Filesystem::indirectBlockAt(Block::ID bid, uint64_t offset, uint64_t size) {
+  // A hole punched over the whole subtree.
+  if (bid == 0) {
+    return 0;
+  }
+
   Block block;
   this->block_manager->get(bid, block);
   Block::ID* refs = (Block::ID*) &block;
@@ -575,6 +1480,10 @@ Block::ID Filesystem::indirectBlockAt(Block::ID bid, uint64_t offset, uint64_t s
 }
 
 int Filesystem::truncate(INode::ID file_inode_num, size_t length) {
+  if(read_only) {
+    throw ReadOnly();
+  }
+
   if(length > max_file_size) {
     throw FileTooBig();
   }
@@ -585,53 +1494,96 @@ int Filesystem::truncate(INode::ID file_inode_num, size_t length) {
     return 0;
   }
 
+  reshape(file_inode_num);
   file_inode.mtime = time(NULL);
   file_inode.ctime = file_inode.mtime;
   file_inode.atime = file_inode.mtime;
 
+  // Inline files just zero or expose bytes in the INode
+  if (file_inode.flags & INode::INLINE_DATA) {
+    if (length <= INode::INLINE_SIZE) {
+      if (length < file_inode.size) {
+        memset(file_inode.inline_data + length, 0, file_inode.size - length);
+      }
+
+      file_inode.size = length;
+      this->inode_manager->set(file_inode_num, file_inode);
+      return 0;
+    }
+
+    uninline(file_inode_num, file_inode);
+  }
+
+  // Packed tails are unpacked if any of their bytes survive, and just
+  // dropped otherwise.
+  if (file_inode.flags & INode::TAIL_PACKED) {
+    if (length > file_inode.blocks * Block::SIZE) {
+      unpack(file_inode_num, file_inode);
+    }
+    else {
+      dropTail(file_inode);
+      file_inode.size = file_inode.blocks * Block::SIZE;
+    }
+  }
+
   // If increasing size, fill with NULL bytes
   if (length > file_inode.size) {
-    appendData(file_inode, NULL, length - file_inode.size, file_inode.size, true);
+    appendData(file_inode_num, file_inode, NULL, length - file_inode.size, file_inode.size, true);
     // Write back changes to file_inode
     this->inode_manager->set(file_inode_num, file_inode);
     return 0;
   } else {
+    shrink(file_inode_num, file_inode, length);
+    return 0;
+  }
+}
 
-    // Remove data from last block
-    if (file_inode.size % Block::SIZE != 0) {
-
-      // If removing remainder of last block is too much, just truncate to the desired length
-      if (file_inode.size % Block::SIZE > file_inode.size - length) {
-        file_inode.size = length;
-        // Write back changes to file_inode
-        this->inode_manager->set(file_inode_num, file_inode);
-        return 0;
-      }
+/**
+ * Cuts a file down to length bytes and saves its INode.  Big files lose
+ * RECLAIM_BATCH blocks at a time, and the journal may commit between
+ * batches (see Storage::settle); their size drops to length first, and
+ * the superblock names them until the end so that a crash part way
+ * through gets finished by recover().
+ */
+void Filesystem::shrink(INode::ID id, INode& inode, uint64_t length) {
+  // A compressed cluster that would end up cut short, or holding a
+  // partial last block, is expanded first
+  uint64_t keep = (length + Block::SIZE - 1) / Block::SIZE;
+  if (keep > 0 && (keep % Extent::CLUSTER != 0 || length % Block::SIZE != 0)) {
+    expand(id, inode, keep - 1);
+  }
 
-      file_inode.size -= file_inode.size % Block::SIZE;
-      deallocateLastBlock(file_inode);
+  Block block;
+  Superblock* superblock = (Superblock*) block.data;
+  uint64_t cut = (inode.blocks > keep + RECLAIM_BATCH) ? cutPoint(inode, inode.blocks - RECLAIM_BATCH) : 0;
+  bool stepped = (cut > keep);
+  if (stepped) {
+    this->block_manager->get(0, block);
+    superblock->truncating = id;
+    this->block_manager->set(0, block);
+    inode.size = length;
+  }
 
-      if (file_inode.size == length) {
-        // Write back changes to file_inode
-        this->inode_manager->set(file_inode_num, file_inode);
-        return 0;
-      }
-    }
+  while (cut > keep) {
+    releaseBlocks(inode, cut);
+    this->inode_manager->set(id, inode);
+    this->block_manager->settle();
+    cut = (inode.blocks > keep + RECLAIM_BATCH) ? cutPoint(inode, inode.blocks - RECLAIM_BATCH) : 0;
+  }
 
-    // Remove other blocks
-    assert(file_inode.size % Block::SIZE == 0);
-    while (file_inode.size - Block::SIZE >= length && file_inode.size > 0) {
-      deallocateLastBlock(file_inode);
-      file_inode.size -= Block::SIZE;
-    }
+  // Free every block past the new end in one pass
+  releaseBlocks(inode, keep);
+  inode.size = length;
+  if (inode.compress_mark > keep) {
+    inode.compress_mark = keep / Extent::CLUSTER * Extent::CLUSTER;
+  }
 
-    // Remove remainder of first block, if any
-    if (file_inode.size > length) {
-      file_inode.size = length;
-    }
-    // Write back changes to file_inode
-    this->inode_manager->set(file_inode_num, file_inode);
-    return 0;
+  // Write back changes to inode
+  this->inode_manager->set(id, inode);
+  if (stepped) {
+    this->block_manager->get(0, block);
+    superblock->truncating = 0;
+    this->block_manager->set(0, block);
   }
 }
 
@@ -689,118 +1641,306 @@ std::string Filesystem::basename(const char* path_cstring) {
 }
 
 
-void Filesystem::deallocateLastBlock(INode& file_inode) {
+/**
+ * Punches a hole in a regular file (fallocate's FALLOC_FL_PUNCH_HOLE):
+ * the whole blocks in the range are freed and read back as zeros, and
+ * the partial blocks at either end are zeroed.  The size stays the same.
+ * Inline and compressed files only have the range zeroed.
+ */
+void Filesystem::punch(INode::ID id, uint64_t offset, uint64_t length) {
+  if(read_only) {
+    throw ReadOnly();
+  }
 
-  size_t scale = Block::SIZE / sizeof(Block::ID);
-  size_t logical_blk_num = file_inode.blocks;
+  INode inode = getINode(id);
+  if (inode.type != FileType::REGULAR) {
+    throw NotAFile();
+  }
 
-  if (logical_blk_num <= INode::DIRECT_POINTERS) {
+  if (offset >= inode.size || length == 0) {
+    return;
+  }
 
-    // Direct block
+  uint64_t end   = (length < inode.size - offset) ? offset + length : inode.size;
+  uint64_t first = (offset + Block::SIZE - 1) / Block::SIZE;
+  uint64_t last  = std::min<uint64_t>(end / Block::SIZE, inode.blocks);
+  if ((inode.flags & (INode::INLINE_DATA | INode::COMPRESSED)) || first >= last) {
+    first = last = end / Block::SIZE;
+  }
 
-    // 1. Just deallocate in inode
-    this->block_manager->release(file_inode.block_pointers[file_inode.blocks - 1]);
+  // Zero the edges (or everything that can't be a hole).
+  uint64_t hole_start = (first == last) ? end : first * Block::SIZE;
+  uint64_t hole_end   = (first == last) ? end : last * Block::SIZE;
+
+  std::vector<char> zeros(std::min<uint64_t>(std::max(hole_start - offset, end - hole_end), 64 * Block::SIZE));
+  uint64_t ranges[2][2] = {{offset, hole_start}, {hole_end, end}};
+  for (int r = 0; r < 2; ++r) {
+    for (uint64_t at = ranges[r][0]; at < ranges[r][1];) {
+      uint64_t n = std::min<uint64_t>(zeros.size(), ranges[r][1] - at);
+      write(id, &zeros[0], n, at);
+      at += n;
+    }
+  }
 
-  } else if (logical_blk_num <= INode::DIRECT_POINTERS + scale) {
+  if (first == last) {
+    return;
+  }
+
+  // Writing may have moved things around (e.g. unpacked a tail).
+  inode = getINode(id);
+  std::vector<Block::ID> freed;
+  for (uint64_t n = first; n < last && n < INode::DIRECT_POINTERS; ++n) {
+    Block::ID old = inode.block_pointers[n];
+    inode.block_pointers[n] = 0;
+    if (old != 0 && references->release(old)) {
+      freed.push_back(old);
+    }
+  }
+
+  uint64_t scale = Block::SIZE / sizeof(Block::ID);
+  uint64_t base  = INode::DIRECT_POINTERS;
+  uint64_t span  = scale;
+  for (int level = 1; level <= 3 && base < last; ++level) {
+    if (base + span > first) {
+      Block::ID& top = inode.block_pointers[INode::DIRECT_POINTERS + level - 1];
+      top = punchTree(id, inode, top, level, base, first, last, freed);
+    }
+
+    base += span;
+    span *= scale;
+  }
+
+  for (Block::ID bid: freed) {
+    extents.erase(bid);
+  }
+
+  inode.flags |= INode::SPARSE;
+  inode.mtime = time(NULL);
+  inode.ctime = inode.mtime;
+  this->inode_manager->set(id, inode);
+  this->block_manager->release(freed);
+  reshape(id);
+  invalidate(id);
+}
 
-    // Single-indirect
+/**
+ * Frees every data block of a file past the first keep blocks, along with
+ * any indirect blocks that no longer map anything.  The pointer tree is
+ * walked once and everything goes back to the block manager in one batch.
+ * Blocks shared with a snapshot just lose a reference.
+ * Does not adjust the file size or save the INode.
+ */
+void Filesystem::releaseBlocks(INode& inode, uint64_t keep) {
+  if (keep >= inode.blocks) {
+    return;
+  }
 
-    // 1. Load in first level block
-    Block direct_ptrs_blk;
-    Block::ID *direct_ptrs = (Block::ID *) &direct_ptrs_blk;
-    this->block_manager->get(file_inode.block_pointers[INode::DIRECT_POINTERS], direct_ptrs_blk);
+  // The indirect blocks that survive get rewritten below.
+  if (keep > 0) {
+    mapBlock(0, inode, keep - 1, false);
+  }
 
-    // 2. Dellocate the direct block
-    this->block_manager->release(direct_ptrs[logical_blk_num - INode::DIRECT_POINTERS - 1]);
+  std::vector<Block::ID> freed;
+  uint64_t end = inode.blocks;
+  for (uint64_t i = keep; i < end && i < INode::DIRECT_POINTERS; ++i) {
+    Block::ID bid = inode.block_pointers[i];
+    if (bid != 0 && references->release(bid)) {
+      freed.push_back(bid);
+    }
+  }
 
-    // 3. If first block in first level, relesae the first level block as well
-    if (logical_blk_num == INode::DIRECT_POINTERS + 1) {
-      this->block_manager->release(file_inode.block_pointers[INode::DIRECT_POINTERS]);
+  uint64_t base  = INode::DIRECT_POINTERS;
+  uint64_t span  = Block::SIZE / sizeof(Block::ID);
+  for (int level = 1; level <= 3 && base < end; ++level) {
+    if (base + span > keep) {
+      releaseTree(inode.block_pointers[INode::DIRECT_POINTERS + level - 1], level, base, keep, end, freed);
     }
 
-  } else if (logical_blk_num <= INode::DIRECT_POINTERS + scale + (scale * scale)) {
+    base += span;
+    span *= Block::SIZE / sizeof(Block::ID);
+  }
 
-    // Double-indirect
+  for (Block::ID bid: freed) {
+    extents.erase(bid);
+  }
 
-    // 1. Load in first level block
-    Block single_indirect_ptrs_blk;
-    Block::ID *single_indirect_ptrs = (Block::ID *) &single_indirect_ptrs_blk;
-    this->block_manager->get(file_inode.block_pointers[INode::DIRECT_POINTERS + 1], single_indirect_ptrs_blk);
+  this->block_manager->release(freed);
+  inode.blocks = keep;
+}
 
-    Block::ID block_idx_in_level = logical_blk_num - INode::DIRECT_POINTERS - scale - 1;
+/**
+ * Collects the blocks to free from the indirect block bid, which sits
+ * level levels above the data blocks and maps the file's blocks starting
+ * at base.  Blocks before keep survive; blocks from end on don't exist.
+ */
+void Filesystem::releaseTree(Block::ID bid, int level, uint64_t base, uint64_t keep, uint64_t end, std::vector<Block::ID>& freed) {
+  // A whole shared subtree stays with the snapshot.
+  if (bid == 0 || (base >= keep && !references->release(bid))) {
+    return;
+  }
 
-    // 2. Load in second level block
-    Block direct_ptrs_blk;
-    Block::ID *direct_ptrs = (Block::ID *) &direct_ptrs_blk;
-    this->block_manager->get(single_indirect_ptrs[block_idx_in_level / scale], direct_ptrs_blk);
+  uint64_t scale = Block::SIZE / sizeof(Block::ID);
+  uint64_t span  = 1;
+  for (int i = 1; i < level; ++i) {
+    span *= scale;
+  }
 
-    // 3. Deallocate the direct block
-    this->block_manager->release(direct_ptrs[block_idx_in_level % scale]);
+  Block block;
+  this->block_manager->get(bid, block);
+  Block::ID* refs = (Block::ID*) &block;
 
-    // 4. Check if first block in second level
-    if (block_idx_in_level % scale == 0) {
-      this->block_manager->release(single_indirect_ptrs[block_idx_in_level / scale]);
+  for (uint64_t i = 0; i < scale && base + i * span < end; ++i) {
+    uint64_t first = base + i * span;
+    if (first + span <= keep) {
+      continue;
     }
 
-    // 5. Check if first block in first level
-    if (logical_blk_num == INode::DIRECT_POINTERS + scale + 1) {
-      this->block_manager->release(file_inode.block_pointers[INode::DIRECT_POINTERS + 1]);
+    if (level == 1) {
+      if (refs[i] != 0 && references->release(refs[i])) {
+        freed.push_back(refs[i]);
+      }
+    }
+    else {
+      releaseTree(refs[i], level - 1, first, keep, end, freed);
     }
+  }
 
-  } else if (logical_blk_num <= INode::DIRECT_POINTERS + scale + (scale * scale) + (scale * scale * scale)) {
-    // Triple-indirect
+  if (base >= keep) {
+    freed.push_back(bid);
+  }
+}
 
-    // 1. Load in first level block
-    Block double_indirect_ptrs_blk;
-    Block::ID *double_indirect_ptrs = (Block::ID *) &double_indirect_ptrs_blk;
-    this->block_manager->get(file_inode.block_pointers[INode::DIRECT_POINTERS + 2], double_indirect_ptrs_blk);
+/**
+ * Clears the pointers to blocks first up to last in the indirect block
+ * bid, which sits level levels above the data blocks and maps the file's
+ * blocks starting at base, one pointer block at a time.  Returns what
+ * should point at it now: subtrees inside the hole, and indirect blocks
+ * left with nothing in them, are dropped (0), and one that's shared
+ * gets a private copy first.  Blocks to free go in freed.
+ */
+Block::ID Filesystem::punchTree(INode::ID id, INode& inode, Block::ID bid, int level, uint64_t base, uint64_t first, uint64_t last, std::vector<Block::ID>& freed) {
+  if (bid == 0) {
+    return 0;
+  }
 
-    Block::ID block_idx_in_level = logical_blk_num - INode::DIRECT_POINTERS - scale - scale * scale - 1;
+  uint64_t scale = Block::SIZE / sizeof(Block::ID);
+  uint64_t span  = 1;
+  for (int i = 1; i < level; ++i) {
+    span *= scale;
+  }
 
-    // 2. Load in second level block
-    Block single_indirect_ptrs_blk;
-    Block::ID *single_indirect_ptrs = (Block::ID *) &single_indirect_ptrs_blk;
-    this->block_manager->get(double_indirect_ptrs[block_idx_in_level / (scale * scale)], single_indirect_ptrs_blk);
+  // Everything under it goes, the same way truncating would let it go.
+  uint64_t end = std::min<uint64_t>(base + scale * span, inode.blocks);
+  if (first <= base && end <= last) {
+    releaseTree(bid, level, base, base, end, freed);
+    return 0;
+  }
 
-    Block::ID block_idx_in_level_two = block_idx_in_level % (scale * scale);
+  bid = own(id, inode, bid, level, base);
 
-    // 3. Load in third level block
-    Block direct_ptrs_blk;
-    Block::ID *direct_ptrs = (Block::ID *) &direct_ptrs_blk;
-    this->block_manager->get(single_indirect_ptrs[block_idx_in_level_two / scale], direct_ptrs_blk);
+  Block block;
+  this->block_manager->get(bid, block);
+  Block::ID* refs = (Block::ID*) &block;
 
-    // 4. Deallocate direct block
-    this->block_manager->release(direct_ptrs[block_idx_in_level_two % scale]);
+  bool empty = true;
+  for (uint64_t i = 0; i < scale && base + i * span < inode.blocks; ++i) {
+    uint64_t start = base + i * span;
+    if (start < last && start + span > first) {
+      if (level > 1) {
+        refs[i] = punchTree(id, inode, refs[i], level - 1, start, first, last, freed);
+      }
+      else if (refs[i] != 0) {
+        if (references->release(refs[i])) {
+          freed.push_back(refs[i]);
+        }
 
-    // 5. Check if first block in third level
-    if (block_idx_in_level_two % scale == 0) {
-      this->block_manager->release(single_indirect_ptrs[block_idx_in_level_two / scale]);
+        refs[i] = 0;
+      }
     }
 
-    // 6. Check if first block in second level
-    if (block_idx_in_level % (scale * scale) == 0) {
-      this->block_manager->release(double_indirect_ptrs[block_idx_in_level / (scale * scale)]);
+    empty = empty && (refs[i] == 0);
+  }
+
+  if (empty) {
+    if (references->release(bid)) {
+      freed.push_back(bid);
     }
 
-    // 7. Check if first block in first level
-    if (logical_blk_num == INode::DIRECT_POINTERS + scale + (scale * scale) + 1) {
-      this->block_manager->release(file_inode.block_pointers[INode::DIRECT_POINTERS + 2]);
+    return 0;
+  }
+
+  this->block_manager->set(bid, block);
+  return bid;
+}
+
+/**
+ * Lowers keep until cutting a file there needs no new blocks (see
+ * reclaim): a compressed cluster that would be cut short has to be
+ * expanded, and an indirect block that survives has to be private (and
+ * exist) before its children can be freed.  Indirect blocks past the
+ * cut are dropped whole, so a shared one just loses a reference.
+ */
+uint64_t Filesystem::cutPoint(const INode& inode, uint64_t keep) {
+  uint64_t scale = Block::SIZE / sizeof(Block::ID);
+  bool     moved = true;
+  while (keep > 0 && moved) {
+    moved = false;
+    if (keep % Extent::CLUSTER != 0 && compressed(inode, (keep - 1) / Extent::CLUSTER)) {
+      keep  = keep / Extent::CLUSTER * Extent::CLUSTER;
+      moved = true;
+      continue;
     }
 
-  } else {
-    // Can't deallocate such a large block! Must be some kind of error in setting inode's blocks
-    throw std::out_of_range("file_inode.blocks is too high; can't deallocate!");
+    uint64_t n = keep - 1;
+    if (n < INode::DIRECT_POINTERS) {
+      break;
+    }
+
+    uint64_t base  = INode::DIRECT_POINTERS;
+    uint64_t span  = scale;
+    int      level = 1;
+    while (n >= base + span) {
+      base  += span;
+      span  *= scale;
+      level += 1;
+    }
+
+    Block::ID bid = inode.block_pointers[INode::DIRECT_POINTERS + level - 1];
+    while (level > 0) {
+      if (bid == 0 || references->shared(bid)) {
+        keep  = base;
+        moved = true;
+        break;
+      }
+
+      if (--level == 0) {
+        break;
+      }
+
+      Block block;
+      this->block_manager->get(bid, block);
+      span /= scale;
+      uint64_t i = (n - base) / span;
+      base += i * span;
+      bid   = ((Block::ID*) &block)[i];
+    }
   }
 
-  // Update the number of allocated data blocks in this inode
-  file_inode.blocks--;
+  return keep;
 }
 
 void Filesystem::unlink(INode::ID id) {
+  if(read_only) {
+    throw ReadOnly();
+  }
+
   INode inode = getINode(id);
   if(inode.links < 2) {
-    truncate(id, 0);
-    inode_manager->release(id);
+    // Big files are freed by the reclaimer so that unlink returns quickly.
+    if(inode.blocks <= RECLAIM_BATCH || !orphan(id, inode)) {
+      truncate(id, 0);
+      inode_manager->release(id);
+    }
   }
   else {
     inode.ctime = time(NULL);
@@ -808,3 +1948,560 @@ void Filesystem::unlink(INode::ID id) {
     save(id, inode);
   }
 }
+
+/**
+ * Records an unlinked file in the superblock's orphan list and hands it
+ * to the reclaimer.  Returns false if the orphan list is full.
+ */
+bool Filesystem::orphan(INode::ID id, INode& inode) {
+  Block block;
+  Superblock* superblock = (Superblock*) block.data;
+  block_manager->get(0, block);
+  if(superblock->orphan_count >= Superblock::MAX_ORPHANS) {
+    return false;
+  }
+
+  superblock->orphans[superblock->orphan_count++] = id;
+  block_manager->set(0, block);
+
+  inode.ctime = time(NULL);
+  inode.links = 0;
+  save(id, inode);
+
+  orphans.push_back(id);
+  orphaned.notify_one();
+  return true;
+}
+
+/**
+ * Finishes what a crash cut off: a file being cut down in steps is cut
+ * the rest of the way, and half made or half deleted snapshots are
+ * deleted.  Then queues the orphans left over from before the last
+ * unmount (or crash) so that the reclaimer finishes freeing them.
+ */
+void Filesystem::recover() {
+  std::lock_guard<OperationMutex> lock(mutex);
+  Block block;
+  Superblock* superblock = (Superblock*) block.data;
+  block_manager->get(0, block);
+
+  if(INode::ID id = superblock->truncating) {
+    INode inode = getINode(id);
+    shrink(id, inode, inode.size);
+    block_manager->get(0, block);
+  }
+
+  for(uint64_t slot = 0; slot < Superblock::MAX_SNAPSHOTS; ++slot) {
+    const Superblock::Snapshot& entry = superblock->snapshots[slot];
+    if(entry.name[0] == '\0' || entry.state == 0) continue;
+
+    std::cerr << "Deleting unfinished snapshot " << std::string(entry.name, strnlen(entry.name, sizeof(entry.name))) << ".\n";
+    dropSnapshot(slot);
+    block_manager->get(0, block);
+  }
+
+  uint64_t count = superblock->orphan_count;
+  if(count > Superblock::MAX_ORPHANS) {
+    throw IOError("Corrupt orphan list.");
+  }
+
+  orphans.assign(superblock->orphans, superblock->orphans + count);
+  orphaned.notify_one();
+}
+
+/**
+ * Background thread that frees orphaned files RECLAIM_BATCH blocks at a
+ * time, dropping the filesystem lock between batches so that other
+ * operations can get in.
+ */
+void Filesystem::reclaim() {
+  std::unique_lock<OperationMutex> lock(mutex);
+  while(!stopping) {
+    if(orphans.empty()) {
+      if(!discarding) {
+        orphaned.wait(lock);
+      }
+      else if(orphaned.wait_for(lock, std::chrono::milliseconds(DISCARD_DELAY)) == std::cv_status::timeout && block_manager->discardable() > 0) {
+        // Trimming takes the lock itself, only for as long as it needs.
+        lock.unlock();
+        try {
+          trim(false);
+        }
+        catch(std::exception& ex) {
+          std::cerr << "Failed to discard freed blocks: " << ex.what() << '\n';
+        }
+
+        lock.lock();
+      }
+
+      continue;
+    }
+
+    INode::ID id = orphans.front();
+    try {
+      // Cutting the file anywhere else could need new blocks, which a
+      // full filesystem may not have.
+      INode inode = getINode(id);
+      uint64_t keep = (inode.blocks > RECLAIM_BATCH) ? cutPoint(inode, inode.blocks - RECLAIM_BATCH) : 0;
+      if(keep > 0) {
+        truncate(id, keep * Block::SIZE);
+      }
+      else {
+        truncate(id, 0);
+        inode_manager->release(id);
+
+        Block block;
+        Superblock* superblock = (Superblock*) block.data;
+        block_manager->get(0, block);
+        uint64_t* end = superblock->orphans + superblock->orphan_count;
+        uint64_t* itr = std::find(superblock->orphans, end, id);
+        if(itr != end) {
+          std::copy(itr + 1, end, itr);
+          superblock->orphan_count -= 1;
+          block_manager->set(0, block);
+        }
+
+        orphans.pop_front();
+      }
+    }
+    catch(std::exception& ex) {
+      std::cerr << "Failed to free orphan " << id << ": " << ex.what() << '\n';
+      orphans.pop_front();
+    }
+
+    lock.unlock();
+    std::this_thread::yield();
+    lock.lock();
+  }
+}
+
+/**
+ * Takes a copy-on-write snapshot of the whole filesystem.  The INode
+ * table is copied (skipping unused parts of it), and the blocks its INodes point to directly (plus
+ * the fragment blocks holding packed tails) get an extra reference, so
+ * the next write to any of them makes a private copy first.  The journal
+ * may commit between table blocks (see Storage::settle); until the end
+ * the slot says CREATING, so a crash leaves something recover() can
+ * delete.
+ */
+void Filesystem::snapshot(const std::string& name) {
+  if(read_only) {
+    throw ReadOnly();
+  }
+
+  if(name.empty() || name.size() >= sizeof(Superblock::Snapshot::name)) {
+    throw NameTooLong(name);
+  }
+
+  Block block;
+  Superblock* superblock = (Superblock*) block.data;
+  block_manager->get(0, block);
+  if(SnapshotINodeManager::find(*superblock, name) >= 0) {
+    throw AlreadyExists(name);
+  }
+
+  uint64_t slot = 0;
+  while(slot < Superblock::MAX_SNAPSHOTS && superblock->snapshots[slot].name[0] != '\0') {
+    slot += 1;
+  }
+
+  if(slot == Superblock::MAX_SNAPSHOTS) {
+    throw TooManySnapshots();
+  }
+
+  Block::ID start = superblock->inode_block_start;
+  uint64_t  count = superblock->inode_block_count;
+  uint64_t  ready = superblock->inode_block_ready;
+  uint64_t  scale = Block::SIZE / sizeof(Block::ID);
+  if(ready == 0) {
+    ready = count;
+  }
+
+  // The index goes out empty first, so that the copies can be added to
+  // it one at a time.
+  std::vector<Block::ID> index_ids;
+  uint64_t nindex = (count + SnapshotIndex::COUNT - 1) / SnapshotIndex::COUNT;
+  try {
+    while(index_ids.size() < nindex) {
+      index_ids.push_back(block_manager->reserve());
+    }
+  }
+  catch(...) {
+    block_manager->release(index_ids);
+    throw;
+  }
+
+  for(uint64_t k = 0; k < nindex; ++k) {
+    Block index_block;
+    SnapshotIndex* index = (SnapshotIndex*) index_block.data;
+    memset(index_block.data, 0, Block::SIZE);
+    index->next = (k + 1 < nindex) ? index_ids[k + 1] : 0;
+    block_manager->set(index_ids[k], index_block);
+  }
+
+  // Allocating blocks changed the superblock.
+  block_manager->get(0, block);
+  Superblock::Snapshot& entry = superblock->snapshots[slot];
+  memset(&entry, 0, sizeof(entry));
+  memcpy(entry.name, name.data(), name.size());
+  entry.created = time(NULL);
+  entry.index   = index_ids[0];
+  entry.state   = Superblock::Snapshot::CREATING;
+  block_manager->set(0, block);
+
+  // Table blocks past ready haven't been written since mkfs.
+  try {
+    for(uint64_t b = 0; b < ready; ++b) {
+      Block table;
+      block_manager->get(start + b, table);
+
+      bool used = false;
+      INode* inodes = (INode*) table.data;
+      for(uint64_t i = 0; i < Block::SIZE / INode::SIZE && !used; ++i) {
+        used = (inodes[i].type != FileType::FREE && inodes[i].type != FileType::RESERVED);
+      }
+
+      // Table blocks with nothing in them aren't copied.
+      if(!used) continue;
+
+      Block::ID copy = block_manager->reserve();
+      for(uint64_t i = 0; i < Block::SIZE / INode::SIZE; ++i) {
+        INode& inode = inodes[i];
+        if(inode.type == FileType::FREE || inode.type == FileType::RESERVED) continue;
+        if(inode.flags & INode::INLINE_DATA) continue;
+
+        for(uint64_t j = 0; j < INode::DIRECT_POINTERS && j < inode.blocks; ++j) {
+          if(inode.block_pointers[j] != 0) references->share(inode.block_pointers[j]);
+        }
+
+        uint64_t base = INode::DIRECT_POINTERS;
+        uint64_t span = scale;
+        for(int level = 1; level <= 3 && base < inode.blocks; ++level) {
+          Block::ID top = inode.block_pointers[INode::DIRECT_POINTERS + level - 1];
+          if (top != 0) references->share(top);
+          base += span;
+          span *= scale;
+        }
+
+        // One reference per tail, so that deleting the snapshot can let
+        // go of them one table block at a time too.
+        if(inode.flags & INode::TAIL_PACKED) {
+          references->share(inode.tail_block);
+        }
+      }
+
+      block_manager->set(copy, table);
+
+      Block index_block;
+      SnapshotIndex* index = (SnapshotIndex*) index_block.data;
+      block_manager->get(index_ids[b / SnapshotIndex::COUNT], index_block);
+      index->tables[b % SnapshotIndex::COUNT] = copy;
+      block_manager->set(index_ids[b / SnapshotIndex::COUNT], index_block);
+      block_manager->settle();
+    }
+  }
+  catch(...) {
+    // Let go of what the index holds so far.
+    dropSnapshot(slot);
+    throw;
+  }
+
+  block_manager->get(0, block);
+  superblock->snapshots[slot].state = 0;
+  block_manager->set(0, block);
+}
+
+/**
+ * Deletes a snapshot, dropping its references to shared blocks and
+ * freeing the ones that nothing else uses.
+ */
+void Filesystem::deleteSnapshot(const std::string& name) {
+  if(read_only) {
+    throw ReadOnly();
+  }
+
+  Block block;
+  Superblock* superblock = (Superblock*) block.data;
+  block_manager->get(0, block);
+
+  int slot = SnapshotINodeManager::find(*superblock, name);
+  if(slot < 0) {
+    throw NoSuchEntry(name);
+  }
+
+  dropSnapshot(slot);
+}
+
+/**
+ * Releases everything the snapshot in a slot holds, then frees the slot.
+ * The journal may commit after each INode (or RECLAIM_BATCH blocks of a
+ * big one): what an INode held is released as it's marked free in the
+ * copy, and each copy is freed as it leaves the index.  The slot says
+ * DELETING until the end, so recover() picks up where a crash left off.
+ */
+void Filesystem::dropSnapshot(uint64_t slot) {
+  Block block;
+  Superblock* superblock = (Superblock*) block.data;
+  block_manager->get(0, block);
+
+  Superblock::Snapshot& entry = superblock->snapshots[slot];
+  Block::ID id    = entry.index;
+  uint64_t  count = superblock->inode_block_count;
+  entry.state = Superblock::Snapshot::DELETING;
+  block_manager->set(0, block);
+
+  std::vector<Block::ID> freed;
+  uint64_t seen = 0;
+  while(id != 0) {
+    Block index_block;
+    SnapshotIndex* index = (SnapshotIndex*) index_block.data;
+    block_manager->get(id, index_block);
+
+    for(uint64_t i = 0; i < SnapshotIndex::COUNT && seen < count; ++i, ++seen) {
+      Block::ID copy = index->tables[i];
+      if(copy == 0) continue;
+
+      Block table;
+      block_manager->get(copy, table);
+
+      INode* inodes = (INode*) table.data;
+      for(uint64_t j = 0; j < Block::SIZE / INode::SIZE; ++j) {
+        INode& inode = inodes[j];
+        if(inode.type == FileType::FREE || inode.type == FileType::RESERVED) continue;
+
+        if(!(inode.flags & INode::INLINE_DATA)) {
+          // Cut the same way as orphans (see reclaim), so that this
+          // never needs new blocks.
+          while(inode.blocks > 0) {
+            uint64_t keep = (inode.blocks > RECLAIM_BATCH) ? cutPoint(inode, inode.blocks - RECLAIM_BATCH) : 0;
+            releaseBlocks(inode, keep);
+            if(keep == 0) break;
+
+            block_manager->set(copy, table);
+            block_manager->settle();
+          }
+
+          if((inode.flags & INode::TAIL_PACKED) && references->release(inode.tail_block)) {
+            block_manager->release(inode.tail_block);
+          }
+        }
+
+        inode.type = FileType::FREE;
+        block_manager->set(copy, table);
+        block_manager->settle();
+      }
+
+      index->tables[i] = 0;
+      block_manager->set(id, index_block);
+      block_manager->release(copy);
+      block_manager->settle();
+    }
+
+    freed.push_back(id);
+    id = index->next;
+  }
+
+  block_manager->get(0, block);
+  memset(&superblock->snapshots[slot], 0, sizeof(Superblock::Snapshot));
+  block_manager->set(0, block);
+  block_manager->release(freed);
+
+  // Tails the live filesystem let go of while the snapshot had them.
+  fragments->reclaim(*inode_manager);
+}
+
+/**
+ * Grows the filesystem to nblocks blocks (or to whatever the device
+ * holds, if that's zero), growing the device too if it's a file.  The
+ * free list, checksum table and reference count table are rebuilt at
+ * the new end of the disk, and everything in between joins the data
+ * region.  The INode table and dedup index keep their size.  Returns
+ * the new block count.
+ */
+uint64_t Filesystem::grow(uint64_t nblocks) {
+  if(read_only) {
+    throw ReadOnly();
+  }
+
+  if(disk == NULL) {
+    throw InvalidArgument("Only filesystems that own their storage can grow.");
+  }
+
+  Block block;
+  Superblock* superblock = (Superblock*) block.data;
+  block_manager->get(0, block);
+  if(superblock->log_segment_count != 0) {
+    throw InvalidArgument("Log-structured filesystems can't grow.");
+  }
+
+  Storage* device = disk;
+  if(simulator != NULL) device = simulator;
+  if(recorder  != NULL) device = recorder;
+  if(nblocks == 0) {
+    nblocks = device->capacity();
+  }
+
+  if(nblocks < superblock->block_count) {
+    throw InvalidArgument("Filesystems can't shrink.");
+  }
+
+  // New tables go at the end, free list last, sized as if the data
+  // region took the whole disk; the data region runs up to them.
+  Block::ID data_start = superblock->data_block_start;
+  Block::ID data_end   = data_start + superblock->data_block_count;
+  uint64_t  count      = nblocks - data_start;
+  uint64_t  nlblocks   = block_manager->listBlocks(count);
+  uint64_t  nkblocks   = (superblock->checksum_block_count > 0) ? ChecksumStorage::layout(nblocks) : 0;
+  uint64_t  nrblocks   = (superblock->refcount_block_count > 0) ? RefCountTable::layout(count) : 0;
+  Block::ID new_end    = nblocks - nlblocks - nkblocks - nrblocks;
+
+  // A grow that was cut off after moving the tables has already set the
+  // block count, and carries on from there.  Otherwise the old free list
+  // (or table) ends the disk, and the data region has to reach past it.
+  bool resumed = (data_end < new_end && superblock->refcount_block_start == new_end);
+  if(nblocks == superblock->block_count && !resumed) {
+    return nblocks;
+  }
+
+  if(!resumed && new_end < superblock->block_count) {
+    throw InvalidArgument("Growing needs at least " + std::to_string(nblocks + superblock->block_count - new_end) + " blocks.");
+  }
+
+  // Nothing may be left in the cache (or in the checksum table) that
+  // would be written to the old places.
+  sync();
+  if(cache == NULL) log_storage->sync();
+  if(!device->resize(nblocks)) {
+    throw IOError("The device can't hold " + std::to_string(nblocks) + " blocks.");
+  }
+
+  Block::ID refcount_start = new_end;
+  Block::ID checksum_start = new_end + nrblocks;
+  checksums->grow(checksum_start, nkblocks, nblocks);
+  uint64_t ready = references->relocate(refcount_start, nrblocks);
+
+  block_manager->get(0, block);
+  superblock->block_count          = nblocks;
+  superblock->refcount_block_start = refcount_start;
+  superblock->refcount_block_count = nrblocks;
+  superblock->refcount_block_ready = (ready < nrblocks) ? ready : 0;
+  superblock->checksum_block_start = checksum_start;
+  superblock->checksum_block_count = nkblocks;
+  block_manager->set(0, block);
+  sync();
+
+  block_manager->grow(new_end, nblocks - nlblocks);
+  sync();
+  return nblocks;
+}
+
+/**
+ * Marks a file whose contents changed without going through the kernel
+ * (so the kernel's page cache for it may be stale).  The next open of
+ * the file will not keep the cache.
+ */
+void Filesystem::invalidate(INode::ID id) {
+  invalidated.insert(id);
+}
+
+/**
+ * Decides whether an open of this file may keep the kernel's page cache
+ * from the previous open.  Clears any pending invalidation.
+ */
+bool Filesystem::keepCache(INode::ID id) {
+  bool stale = (invalidated.erase(id) != 0);
+  return profile.keep_cache && !stale;
+}
+
+/**
+ * Writes out all dirty data, then all dirty metadata as one journal
+ * transaction.  If durable is set, also waits for the disk to make it
+ * stable.  Must be called between operations (or before the current one
+ * has changed anything).
+ */
+void Filesystem::sync(bool durable) {
+  if(cache != NULL) {
+    cache->flush(durable);
+  }
+}
+
+/**
+ * Makes one file durable (fsync).  Its data goes out on its own, but
+ * metadata can only be committed as a whole, after all dirty data; with
+ * datasync that is skipped unless something needed to find the file's
+ * data has changed since the last commit.
+ */
+void Filesystem::sync(INode::ID id, bool datasync) {
+  if(cache == NULL) {
+    return;
+  }
+
+  auto itr = reshaped.find(id);
+  if(datasync && (itr == reshaped.end() || cache->committed(itr->second))) {
+    cache->flush(id, true);
+  }
+  else {
+    cache->flush(true);
+  }
+
+  if(itr != reshaped.end()) {
+    reshaped.erase(itr);
+  }
+}
+
+/**
+ * Notes that a file's size or block layout changed, so that fdatasync
+ * has to commit metadata until the change has been.
+ */
+void Filesystem::reshape(INode::ID id) {
+  if(cache == NULL) {
+    return;
+  }
+
+  // Files whose changes have been committed since are dropped now and
+  // then; each time the map doubles keeps this cheap.
+  uint64_t n = reshaped.size();
+  if(n >= 1024 && (n & (n - 1)) == 0) {
+    for(auto itr = reshaped.begin(); itr != reshaped.end();) {
+      if(cache->committed(itr->second)) itr = reshaped.erase(itr);
+      else ++itr;
+    }
+  }
+
+  reshaped[id] = cache->epoch();
+}
+
+/**
+ * Discards free data blocks, so the device (or the file holding the
+ * image) can reclaim them: the ones freed since the last trim, or every
+ * free block if all is set.  The frees are made durable first, so a
+ * crash can never bring back a block whose contents are gone.  Only
+ * listing the blocks takes the lock, so this must be called without it;
+ * blocks handed out again in the meantime are skipped.  Returns the
+ * number of blocks discarded.
+ */
+uint64_t Filesystem::trim(bool all) {
+  std::vector<Block::ID> ids;
+  {
+    std::lock_guard<OperationMutex> lock(mutex);
+    if(read_only) {
+      throw ReadOnly();
+    }
+
+    ids = block_manager->collect(all);
+  }
+
+  if(ids.empty()) {
+    return 0;
+  }
+
+  if(cache != NULL) cache->commit();
+  else if(log_storage != NULL) log_storage->sync();
+
+  uint64_t count = block_manager->discard(ids);
+
+  // The checksum table and block map changed under the discarded blocks.
+  if(cache != NULL) cache->commit();
+  else if(log_storage != NULL) log_storage->sync();
+  return count;
+}
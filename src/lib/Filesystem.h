@@ -1,37 +1,131 @@
 #pragma once
 
 #include "Block.h"
+#include "Codec.h"
+#include "ExtentCache.h"
 #include "INode.h"
 #include "BlockManager.h"
 #include "INodeManager.h"
 #include "Directory.h"
+#include "MountProfile.h"
+#include "Readahead.h"
+#include "blocks/DedupIndex.h"
+#include "blocks/FragmentManager.h"
+#include "blocks/RefCountTable.h"
+#include "storage/ChecksumStorage.h"
+#include "storage/LogStorage.h"
+#include "storage/PageCache.h"
+#include "storage/RecordingStorage.h"
+#include "storage/SimulatedStorage.h"
 #include <fuse.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 struct fuse_operations;
 struct statvfs;
 
+// What a FUSE file handle (fuse_file_info::fh) points to.
+struct OpenFile {
+  INode::ID   id;        // Zero for the virtual stats file.
+  bool        written;   // Changed through this handle; see Filesystem::changed.
+  Readahead   readahead;
+  std::string contents;  // What the stats file said when it was opened.
+};
+
+// The filesystem lock.  Each outermost hold of it is one operation; the
+// page cache only logs metadata between operations, so a crash never
+// leaves half of one on disk.  (Operations too big for one journal
+// transaction go in steps that the next mount finishes or undoes; see
+// Filesystem::recover.)
+class OperationMutex {
+public:
+  OperationMutex();
+
+  void lock();
+  bool try_lock();
+  void unlock();
+
+  PageCache* cache; // Told when operations begin and end (if set).
+private:
+  std::recursive_mutex mutex;
+  uint64_t             depth;
+};
+
 class Filesystem {
+  Storage*      disk;  // Only set if we own the storage stack.
+  SimulatedStorage* simulator; // Emulated device (-E).
+  RecordingStorage* recorder; // Traces disk I/O (-R).
+  ChecksumStorage* checksums;
+  PageCache*    cache;
+  Journal*      journal;
+  LogStorage*   log_storage;
   BlockManager* block_manager;
   INodeManager* inode_manager;
+  FragmentManager* fragments;
+  RefCountTable* references;
+  DedupIndex*   fingerprints;
+  ExtentCache   extents;
+  CompressionType compression; // For files closed on this mount.
   uint64_t      max_file_size;
   char*         mount_point;
   bool          parallel;
   bool          debug;
+  bool          read_only; // Mounted from a snapshot.
+  bool          discarding; // Discard freed blocks in the background (-o discard).
+  MountProfile  profile;
+  std::vector<std::string>      fuse_options;
+  std::unordered_set<INode::ID> invalidated;
+  std::unordered_map<INode::ID, uint64_t> handles; // Open handles per INode.
+  std::unordered_set<INode::ID> dirtied; // Changed by a handle that's been released.
+  std::unordered_map<INode::ID, uint64_t> reshaped; // Cache epoch of each file's last layout change.
+  std::deque<INode::ID>         orphans; // Unlinked files still to be freed.
+  std::condition_variable_any   orphaned;
+  std::thread                   reclaimer;
+  bool                          stopping;
 public:
   int           verbosity;
+
+  // Serializes all operations; FUSE handlers and the reclaimer hold it.
+  OperationMutex mutex;
+
+  // Files with more blocks than this are freed in the background, this
+  // many blocks at a time.
+  static const uint64_t RECLAIM_BATCH = 16384;
+
+  // With -o discard, freed blocks are discarded together once this many
+  // milliseconds go by without any orphans to free.
+  static const uint64_t DISCARD_DELAY = 5000;
 public:
   Filesystem(int argc, char** argv, bool mkfs);
   Filesystem(BlockManager &block_manager, INodeManager& inode_manager);
   ~Filesystem();
 
-  void mkfs(uint64_t nblocks, uint64_t niblocks);
+  void mkfs(uint64_t nblocks, uint64_t niblocks, bool log_structured = false, bool dedup = false);
   int  mount(char* program, fuse_operations* ops);
   void statfs(struct statvfs* info);
 
-  int  read(INode::ID file_inode_num, char *buffer, size_t size, size_t offset);
+  int  read(INode::ID file_inode_num, char *buffer, size_t size, size_t offset, Readahead* readahead = NULL);
   int  write(INode::ID file_inode_num, const char *buf, size_t size, size_t offset);
   int  truncate(INode::ID file_inode_num, size_t length);
   void unlink(INode::ID id);
+  uint64_t clone(INode::ID src_id, uint64_t src_off, INode::ID dst_id, uint64_t dst_off, uint64_t length);
+  void sync(bool durable = true);
+  void sync(INode::ID id, bool datasync);
+
+  void snapshot(const std::string& name);
+  void deleteSnapshot(const std::string& name);
+  uint64_t grow(uint64_t nblocks);
+  uint64_t trim(bool all);
+  void punch(INode::ID id, uint64_t offset, uint64_t length);
+
+  void invalidate(INode::ID id);
+  bool keepCache(INode::ID id);
 
   std::string dirname(const char* path_cstring);
   std::string basename(const char* path_cstring);
@@ -44,6 +138,11 @@ public:
   INode::ID getINodeID(const std::string& path);
   INode::ID newINodeID();
 
+  uint64_t   open(INode::ID id);
+  void       changed(INode::ID id, fuse_file_info* info);
+  void       release(fuse_file_info* info);
+  Readahead* readahead(fuse_file_info* info);
+
   void save(const Directory& directory);
   void save(INode::ID id, const INode& inode);
 
@@ -52,7 +151,35 @@ private:
   INode::ID componentLookup(INode::ID cur_inode_num, std::string filename);
   INode::ID directLookup(Block *directory, std::string filename);
   Block::ID indirectBlockAt(Block::ID bid, uint64_t offset, uint64_t size);
+  Block::ID pointerBlockAt(const INode& inode, uint64_t offset);
+  void prefetch(const INode& inode, uint64_t offset, uint64_t size, Readahead* readahead);
   Block::ID allocateNextBlock(INode& file_inode);
-  size_t appendData(INode& file_inode, const char *buf, size_t size, size_t offset, bool null_filler);
-  void deallocateLastBlock(INode& file_inode);
+  Block::ID mapBlock(INode::ID id, INode& inode, uint64_t n, bool leaf);
+  Block::ID own(INode::ID id, const INode& inode, Block::ID bid, int level, uint64_t base);
+  Block::ID setPointer(INode& inode, uint64_t n, Block::ID bid);
+  void shareBlock(INode& inode, uint64_t n, Block::ID bid);
+  bool dedup(INode& inode, uint64_t n, const char* data, uint64_t& hash);
+  void remember(Block::ID bid, uint64_t hash);
+  void finishWrite(INode::ID id, const INode& inode, const INode& before, uint64_t changes);
+  int  writeInline(INode::ID id, INode& inode, const char* buf, size_t size, size_t offset);
+  void uninline(INode::ID id, INode& inode);
+  void pack(INode::ID id);
+  void unpack(INode::ID id, INode& inode);
+  void dropTail(INode& inode);
+  void compress(INode::ID id);
+  void expand(INode::ID id, INode& inode, uint64_t n);
+  bool compressed(const INode& inode, uint64_t cluster);
+  const char* extent(const INode& inode, uint64_t cluster);
+  void setData(INode::ID id, const INode& inode, Block::ID block_num, const Block& block);
+  void reshape(INode::ID id);
+  size_t appendData(INode::ID file_inode_num, INode& file_inode, const char *buf, size_t size, size_t offset, bool null_filler);
+  bool orphan(INode::ID id, INode& inode);
+  void recover();
+  void reclaim();
+  void dropSnapshot(uint64_t slot);
+  void shrink(INode::ID id, INode& inode, uint64_t length);
+  void releaseBlocks(INode& inode, uint64_t keep);
+  uint64_t cutPoint(const INode& inode, uint64_t keep);
+  void releaseTree(Block::ID bid, int level, uint64_t base, uint64_t keep, uint64_t end, std::vector<Block::ID>& freed);
+  Block::ID punchTree(INode::ID id, INode& inode, Block::ID bid, int level, uint64_t base, uint64_t first, uint64_t last, std::vector<Block::ID>& freed);
 };
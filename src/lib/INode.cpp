@@ -3,18 +3,20 @@
 #include <cstring>
 #include <ctime>
 #include <fuse.h>
+#include <unistd.h>
 
 INode::INode() {
-  std::memset(this, 0, sizeof(INode));
+  std::memset(static_cast<void*>(this), 0, sizeof(INode));
 }
 
 INode::INode(FileType type, uint16_t mode, uint64_t dev): INode() {
   fuse_context* context = fuse_get_context();
 
+  // Outside a FUSE request (mkfs, benchmarks) the process is the caller.
   this->type   = type;
-  this->mode   = mode & ~context->umask;
-  this->uid    = context->uid;
-  this->gid    = context->gid;
+  this->mode   = mode & ~(context ? context->umask : 022);
+  this->uid    = context ? context->uid : getuid();
+  this->gid    = context ? context->gid : getgid();
   this->atime  = time(NULL);
   this->ctime  = this->atime;
   this->mtime  = this->atime;
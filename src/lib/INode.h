@@ -20,6 +20,13 @@ struct INode {
   static const uint64_t SINGLE_INDIRECT_POINTERS = 1;
   static const uint64_t DOUBLE_INDIRECT_POINTERS = 1;
   static const uint64_t TRIPLE_INDIRECT_POINTERS = 1;
+  static const uint64_t INLINE_SIZE = 192;
+
+  // Bits in INode::flags
+  static const uint32_t INLINE_DATA = 1 << 0; // Contents live in inline_data.
+  static const uint32_t TAIL_PACKED = 1 << 1; // Last partial block lives in a fragment.
+  static const uint32_t COMPRESSED  = 1 << 2; // Some clusters are compressed extents.
+  static const uint32_t SPARSE      = 1 << 3; // Some block pointers are holes that read as zeros.
 
   // Taken from page 6 of http://pages.cs.wisc.edu/~remzi/OSTEP/file-implementation.pdf
   // TODO: Check if the field sizes make sense for us
@@ -41,8 +48,18 @@ struct INode {
     10 direct blocks, 1 single indirect block, 1 double indirect block, 1 triple indirect block
     (10 + 512 + 512 ** 2 + 512 ** 3) * 4096 = 550831693824 ~= pow(2, 39) bytes = 512 GB
    */
-  Block::ID block_pointers[REF_BLOCKS_COUNT];
-  uint8_t __padding[88]; // padding to 256 bytes
+  union {
+    struct {
+      Block::ID block_pointers[REF_BLOCKS_COUNT];
+      Block::ID tail_block;  // Fragment block holding the tail (see TAIL_PACKED).
+      uint32_t  tail_index;  // First fragment of the tail in tail_block.
+      uint32_t  compress_mark; // Blocks before this have been offered for compression.
+      uint8_t __padding[72]; // padding to 256 bytes
+    };
+
+    // Small files store their contents here instead (see INLINE_DATA).
+    char inline_data[INLINE_SIZE];
+  };
 
 public:
   INode();
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <sys/ioctl.h>
+
+#include <stdint.h>
+
+// Filesystem-specific ioctls.  These work on any open file or directory
+// in the mounted filesystem (see bin/snapshot, bin/reflink, bin/resize
+// and bin/trim).
+
+struct SnapshotRequest {
+  char name[24]; // Need not be null terminated.
+};
+
+#define SIGSEGV_IOC_SNAPSHOT        _IOW('S', 1, SnapshotRequest)
+#define SIGSEGV_IOC_DELETE_SNAPSHOT _IOW('S', 2, SnapshotRequest)
+
+// Like FICLONERANGE (which the kernel doesn't pass on to FUSE), issued
+// on the destination file.  The source is named by INode number, since
+// file descriptors mean nothing to the filesystem; the caller has to own
+// it (or be root).  On return, length is the number of bytes cloned.
+struct CloneRequest {
+  uint64_t src_ino;
+  uint64_t src_offset;
+  uint64_t dst_offset;
+  uint64_t length;
+};
+
+#define SIGSEGV_IOC_CLONE_RANGE _IOWR('S', 3, CloneRequest)
+
+// Grows the filesystem (and the disk file, if it isn't a device) to
+// block_count blocks, or to the size of the device if that's zero.  On
+// return, block_count is the new size.
+struct GrowRequest {
+  uint64_t block_count;
+};
+
+#define SIGSEGV_IOC_GROW _IOWR('S', 4, GrowRequest)
+
+// Like FITRIM: discards every free data block.  On return, discarded
+// is the number of blocks passed on to the disk.
+struct TrimRequest {
+  uint64_t discarded;
+};
+
+#define SIGSEGV_IOC_TRIM _IOR('S', 5, TrimRequest)
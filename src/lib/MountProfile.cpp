@@ -0,0 +1,136 @@
+#include "MountProfile.h"
+#include "FSExceptions.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+bool MountProfile::get(const std::string& name, MountProfile& profile) {
+  if(name == "direct") {
+    // No kernel caching at all; every request reaches the filesystem.
+    profile.entry_timeout    = 0;
+    profile.attr_timeout     = 0;
+    profile.negative_timeout = 0;
+    profile.kernel_cache     = false;
+    profile.auto_cache       = false;
+    profile.keep_cache       = false;
+    profile.big_writes       = false;
+    profile.max_write        = 4096;
+    profile.max_read         = 0;
+    profile.max_readahead    = 131072;
+    profile.async_read       = false;
+  }
+  else if(name == "default") {
+    // Short-lived metadata caching and page caching of unchanged files.
+    profile.entry_timeout    = 1;
+    profile.attr_timeout     = 1;
+    profile.negative_timeout = 1;
+    profile.kernel_cache     = false;
+    profile.auto_cache       = true;
+    profile.keep_cache       = true;
+    profile.big_writes       = true;
+    profile.max_write        = 131072;
+    profile.max_read         = 0;
+    profile.max_readahead    = 131072;
+    profile.async_read       = true;
+  }
+  else if(name == "cached") {
+    // Long-lived caching for images that only this mount ever modifies.
+    profile.entry_timeout    = 30;
+    profile.attr_timeout     = 30;
+    profile.negative_timeout = 30;
+    profile.kernel_cache     = false;
+    profile.auto_cache       = false;
+    profile.keep_cache       = true;
+    profile.big_writes       = true;
+    profile.max_write        = 131072;
+    profile.max_read         = 0;
+    profile.max_readahead    = 1048576;
+    profile.async_read       = true;
+  }
+  else {
+    return false;
+  }
+
+  return true;
+}
+
+bool MountProfile::set(const std::string& option) {
+  size_t split = option.find('=');
+  std::string name  = option.substr(0, split);
+  std::string value = (split == std::string::npos)? "" : option.substr(split + 1);
+
+  if(name == "entry_timeout")         entry_timeout    = seconds(name, value);
+  else if(name == "attr_timeout")     attr_timeout     = seconds(name, value);
+  else if(name == "negative_timeout") negative_timeout = seconds(name, value);
+  else if(name == "kernel_cache")     kernel_cache     = flag(name, value);
+  else if(name == "auto_cache")       auto_cache       = flag(name, value);
+  else if(name == "keep_cache")       keep_cache       = flag(name, value);
+  else if(name == "big_writes")       big_writes       = flag(name, value);
+  else if(name == "max_write")        max_write        = bytes(name, value);
+  else if(name == "max_read")         max_read         = bytes(name, value);
+  else if(name == "max_readahead")    max_readahead    = bytes(name, value);
+  else if(name == "async_read")       async_read       = flag(name, value);
+  else if(name == "sync_read")        async_read       = !flag(name, value);
+  else return false;
+
+  return true;
+}
+
+double MountProfile::seconds(const std::string& name, const std::string& value) {
+  char* end = NULL;
+  errno = 0;
+  double result = std::strtod(value.c_str(), &end);
+  if(value.empty() || *end != '\0' || errno != 0 || !(result >= 0)) {
+    throw InvalidArgument("Bad number of seconds for " + name + ": " + value);
+  }
+
+  return result;
+}
+
+uint32_t MountProfile::bytes(const std::string& name, const std::string& value) {
+  char* end = NULL;
+  errno = 0;
+  unsigned long result = std::strtoul(value.c_str(), &end, 10);
+  if(value.empty() || value[0] == '-' || *end != '\0' || errno != 0 || result > UINT32_MAX) {
+    throw InvalidArgument("Bad number of bytes for " + name + ": " + value);
+  }
+
+  return result;
+}
+
+bool MountProfile::flag(const std::string& name, const std::string& value) {
+  if(value == "" || value == "1" || value == "true")  return true;
+  if(value == "0" || value == "false") return false;
+  throw InvalidArgument("Bad flag value for " + name + ": " + value);
+}
+
+std::vector<std::string> MountProfile::options() const {
+  std::vector<std::string> result;
+  char buffer[64];
+
+  std::snprintf(buffer, sizeof(buffer), "entry_timeout=%g", entry_timeout);
+  result.push_back(buffer);
+  std::snprintf(buffer, sizeof(buffer), "attr_timeout=%g", attr_timeout);
+  result.push_back(buffer);
+  std::snprintf(buffer, sizeof(buffer), "negative_timeout=%g", negative_timeout);
+  result.push_back(buffer);
+
+  if(kernel_cache) result.push_back("kernel_cache");
+  if(auto_cache)   result.push_back("auto_cache");
+  if(big_writes) {
+    result.push_back("big_writes");
+    std::snprintf(buffer, sizeof(buffer), "max_write=%u", max_write);
+    result.push_back(buffer);
+  }
+
+  if(max_read != 0) {
+    std::snprintf(buffer, sizeof(buffer), "max_read=%u", max_read);
+    result.push_back(buffer);
+  }
+
+  std::snprintf(buffer, sizeof(buffer), "max_readahead=%u", max_readahead);
+  result.push_back(buffer);
+  result.push_back(async_read? "async_read" : "sync_read");
+  return result;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Kernel-side caching and request sizing options passed to FUSE at mount.
+struct MountProfile {
+  double   entry_timeout;    // Seconds the kernel may cache name lookups.
+  double   attr_timeout;     // Seconds the kernel may cache file attributes.
+  double   negative_timeout; // Seconds the kernel may cache failed lookups.
+  bool     kernel_cache;     // Never flush the page cache on open (unsafe with invalidate()).
+  bool     auto_cache;       // Flush the page cache on open if mtime or size changed.
+  bool     keep_cache;       // Let fs_open keep the page cache of unchanged files.
+  bool     big_writes;       // Allow write requests larger than one page.
+  uint32_t max_write;        // Largest write request in bytes (needs big_writes).
+  uint32_t max_read;         // Largest read request in bytes (0 for the kernel default).
+  uint32_t max_readahead;    // Kernel readahead window in bytes.
+  bool     async_read;       // Allow the kernel to issue reads in parallel.
+
+  // Looks up a named profile: "default", "cached" or "direct".
+  static bool get(const std::string& name, MountProfile& profile);
+
+  // Applies a "name=value" (or bare flag) override.  Unknown options are
+  // returned as false so that the caller can pass them through to FUSE;
+  // known ones with bad values throw InvalidArgument.
+  bool set(const std::string& option);
+
+  // The profile rendered as FUSE "-o" option strings.
+  std::vector<std::string> options() const;
+
+private:
+  static double   seconds(const std::string& name, const std::string& value);
+  static uint32_t bytes(const std::string& name, const std::string& value);
+  static bool     flag(const std::string& name, const std::string& value);
+};
@@ -0,0 +1,33 @@
+#include "Readahead.h"
+
+#include <algorithm>
+
+const uint64_t Readahead::MIN_WINDOW;
+const uint64_t Readahead::MAX_WINDOW;
+
+Readahead::Readahead(): next(0), ahead(0), window(0) {
+  // Nothing else to do.
+}
+
+bool Readahead::access(uint64_t first, uint64_t last, uint64_t& start, uint64_t& count) {
+  // Re-reading the block we stopped in still counts as sequential.
+  bool sequential = (first == next || first + 1 == next);
+  next = last + 1;
+
+  if(!sequential) {
+    window = 0;
+    ahead  = 0;
+    return false;
+  }
+
+  window = (window == 0)? MIN_WINDOW : std::min(window * 2, MAX_WINDOW);
+  start  = std::max(ahead, next);
+  if(start >= next + window) {
+    // Still far enough ahead of the reader.
+    return false;
+  }
+
+  count = next + window - start;
+  ahead = start + count;
+  return true;
+}
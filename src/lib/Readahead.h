@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+
+// Sequential stream detection for one open file.  The window starts
+// small, doubles with every sequential read up to MAX_WINDOW, and is
+// dropped entirely as soon as the file is read out of order.
+class Readahead {
+public:
+  static const uint64_t MIN_WINDOW = 4;   // In blocks.
+  static const uint64_t MAX_WINDOW = 256; // In blocks.
+
+  Readahead();
+
+  // Records a read of blocks first..last (inclusive).  Returns true if
+  // blocks start..start+count-1 should be prefetched.
+  bool access(uint64_t first, uint64_t last, uint64_t& start, uint64_t& count);
+
+private:
+  uint64_t next;   // Block a sequential reader would ask for next.
+  uint64_t ahead;  // First block that hasn't been prefetched yet.
+  uint64_t window; // Blocks to keep in flight past the reader.
+};
@@ -0,0 +1,203 @@
+#include "Stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+// Anonymous namespace for file-local helpers:
+namespace {
+  const char* OP_NAMES[Stats::OP_COUNT] = {
+    "fuse.access",
+    "fuse.chmod",
+    "fuse.chown",
+    "fuse.fallocate",
+    "fuse.flush",
+    "fuse.fsync",
+    "fuse.getattr",
+    "fuse.ioctl",
+    "fuse.link",
+    "fuse.mkdir",
+    "fuse.mknod",
+    "fuse.open",
+    "fuse.read",
+    "fuse.readdir",
+    "fuse.readlink",
+    "fuse.release",
+    "fuse.rename",
+    "fuse.rmdir",
+    "fuse.statfs",
+    "fuse.symlink",
+    "fuse.truncate",
+    "fuse.unlink",
+    "fuse.utime",
+    "fuse.write",
+    "cache.get",
+    "cache.set",
+    "disk.get",
+    "disk.set",
+    "disk.sync",
+    "disk.discard",
+    "blocks.reserve",
+    "blocks.release",
+    "inodes.get",
+    "inodes.set"
+  };
+
+  const char* COUNTER_NAMES[Stats::COUNTER_COUNT] = {
+    "fuse.read_bytes",
+    "fuse.write_bytes",
+    "cache.hits",
+    "cache.misses",
+    "disk.read_blocks",
+    "disk.write_blocks",
+    "disk.discard_blocks"
+  };
+
+  // Sixteen buckets per power of two; everything from 2^40 ns (about
+  // eighteen minutes) up shares the last one.
+  const int SUB_BITS = 4;
+  const int SUB      = 1 << SUB_BITS;
+  const int TOP      = 40;
+  const int BUCKETS  = (TOP - SUB_BITS + 1) * SUB;
+
+  int bucket(uint64_t value) {
+    if(value < uint64_t(SUB)) return int(value);
+
+    int exponent = 63 - __builtin_clzll(value);
+    if(exponent >= TOP) return BUCKETS - 1;
+    return (exponent - SUB_BITS + 1) * SUB + int((value >> (exponent - SUB_BITS)) & (SUB - 1));
+  }
+
+  // The middle of a bucket's range.
+  uint64_t midpoint(int index) {
+    if(index < SUB) return index;
+
+    int shift = index / SUB - 1;
+    uint64_t low = uint64_t(SUB + index % SUB) << shift;
+    return low + (uint64_t(1) << shift) / 2;
+  }
+
+  // One thread's numbers.  Only the owning thread writes to a shard, so
+  // plain loads and stores are enough; atomics just keep report() from
+  // reading torn values.  Shards outlive their threads so that nothing
+  // recorded is lost.
+  struct Shard {
+    std::atomic<uint64_t> counts[Stats::OP_COUNT];
+    std::atomic<uint64_t> errors[Stats::OP_COUNT];
+    std::atomic<uint64_t> totals[Stats::OP_COUNT];
+    std::atomic<uint64_t> maxima[Stats::OP_COUNT];
+    std::atomic<uint64_t> buckets[Stats::OP_COUNT][BUCKETS];
+    std::atomic<uint64_t> counters[Stats::COUNTER_COUNT];
+  };
+
+  void bump(std::atomic<uint64_t>& value, uint64_t amount) {
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+  }
+
+  std::mutex& registry_mutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  std::vector<Shard*>& registry() {
+    static std::vector<Shard*> shards;
+    return shards;
+  }
+
+  Shard& local() {
+    static thread_local Shard* shard = NULL;
+    if(shard == NULL) {
+      shard = new Shard(); // Value-initialized: all zeros.
+      std::lock_guard<std::mutex> lock(registry_mutex());
+      registry().push_back(shard);
+    }
+
+    return *shard;
+  }
+}
+
+const char* Stats::name(Op op) {
+  return OP_NAMES[op];
+}
+
+void Stats::record(Op op, uint64_t nanoseconds) {
+  Shard& shard = local();
+  bump(shard.counts[op], 1);
+  bump(shard.totals[op], nanoseconds);
+  bump(shard.buckets[op][bucket(nanoseconds)], 1);
+  if(nanoseconds > shard.maxima[op].load(std::memory_order_relaxed)) {
+    shard.maxima[op].store(nanoseconds, std::memory_order_relaxed);
+  }
+}
+
+void Stats::fail(Op op) {
+  bump(local().errors[op], 1);
+}
+
+void Stats::add(Counter counter, uint64_t amount) {
+  bump(local().counters[counter], amount);
+}
+
+std::string Stats::report() {
+  std::vector<Shard*> shards;
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    shards = registry();
+  }
+
+  const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  std::string result = "# op count errors mean_us p50_us p90_us p99_us p999_us max_us\n";
+  std::vector<uint64_t> buckets(BUCKETS);
+  char line[256];
+
+  for(int op = 0; op < OP_COUNT; ++op) {
+    uint64_t count  = 0;
+    uint64_t errors = 0;
+    uint64_t total  = 0;
+    uint64_t max    = 0;
+    buckets.assign(BUCKETS, 0);
+    for(Shard* shard: shards) {
+      count  += shard->counts[op].load(std::memory_order_relaxed);
+      errors += shard->errors[op].load(std::memory_order_relaxed);
+      total  += shard->totals[op].load(std::memory_order_relaxed);
+      max     = std::max(max, shard->maxima[op].load(std::memory_order_relaxed));
+      for(int i = 0; i < BUCKETS; ++i) {
+        buckets[i] += shard->buckets[op][i].load(std::memory_order_relaxed);
+      }
+    }
+
+    // Shards are read while their threads keep writing, so the buckets
+    // may add up to a little more than count; rank against their sum.
+    uint64_t seen = 0;
+    for(uint64_t n: buckets) seen += n;
+
+    double   percentiles[4] = {0, 0, 0, 0};
+    uint64_t sum = 0;
+    int      i   = 0;
+    for(int q = 0; q < 4 && seen > 0; ++q) {
+      uint64_t rank = uint64_t(quantiles[q] * (seen - 1)) + 1;
+      while(sum + buckets[i] < rank) sum += buckets[i++];
+      percentiles[q] = std::min(midpoint(i), max) / 1000.0;
+    }
+
+    std::snprintf(line, sizeof(line), "%s %llu %llu %.3f %.3f %.3f %.3f %.3f %.3f\n", OP_NAMES[op],
+      (unsigned long long) count, (unsigned long long) errors, count ? total / 1000.0 / count : 0.0,
+      percentiles[0], percentiles[1], percentiles[2], percentiles[3], max / 1000.0);
+    result += line;
+  }
+
+  result += "# counter value\n";
+  for(int counter = 0; counter < COUNTER_COUNT; ++counter) {
+    uint64_t value = 0;
+    for(Shard* shard: shards) {
+      value += shard->counters[counter].load(std::memory_order_relaxed);
+    }
+
+    std::snprintf(line, sizeof(line), "%s %llu\n", COUNTER_NAMES[counter], (unsigned long long) value);
+    result += line;
+  }
+
+  return result;
+}
@@ -7,4 +7,35 @@ public:
   virtual ~Storage() {}
   virtual void get(Block::ID id, Block& dst) = 0;
   virtual void set(Block::ID id, const Block& src) = 0;
+
+  // Transfers count consecutive blocks.  Backends that can coalesce
+  // these into a single I/O should override them.
+  virtual void getRange(Block::ID id, Block* dst, uint64_t count) {
+    for(uint64_t i = 0; i < count; ++i) get(id + i, dst[i]);
+  }
+
+  virtual void setRange(Block::ID id, const Block* src, uint64_t count) {
+    for(uint64_t i = 0; i < count; ++i) set(id + i, src[i]);
+  }
+
+  // Makes everything written so far durable.
+  virtual void sync() {}
+
+  // Says that what has been written so far is consistent on its own,
+  // even though the operation writing it isn't done.  Caches that
+  // commit metadata in transactions may commit it now, so that no one
+  // operation needs a transaction bigger than the journal.
+  virtual void settle() {}
+
+  // Says that these blocks hold nothing worth keeping, so the device
+  // can let go of them; until they're written again, reading them
+  // returns zeroes or whatever they held.
+  virtual void discard(Block::ID, uint64_t) {}
+
+  // Blocks the device underneath holds right now, or 0 if unknown.
+  virtual uint64_t capacity() { return 0; }
+
+  // Lets blocks up to nblocks be used, growing the device if it can.
+  // Returns false if it can't hold that many.
+  virtual bool resize(uint64_t) { return false; }
 };
@@ -3,6 +3,21 @@
 #include "Block.h"
 
 struct Superblock {
+  static const uint64_t MAX_ORPHANS   = 256;
+  static const uint64_t MAX_SNAPSHOTS = 16;
+
+  struct Snapshot {
+    // A crash can leave a snapshot half made or half deleted; the next
+    // mount deletes it (see Filesystem::recover).
+    static const uint64_t CREATING = 1;
+    static const uint64_t DELETING = 2;
+
+    char      name[24]; // Empty if this slot is free.
+    uint64_t  created;
+    Block::ID index;    // First block of the list of INode table copies.
+    uint64_t  state;    // Zero once the snapshot is complete.
+  };
+
   union {
     uint64_t config[16];
     struct {
@@ -15,9 +30,48 @@ struct Superblock {
 
       Block::ID data_block_start;
       uint64_t  data_block_count;
+
+      Block::ID fragment_head; // First block in the tail fragment chain.
+
+      Block::ID journal_block_start;
+      uint64_t  journal_block_count;
+
+      // Only set for log-structured filesystems (see LogStorage).
+      Block::ID log_map_start;
+      Block::ID log_segment_start;
+      uint64_t  log_segment_count;
+
+      Block::ID refcount_block_start;
+      uint64_t  refcount_block_count;
     };
   };
 
   uint64_t inode_config[8];
   uint64_t data_config[8];
+
+  // Unlinked INodes whose blocks are still being freed in the background.
+  uint64_t orphan_count;
+  uint64_t orphans[MAX_ORPHANS];
+
+  Snapshot snapshots[MAX_SNAPSHOTS];
+
+  // Fingerprint index for deduplication (see DedupIndex); empty if off.
+  Block::ID dedup_block_start;
+  uint64_t  dedup_block_count;
+
+  // One CRC32C per block (see ChecksumStorage).
+  Block::ID checksum_block_start;
+  uint64_t  checksum_block_count;
+
+  // mkfs only initializes the first block of the INode and reference
+  // count tables; these count the blocks (from the start) that have
+  // been written since.  Zero means the whole table is initialized.
+  uint64_t  inode_block_ready;
+  uint64_t  refcount_block_ready;
+
+  // A file being cut down in steps (see Filesystem::shrink), so that
+  // the next mount can finish if a crash gets in the way; zero if none.
+  uint64_t  truncating;
 };
+
+static_assert(sizeof(Superblock) <= Block::SIZE, "Superblock must fit in a block!");
@@ -0,0 +1,162 @@
+#include "Trace.h"
+
+#ifdef SIGSEGV_TRACE
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <unistd.h>
+
+const uint64_t Trace::CAPACITY;
+std::atomic<bool> Trace::enabled(false);
+
+// Anonymous namespace for file-local helpers:
+namespace {
+  struct Event {
+    const char* name;
+    uint64_t    start; // Nanoseconds since the epoch below.
+    uint64_t    end;
+  };
+
+  // One thread's spans.  Only the owning thread writes; head counts the
+  // spans it has finished, so slot head % CAPACITY is the next to go.
+  struct Ring {
+    uint64_t              tid;
+    std::atomic<uint64_t> head;
+    Event                 events[Trace::CAPACITY];
+  };
+
+  std::chrono::steady_clock::time_point epoch;
+  std::mutex          mutex;   // Protects rings and the fields below.
+  std::vector<Ring*>  rings;   // Never freed; threads may outlive a dump.
+  FILE*               output = NULL;
+  std::thread         dumper;
+  bool                stopping = false;
+
+  Ring& local() {
+    static thread_local Ring* ring = NULL;
+    if(ring == NULL) {
+      ring = new Ring;
+      ring->head = 0;
+      std::lock_guard<std::mutex> lock(mutex);
+      ring->tid = rings.size() + 1;
+      rings.push_back(ring);
+    }
+
+    return *ring;
+  }
+
+  // Called with the lock held.  Rewrites the output file with every span
+  // still in the rings.
+  void dump() {
+    if(output == NULL) return;
+
+    std::rewind(output);
+    if(ftruncate(fileno(output), 0) != 0) {
+      std::cerr << "Could not truncate the trace file.\n";
+    }
+
+    std::fprintf(output, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    std::fprintf(output, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"sigsegv\"}}", getpid());
+
+    std::vector<Event> events;
+    for(Ring* ring: rings) {
+      // Copy first, then drop anything the owner may have overwritten
+      // while we were copying.
+      uint64_t head  = ring->head.load(std::memory_order_acquire);
+      uint64_t first = (head > Trace::CAPACITY) ? head - Trace::CAPACITY : 0;
+      events.clear();
+      for(uint64_t i = first; i < head; ++i) {
+        events.push_back(ring->events[i % Trace::CAPACITY]);
+      }
+
+      uint64_t after = ring->head.load(std::memory_order_acquire);
+      uint64_t valid = (after + 1 > Trace::CAPACITY) ? after + 1 - Trace::CAPACITY : 0;
+      for(uint64_t i = std::max(first, valid); i < head; ++i) {
+        const Event& event = events[i - first];
+        std::fprintf(output, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f}",
+          event.name, getpid(), (unsigned long long) ring->tid, event.start / 1000.0, (event.end - event.start) / 1000.0);
+      }
+    }
+
+    std::fprintf(output, "\n]}\n");
+    std::fflush(output);
+  }
+
+  // Dumps whenever SIGUSR1 arrives.  The signal is blocked everywhere
+  // else, so sigwait() gets it here and the dump runs in a normal thread.
+  void run() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+
+    while(true) {
+      int signal = 0;
+      sigwait(&signals, &signal);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if(stopping) break;
+      dump();
+      std::cerr << "Trace written.\n";
+    }
+  }
+}
+
+void Trace::start(const char* path) {
+  output = std::fopen(path, "w");
+  if(output == NULL) {
+    std::cerr << "Could not open trace file " << path << ".\n";
+    return;
+  }
+
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  epoch    = std::chrono::steady_clock::now();
+  stopping = false;
+  enabled  = true;
+  dumper  = std::thread(run);
+}
+
+void Trace::stop() {
+  if(output == NULL) return;
+
+  enabled = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    dump();
+    std::fclose(output);
+    output = NULL;
+  }
+
+  pthread_kill(dumper.native_handle(), SIGUSR1);
+  dumper.join();
+}
+
+uint64_t Trace::now() {
+  // Never zero, which Span uses to mean "not recording".
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count() + 1;
+}
+
+void Trace::record(const char* name, uint64_t start, uint64_t end) {
+  Ring& ring = local();
+  uint64_t head = ring.head.load(std::memory_order_relaxed);
+  Event& event = ring.events[head % CAPACITY];
+  event.name  = name;
+  event.start = start;
+  event.end   = end;
+  ring.head.store(head + 1, std::memory_order_release);
+}
+
+#endif
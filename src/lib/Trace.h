@@ -0,0 +1,60 @@
+#pragma once
+
+// Scoped trace spans, for seeing where the time inside one request goes.
+//
+//   TRACE_SPAN("Filesystem::read");
+//
+// records the time from there to the end of the enclosing scope.  Each
+// thread keeps its most recent spans in its own ring buffer; they are
+// written out as Chrome trace-event JSON (load it in chrome://tracing or
+// ui.perfetto.dev) on SIGUSR1 and at unmount.  Span names must be string
+// literals (or otherwise live forever).
+//
+// Tracing only exists in builds made with -DSIGSEGV_TRACE (make TRACE=1);
+// otherwise TRACE_SPAN expands to nothing.  Even then nothing is recorded
+// until Trace::start() is called (the -T option).
+
+#ifdef SIGSEGV_TRACE
+
+#include <atomic>
+#include <cstdint>
+
+class Trace {
+public:
+  static const uint64_t CAPACITY = 65536; // Spans kept per thread.
+
+  class Span {
+  public:
+    Span(const char* name): name(name), start(enabled.load(std::memory_order_relaxed) ? now() : 0) {}
+    ~Span() {
+      if(start != 0) record(name, start, now());
+    }
+
+  private:
+    const char* name;
+    uint64_t    start;
+  };
+
+  // Starts recording, to be written to path.  Call this before any other
+  // threads are started, so that they all leave SIGUSR1 to our dumper.
+  static void start(const char* path);
+
+  // Writes out the final trace and stops recording.
+  static void stop();
+
+private:
+  static std::atomic<bool> enabled;
+
+  static uint64_t now();
+  static void record(const char* name, uint64_t start, uint64_t end);
+};
+
+#define TRACE_JOIN2(a, b) a##b
+#define TRACE_JOIN(a, b)  TRACE_JOIN2(a, b)
+#define TRACE_SPAN(name)  Trace::Span TRACE_JOIN(trace_span_, __LINE__)(name)
+
+#else
+
+#define TRACE_SPAN(name) ((void) 0)
+
+#endif
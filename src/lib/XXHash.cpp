@@ -0,0 +1,96 @@
+#include "XXHash.h"
+
+#include <cstring>
+
+// Anonymous namespace for file-local helpers:
+namespace {
+  const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+  const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+  const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+  const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+  const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+  uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  uint64_t read64(const unsigned char* p) {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  uint32_t read32(const unsigned char* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  uint64_t round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc  = rotl(acc, 31);
+    return acc * PRIME1;
+  }
+
+  uint64_t merge(uint64_t acc, uint64_t value) {
+    acc ^= round(0, value);
+    return acc * PRIME1 + PRIME4;
+  }
+}
+
+uint64_t xxhash64(const void* data, size_t size, uint64_t seed) {
+  const unsigned char* p   = (const unsigned char*) data;
+  const unsigned char* end = p + size;
+  uint64_t hash;
+
+  if(size >= 32) {
+    // Four independent lanes, so the compiler can keep them all busy.
+    uint64_t v1 = seed + PRIME1 + PRIME2;
+    uint64_t v2 = seed + PRIME2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME1;
+    const unsigned char* limit = end - 32;
+    do {
+      v1 = round(v1, read64(p));
+      v2 = round(v2, read64(p + 8));
+      v3 = round(v3, read64(p + 16));
+      v4 = round(v4, read64(p + 24));
+      p += 32;
+    } while(p <= limit);
+
+    hash = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    hash = merge(hash, v1);
+    hash = merge(hash, v2);
+    hash = merge(hash, v3);
+    hash = merge(hash, v4);
+  }
+  else {
+    hash = seed + PRIME5;
+  }
+
+  hash += size;
+  while(p + 8 <= end) {
+    hash ^= round(0, read64(p));
+    hash  = rotl(hash, 27) * PRIME1 + PRIME4;
+    p += 8;
+  }
+
+  if(p + 4 <= end) {
+    hash ^= read32(p) * PRIME1;
+    hash  = rotl(hash, 23) * PRIME2 + PRIME3;
+    p += 4;
+  }
+
+  while(p < end) {
+    hash ^= (*p) * PRIME5;
+    hash  = rotl(hash, 11) * PRIME1;
+    p += 1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= PRIME2;
+  hash ^= hash >> 29;
+  hash *= PRIME3;
+  hash ^= hash >> 32;
+  return hash;
+}
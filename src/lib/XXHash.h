@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// 64 bit xxHash (XXH64) of size bytes at data.
+uint64_t xxhash64(const void* data, size_t size, uint64_t seed = 0);
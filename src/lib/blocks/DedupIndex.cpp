@@ -0,0 +1,92 @@
+#include "DedupIndex.h"
+#include "../Superblock.h"
+
+#include <cstring>
+
+// Anonymous namespace for file-local types:
+namespace {
+  struct Entry {
+    uint64_t  hash;
+    Block::ID block; // 0 if the entry is empty.
+  };
+
+  const uint64_t ENTRIES = Block::SIZE / sizeof(Entry); // Entries per bucket.
+}
+
+DedupIndex::DedupIndex(BlockManager& block_manager):
+  block_manager(&block_manager),
+  loaded(false),
+  start(0),
+  count(0)
+{
+  // The superblock isn't valid until after mkfs, so it's read on first use.
+}
+
+void DedupIndex::load() {
+  Block block;
+  Superblock* superblock = (Superblock*) block.data;
+  block_manager->get(0, block);
+  start  = superblock->dedup_block_start;
+  count  = superblock->dedup_block_count;
+  loaded = true;
+}
+
+void DedupIndex::mkfs() {
+  load();
+
+  Block block;
+  std::memset(block.data, 0, Block::SIZE);
+  for(uint64_t i = 0; i < count; ++i) {
+    block_manager->set(start + i, block);
+  }
+}
+
+bool DedupIndex::enabled() {
+  if(!loaded) load();
+  return count != 0;
+}
+
+Block::ID DedupIndex::find(uint64_t hash) {
+  if(!enabled()) return 0;
+
+  Block block;
+  Entry* entries = (Entry*) block.data;
+  block_manager->get(start + hash % count, block);
+  for(uint64_t i = 0; i < ENTRIES; ++i) {
+    if(entries[i].block != 0 && entries[i].hash == hash) {
+      return entries[i].block;
+    }
+  }
+
+  return 0;
+}
+
+void DedupIndex::insert(uint64_t hash, Block::ID id) {
+  if(!enabled()) return;
+
+  Block block;
+  Entry* entries = (Entry*) block.data;
+  block_manager->get(start + hash % count, block);
+
+  // Reuse an entry with the same hash or an empty one; failing that,
+  // overwrite the one the hash's other bits pick.
+  uint64_t slot = ENTRIES;
+  for(uint64_t i = 0; i < ENTRIES; ++i) {
+    if(entries[i].block != 0 && entries[i].hash == hash) {
+      slot = i;
+      break;
+    }
+
+    if(entries[i].block == 0 && slot == ENTRIES) {
+      slot = i;
+    }
+  }
+
+  if(slot == ENTRIES) {
+    slot = (hash / count) % ENTRIES;
+  }
+
+  entries[slot].hash  = hash;
+  entries[slot].block = id;
+  block_manager->set(start + hash % count, block);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "../BlockManager.h"
+
+// Persistent fingerprint index for inline deduplication.
+//
+// A hash table in its own region (reserved by mkfs -D) maps content
+// fingerprints to the data blocks that had that content when they were
+// written.  Each index block is a bucket; a full bucket overwrites one
+// of its entries.  Entries are only hints: callers check that the block
+// is still live and compare its contents before sharing it.
+class DedupIndex {
+public:
+  DedupIndex(BlockManager& block_manager);
+
+  // Empties the index; the superblock must already say where it is.
+  void mkfs();
+
+  bool      enabled();
+  Block::ID find(uint64_t hash);
+  void      insert(uint64_t hash, Block::ID id);
+
+private:
+  BlockManager* block_manager;
+  bool          loaded;
+  Block::ID     start;
+  uint64_t      count;
+
+  void load();
+};
@@ -0,0 +1,302 @@
+#include "FragmentManager.h"
+#include "../FSExceptions.h"
+#include "../Superblock.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+// Anonymous namespace for file-local types:
+namespace {
+  const uint64_t MAGIC = 0x5347534654414953; // Identifies fragment blocks.
+
+  struct Header {
+    uint64_t  magic;
+    Block::ID next;                         // Next fragment block in the chain.
+    INode::ID owners[FragmentManager::COUNT + 1]; // Owner of each fragment (0 if free).
+  };
+
+  static_assert(sizeof(Header) <= FragmentManager::SIZE, "Fragment header is too big!");
+
+  uint64_t fragments(uint64_t size) {
+    return (size + FragmentManager::SIZE - 1) / FragmentManager::SIZE;
+  }
+
+  uint32_t mask(uint32_t index, uint64_t size) {
+    return ((1u << fragments(size)) - 1) << index;
+  }
+
+  // Length of the longest run of free fragments in a block.
+  uint32_t longest(uint32_t bits) {
+    uint32_t best = 0;
+    uint32_t run  = 0;
+    for(uint32_t i = 1; i <= FragmentManager::COUNT; ++i) {
+      run  = (bits & (1u << i))? 0 : run + 1;
+      best = std::max(best, run);
+    }
+
+    return best;
+  }
+
+  // First index with room for size bytes, or 0 if there isn't any.
+  uint32_t fit(uint32_t bits, uint64_t size) {
+    for(uint32_t i = 1; i + fragments(size) <= FragmentManager::COUNT + 1; ++i) {
+      if((bits & mask(i, size)) == 0) return i;
+    }
+
+    return 0;
+  }
+}
+
+const uint64_t FragmentManager::SIZE;
+const uint64_t FragmentManager::COUNT;
+const uint64_t FragmentManager::MAX_TAIL;
+
+FragmentManager::FragmentManager(BlockManager& block_manager, RefCountTable& references):
+  block_manager(&block_manager),
+  references(&references),
+  loaded(false),
+  head(0),
+  tail(0),
+  cursor(0)
+{
+  // The superblock isn't valid until after mkfs, so the chain is read
+  // in on first use.
+}
+
+void FragmentManager::mkfs() {
+  used.clear();
+  prev.clear();
+  for(auto& blocks: free) blocks.clear();
+  head   = 0;
+  tail   = 0;
+  cursor = 0;
+  loaded = true;
+}
+
+void FragmentManager::load() {
+  Block block;
+  Superblock* superblock = (Superblock*) block.data;
+  block_manager->get(0, block);
+  head   = superblock->fragment_head;
+  tail   = 0;
+  cursor = head;
+  loaded = true;
+}
+
+bool FragmentManager::scan() {
+  if(cursor == 0) return false;
+
+  Block block;
+  Header* header = (Header*) block.data;
+  block_manager->get(cursor, block);
+  if(header->magic != MAGIC) {
+    throw IOError("Corrupt fragment block " + std::to_string(cursor));
+  }
+
+  uint32_t bits = 0;
+  for(uint32_t i = 1; i <= COUNT; ++i) {
+    if(header->owners[i] != 0) bits |= 1u << i;
+  }
+
+  prev[cursor] = tail;
+  setUsed(cursor, bits);
+  tail   = cursor;
+  cursor = header->next;
+  return true;
+}
+
+void FragmentManager::setHead(Block::ID id) {
+  Block block;
+  Superblock* superblock = (Superblock*) block.data;
+  block_manager->get(0, block);
+  superblock->fragment_head = id;
+  block_manager->set(0, block);
+  head = id;
+}
+
+void FragmentManager::setUsed(Block::ID id, uint32_t bits) {
+  auto itr = used.find(id);
+  if(itr != used.end()) {
+    free[longest(itr->second)].erase(id);
+  }
+
+  used[id] = bits;
+  free[longest(bits)].insert(id);
+}
+
+void FragmentManager::store(INode::ID owner, const char* src, uint64_t size, Block::ID& block_num, uint32_t& index) {
+  if(!loaded) load();
+  if(size == 0 || size > MAX_TAIL) {
+    throw std::length_error("Tail size out of range.");
+  }
+
+  // Take the first block with a long enough run that isn't shared.
+  block_num = 0;
+  for(uint64_t run = fragments(size); run <= COUNT && block_num == 0; ++run) {
+    for(Block::ID id: free[run]) {
+      if(!references->shared(id)) {
+        block_num = id;
+        break;
+      }
+    }
+  }
+
+  // Otherwise read in more of the chain until something fits.
+  while(block_num == 0 && scan()) {
+    if(fit(used[tail], size) != 0 && !references->shared(tail)) {
+      block_num = tail;
+    }
+  }
+
+  Block block;
+  Header* header = (Header*) block.data;
+  if(block_num == 0) {
+    // Start a new fragment block at the head of the chain.
+    block_num = block_manager->reserve();
+
+    std::memset(block.data, 0, Block::SIZE);
+    header->magic = MAGIC;
+    header->next  = head;
+    if(used.count(head)) prev[head] = block_num;
+    else tail = block_num;
+    prev[block_num] = 0;
+    setUsed(block_num, 0);
+    setHead(block_num);
+  }
+  else {
+    block_manager->get(block_num, block);
+  }
+
+  index = fit(used[block_num], size);
+  for(uint64_t i = index; i < index + fragments(size); ++i) {
+    header->owners[i] = owner;
+  }
+
+  std::memcpy(block.data + index * SIZE, src, size);
+  block_manager->set(block_num, block);
+  setUsed(block_num, used[block_num] | mask(index, size));
+}
+
+void FragmentManager::load(Block::ID block_num, uint32_t index, char* dst, uint64_t size) {
+  Block block;
+  block_manager->get(block_num, block);
+  std::memcpy(dst, block.data + index * SIZE, size);
+}
+
+void FragmentManager::release(Block::ID block_num, uint32_t index, uint64_t size) {
+  if(!loaded) load();
+
+  // A snapshot still has this block as it was; see reclaim().
+  if(references->shared(block_num)) {
+    return;
+  }
+
+  Block block;
+  Header* header = (Header*) block.data;
+  block_manager->get(block_num, block);
+
+  uint32_t bits = 0;
+  for(uint64_t i = index; i < index + fragments(size); ++i) {
+    header->owners[i] = 0;
+  }
+
+  for(uint32_t i = 1; i <= COUNT; ++i) {
+    if(header->owners[i] != 0) bits |= 1u << i;
+  }
+
+  // Nothing left in this block; unlink it and give it back.
+  if(bits == 0 && unlink(block_num, header->next)) {
+    return;
+  }
+
+  block_manager->set(block_num, block);
+  if(used.count(block_num)) setUsed(block_num, bits);
+}
+
+void FragmentManager::reclaim(INodeManager& inodes) {
+  if(!loaded) load();
+  while(scan());
+
+  std::vector<Block::ID> ids;
+  for(const auto& itr: used) {
+    if(!references->shared(itr.first)) ids.push_back(itr.first);
+  }
+
+  for(Block::ID id: ids) {
+    // Each block's cleanup stands on its own, so long chains can be
+    // committed in pieces.
+    block_manager->settle();
+
+    Block block;
+    Header* header = (Header*) block.data;
+    block_manager->get(id, block);
+
+    // A fragment still belongs to its owner if that's where the owner's
+    // tail is; the INode may have been reused since.
+    bool     changed = false;
+    uint32_t bits    = 0;
+    for(uint32_t i = 1; i <= COUNT; ++i) {
+      if(header->owners[i] == 0) continue;
+
+      INode inode;
+      inodes.get(header->owners[i], inode);
+      uint64_t size  = inode.size - inode.blocks * Block::SIZE;
+      bool     owned = inode.type != FileType::FREE && (inode.flags & INode::TAIL_PACKED) && inode.tail_block == id
+                    && i >= inode.tail_index && i < inode.tail_index + fragments(size);
+      if(owned) {
+        bits |= 1u << i;
+      }
+      else {
+        header->owners[i] = 0;
+        changed = true;
+      }
+    }
+
+    if(bits == 0 && unlink(id, header->next)) continue;
+    if(changed) {
+      block_manager->set(id, block);
+      setUsed(id, bits);
+    }
+  }
+}
+
+// Takes an empty block out of the chain and frees it.  That means
+// writing to the block before it, which has to wait while a snapshot
+// shares it.  Returns whether the block was unlinked.
+bool FragmentManager::unlink(Block::ID block_num, Block::ID after) {
+  // Unlinking needs the previous block, so read the chain in up to this
+  // one.
+  while(!used.count(block_num) && scan());
+  if(!used.count(block_num)) {
+    throw IOError("Fragment block " + std::to_string(block_num) + " isn't in the chain");
+  }
+
+  Block::ID before = prev[block_num];
+  if(before != 0 && references->shared(before)) {
+    return false;
+  }
+
+  if(before == 0) {
+    setHead(after);
+  }
+  else {
+    Block link;
+    block_manager->get(before, link);
+    ((Header*) link.data)->next = after;
+    block_manager->set(before, link);
+  }
+
+  if(used.count(after)) prev[after] = before;
+  else tail = before;
+
+  free[longest(used[block_num])].erase(block_num);
+  used.erase(block_num);
+  prev.erase(block_num);
+  if(references->release(block_num)) {
+    block_manager->release(block_num);
+  }
+
+  return true;
+}
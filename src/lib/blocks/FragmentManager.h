@@ -0,0 +1,61 @@
+#pragma once
+
+#include "../BlockManager.h"
+#include "../INode.h"
+#include "../INodeManager.h"
+#include "RefCountTable.h"
+
+#include <map>
+#include <set>
+
+// Packs the partial last blocks ("tails") of small files together.
+//
+// A fragment block is split into 256 byte fragments.  The first one is
+// a header that links fragment blocks into a chain (rooted in the
+// superblock) and records which INode owns each of the others.  A tail
+// takes up a run of neighbouring fragments in a single block.
+//
+// Fragment blocks that a snapshot still uses are never written to at
+// all: tails released from them keep their owners until the snapshot is
+// gone and reclaim() checks who still uses what.
+//
+// Blocks are indexed by their longest run of free fragments, so finding
+// room for a tail doesn't walk the whole chain.  The chain is read in a
+// block at a time, from the head, only as far as it needs to be.
+class FragmentManager {
+public:
+  static const uint64_t SIZE     = 256; // Bytes per fragment.
+  static const uint64_t COUNT    = Block::SIZE / SIZE - 1; // Usable fragments per block.
+  static const uint64_t MAX_TAIL = COUNT * SIZE;
+
+  FragmentManager(BlockManager& block_manager, RefCountTable& references);
+
+  void mkfs();
+
+  // Copies size bytes into free fragments owned by owner and returns
+  // where they went.  Allocates a new fragment block if none has room.
+  void store(INode::ID owner, const char* src, uint64_t size, Block::ID& block, uint32_t& index);
+  void load(Block::ID block, uint32_t index, char* dst, uint64_t size);
+  void release(Block::ID block, uint32_t index, uint64_t size);
+
+  // Frees the fragments of blocks no longer shared with a snapshot whose
+  // owners have let go of them, and unlinks any blocks left empty.
+  void reclaim(INodeManager& inodes);
+
+private:
+  BlockManager* block_manager;
+  RefCountTable* references;
+  bool          loaded; // Whether head has been read from the superblock.
+  Block::ID     head;
+  Block::ID     tail;   // Last block read in from the chain (0 if none).
+  Block::ID     cursor; // Next block in the chain to read in (0 at the end).
+  std::map<Block::ID, uint32_t>  used; // Bitmap of used fragments per block.
+  std::map<Block::ID, Block::ID> prev; // Previous block in the chain.
+  std::set<Block::ID> free[COUNT + 1]; // Blocks by longest free run.
+
+  void load();
+  bool scan();
+  void setHead(Block::ID id);
+  void setUsed(Block::ID id, uint32_t bits);
+  bool unlink(Block::ID id, Block::ID next);
+};
@@ -0,0 +1,147 @@
+#include "RefCountTable.h"
+#include "../FSExceptions.h"
+#include "../Superblock.h"
+
+#include <cstring>
+#include <stdexcept>
+
+// Anonymous namespace for file-local constants:
+namespace {
+  const uint64_t ENTRIES = Block::SIZE / sizeof(uint16_t); // Counters per block.
+  const uint16_t INDEXED = 0x8000;
+  const uint16_t COUNT   = 0x7fff;
+}
+
+RefCountTable::RefCountTable(BlockManager& block_manager):
+  block_manager(&block_manager),
+  loaded(false),
+  start(0),
+  count(0),
+  data_start(0),
+  ready(0)
+{
+  // The superblock isn't valid until after mkfs, so it's read on first use.
+}
+
+uint64_t RefCountTable::layout(uint64_t nblocks) {
+  return (nblocks + ENTRIES - 1) / ENTRIES;
+}
+
+void RefCountTable::load() {
+  Block block;
+  Superblock* superblock = (Superblock*) block.data;
+  block_manager->get(0, block);
+  start      = superblock->refcount_block_start;
+  count      = superblock->refcount_block_count;
+  data_start = superblock->data_block_start;
+  ready      = superblock->refcount_block_ready;
+  if(ready == 0 || ready > count) ready = count;
+  loaded     = true;
+}
+
+void RefCountTable::mkfs() {
+  load();
+  ready = 0;
+  if(count > 0) extend(0);
+}
+
+// Zeroes the uninitialized table blocks up to and including this one.
+void RefCountTable::extend(uint64_t index) {
+  Block block;
+  std::memset(block.data, 0, Block::SIZE);
+  for(uint64_t i = ready; i <= index; ++i) {
+    block_manager->set(start + i, block);
+  }
+
+  ready = index + 1;
+  Superblock* superblock = (Superblock*) block.data;
+  block_manager->get(0, block);
+  superblock->refcount_block_ready = ready;
+  block_manager->set(0, block);
+}
+
+uint16_t RefCountTable::get(Block::ID id) {
+  if(!loaded) load();
+  if(count == 0) return 0;
+
+  uint64_t index = id - data_start;
+  if(id < data_start || index / ENTRIES >= count) {
+    throw std::out_of_range("Block has no reference count.");
+  }
+
+  if(index / ENTRIES >= ready) {
+    return 0;
+  }
+
+  Block block;
+  block_manager->get(start + index / ENTRIES, block);
+  return ((uint16_t*) block.data)[index % ENTRIES];
+}
+
+void RefCountTable::set(Block::ID id, uint16_t value) {
+  uint64_t index = id - data_start;
+  if(id < data_start || index / ENTRIES >= count) {
+    throw std::out_of_range("Block has no reference count.");
+  }
+
+  if(index / ENTRIES >= ready) {
+    extend(index / ENTRIES);
+  }
+
+  Block block;
+  block_manager->get(start + index / ENTRIES, block);
+  ((uint16_t*) block.data)[index % ENTRIES] = value;
+  block_manager->set(start + index / ENTRIES, block);
+}
+
+uint64_t RefCountTable::relocate(Block::ID start, uint64_t count) {
+  if(!loaded) load();
+
+  // The copy isn't used until the superblock points at it, so it can be
+  // committed in pieces.
+  Block block;
+  for(uint64_t i = 0; i < ready; ++i) {
+    block_manager->get(this->start + i, block);
+    block_manager->set(start + i, block);
+    block_manager->settle();
+  }
+
+  this->start = start;
+  this->count = count;
+  return ready;
+}
+
+bool RefCountTable::shared(Block::ID id) {
+  return (get(id) & COUNT) != 0;
+}
+
+void RefCountTable::share(Block::ID id) {
+  uint16_t value = get(id);
+  if((value & COUNT) == COUNT) {
+    throw TooManyLinks();
+  }
+
+  set(id, value + 1);
+}
+
+bool RefCountTable::release(Block::ID id) {
+  uint16_t value = get(id);
+  if((value & COUNT) == 0) {
+    if(value & INDEXED) set(id, 0);
+    return true;
+  }
+
+  set(id, value - 1);
+  return false;
+}
+
+bool RefCountTable::indexed(Block::ID id) {
+  return (get(id) & INDEXED) != 0;
+}
+
+void RefCountTable::index(Block::ID id) {
+  uint16_t value = get(id);
+  if(!(value & INDEXED)) {
+    set(id, value | INDEXED);
+  }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "../BlockManager.h"
+
+// Counts the extra references to data blocks that are shared between
+// the live filesystem and its snapshots (see Filesystem::snapshot).
+//
+// Each data block gets a 16 bit counter in a table reserved at mkfs.
+// A block with a count of zero has exactly one owner, and can be
+// written in place or freed; anything else has to be copied before it
+// is written.  The top bit marks blocks that the dedup index points to
+// (see DedupIndex); it's cleared when the block is freed.
+class RefCountTable {
+public:
+  RefCountTable(BlockManager& block_manager);
+
+  // Blocks needed to count references to nblocks data blocks.
+  static uint64_t layout(uint64_t nblocks);
+
+  // Starts an empty table; the superblock must already say where it
+  // is.  Only the first block is written, the rest as it's needed.
+  void mkfs();
+
+  bool shared(Block::ID id);
+  void share(Block::ID id);
+
+  // Drops one reference.  Returns true if that was the last one, in
+  // which case the caller frees the block.
+  bool release(Block::ID id);
+
+  bool indexed(Block::ID id);
+  void index(Block::ID id);
+
+  // Copies the table to a bigger one at start, for a disk that has
+  // grown, and uses that from now on.  Returns how many blocks of it
+  // are initialized; the caller updates the superblock.
+  uint64_t relocate(Block::ID start, uint64_t count);
+
+private:
+  BlockManager* block_manager;
+  bool          loaded;
+  Block::ID     start;
+  uint64_t      count;
+  Block::ID     data_start;
+  uint64_t      ready; // Table blocks initialized so far (see Superblock).
+
+  void     load();
+  void     extend(uint64_t index);
+  uint16_t get(Block::ID id);
+  void     set(Block::ID id, uint16_t value);
+};
@@ -1,5 +1,8 @@
 #include "StackBasedBlockManager.h"
 #include "../FSExceptions.h"
+#include "../Stats.h"
+
+#include <algorithm>
 
 #if defined(__linux__)
   #include <sys/statfs.h>
@@ -23,10 +26,19 @@ namespace {
     uint64_t  last_index;  // Index of the last valid entry in the free list
     Block::ID last_block;  // Block ID of the last block in the free list (leftmost)
     Block::ID first_block; // Block ID of the first block in the free list (rightmost)
+    Block::ID lazy_block;  // Free list blocks below this one were never written (0 if none)
   };
+
+  // Freed blocks remembered for the next discard; past this many it's
+  // cheaper to walk the whole free list instead.
+  const size_t MAX_FREED = 1 << 20;
 }
 
-StackBasedBlockManager::StackBasedBlockManager(Storage& storage): disk(&storage) {
+StackBasedBlockManager::StackBasedBlockManager(Storage& storage, bool track):
+  disk(&storage),
+  tracking(track),
+  overflowed(false)
+{
   Block block;
   Superblock* superblock = (Superblock*) &block;
   Config* config = (Config*) superblock->data_config;
@@ -37,6 +49,9 @@ StackBasedBlockManager::StackBasedBlockManager(Storage& storage): disk(&storage)
   this->last_index  = config->last_index;
   this->last_block  = config->last_block;
   this->first_block = config->first_block;
+  this->lazy_block  = config->lazy_block;
+  this->data_start  = superblock->data_block_start;
+  this->data_count  = superblock->data_block_count;
 }
 
 StackBasedBlockManager::~StackBasedBlockManager() {
@@ -57,56 +72,67 @@ void StackBasedBlockManager::mkfs() {
   Block::ID start = superblock->data_block_start;
   uint64_t count  = superblock->data_block_count;
 
-  // The first available free block
-  Block block;
+  // The free list blocks are filled from the end of the data region
+  // down, each holding the next NREFS blocks from the start, until the
+  // two meet.  None of them are written: until a block is changed, read
+  // works out what it holds.
   Block::ID free_block = start + count - 1;
-  DatablockNode *data = (DatablockNode *) &block;
   Block::ID curr = start;
+  while (free_block - curr >= (uint64_t) DatablockNode::NREFS) {
+    curr += DatablockNode::NREFS;
+    free_block--;
+  }
 
-  // Create the freelist
-  while (true) {
-
-    for (int i = DatablockNode::NREFS - 1; i >= 0; --i) {
-
-      // If collision, curr is the current free list block
-      // We don't want to allocate free list blocks, so exit.
-      if (curr == free_block) {
-        if (i != DatablockNode::NREFS - 1) {
-          // Write last free list block
-          this->disk->set(free_block, block);
-          config->last_index = i + 1;
-          config->last_block = free_block;
-        } else {
-          // If we just started looking at this free block,
-          // the real last free block was before this one.
-          config->last_index = 0;
-          config->last_block = free_block + 1;
-        }
-
-        // Update superblock
-        config->top_block = start + count - 1;
-        config->top_index = DatablockNode::NREFS - 1;
-        config->first_block = start + count - 1;
-        superblock->data_block_count = free_block - start - 1; // we don't allow allocation of last free block
-        this->disk->set(0, superblock_blk);
-
-        // Update class members with true values
-        this->top_block   = config->top_block;
-        this->top_index   = config->top_index;
-        this->last_index  = config->last_index;
-        this->last_block  = config->last_block;
-        this->first_block = config->first_block;
-        return;
-      }
+  // If collision, curr is the current free list block
+  // We don't want to allocate free list blocks, so stop there.
+  int i = DatablockNode::NREFS - 1 - (free_block - curr);
+  if (i != DatablockNode::NREFS - 1) {
+    config->last_index = i + 1;
+    config->last_block = free_block;
+  } else {
+    // If we just started looking at this free block,
+    // the real last free block was before this one.
+    config->last_index = 0;
+    config->last_block = free_block + 1;
+  }
 
-      // Put curr into the free list
-      data->free_blocks[i] = curr;
-      curr++;
-    }
+  // Update superblock
+  config->top_block = start + count - 1;
+  config->top_index = DatablockNode::NREFS - 1;
+  config->first_block = start + count - 1;
+  config->lazy_block = config->first_block + 1;
+  superblock->data_block_count = free_block - start - 1; // we don't allow allocation of last free block
+  this->disk->set(0, superblock_blk);
 
-    // Write the free block to disk
-    this->disk->set(free_block, block);
-    free_block--;
+  // Update class members with true values
+  this->top_block   = config->top_block;
+  this->top_index   = config->top_index;
+  this->last_index  = config->last_index;
+  this->last_block  = config->last_block;
+  this->first_block = config->first_block;
+  this->lazy_block  = config->lazy_block;
+  this->data_start  = start;
+  this->data_count  = superblock->data_block_count;
+}
+
+// Reads a free list block, filling in the ones mkfs didn't write.
+void StackBasedBlockManager::read(Block::ID id, Block& block) {
+  if (id >= this->lazy_block) {
+    this->disk->get(id, block);
+    return;
+  }
+
+  DatablockNode *node = (DatablockNode *) &block;
+  Block::ID base = this->data_start + (this->first_block - id) * DatablockNode::NREFS;
+  for (int i = 0; i < DatablockNode::NREFS; ++i) {
+    node->free_blocks[i] = base + (DatablockNode::NREFS - 1 - i);
+  }
+}
+
+void StackBasedBlockManager::write(Block::ID id, const Block& block) {
+  this->disk->set(id, block);
+  if (id < this->lazy_block) {
+    this->lazy_block = id;
   }
 }
 
@@ -118,10 +144,12 @@ void StackBasedBlockManager::update_superblock() {
   this->disk->get(0, block);
   config->top_block = this->top_block;
   config->top_index = this->top_index;
+  config->lazy_block = this->lazy_block;
   this->disk->set(0, block);
 }
 
 void StackBasedBlockManager::release(Block::ID free_block_num) {
+  Stats::Timer timer(Stats::BLOCK_RELEASE);
 
   // If insertion causes index to overflow the block,
   // move to previous block in free list.
@@ -139,13 +167,62 @@ void StackBasedBlockManager::release(Block::ID free_block_num) {
   // Update the free list
   Block block;
   DatablockNode *node = (DatablockNode *) &block;
-  this->disk->get(this->top_block, block);
+  this->read(this->top_block, block);
   node->free_blocks[this->top_index] = free_block_num;
-  this->disk->set(this->top_block, block);
+  this->write(this->top_block, block);
   this->update_superblock();
+
+  if (this->tracking && !this->overflowed) {
+    this->freed.insert(free_block_num);
+    if (this->freed.size() > MAX_FREED) {
+      this->overflowed = true;
+      this->freed.clear();
+    }
+  }
+}
+
+void StackBasedBlockManager::release(const std::vector<Block::ID>& free_block_nums) {
+  Stats::Timer timer(Stats::BLOCK_RELEASE);
+  // Same as releasing one at a time, but each free list block and the
+  // superblock are only written once.
+  Block block;
+  DatablockNode *node = (DatablockNode *) &block;
+  size_t i = 0;
+  while (i < free_block_nums.size()) {
+    if (this->top_index == DatablockNode::NREFS - 1) {
+      if (this->top_block == this->first_block) {
+        this->update_superblock();
+        throw std::out_of_range("Can't insert block at top of data block free list!");
+      }
+
+      this->top_block = this->top_block + 1;
+      this->top_index = 0;
+    } else {
+      this->top_index++;
+    }
+
+    this->read(this->top_block, block);
+    node->free_blocks[this->top_index] = free_block_nums[i++];
+    while (i < free_block_nums.size() && this->top_index < DatablockNode::NREFS - 1) {
+      node->free_blocks[++this->top_index] = free_block_nums[i++];
+    }
+
+    this->write(this->top_block, block);
+  }
+
+  this->update_superblock();
+
+  if (this->tracking && !this->overflowed) {
+    this->freed.insert(free_block_nums.begin(), free_block_nums.end());
+    if (this->freed.size() > MAX_FREED) {
+      this->overflowed = true;
+      this->freed.clear();
+    }
+  }
 }
 
 Block::ID StackBasedBlockManager::reserve() {
+  Stats::Timer timer(Stats::BLOCK_RESERVE);
 
   // Check if free list is almost empty and refuse allocation of last block
   if (this->top_block == this->last_block && this->top_index == this->last_index) {
@@ -155,7 +232,7 @@ Block::ID StackBasedBlockManager::reserve() {
   // Get next free block
   Block block;
   DatablockNode *node = (DatablockNode *) &block;
-  this->disk->get(this->top_block, block);
+  this->read(this->top_block, block);
   Block::ID free_block_num = node->free_blocks[this->top_index];
   if (this->top_index == 0) {
     this->top_index = DatablockNode::NREFS - 1;
@@ -165,21 +242,183 @@ Block::ID StackBasedBlockManager::reserve() {
   }
 
   this->update_superblock();
+  this->forget(free_block_num);
   return free_block_num;
 }
 
+// A block that's been handed out again mustn't be discarded.
+void StackBasedBlockManager::forget(Block::ID id) {
+  if (!this->freed.empty()) {
+    this->freed.erase(id);
+  }
+
+  std::lock_guard<std::mutex> lock(this->discarding);
+  this->collected.erase(id);
+}
+
+uint64_t StackBasedBlockManager::listBlocks(uint64_t count) {
+  // One more entry for the bottom of the stack, which is never used.
+  return (count + DatablockNode::NREFS) / DatablockNode::NREFS;
+}
+
+void StackBasedBlockManager::grow(Block::ID data_end, Block::ID list_start) {
+  Block superblock_blk;
+  Superblock *superblock = (Superblock *) &superblock_blk;
+  this->disk->get(0, superblock_blk);
+  Block::ID start   = superblock->data_block_start;
+  Block::ID old_end = start + superblock->data_block_count;
+  if (data_end < old_end || list_start < data_end) {
+    throw std::out_of_range("Free list can't move there!");
+  }
+
+  // The new list starts with an unused bottom entry, then the new
+  // blocks (so the lowest is handed out last of all), then everything
+  // that was free before in the same order.  The old list blocks are
+  // free now too: they're in the new part of the data region.
+  Block out;
+  DatablockNode *out_node = (DatablockNode *) &out;
+  Block::ID out_block = list_start;
+  uint64_t  out_index = 0;
+  std::memset(out.data, 0, Block::SIZE);
+
+  // Nothing points at the new list yet, so it can be committed in as
+  // many pieces as it takes.
+  for (Block::ID id = data_end; id-- > old_end;) {
+    if (++out_index == (uint64_t) DatablockNode::NREFS) {
+      this->disk->set(out_block++, out);
+      this->disk->settle();
+      out_index = 0;
+    }
+
+    out_node->free_blocks[out_index] = id;
+  }
+
+  Block in;
+  DatablockNode *in_node = (DatablockNode *) &in;
+  Block::ID in_block = this->last_block;
+  uint64_t  in_index = this->last_index;
+  this->read(in_block, in);
+  while (in_block != this->top_block || in_index != this->top_index) {
+    if (++in_index == (uint64_t) DatablockNode::NREFS) {
+      this->read(++in_block, in);
+      in_index = 0;
+    }
+
+    if (++out_index == (uint64_t) DatablockNode::NREFS) {
+      this->disk->set(out_block++, out);
+      this->disk->settle();
+      out_index = 0;
+    }
+
+    out_node->free_blocks[out_index] = in_node->free_blocks[in_index];
+  }
+
+  this->disk->set(out_block, out);
+  this->disk->sync();
+
+  this->top_block   = out_block;
+  this->top_index   = out_index;
+  this->last_block  = list_start;
+  this->last_index  = 0;
+  this->first_block = list_start + this->listBlocks(data_end - start) - 1;
+  this->lazy_block  = 0;
+  this->data_count  = data_end - start;
+
+  // Only now does the superblock point at the new list.
+  Config* config = (Config*) superblock->data_config;
+  this->disk->get(0, superblock_blk);
+  config->top_block   = this->top_block;
+  config->top_index   = this->top_index;
+  config->last_index  = this->last_index;
+  config->last_block  = this->last_block;
+  config->first_block = this->first_block;
+  config->lazy_block  = this->lazy_block;
+  superblock->data_block_count = this->data_count;
+  this->disk->set(0, superblock_blk);
+}
+
+std::vector<Block::ID> StackBasedBlockManager::collect(bool all) {
+  std::vector<Block::ID> ids;
+  if (all || this->overflowed) {
+    // Everything on the free list, above the unused bottom entry.
+    Block block;
+    DatablockNode *node = (DatablockNode *) &block;
+    Block::ID index_block = this->last_block;
+    uint64_t  index = this->last_index;
+    this->read(index_block, block);
+    while (index_block != this->top_block || index != this->top_index) {
+      if (++index == (uint64_t) DatablockNode::NREFS) {
+        this->read(++index_block, block);
+        index = 0;
+      }
+
+      ids.push_back(node->free_blocks[index]);
+    }
+  } else {
+    ids.assign(this->freed.begin(), this->freed.end());
+  }
+
+  this->freed.clear();
+  this->overflowed = false;
+
+  std::lock_guard<std::mutex> lock(this->discarding);
+  this->collected.insert(ids.begin(), ids.end());
+  return ids;
+}
+
+uint64_t StackBasedBlockManager::discard(const std::vector<Block::ID>& blocks) {
+  std::vector<Block::ID> ids(blocks);
+  std::sort(ids.begin(), ids.end());
+
+  // Coalesce into runs of neighbouring blocks that are still free.  The
+  // lock is held over each discard, so a block can't be handed out and
+  // written in between the check and the discard.
+  uint64_t count = 0;
+  size_t i = 0;
+  while (i < ids.size()) {
+    std::lock_guard<std::mutex> lock(this->discarding);
+    if (this->collected.erase(ids[i]) == 0) {
+      ++i;
+      continue;
+    }
+
+    size_t j = i + 1;
+    while (j < ids.size() && ids[j] == ids[j - 1] + 1 && this->collected.erase(ids[j]) != 0) {
+      ++j;
+    }
+
+    this->disk->discard(ids[i], j - i);
+    count += j - i;
+    i = j;
+  }
+
+  return count;
+}
+
+uint64_t StackBasedBlockManager::discardable() {
+  if (this->overflowed) {
+    uint64_t nrefs = DatablockNode::NREFS;
+    return (top_block - last_block) * nrefs + top_index - last_index;
+  }
+
+  return this->freed.size();
+}
+
 void StackBasedBlockManager::statfs(struct statvfs* info) {
   uint64_t nrefs = DatablockNode::NREFS;
-  uint64_t total = (last_block - first_block) * nrefs + last_index;
-  uint64_t used  = (top_block  - first_block) * nrefs + top_index;
+  uint64_t free  = (top_block - last_block) * nrefs + top_index - last_index;
 
   // Based on http://pubs.opengroup.org/onlinepubs/009604599/basedefs/sys/statvfs.h.html
   // Also see http://man7.org/linux/man-pages/man3/statvfs.3.html
-  info->f_blocks  = total;        // Total number of blocks on file system in units of f_frsize.
-  info->f_bfree   = total - used; // Total number of free blocks.
-  info->f_bavail  = total - used; // Number of free blocks available to non-privileged process.
+  info->f_blocks  = data_count; // Total number of blocks on file system in units of f_frsize.
+  info->f_bfree   = free;       // Total number of free blocks.
+  info->f_bavail  = free;       // Number of free blocks available to non-privileged process.
 }
 
 void StackBasedBlockManager::set(Block::ID id, const Block& src) {
   disk->set(id, src);
 }
+
+void StackBasedBlockManager::settle() {
+  disk->settle();
+}
@@ -3,13 +3,17 @@
 #include <stdexcept>
 #include <cstdint>
 #include <cstring>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
 #include "../BlockManager.h"
 #include "../Storage.h"
 #include "../Superblock.h"
 
 class StackBasedBlockManager: public BlockManager {
 public:
-  StackBasedBlockManager(Storage& disk);
+  // With track set, freed blocks are remembered for collect(false).
+  StackBasedBlockManager(Storage& disk, bool track = false);
   ~StackBasedBlockManager();
 
   virtual void mkfs();
@@ -17,10 +21,19 @@ public:
 
   virtual void get(Block::ID id, Block& dst);
   virtual void set(Block::ID id, const Block& src);
+  virtual void settle();
 
   virtual void release(Block::ID block_num);
+  virtual void release(const std::vector<Block::ID>& block_nums);
   virtual Block::ID reserve();
 
+  virtual uint64_t listBlocks(uint64_t count);
+  virtual void grow(Block::ID data_end, Block::ID list_start);
+
+  virtual std::vector<Block::ID> collect(bool all);
+  virtual uint64_t discard(const std::vector<Block::ID>& ids);
+  virtual uint64_t discardable();
+
   void update_superblock();
 
 private:
@@ -29,5 +42,18 @@ private:
   uint64_t  last_index;
   Block::ID first_block;
   Block::ID last_block;
+  Block::ID lazy_block;
+  Block::ID data_start;
+  uint64_t  data_count;
   Storage*  disk;
+
+  bool      tracking;
+  bool      overflowed; // Freed more than we remember; discard them all.
+  std::unordered_set<Block::ID> freed; // Since the last collect; none are reserved.
+  std::unordered_set<Block::ID> collected; // Waiting to be discarded; none are reserved.
+  std::mutex                    discarding; // Keeps reserve() out of a discard in progress.
+
+  void read(Block::ID id, Block& block);
+  void forget(Block::ID id);
+  void write(Block::ID id, const Block& block);
 };
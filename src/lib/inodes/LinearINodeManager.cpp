@@ -1,5 +1,7 @@
 #include "LinearINodeManager.h"
 #include "../FSExceptions.h"
+#include "../Stats.h"
+#include "../Trace.h"
 
 #if defined(__linux__)
   #include <sys/statfs.h>
@@ -20,24 +22,44 @@ LinearINodeManager::~LinearINodeManager() {
 void LinearINodeManager::mkfs() {
   this->reload();
 
+  // Only the first table block is written; the rest are zeroed as
+  // they're first needed (see extend).
   Block block;
   std::memset(block.data, 0, Block::SIZE);
-  for(uint64_t i = 1; i < block_count; ++i) {
-    this->disk->set(start_block + i, block);
-  }
 
   // Reserve INodes for null and root:
   INode* inodes = (INode*) block.data;
   inodes[0].type = FileType::RESERVED;
   inodes[1].type = FileType::RESERVED;
   this->disk->set(start_block, block);
+
+  Superblock* superblock = (Superblock*) block.data;
+  this->disk->get(0, block);
+  superblock->inode_block_ready = 1;
+  this->disk->set(0, block);
+  this->ready = 1;
+}
+
+// Zeroes the uninitialized table blocks up to and including this one.
+void LinearINodeManager::extend(uint64_t block_index) {
+  Block block;
+  std::memset(block.data, 0, Block::SIZE);
+  for(uint64_t i = this->ready; i <= block_index; ++i) {
+    this->disk->set(start_block + i, block);
+  }
+
+  this->ready = block_index + 1;
+  Superblock* superblock = (Superblock*) block.data;
+  this->disk->get(0, block);
+  superblock->inode_block_ready = this->ready;
+  this->disk->set(0, block);
 }
 
 // Get an inode from the freelist and return it
 INode::ID LinearINodeManager::reserve() {
   Block block;
   uint64_t num_inodes_per_block = Block::SIZE / INode::SIZE;
-  for(uint64_t i = 0; i < block_count; i++) {
+  for(uint64_t i = 0; i < this->ready; i++) {
     this->disk->get(start_block + i, block);
     INode* inodes = (INode*) block.data;
 
@@ -48,6 +70,11 @@ INode::ID LinearINodeManager::reserve() {
     }
   }
 
+  // Everything past the initialized blocks is free.
+  if(this->ready < block_count) {
+    return this->ready * num_inodes_per_block;
+  }
+
   throw OutOfINodes();
 }
 
@@ -60,6 +87,10 @@ void LinearINodeManager::release(INode::ID inode_num) {
   uint64_t num_inodes_per_block = (Block::SIZE / INode::SIZE);
   uint64_t block_index = inode_num / num_inodes_per_block;
   uint64_t inode_index = inode_num % num_inodes_per_block;
+  if(block_index >= this->ready) {
+    // Never used, so already free.
+    return;
+  }
 
   // Load the inode and modify attribute
   Block block;
@@ -81,10 +112,16 @@ void LinearINodeManager::reload() {
   start_block = superblock->inode_block_start;
   block_count = superblock->inode_block_count;
   num_inodes  = num_inodes_per_block * block_count;
+  ready       = superblock->inode_block_ready;
+  if(ready == 0 || ready > block_count) {
+    ready = block_count;
+  }
 }
 
 // Reads an inode from disk into the memory provided by the user
 void LinearINodeManager::get(INode::ID inode_num, INode& user_inode) {
+  Stats::Timer timer(Stats::INODE_GET);
+  TRACE_SPAN("inodes.get");
   if (inode_num >= this->num_inodes || inode_num < this->root) {
     throw std::out_of_range("INode index is out of range!");
   }
@@ -92,6 +129,11 @@ void LinearINodeManager::get(INode::ID inode_num, INode& user_inode) {
   uint64_t num_inodes_per_block = (Block::SIZE / INode::SIZE);
   uint64_t block_index = inode_num / num_inodes_per_block;
   uint64_t inode_index = inode_num % num_inodes_per_block;
+  if(block_index >= this->ready) {
+    // Uninitialized blocks hold nothing but free INodes.
+    user_inode = INode();
+    return;
+  }
 
   Block block;
   this->disk->get(start_block + block_index, block);
@@ -101,6 +143,8 @@ void LinearINodeManager::get(INode::ID inode_num, INode& user_inode) {
 }
 
 void LinearINodeManager::set(INode::ID inode_num, const INode& user_inode) {
+  Stats::Timer timer(Stats::INODE_SET);
+  TRACE_SPAN("inodes.set");
   if (inode_num >= this->num_inodes || inode_num < this->root) {
     throw std::out_of_range("INode index is out of range!");
   }
@@ -108,6 +152,9 @@ void LinearINodeManager::set(INode::ID inode_num, const INode& user_inode) {
   uint64_t num_inodes_per_block = (Block::SIZE / INode::SIZE);
   uint64_t block_index = inode_num / num_inodes_per_block;
   uint64_t inode_index = inode_num % num_inodes_per_block;
+  if(block_index >= this->ready) {
+    this->extend(block_index);
+  }
 
   Block block;
   this->disk->get(start_block + block_index, block);
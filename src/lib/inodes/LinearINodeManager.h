@@ -29,6 +29,8 @@ private:
   Block::ID start_block;
   uint64_t  block_count;
   uint64_t  num_inodes;
+  uint64_t  ready; // Table blocks initialized so far (see Superblock).
 
   void reload();
+  void extend(uint64_t block_index);
 };
@@ -0,0 +1,105 @@
+#include "SnapshotINodeManager.h"
+#include "../FSExceptions.h"
+#include "../Stats.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__linux__)
+  #include <sys/statfs.h>
+  #include <sys/statvfs.h>
+  #include <sys/vfs.h>
+#else
+  #include <fuse.h>
+#endif
+
+const uint64_t SnapshotIndex::COUNT;
+
+SnapshotINodeManager::SnapshotINodeManager(Storage& storage, const std::string& name): disk(&storage) {
+  Block block;
+  Superblock* superblock = (Superblock*) block.data;
+  this->disk->get(0, block);
+
+  int slot = find(*superblock, name);
+  if(slot < 0) {
+    throw NoSuchEntry(name);
+  }
+
+  uint64_t count = superblock->inode_block_count;
+  for(Block::ID id = superblock->snapshots[slot].index; id != 0;) {
+    SnapshotIndex* index = (SnapshotIndex*) block.data;
+    this->disk->get(id, block);
+    for(uint64_t i = 0; i < SnapshotIndex::COUNT && tables.size() < count; ++i) {
+      tables.push_back(index->tables[i]);
+    }
+
+    id = index->next;
+  }
+
+  if(tables.size() != count) {
+    throw IOError("Corrupt snapshot index.");
+  }
+
+  num_inodes = count * (Block::SIZE / INode::SIZE);
+}
+
+SnapshotINodeManager::~SnapshotINodeManager() {
+  // Nothing to do.
+}
+
+int SnapshotINodeManager::find(const Superblock& superblock, const std::string& name) {
+  for(uint64_t i = 0; i < Superblock::MAX_SNAPSHOTS; ++i) {
+    const char* slot = superblock.snapshots[i].name;
+    if(slot[0] != '\0' && superblock.snapshots[i].state == 0 && name == std::string(slot, strnlen(slot, sizeof(superblock.snapshots[i].name)))) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+void SnapshotINodeManager::mkfs() {
+  throw ReadOnly();
+}
+
+INode::ID SnapshotINodeManager::reserve() {
+  throw ReadOnly();
+}
+
+void SnapshotINodeManager::release(INode::ID) {
+  throw ReadOnly();
+}
+
+void SnapshotINodeManager::set(INode::ID, const INode&) {
+  throw ReadOnly();
+}
+
+void SnapshotINodeManager::get(INode::ID inode_num, INode& user_inode) {
+  Stats::Timer timer(Stats::INODE_GET);
+  if (inode_num >= this->num_inodes || inode_num < this->root) {
+    throw std::out_of_range("INode index is out of range!");
+  }
+
+  uint64_t num_inodes_per_block = (Block::SIZE / INode::SIZE);
+  uint64_t block_index = inode_num / num_inodes_per_block;
+  uint64_t inode_index = inode_num % num_inodes_per_block;
+
+  if(tables[block_index] == 0) {
+    user_inode = INode();
+    return;
+  }
+
+  Block block;
+  this->disk->get(tables[block_index], block);
+  memcpy(&user_inode, &(block.data[inode_index * INode::SIZE]), INode::SIZE);
+}
+
+INode::ID SnapshotINodeManager::getRoot() {
+  return this->root;
+}
+
+void SnapshotINodeManager::statfs(struct statvfs* info) {
+  info->f_files  = num_inodes;
+  info->f_ffree  = 0;
+  info->f_favail = 0;
+}
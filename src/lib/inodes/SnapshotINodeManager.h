@@ -0,0 +1,47 @@
+#pragma once
+
+#include "../Superblock.h"
+#include "../INodeManager.h"
+#include "../Storage.h"
+#include "../Block.h"
+
+#include <string>
+#include <vector>
+
+// One block of a snapshot's list of INode table copies.
+struct SnapshotIndex {
+  static const uint64_t COUNT = Block::SIZE / sizeof(Block::ID) - 1;
+
+  Block::ID next;          // Next index block (0 if this is the last).
+  Block::ID tables[COUNT]; // Copies of the INode table blocks, in order
+                           // (0 for blocks with no INodes in use).
+};
+
+// Read-only view of the INode table as it was when a snapshot was
+// taken (see Filesystem::snapshot).  Anything that would change it
+// throws ReadOnly.
+class SnapshotINodeManager: public INodeManager {
+public:
+  SnapshotINodeManager(Storage& storage, const std::string& name);
+  ~SnapshotINodeManager();
+
+  // Returns the superblock slot of the named snapshot, or -1.  Snapshots
+  // that a crash cut off part way are skipped.
+  static int find(const Superblock& superblock, const std::string& name);
+
+  void mkfs();
+  void statfs(struct statvfs* info);
+  INode::ID getRoot();
+
+  INode::ID reserve();
+  void release(INode::ID id);
+  void get(INode::ID id, INode& dst);
+  void set(INode::ID id, const INode& src);
+
+private:
+  static const uint64_t root = 1;
+
+  Storage*  disk;
+  std::vector<Block::ID> tables;
+  uint64_t  num_inodes;
+};
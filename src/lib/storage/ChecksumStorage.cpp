@@ -0,0 +1,362 @@
+#include "ChecksumStorage.h"
+#include "../CRC32C.h"
+#include "../FSExceptions.h"
+#include "../Superblock.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+// Anonymous namespace for file-local helpers:
+namespace {
+  typedef std::chrono::steady_clock Clock;
+
+  const uint64_t ENTRIES = Block::SIZE / sizeof(uint32_t); // Checksums per block.
+  const uint64_t BATCH   = 256; // Table blocks initialized at once.
+
+  // Set in the superblock's entry while part of the table is
+  // uninitialized; the rest of it counts the blocks that are.
+  const uint32_t LAZY = 0x80000000;
+
+  // The superblock's entry, at the start of the first table block.
+  uint32_t& mark(Block& block) {
+    return ((uint32_t*) block.data)[0];
+  }
+
+  // Zero is taken to mean "never written".
+  uint32_t checksum(const Block& block) {
+    uint32_t sum = crc32c(block.data, Block::SIZE);
+    return (sum != 0) ? sum : 1;
+  }
+
+  uint64_t since(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+  }
+}
+
+ChecksumStorage::ChecksumStorage(Storage& storage, Verify policy):
+  backing(&storage),
+  policy(policy),
+  enabled(false),
+  start(0),
+  count(0),
+  nblocks(0),
+  ready(0),
+  journal_start(0),
+  journal_count(0)
+{
+  std::memset(&counters, 0, sizeof(counters));
+}
+
+ChecksumStorage::~ChecksumStorage() {
+  try {
+    if(enabled) sync();
+  }
+  catch(std::exception& ex) {
+    std::cerr << "Checksum flush failed: " << ex.what() << '\n';
+  }
+}
+
+bool ChecksumStorage::parse(const std::string& name, Verify& policy) {
+  if(name == "off")       policy = Verify::OFF;
+  else if(name == "warn") policy = Verify::WARN;
+  else if(name == "on")   policy = Verify::ON;
+  else return false;
+  return true;
+}
+
+uint64_t ChecksumStorage::layout(uint64_t nblocks) {
+  return (nblocks + ENTRIES - 1) / ENTRIES;
+}
+
+void ChecksumStorage::format(Block::ID start, uint64_t count, uint64_t nblocks, Block::ID journal_start, uint64_t journal_count) {
+  std::lock_guard<std::mutex> lock(mutex);
+  this->start         = start;
+  this->count         = count;
+  this->journal_start = journal_start;
+  this->journal_count = journal_count;
+  this->nblocks       = nblocks;
+
+  tables.clear();
+  lru.clear();
+  enabled = true;
+
+  // Only the first table block is written now (see sync); it starts out
+  // zeroed like the rest.
+  ready = 0;
+  Table& first = table(0);
+  ready = 1;
+  mark(first.block) = (ready < count) ? (LAZY | ready) : 0;
+  writeTable(0);
+}
+
+void ChecksumStorage::load() {
+  std::lock_guard<std::mutex> lock(mutex);
+  Block block;
+  Superblock* superblock = (Superblock*) block.data;
+  backing->get(0, block);
+  if(superblock->checksum_block_count == 0) {
+    return;
+  }
+
+  start         = superblock->checksum_block_start;
+  count         = superblock->checksum_block_count;
+  journal_start = superblock->journal_block_start;
+  journal_count = superblock->journal_block_count;
+  if(layout(superblock->block_count) > count) {
+    throw IOError("Checksum table too small.");
+  }
+
+  // The first table block says how many are initialized; the others
+  // only hold zeroes as far as we're concerned.  The rest of the table
+  // is read as it's needed.
+  nblocks = superblock->block_count;
+  backing->get(start, block);
+  uint32_t first = mark(block);
+  ready = (first & LAZY) ? std::min<uint64_t>(first & ~LAZY, count) : count;
+
+  tables.clear();
+  lru.clear();
+  enabled = true;
+}
+
+void ChecksumStorage::grow(Block::ID start, uint64_t count, uint64_t nblocks) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if(!enabled) {
+    return;
+  }
+
+  // Copy the part that was initialized; syncs carry on from there.
+  // Until the members change, table() still reads the old place.
+  for(uint64_t index = 1; index < ready; ++index) {
+    Table& copy = table(index);
+    backing->set(start + index, copy.block);
+    copy.dirty = false;
+  }
+
+  Table& first = table(0);
+  this->start   = start;
+  this->count   = count;
+  this->nblocks = nblocks;
+  mark(first.block) = (ready < count) ? (LAZY | ready) : 0;
+
+  backing->sync();
+  writeTable(0);
+  backing->sync();
+}
+
+void ChecksumStorage::get(Block::ID id, Block& dst) {
+  getRange(id, &dst, 1);
+}
+
+void ChecksumStorage::set(Block::ID id, const Block& src) {
+  setRange(id, &src, 1);
+}
+
+void ChecksumStorage::getRange(Block::ID id, Block* dst, uint64_t count) {
+  backing->getRange(id, dst, count);
+  if(enabled && policy != Verify::OFF) {
+    verify(id, dst, count);
+  }
+}
+
+void ChecksumStorage::setRange(Block::ID id, const Block* src, uint64_t count) {
+  if(enabled) {
+    stamp(id, src, count);
+  }
+
+  backing->setRange(id, src, count);
+}
+
+void ChecksumStorage::sync() {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<uint64_t> dirty;
+  for(const auto& itr: tables) {
+    if(itr.second.dirty) dirty.push_back(itr.first);
+  }
+
+  uint64_t end = ready;
+  if(ready < count && !dirty.empty()) {
+    // Initialize the next part of a lazily formatted table.  Blocks
+    // written past it are written anyway, but a later load ignores
+    // them until this catches up; that only loses their checksums.
+    end = std::min(count, ready + BATCH);
+    Block zero;
+    std::memset(zero.data, 0, Block::SIZE);
+    for(uint64_t index = ready; index < end; ++index) {
+      if(tables.count(index) == 0) backing->set(start + index, zero);
+      else if(!tables[index].dirty) dirty.push_back(index);
+    }
+  }
+
+  std::sort(dirty.begin(), dirty.end());
+  for(uint64_t index: dirty) {
+    if(index != 0 || end == ready) writeTable(index);
+  }
+
+  if(end != ready) {
+    // Only move the mark once the blocks behind it are on disk.
+    backing->sync();
+    ready = end;
+    mark(table(0).block) = (ready < count) ? (LAZY | ready) : 0;
+    writeTable(0);
+  }
+
+  backing->sync();
+}
+
+void ChecksumStorage::discard(Block::ID id, uint64_t count) {
+  if(enabled) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for(uint64_t i = 0; i < count && id + i < nblocks; ++i) {
+      if(!covered(id + i) || sum(id + i) == 0) continue;
+      setSum(id + i, 0);
+    }
+  }
+
+  backing->discard(id, count);
+}
+
+void ChecksumStorage::restamp(const std::vector<Block::ID>& ids) {
+  if(!enabled) {
+    return;
+  }
+
+  Block block;
+  for(Block::ID id: ids) {
+    if(!covered(id)) continue;
+
+    backing->get(id, block);
+    stamp(id, &block, 1);
+  }
+}
+
+// Called with the lock held.  The table block holding the given index,
+// read in if it isn't in memory.  Blocks past the initialized part read
+// as zeroes, even ones evicted since they were changed: that only loses
+// checksums, the way a crash before the next sync would.
+ChecksumStorage::Table& ChecksumStorage::table(uint64_t index) {
+  auto itr = tables.find(index);
+  if(itr != tables.end()) {
+    lru.splice(lru.begin(), lru, itr->second.position);
+    return itr->second;
+  }
+
+  Table loaded;
+  loaded.dirty = false;
+  if(index < ready) {
+    backing->get(start + index, loaded.block);
+  }
+  else {
+    std::memset(loaded.block.data, 0, Block::SIZE);
+  }
+
+  lru.push_front(index);
+  loaded.position = lru.begin();
+  Table& entry = tables[index] = loaded;
+  evict();
+  return entry;
+}
+
+// Called with the lock held.
+uint32_t ChecksumStorage::sum(Block::ID id) {
+  return ((uint32_t*) table(id / ENTRIES).block.data)[id % ENTRIES];
+}
+
+// Called with the lock held.
+void ChecksumStorage::setSum(Block::ID id, uint32_t value) {
+  Table& entry = table(id / ENTRIES);
+  ((uint32_t*) entry.block.data)[id % ENTRIES] = value;
+  entry.dirty = true;
+}
+
+// Called with the lock held.  Writes out changed table blocks as they
+// go; the checksums in them are no less current than what's on disk.
+void ChecksumStorage::evict() {
+  while(tables.size() > CACHED) {
+    uint64_t index = lru.back();
+    if(tables[index].dirty) writeTable(index);
+
+    lru.pop_back();
+    tables.erase(index);
+  }
+}
+
+// Called with the lock held, for a table block that's in memory.
+void ChecksumStorage::writeTable(uint64_t index) {
+  Table& entry = tables[index];
+  backing->set(start + index, entry.block);
+  entry.dirty = false;
+}
+
+ChecksumStorage::Stats ChecksumStorage::stats() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return counters;
+}
+
+bool ChecksumStorage::covered(Block::ID id) const {
+  if(id == 0 || id >= nblocks) return false;
+  if(id >= start && id < start + count) return false;
+  if(id >= journal_start && id < journal_start + journal_count) return false;
+  return true;
+}
+
+void ChecksumStorage::verify(Block::ID id, const Block* blocks, uint64_t count) {
+  // Checksum outside the lock; readers can go in parallel.
+  Clock::time_point begin = Clock::now();
+  std::vector<uint32_t> found(count);
+  for(uint64_t i = 0; i < count; ++i) {
+    found[i] = checksum(blocks[i]);
+  }
+
+  std::vector<Block::ID> bad;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    counters.nanoseconds += since(begin);
+    for(uint64_t i = 0; i < count; ++i) {
+      if(!covered(id + i)) continue;
+
+      uint32_t expected = sum(id + i);
+      if(expected == 0) continue;
+
+      counters.verified += 1;
+      if(found[i] != expected) {
+        counters.mismatches += 1;
+        bad.push_back(id + i);
+      }
+    }
+  }
+
+  if(bad.empty()) {
+    return;
+  }
+
+  std::string message = "Checksum mismatch in block " + std::to_string(bad[0]);
+  if(bad.size() > 1) {
+    message += " (and " + std::to_string(bad.size() - 1) + " more)";
+  }
+
+  if(policy == Verify::ON) {
+    throw IOError(message);
+  }
+
+  std::cerr << message << '\n';
+}
+
+void ChecksumStorage::stamp(Block::ID id, const Block* blocks, uint64_t count) {
+  Clock::time_point begin = Clock::now();
+  std::vector<uint32_t> found(count);
+  for(uint64_t i = 0; i < count; ++i) {
+    found[i] = checksum(blocks[i]);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  counters.nanoseconds += since(begin);
+  for(uint64_t i = 0; i < count; ++i) {
+    if(!covered(id + i)) continue;
+
+    setSum(id + i, found[i]);
+    counters.written += 1;
+  }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "../Storage.h"
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Per-block CRC32C checksums.
+//
+// mkfs reserves a region holding one 32 bit checksum for every block on
+// the disk.  Blocks are checksummed as they are written and checked as
+// they are read.  The table is read a block at a time as it's needed,
+// and up to CACHED blocks of it are kept in memory; the changed ones
+// are written out ahead of every sync, or when they're evicted.  A
+// checksum of zero means the block hasn't been written since mkfs.
+//
+// The superblock, the journal (which checksums its own transactions)
+// and the table itself aren't covered.  The superblock's entry says how
+// much of the table mkfs has left unwritten: the rest is zeroed a batch
+// at a time by the syncs that follow writes.
+class ChecksumStorage: public Storage {
+public:
+  // What to do about a block that doesn't match its checksum.
+  enum class Verify {
+    OFF,  // Don't check reads at all.
+    WARN, // Log it and carry on.
+    ON    // Fail the read with an IOError.
+  };
+
+  struct Stats {
+    uint64_t written;     // Blocks checksummed on write.
+    uint64_t verified;    // Blocks checked on read.
+    uint64_t mismatches;  // Blocks that failed the check.
+    uint64_t nanoseconds; // Spent computing checksums.
+  };
+
+  ChecksumStorage(Storage& backing, Verify policy = Verify::WARN);
+  ~ChecksumStorage();
+
+  static bool parse(const std::string& name, Verify& policy);
+
+  // Blocks needed to hold checksums for nblocks blocks.
+  static uint64_t layout(uint64_t nblocks);
+
+  // Starts an empty table for a newly created filesystem.
+  void format(Block::ID start, uint64_t count, uint64_t nblocks, Block::ID journal_start, uint64_t journal_count);
+
+  // Reads the table if the superblock says there is one.
+  void load();
+
+  // Moves the table to a new place, big enough for a disk that has
+  // grown to nblocks blocks.  The caller points the superblock at it.
+  void grow(Block::ID start, uint64_t count, uint64_t nblocks);
+
+  void get(Block::ID id, Block& dst);
+  void set(Block::ID id, const Block& src);
+  void getRange(Block::ID id, Block* dst, uint64_t count);
+  void setRange(Block::ID id, const Block* src, uint64_t count);
+  void sync();
+
+  // Discarded blocks read back as anything, so they lose their checksums.
+  void discard(Block::ID id, uint64_t count);
+
+  // Checksums these blocks again as they are on disk, without checking
+  // them first: a crash may have left their entries out of date.
+  void restamp(const std::vector<Block::ID>& ids);
+
+  Stats stats();
+
+private:
+  // Table blocks kept in memory (enough for 16 GiB of disk).
+  static const uint64_t CACHED = 1024;
+
+  struct Table {
+    Block block;
+    bool  dirty;
+    std::list<uint64_t>::iterator position;
+  };
+
+  Storage*  backing;
+  Verify    policy;
+  bool      enabled;
+  Block::ID start;
+  uint64_t  count;
+  uint64_t  nblocks; // Blocks the table covers.
+  uint64_t  ready;   // Table blocks initialized so far.
+  Block::ID journal_start;
+  uint64_t  journal_count;
+
+  std::unordered_map<uint64_t, Table> tables;
+  std::list<uint64_t>                 lru; // Most recently used first.
+  Stats                               counters;
+  std::mutex                          mutex;
+
+  bool     covered(Block::ID id) const;
+  void     verify(Block::ID id, const Block* blocks, uint64_t count);
+  void     stamp(Block::ID id, const Block* blocks, uint64_t count);
+  Table&   table(uint64_t index);
+  uint32_t sum(Block::ID id);
+  void     setSum(Block::ID id, uint32_t value);
+  void     evict();
+  void     writeTable(uint64_t index);
+};
@@ -1,42 +1,157 @@
 #include "FileStorage.h"
 #include "../FSExceptions.h"
+#include "../Stats.h"
+#include "../Trace.h"
 
-FileStorage::FileStorage(const char* filename, uint64_t nblocks): file(filename) {
-  // check if the file exists and create a new file if it doesn't
-  if(!file.good()) {
-    file.open(filename, std::fstream::in | std::fstream::out | std::fstream::trunc);
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+  #include <linux/fs.h>
+#endif
+
+FileStorage::FileStorage(const char* filename, uint64_t nblocks) {
+  // Create a new file if it doesn't exist yet
+  fd = open(filename, O_RDWR | O_CREAT, 0644);
+  if(fd < 0) {
+    throw IOError(std::string("Could not open disk file ") + filename);
   }
   this->size = nblocks;
 }
 
 FileStorage::~FileStorage() {
-  file.close();
+  close(fd);
 }
 
 void FileStorage::get(Block::ID id, Block& dst) {
-  if(id >= this->size) {
+  getRange(id, &dst, 1);
+}
+
+void FileStorage::set(Block::ID id, const Block& src) {
+  setRange(id, &src, 1);
+}
+
+void FileStorage::getRange(Block::ID id, Block* dst, uint64_t count) {
+  Stats::Timer timer(Stats::DISK_GET);
+  TRACE_SPAN("disk.get");
+  Stats::add(Stats::DISK_READ_BLOCKS, count);
+  if(id >= this->size || count > this->size - id) {
     throw std::length_error("Block read out of range.");
   }
 
-  file.seekg(id * Block::SIZE);
-  file.read(dst.data, Block::SIZE);
-  if(file.fail()) {
-    std::string message = "Block read failed for block ";
-    throw IOError(message + std::to_string(id));
+  char*  buffer = dst->data;
+  size_t bytes  = count * Block::SIZE;
+  off_t  offset = id * Block::SIZE;
+  while(bytes > 0) {
+    ssize_t done = pread(fd, buffer, bytes, offset);
+    if(done <= 0) {
+      std::string message = "Block read failed for block ";
+      throw IOError(message + std::to_string(offset / Block::SIZE));
+    }
+
+    buffer += done;
+    bytes  -= done;
+    offset += done;
   }
 }
 
-void FileStorage::set(Block::ID id, const Block& src) {
-  if(id >= this->size) {
+void FileStorage::setRange(Block::ID id, const Block* src, uint64_t count) {
+  Stats::Timer timer(Stats::DISK_SET);
+  TRACE_SPAN("disk.set");
+  Stats::add(Stats::DISK_WRITE_BLOCKS, count);
+  if(id >= this->size || count > this->size - id) {
     throw std::length_error("Block write out of range.");
   }
 
-  file.seekp(id * Block::SIZE);
-  file.write(src.data, Block::SIZE);
-  if(file.fail()) {
-    std::string message = "Block write failed for block ";
-    throw IOError(message + std::to_string(id));
+  const char* buffer = src->data;
+  size_t      bytes  = count * Block::SIZE;
+  off_t       offset = id * Block::SIZE;
+  while(bytes > 0) {
+    ssize_t done = pwrite(fd, buffer, bytes, offset);
+    if(done <= 0) {
+      std::string message = "Block write failed for block ";
+      throw IOError(message + std::to_string(offset / Block::SIZE));
+    }
+
+    buffer += done;
+    bytes  -= done;
+    offset += done;
+  }
+}
+
+void FileStorage::discard(Block::ID id, uint64_t count) {
+  Stats::Timer timer(Stats::DISK_DISCARD);
+  TRACE_SPAN("disk.discard");
+  Stats::add(Stats::DISK_DISCARD_BLOCKS, count);
+  if(id >= this->size || count > this->size - id) {
+    throw std::length_error("Block discard out of range.");
+  }
+
+  struct stat info;
+  if(fstat(fd, &info) != 0) {
+    return;
+  }
+
+#ifdef BLKDISCARD
+  if(S_ISBLK(info.st_mode)) {
+    uint64_t range[2] = {id * Block::SIZE, count * Block::SIZE};
+    ioctl(fd, BLKDISCARD, range);
+    return;
+  }
+#endif
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if(S_ISREG(info.st_mode)) {
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, id * Block::SIZE, count * Block::SIZE);
+  }
+#endif
+}
+
+uint64_t FileStorage::capacity() {
+  struct stat info;
+  if(fstat(fd, &info) != 0) {
+    return 0;
+  }
+
+#ifdef BLKGETSIZE64
+  if(S_ISBLK(info.st_mode)) {
+    uint64_t bytes;
+    if(ioctl(fd, BLKGETSIZE64, &bytes) != 0) {
+      return 0;
+    }
+
+    return bytes / Block::SIZE;
+  }
+#endif
+
+  return info.st_size / Block::SIZE;
+}
+
+bool FileStorage::resize(uint64_t nblocks) {
+  struct stat info;
+  if(fstat(fd, &info) != 0) {
+    return false;
+  }
+
+  if(S_ISREG(info.st_mode) && uint64_t(info.st_size) < nblocks * Block::SIZE) {
+    if(ftruncate(fd, nblocks * Block::SIZE) != 0) {
+      return false;
+    }
+  }
+  else if(capacity() < nblocks) {
+    return false;
   }
 
-  file.flush();
+  this->size = nblocks;
+  return true;
+}
+
+void FileStorage::sync() {
+  Stats::Timer timer(Stats::DISK_SYNC);
+  TRACE_SPAN("disk.sync");
+  if(fsync(fd) != 0) {
+    throw IOError("Disk sync failed.");
+  }
 }
@@ -1,16 +1,29 @@
 #pragma once
 
 #include "../Storage.h"
-#include <fstream>
+#include <atomic>
 #include <stdexcept>
 
 class FileStorage: public Storage {
-  std::fstream file;
-  uint64_t     size;
+  int      fd;
+  std::atomic<uint64_t> size;
 public:
   FileStorage(const char* filename, uint64_t nblocks);
   ~FileStorage();
 
   void get(Block::ID id, Block& dst);
   void set(Block::ID id, const Block& src);
+
+  void getRange(Block::ID id, Block* dst, uint64_t count);
+  void setRange(Block::ID id, const Block* src, uint64_t count);
+  void sync();
+
+  // Punches a hole in a regular file, or passes a device a BLKDISCARD.
+  // Best effort: errors (say, a filesystem without hole punching) are
+  // ignored.
+  void discard(Block::ID id, uint64_t count);
+
+  // Regular files are extended as needed; devices have to have grown.
+  uint64_t capacity();
+  bool resize(uint64_t nblocks);
 };
@@ -0,0 +1,314 @@
+#include "Journal.h"
+#include "ChecksumStorage.h"
+#include "../FSExceptions.h"
+#include "../Superblock.h"
+#include "../Trace.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Anonymous namespace for file-local types:
+namespace {
+  const uint64_t HEADER_MAGIC     = 0x4a4e524c48445221;
+  const uint64_t DESCRIPTOR_MAGIC = 0x4a4e524c54584e21;
+  const uint64_t CONTINUED_MAGIC  = 0x4a4e524c434f4e54; // More of the group follows.
+  const uint64_t INTENT_MAGIC     = 0x4a4e524c44415441; // Data blocks; nothing follows.
+
+  struct Header {
+    uint64_t magic;
+    uint64_t sequence; // First transaction to replay.
+    uint64_t tail;     // Where it starts, relative to the journal start.
+  };
+
+  struct Descriptor {
+    static const uint64_t NREFS = (Block::SIZE - 4 * sizeof(uint64_t)) / sizeof(Block::ID);
+
+    uint64_t  magic;
+    uint64_t  sequence;
+    uint64_t  count;
+    uint64_t  checksum; // Of the blocks that follow (or of the IDs, for data).
+    Block::ID ids[NREFS];
+  };
+
+  static_assert(sizeof(Descriptor) <= Block::SIZE, "Journal descriptor is too big!");
+
+  uint64_t checksum(const void* data, uint64_t size) {
+    // FNV-1a; only used to spot transactions that were torn by a crash.
+    uint64_t hash = 14695981039346656037ull;
+    for(uint64_t i = 0; i < size; ++i) {
+      hash ^= ((const uint8_t*) data)[i];
+      hash *= 1099511628211ull;
+    }
+
+    return hash;
+  }
+
+  void writeRanges(Storage* storage, const Block::ID* ids, const Block* blocks, uint64_t n) {
+    uint64_t first = 0;
+    for(uint64_t i = 1; i <= n; ++i) {
+      if(i == n || ids[i] != ids[i - 1] + 1) {
+        storage->setRange(ids[first], &blocks[first], i - first);
+        first = i;
+      }
+    }
+  }
+}
+
+Journal::Journal(Storage& storage, ChecksumStorage* checksums):
+  backing(&storage),
+  checksums(checksums),
+  in_place(true),
+  unsynced(false),
+  start(0),
+  count(0),
+  head(1),
+  sequence(1)
+{
+  // Nothing else to do until format() or replay().
+}
+
+Journal::~Journal() {
+  // A clean shutdown leaves nothing to replay.
+  try {
+    if(count > 0) checkpoint();
+  }
+  catch(std::exception& ex) {
+    std::cerr << "Journal checkpoint failed: " << ex.what() << '\n';
+  }
+}
+
+void Journal::format(Block::ID start, uint64_t count, bool in_place) {
+  this->start    = start;
+  this->count    = count;
+  this->head     = 1;
+  this->sequence = 1;
+  this->in_place = in_place;
+  if(count > 0) {
+    // Transactions left over from an earlier filesystem on the same
+    // disk would look just like ours once the sequence numbers catch up.
+    std::vector<Block> empty(count - 1);
+    backing->setRange(start + 1, &empty[0], empty.size());
+    writeHeader();
+    backing->sync();
+  }
+}
+
+void Journal::replay() {
+  Block block;
+  Superblock* superblock = (Superblock*) block.data;
+  backing->get(0, block);
+  start    = superblock->journal_block_start;
+  count    = superblock->journal_block_count;
+  in_place = (superblock->log_segment_count == 0);
+  if(count == 0) {
+    return;
+  }
+
+  Header* header = (Header*) block.data;
+  backing->get(start, block);
+  if(header->magic != HEADER_MAGIC) {
+    throw IOError("Corrupt journal header.");
+  }
+
+  uint64_t position = header->tail;
+  sequence = header->sequence;
+
+  Block descriptor_block;
+  Descriptor* descriptor = (Descriptor*) descriptor_block.data;
+  std::vector<Block>     blocks;
+  std::vector<Block::ID> ids;     // The group so far.
+  std::vector<Block::ID> written; // Blocks that may have changed.
+  uint64_t replayed = 0;
+  while(position < count) {
+    backing->get(start + position, descriptor_block);
+    if(descriptor->magic == INTENT_MAGIC && descriptor->sequence == sequence) {
+      if(descriptor->count > Descriptor::NREFS) break;
+      if(checksum(descriptor->ids, descriptor->count * sizeof(Block::ID)) != descriptor->checksum) break;
+      written.insert(written.end(), descriptor->ids, descriptor->ids + descriptor->count);
+      position += 1;
+      sequence += 1;
+      continue;
+    }
+
+    bool last = (descriptor->magic == DESCRIPTOR_MAGIC);
+    if((!last && descriptor->magic != CONTINUED_MAGIC) || descriptor->sequence != sequence) break;
+    if(descriptor->count > Descriptor::NREFS || position + 1 + descriptor->count > count) break;
+
+    uint64_t first = blocks.size();
+    blocks.resize(first + descriptor->count);
+    backing->getRange(start + position + 1, &blocks[first], descriptor->count);
+    if(checksum(&blocks[first], descriptor->count * Block::SIZE) != descriptor->checksum) break;
+    ids.insert(ids.end(), descriptor->ids, descriptor->ids + descriptor->count);
+
+    position += 1 + descriptor->count;
+    sequence += 1;
+
+    // A group is only written in place once all of it made it to the log.
+    if(last) {
+      for(uint64_t i = 0; i < ids.size(); ++i) {
+        backing->set(ids[i], blocks[i]);
+      }
+
+      written.insert(written.end(), ids.begin(), ids.end());
+      blocks.clear();
+      ids.clear();
+      replayed += 1;
+    }
+  }
+
+  if(replayed > 0) {
+    std::cerr << "Replayed " << replayed << " journal transactions.\n";
+  }
+
+  if(checksums != NULL) {
+    // Only now does the superblock say where the table is (grow() moves
+    // it).  Nothing above was checksummed, and the table may not have
+    // been synced with the data blocks; the checkpoint below writes out
+    // their new checksums.
+    checksums->load();
+    checksums->restamp(written);
+  }
+
+  checkpoint();
+}
+
+void Journal::commit(const std::vector<Block::ID>& ids, const std::vector<Block>& blocks) {
+  if(ids.empty()) {
+    return;
+  }
+
+  TRACE_SPAN("journal.commit");
+
+  // The data these blocks point to has to be on disk before they are.
+  if(unsynced) {
+    backing->sync();
+    unsynced = false;
+  }
+
+  if(count > 0) {
+    // Big groups are split into as many descriptors as they need, and
+    // only the last one marks the group as complete.  A group that
+    // can't fit even in an empty log could only be written in place
+    // without any atomicity, so it's refused before anything is written.
+    uint64_t most = Descriptor::NREFS;
+    if(most > count - 2) most = count - 2;
+    if(ids.size() > capacity()) {
+      throw IOError("A transaction of " + std::to_string(ids.size()) + " blocks doesn't fit in the journal.");
+    }
+
+    uint64_t needed = ids.size() + (ids.size() + most - 1) / most;
+    if(head + needed > count) {
+      // Not enough room left; start the log over first.
+      checkpoint();
+    }
+
+    for(uint64_t i = 0; i < ids.size(); i += most) {
+      uint64_t n = std::min<uint64_t>(most, ids.size() - i);
+      append(&ids[i], &blocks[i], n, i + n == ids.size());
+    }
+
+    // One sync commits the whole group.
+    backing->sync();
+    unsynced = false;
+  }
+
+  writeRanges(backing, &ids[0], &blocks[0], ids.size());
+}
+
+uint64_t Journal::capacity() {
+  if(count == 0) {
+    return UINT64_MAX;
+  }
+
+  // Everything after the header, less a descriptor per NREFS blocks.
+  uint64_t most = Descriptor::NREFS;
+  if(most > count - 2) most = count - 2;
+  return (count - 1) - (count - 1 + most) / (most + 1);
+}
+
+void Journal::write(const std::vector<Block::ID>& ids, const std::vector<Block>& blocks) {
+  if(ids.empty()) {
+    return;
+  }
+
+  TRACE_SPAN("journal.write");
+
+  unsynced = true;
+  if(count == 0 || checksums == NULL || !in_place) {
+    writeRanges(backing, &ids[0], &blocks[0], ids.size());
+    return;
+  }
+
+  // Every descriptor's worth of IDs needs to be on disk before the
+  // blocks themselves start to be overwritten.
+  uint64_t most = Descriptor::NREFS;
+  uint64_t done = 0;
+  while(done < ids.size()) {
+    if(head >= count) {
+      checkpoint();
+    }
+
+    uint64_t end = done;
+    while(end < ids.size() && head < count) {
+      uint64_t n = std::min(most, ids.size() - end);
+      note(&ids[end], n);
+      end += n;
+    }
+
+    backing->sync();
+    writeRanges(backing, &ids[done], &blocks[done], end - done);
+    done = end;
+  }
+}
+
+void Journal::append(const Block::ID* ids, const Block* blocks, uint64_t n, bool last) {
+  // The descriptor and its blocks go out as one sequential write.
+  std::vector<Block> entry(n + 1);
+  Descriptor* descriptor = (Descriptor*) entry[0].data;
+  std::memset(entry[0].data, 0, Block::SIZE);
+  descriptor->magic    = last? DESCRIPTOR_MAGIC : CONTINUED_MAGIC;
+  descriptor->sequence = sequence;
+  descriptor->count    = n;
+  descriptor->checksum = checksum(blocks, n * Block::SIZE);
+  std::memcpy(descriptor->ids, ids, n * sizeof(Block::ID));
+  std::copy(blocks, blocks + n, entry.begin() + 1);
+
+  backing->setRange(start + head, &entry[0], n + 1);
+  head     += n + 1;
+  sequence += 1;
+}
+
+void Journal::note(const Block::ID* ids, uint64_t n) {
+  Block block;
+  Descriptor* descriptor = (Descriptor*) block.data;
+  std::memset(block.data, 0, Block::SIZE);
+  descriptor->magic    = INTENT_MAGIC;
+  descriptor->sequence = sequence;
+  descriptor->count    = n;
+  descriptor->checksum = checksum(ids, n * sizeof(Block::ID));
+  std::memcpy(descriptor->ids, ids, n * sizeof(Block::ID));
+
+  backing->set(start + head, block);
+  head     += 1;
+  sequence += 1;
+}
+
+void Journal::checkpoint() {
+  // Everything logged so far has been written in place; once that is
+  // durable, the log can start over from the top.
+  backing->sync();
+  head     = 1;
+  unsynced = false;
+  writeHeader();
+  backing->sync();
+}
+
+void Journal::writeHeader() {
+  Block block;
+  Header* header = (Header*) block.data;
+  std::memset(block.data, 0, Block::SIZE);
+  header->magic    = HEADER_MAGIC;
+  header->sequence = sequence;
+  header->tail     = 1;
+  backing->set(start, block);
+}
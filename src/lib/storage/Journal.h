@@ -0,0 +1,66 @@
+#pragma once
+
+#include "../Storage.h"
+
+#include <cstddef>
+#include <vector>
+
+class ChecksumStorage;
+
+// Write-ahead log for metadata blocks.
+//
+// The journal lives in a region reserved by mkfs.  Its first block is a
+// header saying where replay starts; after that come transactions, each
+// one or more descriptor blocks (listing block IDs and a checksum) that
+// are followed by the blocks themselves.  A transaction is durable once
+// all of it has been written and synced; only then are its blocks
+// written in place.  When the log fills up, the in-place copies are
+// synced and the log starts over.
+//
+// Data blocks aren't logged, but when there's a checksum table the IDs
+// of data blocks about to be overwritten in place are: until the next
+// sync their checksums may not match what's on disk, so replay
+// recomputes them.
+class Journal {
+public:
+  Journal(Storage& backing, ChecksumStorage* checksums = NULL);
+  ~Journal();
+
+  // Sets up an empty journal in a newly created filesystem.  Data
+  // blocks aren't overwritten in place on log-structured filesystems.
+  void format(Block::ID start, uint64_t count, bool in_place = true);
+
+  // Finds the journal through the superblock and writes any committed
+  // transactions in place.  Must run before anything else reads the disk.
+  // Loads the checksum table afterwards, since a replayed transaction
+  // may have moved it.
+  void replay();
+
+  // Writes data blocks in place, after noting them in the log if their
+  // checksums need it.  Sorted by ID.
+  void write(const std::vector<Block::ID>& ids, const std::vector<Block>& blocks);
+
+  // Logs a group of blocks as one transaction, then writes them in
+  // place.  Data written before it goes out first.  Writes straight
+  // through if there is no journal.  Throws IOError for groups of more
+  // than capacity() blocks, which can't be made atomic.
+  void commit(const std::vector<Block::ID>& ids, const std::vector<Block>& blocks);
+
+  // The most blocks one transaction can hold.
+  uint64_t capacity();
+
+private:
+  Storage*         backing;
+  ChecksumStorage* checksums;
+  bool             in_place; // Data blocks are overwritten where they are.
+  bool             unsynced; // Data was written since the last sync.
+  Block::ID        start;    // First block of the journal region (the header).
+  uint64_t         count;    // Blocks in the journal region.
+  uint64_t         head;     // Where the next transaction goes, relative to start.
+  uint64_t         sequence; // Sequence number of the next transaction.
+
+  void append(const Block::ID* ids, const Block* blocks, uint64_t n, bool last);
+  void note(const Block::ID* ids, uint64_t n);
+  void checkpoint();
+  void writeHeader();
+};
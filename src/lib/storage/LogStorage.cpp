@@ -0,0 +1,425 @@
+#include "LogStorage.h"
+#include "../FSExceptions.h"
+#include "../Superblock.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+// Anonymous namespace for file-local constants:
+namespace {
+  const uint64_t ENTRIES = Block::SIZE / sizeof(Block::ID); // Mapping entries per block.
+}
+
+const uint64_t LogStorage::SEGMENT_SIZE;
+
+LogStorage::LogStorage(Storage& storage):
+  backing(&storage),
+  enabled(false),
+  data_start(0),
+  data_count(0),
+  map_start(0),
+  segment_start(0),
+  segment_count(0),
+  current(0),
+  fill(0),
+  flushed(0),
+  clock(0),
+  stopping(false)
+{
+  cleaner = std::thread(&LogStorage::run, this);
+}
+
+LogStorage::~LogStorage() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+
+  wakeup.notify_all();
+  cleaner.join();
+
+  try {
+    if(enabled) persist();
+  }
+  catch(std::exception& ex) {
+    std::cerr << "Log flush failed: " << ex.what() << '\n';
+  }
+}
+
+uint64_t LogStorage::layout(Block::ID start, uint64_t nblocks, Block::ID& map_start, Block::ID& segment_start, uint64_t& segment_count) {
+  // Keep a tenth of the segments (and at least four) spare so that the
+  // cleaner always has somewhere to copy live blocks to.
+  uint64_t map_blocks = 0;
+  uint64_t count      = 0;
+  for(int pass = 0; pass < 2; ++pass) {
+    segment_count = (nblocks - map_blocks) / SEGMENT_SIZE;
+    uint64_t spare = std::max<uint64_t>(4, segment_count / 10);
+    if(segment_count <= spare) {
+      return 0;
+    }
+
+    count = (segment_count - spare) * SEGMENT_SIZE;
+    if(pass == 0) {
+      map_blocks = (count + ENTRIES - 1) / ENTRIES;
+    }
+  }
+
+  map_start     = start;
+  segment_start = start + map_blocks;
+  return count;
+}
+
+void LogStorage::format(Block::ID data_start, Block::ID map_start, Block::ID segment_start, uint64_t segment_count) {
+  std::lock_guard<std::mutex> lock(mutex);
+  this->data_start    = data_start;
+  this->map_start     = map_start;
+  this->segment_start = segment_start;
+  this->segment_count = segment_count;
+  this->data_count    = (segment_start - map_start) * ENTRIES;
+
+  map.assign(this->data_count, 0);
+  owners.assign(segment_count * SEGMENT_SIZE, 0);
+  live.assign(segment_count, 0);
+  stamps.assign(segment_count, 0);
+  pending.clear();
+  dirty.clear();
+  free.clear();
+  for(uint64_t i = 1; i < segment_count; ++i) {
+    free.push_back(i);
+  }
+
+  current = 0;
+  fill    = 0;
+  flushed = 0;
+  clock   = 0;
+  buffer.resize(SEGMENT_SIZE);
+  enabled = true;
+
+  Block block;
+  std::memset(block.data, 0, Block::SIZE);
+  for(Block::ID id = map_start; id < segment_start; ++id) {
+    backing->set(id, block);
+  }
+}
+
+void LogStorage::load() {
+  std::lock_guard<std::mutex> lock(mutex);
+  Block block;
+  Superblock* superblock = (Superblock*) block.data;
+  backing->get(0, block);
+  if(superblock->log_segment_count == 0) {
+    return;
+  }
+
+  data_start    = superblock->data_block_start;
+  map_start     = superblock->log_map_start;
+  segment_start = superblock->log_segment_start;
+  segment_count = superblock->log_segment_count;
+  data_count    = (segment_start - map_start) * ENTRIES;
+
+  std::vector<Block> table(segment_start - map_start);
+  backing->getRange(map_start, &table[0], table.size());
+  map.assign(data_count, 0);
+  std::memcpy(&map[0], table[0].data, data_count * sizeof(Block::ID));
+
+  owners.assign(segment_count * SEGMENT_SIZE, 0);
+  live.assign(segment_count, 0);
+  stamps.assign(segment_count, 0);
+  for(uint64_t i = 0; i < data_count; ++i) {
+    if(map[i] == 0) continue;
+
+    uint64_t offset = map[i] - segment_start;
+    if(map[i] < segment_start || offset >= owners.size()) {
+      throw IOError("Corrupt log mapping table.");
+    }
+
+    owners[offset] = i + 1;
+    live[offset / SEGMENT_SIZE] += 1;
+  }
+
+  pending.clear();
+  dirty.clear();
+  free.clear();
+  for(uint64_t i = 0; i < segment_count; ++i) {
+    if(live[i] == 0) free.push_back(i);
+  }
+
+  if(free.empty()) {
+    throw IOError("No free log segments.");
+  }
+
+  current = free.front();
+  free.pop_front();
+  fill    = 0;
+  flushed = 0;
+  clock   = 0;
+  buffer.resize(SEGMENT_SIZE);
+  enabled = true;
+}
+
+void LogStorage::get(Block::ID id, Block& dst) {
+  std::lock_guard<std::mutex> lock(mutex);
+  read(id, dst);
+}
+
+void LogStorage::set(Block::ID id, const Block& src) {
+  setRange(id, &src, 1);
+}
+
+void LogStorage::getRange(Block::ID id, Block* dst, uint64_t count) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if(!enabled || id + count <= data_start) {
+    backing->getRange(id, dst, count);
+    return;
+  }
+
+  // Blocks that still sit next to each other on disk are read together.
+  uint64_t i = 0;
+  while(i < count) {
+    Block::ID first = (id + i >= data_start && id + i - data_start < data_count) ? map[id + i - data_start] : 0;
+    if(first == 0 || (first - segment_start) / SEGMENT_SIZE == current) {
+      read(id + i, dst[i]);
+      i += 1;
+      continue;
+    }
+
+    uint64_t n = 1;
+    while(i + n < count && id + i + n - data_start < data_count) {
+      Block::ID next = map[id + i + n - data_start];
+      if(next != first + n || (next - segment_start) / SEGMENT_SIZE == current) break;
+      n += 1;
+    }
+
+    backing->getRange(first, &dst[i], n);
+    i += n;
+  }
+}
+
+void LogStorage::setRange(Block::ID id, const Block* src, uint64_t count) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if(!enabled || id + count <= data_start) {
+    backing->setRange(id, src, count);
+    return;
+  }
+
+  for(uint64_t i = 0; i < count; ++i) {
+    if(id + i < data_start) {
+      backing->set(id + i, src[i]);
+      continue;
+    }
+
+    if(id + i - data_start >= data_count) {
+      throw std::length_error("Block write out of range.");
+    }
+
+    append(id + i - data_start, src[i]);
+  }
+
+  // Clean in the foreground if the background cleaner fell behind.
+  while(free.size() < 2) {
+    if(!pending.empty()) {
+      persist();
+    }
+    else if(!clean()) {
+      break;
+    }
+  }
+
+  if(free.size() < std::max<uint64_t>(4, segment_count / 20)) {
+    wakeup.notify_one();
+  }
+}
+
+void LogStorage::sync() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if(enabled) {
+    persist();
+  }
+  else {
+    backing->sync();
+  }
+}
+
+void LogStorage::discard(Block::ID id, uint64_t count) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if(!enabled || id + count <= data_start) {
+    backing->discard(id, count);
+    return;
+  }
+
+  for(uint64_t i = 0; i < count; ++i) {
+    if(id + i < data_start || id + i - data_start >= data_count) continue;
+
+    uint64_t  index = id + i - data_start;
+    Block::ID old   = map[index];
+    if(old == 0) continue;
+
+    uint64_t offset = old - segment_start;
+    owners[offset] = 0;
+    live[offset / SEGMENT_SIZE] -= 1;
+    map[index] = 0;
+    dirty.insert(index / ENTRIES);
+  }
+}
+
+// Called with the lock held.
+void LogStorage::read(Block::ID id, Block& dst) {
+  if(!enabled || id < data_start) {
+    backing->get(id, dst);
+    return;
+  }
+
+  if(id - data_start >= data_count) {
+    throw std::length_error("Block read out of range.");
+  }
+
+  Block::ID physical = map[id - data_start];
+  if(physical == 0) {
+    std::memset(dst.data, 0, Block::SIZE);
+    return;
+  }
+
+  uint64_t offset = physical - segment_start;
+  if(offset / SEGMENT_SIZE == current) {
+    dst = buffer[offset % SEGMENT_SIZE];
+  }
+  else {
+    backing->get(physical, dst);
+  }
+}
+
+// Called with the lock held.
+void LogStorage::append(uint64_t index, const Block& src) {
+  if(fill == SEGMENT_SIZE) {
+    open();
+  }
+
+  Block::ID old = map[index];
+  if(old != 0) {
+    uint64_t offset = old - segment_start;
+    owners[offset] = 0;
+    live[offset / SEGMENT_SIZE] -= 1;
+  }
+
+  uint64_t offset = current * SEGMENT_SIZE + fill;
+  buffer[fill]   = src;
+  owners[offset] = index + 1;
+  map[index]     = segment_start + offset;
+  live[current] += 1;
+  dirty.insert(index / ENTRIES);
+
+  fill  += 1;
+  clock += 1;
+  stamps[current] = clock;
+}
+
+// Called with the lock held.  Closes the full segment and opens the next.
+void LogStorage::open() {
+  flush();
+  if(free.empty()) {
+    persist();
+  }
+
+  if(free.empty()) {
+    throw OutOfDataBlocks();
+  }
+
+  current = free.front();
+  free.pop_front();
+  fill    = 0;
+  flushed = 0;
+}
+
+// Called with the lock held.  Writes out the new part of the open segment.
+void LogStorage::flush() {
+  if(fill > flushed) {
+    Block::ID first = segment_start + current * SEGMENT_SIZE + flushed;
+    backing->setRange(first, &buffer[flushed], fill - flushed);
+    flushed = fill;
+  }
+}
+
+// Called with the lock held.  Makes everything durable, mapping table
+// last, and then lets cleaned segments be reused.
+void LogStorage::persist() {
+  flush();
+  backing->sync();
+
+  for(uint64_t index: dirty) {
+    Block block;
+    std::memcpy(block.data, &map[index * ENTRIES], Block::SIZE);
+    backing->set(map_start + index, block);
+  }
+
+  dirty.clear();
+  backing->sync();
+
+  free.insert(free.end(), pending.begin(), pending.end());
+  pending.clear();
+}
+
+// Called with the lock held.  Copies the live blocks out of the segment
+// with the best cost-benefit ratio: (1 - u) * age / (1 + u), where u is
+// the fraction of the segment still live.  Returns false if there's
+// nothing worth cleaning.
+bool LogStorage::clean() {
+  std::vector<bool> reusable(segment_count, false);
+  for(uint64_t s: free)    reusable[s] = true;
+  for(uint64_t s: pending) reusable[s] = true;
+
+  uint64_t victim = segment_count;
+  double   best   = 0;
+  for(uint64_t s = 0; s < segment_count; ++s) {
+    if(s == current || reusable[s] || live[s] == SEGMENT_SIZE) continue;
+
+    double u     = double(live[s]) / SEGMENT_SIZE;
+    double age   = double(clock - stamps[s] + 1);
+    double score = (1 - u) * age / (1 + u);
+    if(score > best) {
+      best   = score;
+      victim = s;
+    }
+  }
+
+  if(victim == segment_count) {
+    return false;
+  }
+
+  if(live[victim] > 0) {
+    std::vector<Block> blocks(SEGMENT_SIZE);
+    backing->getRange(segment_start + victim * SEGMENT_SIZE, &blocks[0], SEGMENT_SIZE);
+    for(uint64_t i = 0; i < SEGMENT_SIZE; ++i) {
+      uint64_t owner = owners[victim * SEGMENT_SIZE + i];
+      if(owner != 0) append(owner - 1, blocks[i]);
+    }
+  }
+
+  pending.push_back(victim);
+  return true;
+}
+
+void LogStorage::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while(!stopping) {
+    wakeup.wait_for(lock, std::chrono::milliseconds(1000));
+    if(stopping || !enabled) continue;
+
+    try {
+      // Keep a twentieth of the segments (at least four) free.
+      uint64_t target = std::max<uint64_t>(4, segment_count / 20);
+      while(!stopping && free.size() + pending.size() < target && clean()) {
+        lock.unlock();
+        std::this_thread::yield();
+        lock.lock();
+      }
+
+      if(!pending.empty()) {
+        persist();
+      }
+    }
+    catch(std::exception& ex) {
+      std::cerr << "Log cleaning failed: " << ex.what() << '\n';
+    }
+  }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "../Storage.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+// Log-structured layout for the data region.
+//
+// Blocks below the data region pass straight through.  Data blocks are
+// never overwritten in place: every write is appended to the open
+// segment, and a mapping table (kept in memory and written to its own
+// region on sync) says where each block currently lives.  A background
+// cleaner copies the live blocks out of mostly-dead segments so that
+// they can be reused, choosing victims by cost-benefit.
+//
+// Segments freed by the cleaner are only reused once the mapping table
+// that no longer points into them is on disk.
+class LogStorage: public Storage {
+public:
+  static const uint64_t SEGMENT_SIZE = 512; // Blocks per segment.
+
+  LogStorage(Storage& backing);
+  ~LogStorage();
+
+  // Splits a data region of nblocks blocks starting at start into a
+  // mapping table and segments.  Returns how many data blocks it holds
+  // (zero if it's too small).
+  static uint64_t layout(Block::ID start, uint64_t nblocks, Block::ID& map_start, Block::ID& segment_start, uint64_t& segment_count);
+
+  // Starts a new, empty log for a newly created filesystem.
+  void format(Block::ID data_start, Block::ID map_start, Block::ID segment_start, uint64_t segment_count);
+
+  // Reads the mapping table if the superblock says this filesystem is
+  // log-structured; otherwise everything passes through.
+  void load();
+
+  void get(Block::ID id, Block& dst);
+  void set(Block::ID id, const Block& src);
+  void getRange(Block::ID id, Block* dst, uint64_t count);
+  void setRange(Block::ID id, const Block* src, uint64_t count);
+  void sync();
+
+  // Discarded data blocks are dropped from the mapping table, so the
+  // cleaner doesn't have to copy them; everything else passes through.
+  void discard(Block::ID id, uint64_t count);
+
+private:
+  Storage*  backing;
+  bool      enabled;
+  Block::ID data_start;
+  uint64_t  data_count;
+  Block::ID map_start;
+  Block::ID segment_start;
+  uint64_t  segment_count;
+
+  std::vector<Block::ID> map;     // Data block index -> physical block (0 if never written).
+  std::vector<uint64_t>  owners;  // Physical block offset -> data block index + 1 (0 if dead).
+  std::vector<uint64_t>  live;    // Live blocks per segment.
+  std::vector<uint64_t>  stamps;  // When each segment was last written, in blocks appended.
+  std::deque<uint64_t>   free;    // Segments that can be written.
+  std::vector<uint64_t>  pending; // Segments cleaned since the last sync.
+  std::set<uint64_t>     dirty;   // Mapping table blocks that need writing.
+
+  uint64_t           current; // The open segment.
+  uint64_t           fill;    // Blocks appended to it.
+  uint64_t           flushed; // Blocks of it already on disk.
+  std::vector<Block> buffer;  // Its contents.
+  uint64_t           clock;   // Blocks appended so far.
+
+  std::mutex              mutex;
+  std::condition_variable wakeup;
+  std::thread             cleaner;
+  bool                    stopping;
+
+  void read(Block::ID id, Block& dst);
+  void append(uint64_t index, const Block& src);
+  void open();
+  void flush();
+  void persist();
+  bool clean();
+  void run();
+};
@@ -1,4 +1,6 @@
 #include "MemoryStorage.h"
+#include "../Stats.h"
+#include "../Trace.h"
 
 #include <cstring>
 #include <stdexcept>
@@ -13,6 +15,9 @@ MemoryStorage::~MemoryStorage() {
 }
 
 void MemoryStorage::get(Block::ID id, Block& dst) {
+  Stats::Timer timer(Stats::DISK_GET);
+  TRACE_SPAN("disk.get");
+  Stats::add(Stats::DISK_READ_BLOCKS);
   if(id >= size) {
     throw std::length_error("Block read out of range.");
   }
@@ -22,6 +27,9 @@ void MemoryStorage::get(Block::ID id, Block& dst) {
 }
 
 void MemoryStorage::set(Block::ID id, const Block& src) {
+  Stats::Timer timer(Stats::DISK_SET);
+  TRACE_SPAN("disk.set");
+  Stats::add(Stats::DISK_WRITE_BLOCKS);
   if(id >= size) {
     throw std::length_error("Block write out of range.");
   }
@@ -0,0 +1,563 @@
+#include "PageCache.h"
+#include "../Stats.h"
+#include "../Trace.h"
+
+#include <algorithm>
+#include <iostream>
+
+PageCache::PageCache(Storage& storage, uint64_t capacity, Journal* journal, double dirty_ratio, uint64_t expire_ms):
+  backing(&storage),
+  journal(journal),
+  capacity(capacity),
+  expire(expire_ms),
+  ndirty(0),
+  nchanges(0),
+  copied(0),
+  done(0),
+  busy(false),
+  waiting(0),
+  stopping(false)
+{
+  dirty_limit = std::max<uint64_t>(1, capacity * dirty_ratio);
+  dirty_max   = std::max<uint64_t>(dirty_limit, capacity / 2);
+  flusher     = std::thread(&PageCache::run, this);
+  reader      = std::thread(&PageCache::readahead, this);
+}
+
+PageCache::~PageCache() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+
+  wakeup.notify_all();
+  idle.notify_all();
+  queued.notify_all();
+  flusher.join();
+  reader.join();
+
+  try {
+    sync();
+  }
+  catch(std::exception& ex) {
+    std::cerr << "Page cache flush failed: " << ex.what() << '\n';
+  }
+}
+
+void PageCache::get(Block::ID id, Block& dst) {
+  Stats::Timer timer(Stats::CACHE_GET);
+  std::unique_lock<std::mutex> lock(mutex);
+  auto itr = entries.find(id);
+  while(itr != entries.end() && itr->second.loading) {
+    loaded.wait(lock);
+    itr = entries.find(id);
+  }
+
+  if(itr != entries.end()) {
+    lru.splice(lru.begin(), lru, itr->second.position);
+    dst = itr->second.block;
+    Stats::add(Stats::CACHE_HITS);
+    return;
+  }
+
+  Stats::add(Stats::CACHE_MISSES);
+  TRACE_SPAN("cache.miss");
+
+  // Read without the lock, so that other threads aren't held up behind
+  // the disk.  Loading entries are never evicted; anyone else who wants
+  // this block waits for it instead of reading it again.
+  lookup(id).loading = true;
+  lock.unlock();
+
+  Block block;
+  try {
+    backing->get(id, block);
+  }
+  catch(...) {
+    lock.lock();
+    Entry& entry = entries[id];
+    entry.loading = false;
+    if(entry.version == 0) {
+      lru.erase(entry.position);
+      entries.erase(id);
+    }
+
+    loaded.notify_all();
+    throw;
+  }
+
+  lock.lock();
+  Entry& entry = entries[id];
+  entry.loading = false;
+  if(entry.version == 0) {
+    // Otherwise it was set while we were reading, and that's newer.
+    entry.block = block;
+  }
+
+  dst = entry.block;
+  loaded.notify_all();
+  evict();
+}
+
+void PageCache::set(Block::ID id, const Block& src) {
+  set(id, src, 0);
+}
+
+void PageCache::set(Block::ID id, const Block& src, INode::ID owner) {
+  Stats::Timer timer(Stats::CACHE_SET);
+  std::unique_lock<std::mutex> lock(mutex);
+  Entry& entry = lookup(id);
+  entry.block = src;
+  entry.version += 1;
+  if(owner == 0) {
+    nchanges += 1;
+  }
+
+  if(entry.dirty && entry.owner != owner) {
+    clean(id, entry);
+  }
+
+  if(!entry.dirty) {
+    entry.dirty   = true;
+    entry.owner   = owner;
+    entry.dirtied = Clock::now();
+    dirty[owner].insert(id);
+    ndirty += 1;
+  }
+
+  evict();
+  if(ndirty >= dirty_max) {
+    // Too far behind; write out file data before accepting more.  The
+    // metadata has to wait until the operation is over.
+    lock.unlock();
+    std::lock_guard<std::mutex> guard(io);
+    lock.lock();
+    writeback(lock, false);
+  }
+
+  if(ndirty >= dirty_limit) {
+    wakeup.notify_one();
+  }
+}
+
+void PageCache::sync() {
+  flush(true);
+}
+
+// Called by the running operation, so there's no need to wait for it.
+void PageCache::settle() {
+  std::unique_lock<std::mutex> lock(mutex);
+  if(!full()) {
+    return;
+  }
+
+  lock.unlock();
+  std::lock_guard<std::mutex> guard(io);
+  lock.lock();
+  writeback(lock, true);
+}
+
+void PageCache::discard(Block::ID id, uint64_t count) {
+  // Holding the I/O lock keeps readahead from bringing them back while
+  // the discard is on its way down.
+  std::lock_guard<std::mutex> guard(io);
+
+  // Dirty blocks have been handed out again since they were freed, so
+  // their part of the range isn't passed on.
+  std::vector<Block::ID> kept;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(count < entries.size()) {
+      for(uint64_t i = 0; i < count; ++i) {
+        auto itr = entries.find(id + i);
+        if(itr == entries.end() || itr->second.loading) continue;
+
+        if(itr->second.dirty) {
+          kept.push_back(id + i);
+        }
+        else {
+          lru.erase(itr->second.position);
+          entries.erase(itr);
+        }
+      }
+    }
+    else {
+      for(auto itr = entries.begin(); itr != entries.end();) {
+        if(itr->first < id || itr->first - id >= count || itr->second.loading) {
+          ++itr;
+        }
+        else if(itr->second.dirty) {
+          kept.push_back(itr->first);
+          ++itr;
+        }
+        else {
+          lru.erase(itr->second.position);
+          itr = entries.erase(itr);
+        }
+      }
+
+      std::sort(kept.begin(), kept.end());
+    }
+  }
+
+  Block::ID start = id;
+  for(Block::ID bid: kept) {
+    if(bid > start) backing->discard(start, bid - start);
+    start = bid + 1;
+  }
+
+  if(start < id + count) {
+    backing->discard(start, id + count - start);
+  }
+}
+
+void PageCache::flush(bool durable) {
+  std::lock_guard<std::mutex> guard(io);
+  std::unique_lock<std::mutex> lock(mutex);
+  writeback(lock, true);
+
+  if(durable) {
+    lock.unlock();
+    backing->sync();
+  }
+}
+
+void PageCache::flush(INode::ID owner, bool durable) {
+  std::lock_guard<std::mutex> guard(io);
+  std::unique_lock<std::mutex> lock(mutex);
+  auto itr = dirty.find(owner);
+  if(owner != 0 && itr != dirty.end()) {
+    std::vector<Block::ID> ids(itr->second.begin(), itr->second.end());
+    writeback(lock, ids, false);
+  }
+
+  if(durable) {
+    lock.unlock();
+    backing->sync();
+  }
+}
+
+void PageCache::commit() {
+  std::unique_lock<std::mutex> lock(mutex);
+  commit(lock);
+  lock.unlock();
+
+  std::lock_guard<std::mutex> guard(io);
+  backing->sync();
+}
+
+// Called with the cache lock held.  Lets the running operation finish
+// and keeps new ones out while the dirty blocks are copied, so that only
+// whole operations get logged.
+void PageCache::commit(std::unique_lock<std::mutex>& lock) {
+  waiting += 1;
+  idle.wait(lock, [this]{return !busy || stopping;});
+  lock.unlock();
+  std::lock_guard<std::mutex> guard(io);
+  lock.lock();
+  writeback(lock, true, true);
+}
+
+// Called with the cache lock held.
+void PageCache::resume() {
+  waiting -= 1;
+  idle.notify_all();
+}
+
+void PageCache::begin() {
+  std::unique_lock<std::mutex> lock(mutex);
+  idle.wait(lock, [this]{return waiting == 0 || stopping;});
+  busy = true;
+}
+
+void PageCache::end() {
+  std::unique_lock<std::mutex> lock(mutex);
+  busy = false;
+  idle.notify_all();
+  if(!full()) {
+    return;
+  }
+
+  // Operations are serialized, so nothing else can be half done now.
+  // Committing here keeps a batch of many small operations from getting
+  // too big for one transaction.
+  lock.unlock();
+  std::lock_guard<std::mutex> guard(io);
+  lock.lock();
+  try {
+    writeback(lock, true);
+  }
+  catch(std::exception& ex) {
+    std::cerr << "Page cache writeback failed: " << ex.what() << '\n';
+  }
+}
+
+void PageCache::prefetch(const std::vector<Block::ID>& ids) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for(Block::ID id: ids) {
+    // Don't let a runaway reader push the whole cache out.
+    if(pending.size() >= capacity / 4) break;
+    if(entries.count(id) == 0) pending.push_back(id);
+  }
+
+  queued.notify_one();
+}
+
+uint64_t PageCache::changes() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return nchanges;
+}
+
+uint64_t PageCache::epoch() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return copied;
+}
+
+bool PageCache::committed(uint64_t epoch) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return done > epoch;
+}
+
+// Called with the cache lock held.  Whether the dirty metadata fills
+// half of a journal transaction, leaving the other half for whatever
+// the running operation does before its next chance to commit, or is
+// enough to push the cache past its size (metadata can't be evicted).
+bool PageCache::full() {
+  auto itr = dirty.find(0);
+  if(itr == dirty.end()) {
+    return false;
+  }
+
+  uint64_t count = itr->second.size();
+  return count >= dirty_max || (journal != NULL && 2 * count >= journal->capacity());
+}
+
+PageCache::Entry& PageCache::lookup(Block::ID id) {
+  auto itr = entries.find(id);
+  if(itr != entries.end()) {
+    lru.splice(lru.begin(), lru, itr->second.position);
+    return itr->second;
+  }
+
+  lru.push_front(id);
+  Entry& entry   = entries[id];
+  entry.owner    = 0;
+  entry.dirty    = false;
+  entry.loading  = false;
+  entry.version  = 0;
+  entry.position = lru.begin();
+  return entry;
+}
+
+void PageCache::evict() {
+  // Drop the least recently used clean blocks; dirty ones must wait
+  // for the flusher, and loading ones for their reader.
+  auto itr = lru.end();
+  while(entries.size() > capacity && itr != lru.begin()) {
+    --itr;
+    const Entry& entry = entries[*itr];
+    if(!entry.dirty && !entry.loading) {
+      entries.erase(*itr);
+      itr = lru.erase(itr);
+    }
+  }
+}
+
+void PageCache::clean(Block::ID id, Entry& entry) {
+  auto itr = dirty.find(entry.owner);
+  itr->second.erase(id);
+  if(itr->second.empty()) {
+    dirty.erase(itr);
+  }
+
+  entry.dirty = false;
+  ndirty -= 1;
+}
+
+// Called with both locks held; releases the cache lock while writing.
+// Holding the I/O lock makes batches reach the disk in the same order
+// that their contents were copied.
+void PageCache::writeback(std::unique_lock<std::mutex>& lock, bool metadata, bool holding) {
+  std::vector<Block::ID> ids;
+  for(const auto& itr: dirty) {
+    if(itr.first == 0 && !metadata) continue;
+    ids.insert(ids.end(), itr.second.begin(), itr.second.end());
+  }
+
+  std::sort(ids.begin(), ids.end());
+  if(!metadata) {
+    writeback(lock, ids, holding);
+    return;
+  }
+
+  // Every metadata change made before now is in this batch.
+  uint64_t batch = ++copied;
+  writeback(lock, ids, holding);
+  done = batch;
+}
+
+// Called with both locks held, like the above; writes out the given
+// dirty blocks, which must be sorted.
+void PageCache::writeback(std::unique_lock<std::mutex>& lock, const std::vector<Block::ID>& ids, bool holding) {
+  if(ids.empty()) {
+    if(holding) resume();
+    return;
+  }
+
+  TRACE_SPAN("cache.writeback");
+
+  std::vector<Block>    blocks;
+  std::vector<Block::ID> written;
+  std::vector<uint64_t> versions;
+  std::vector<Block>    metadata_blocks;
+  std::vector<Block::ID> logged;
+  std::vector<uint64_t> logged_versions;
+  for(Block::ID id: ids) {
+    Entry& entry = entries[id];
+    if(entry.owner == 0) {
+      metadata_blocks.push_back(entry.block);
+      logged.push_back(id);
+      logged_versions.push_back(entry.version);
+    }
+    else {
+      blocks.push_back(entry.block);
+      written.push_back(id);
+      versions.push_back(entry.version);
+    }
+  }
+
+  // With the copies taken, operations that were held off can go on.
+  if(holding) resume();
+
+  lock.unlock();
+  try {
+    size_t start = 0;
+    if(journal != NULL) {
+      journal->write(written, blocks);
+    }
+    else {
+      for(size_t i = 1; i <= written.size(); ++i) {
+        if(i == written.size() || written[i] != written[i - 1] + 1) {
+          backing->setRange(written[start], &blocks[start], i - start);
+          start = i;
+        }
+      }
+    }
+
+    // Metadata goes out after the data it points to, as one transaction.
+    if(!logged.empty() && journal != NULL) {
+      journal->commit(logged, metadata_blocks);
+    }
+    else if(!logged.empty()) {
+      backing->sync();
+      start = 0;
+      for(size_t i = 1; i <= logged.size(); ++i) {
+        if(i == logged.size() || logged[i] != logged[i - 1] + 1) {
+          backing->setRange(logged[start], &metadata_blocks[start], i - start);
+          start = i;
+        }
+      }
+    }
+  }
+  catch(...) {
+    lock.lock();
+    throw;
+  }
+  lock.lock();
+
+  written.insert(written.end(), logged.begin(), logged.end());
+  versions.insert(versions.end(), logged_versions.begin(), logged_versions.end());
+
+  // Blocks that were rewritten in the meantime stay dirty.
+  for(size_t i = 0; i < written.size(); ++i) {
+    auto itr = entries.find(written[i]);
+    if(itr != entries.end() && itr->second.dirty && itr->second.version == versions[i]) {
+      clean(written[i], itr->second);
+    }
+  }
+
+  evict();
+}
+
+void PageCache::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while(!stopping) {
+    wakeup.wait_for(lock, std::chrono::milliseconds(1000));
+    if(stopping) break;
+
+    Clock::time_point cutoff = Clock::now() - expire;
+    bool due = (ndirty >= dirty_limit);
+    for(auto itr = dirty.begin(); itr != dirty.end() && !due; ++itr) {
+      for(Block::ID id: itr->second) {
+        if(entries[id].dirtied <= cutoff) {
+          due = true;
+          break;
+        }
+      }
+    }
+
+    if(!due) continue;
+
+    try {
+      commit(lock);
+    }
+    catch(std::exception& ex) {
+      std::cerr << "Page cache writeback failed: " << ex.what() << '\n';
+    }
+  }
+}
+
+void PageCache::readahead() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while(!stopping) {
+    if(pending.empty()) {
+      queued.wait(lock);
+      continue;
+    }
+
+    std::vector<Block::ID> ids(pending.begin(), pending.end());
+    pending.clear();
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    // Holding the I/O lock keeps writebacks from changing blocks on disk
+    // between our read and our insert.
+    lock.unlock();
+    std::lock_guard<std::mutex> guard(io);
+    lock.lock();
+
+    std::vector<Block::ID> missing;
+    for(Block::ID id: ids) {
+      if(entries.count(id) == 0) missing.push_back(id);
+    }
+
+    lock.unlock();
+    size_t start = 0;
+    for(size_t i = 1; i <= missing.size(); ++i) {
+      if(i < missing.size() && missing[i] == missing[i - 1] + 1) continue;
+
+      std::vector<Block> blocks(i - start);
+      try {
+        backing->getRange(missing[start], &blocks[0], blocks.size());
+      }
+      catch(std::exception& ex) {
+        std::cerr << "Page cache readahead failed: " << ex.what() << '\n';
+        start = i;
+        continue;
+      }
+
+      lock.lock();
+      for(size_t j = 0; j < blocks.size(); ++j) {
+        if(entries.count(missing[start + j]) == 0) {
+          lookup(missing[start + j]).block = blocks[j];
+        }
+      }
+
+      evict();
+      lock.unlock();
+      start = i;
+    }
+
+    lock.lock();
+  }
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "../Storage.h"
+#include "../INode.h"
+#include "Journal.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Write-back block cache in front of another Storage.
+//
+// Dirty blocks stay in memory until a background flusher writes them
+// out, either because they are older than the expiry age or because
+// too much of the cache is dirty.  Writes go out in sorted batches so
+// that runs of neighbouring blocks become single backend writes.
+//
+// File data blocks are tagged with the INode that owns them; untagged
+// blocks (owner 0) are metadata.  Metadata only goes out as a whole, at
+// a point where no operation is half done (see begin() and end()), and
+// all dirty data goes out before it; if there is a journal, each such
+// batch of metadata is one transaction.  Operations too big for one
+// transaction mark the points in between where they can be committed
+// (see settle()).  Data alone can be written out at any time.
+class PageCache: public Storage {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  PageCache(Storage& backing, uint64_t capacity, Journal* journal = NULL, double dirty_ratio = 0.25, uint64_t expire_ms = 5000);
+  ~PageCache();
+
+  void get(Block::ID id, Block& dst);
+  void set(Block::ID id, const Block& src);
+  void set(Block::ID id, const Block& src, INode::ID owner);
+  void sync();
+
+  // Commits the metadata changed so far, mid-operation, once it fills
+  // half of a journal transaction or too much of the cache.
+  void settle();
+
+  // Drops clean copies of the blocks before passing the discard on,
+  // leaving out any that are dirty.
+  void discard(Block::ID id, uint64_t count);
+
+  // Writes out all dirty data and then all dirty metadata.  The caller
+  // must be between operations, or in one that hasn't changed anything.
+  void flush(bool durable);
+
+  // Writes out one file's dirty data, but no metadata.
+  void flush(INode::ID owner, bool durable);
+
+  // Like sync(), for callers outside any operation: waits for the
+  // running one to finish first.
+  void commit();
+
+  // Bracket an operation.  Metadata is never committed while one is
+  // running (except where it settles), and new ones are held off while
+  // the copies are taken.  An operation that leaves a lot of metadata
+  // dirty commits it on the way out.
+  void begin();
+  void end();
+
+  // Queues blocks to be read into the cache in the background.
+  void prefetch(const std::vector<Block::ID>& ids);
+
+  // Metadata blocks set so far; lets callers tell whether they changed
+  // any.
+  uint64_t changes();
+
+  // Metadata changed now goes out with the batch after epoch(), and has
+  // been written once committed() says so for that epoch.
+  uint64_t epoch();
+  bool     committed(uint64_t epoch);
+
+private:
+  struct Entry {
+    Block      block;
+    INode::ID  owner;
+    bool       dirty;
+    bool       loading; // Being read in by get(), without the lock.
+    uint64_t   version;
+    Clock::time_point dirtied;
+    std::list<Block::ID>::iterator position;
+  };
+
+  Storage*  backing;
+  Journal*  journal;
+  uint64_t  capacity;
+  uint64_t  dirty_limit; // Dirty blocks that wake up the flusher.
+  uint64_t  dirty_max;   // Dirty blocks that make writers flush inline.
+  std::chrono::milliseconds expire;
+
+  std::unordered_map<Block::ID, Entry>     entries;
+  std::list<Block::ID>                     lru;   // Most recently used first.
+  std::map<INode::ID, std::set<Block::ID>> dirty; // Dirty blocks by owner.
+  uint64_t                                 ndirty;
+  uint64_t                                 nchanges;
+  uint64_t                                 copied; // Metadata batches taken.
+  uint64_t                                 done;   // Metadata batches written.
+
+  std::mutex              io;    // Orders writebacks against each other.
+  std::mutex              mutex; // Protects everything above.
+  std::condition_variable wakeup;
+  std::condition_variable loaded;  // Signals entries done loading.
+  std::condition_variable idle;    // Signals changes to busy and waiting.
+  bool                    busy;    // An operation is running.
+  uint64_t                waiting; // Threads waiting to commit.
+  std::thread             flusher;
+  std::deque<Block::ID>   pending; // Blocks waiting to be prefetched.
+  std::condition_variable queued;
+  std::thread             reader;
+  bool                    stopping;
+
+  Entry& lookup(Block::ID id);
+  bool   full();
+  void   evict();
+  void   clean(Block::ID id, Entry& entry);
+  void   commit(std::unique_lock<std::mutex>& lock);
+  void   resume();
+  void   writeback(std::unique_lock<std::mutex>& lock, bool metadata, bool holding = false);
+  void   writeback(std::unique_lock<std::mutex>& lock, const std::vector<Block::ID>& ids, bool holding);
+  void   run();
+  void   readahead();
+};
@@ -0,0 +1,159 @@
+#include "RecordingStorage.h"
+#include "../FSExceptions.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+// Anonymous namespace for file-local helpers:
+namespace {
+  const char MAGIC[8] = {'S', 'I', 'G', 'T', 'R', 'A', 'C', 'E'};
+
+  uint8_t threadNumber() {
+    static std::atomic<unsigned> next(0);
+    static thread_local int number = -1;
+    if(number < 0) {
+      // Past 255 threads they start sharing numbers.
+      number = next.fetch_add(1) % 256;
+    }
+
+    return number;
+  }
+}
+
+const uint32_t RecordingStorage::VERSION;
+const size_t   RecordingStorage::BATCH;
+
+RecordingStorage::RecordingStorage(Storage& storage, const char* path, uint64_t nblocks):
+  backing(&storage),
+  start(std::chrono::steady_clock::now())
+{
+  output = std::fopen(path, "wb");
+  if(output == NULL) {
+    throw IOError(std::string("Could not open trace file ") + path);
+  }
+
+  Header header;
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version     = VERSION;
+  header.block_size  = Block::SIZE;
+  header.block_count = nblocks;
+  if(std::fwrite(&header, sizeof(header), 1, output) != 1) {
+    std::fclose(output);
+    throw IOError(std::string("Could not write trace file ") + path);
+  }
+
+  buffer.reserve(BATCH);
+}
+
+RecordingStorage::~RecordingStorage() {
+  flush();
+  std::fclose(output);
+}
+
+void RecordingStorage::load(const char* path, Header& header, std::vector<Record>& records) {
+  FILE* input = std::fopen(path, "rb");
+  if(input == NULL) {
+    throw IOError(std::string("Could not open trace file ") + path);
+  }
+
+  if(std::fread(&header, sizeof(header), 1, input) != 1 || std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION) {
+    std::fclose(input);
+    throw IOError(std::string("Not a block trace: ") + path);
+  }
+
+  records.clear();
+  std::vector<Record> batch(BATCH);
+  size_t n;
+  while((n = std::fread(&batch[0], sizeof(Record), BATCH, input)) > 0) {
+    records.insert(records.end(), batch.begin(), batch.begin() + n);
+  }
+
+  std::fclose(input);
+}
+
+void RecordingStorage::get(Block::ID id, Block& dst) {
+  log(GET, id, 1);
+  backing->get(id, dst);
+}
+
+void RecordingStorage::set(Block::ID id, const Block& src) {
+  log(SET, id, 1);
+  backing->set(id, src);
+}
+
+void RecordingStorage::getRange(Block::ID id, Block* dst, uint64_t count) {
+  log(GET, id, count);
+  backing->getRange(id, dst, count);
+}
+
+void RecordingStorage::setRange(Block::ID id, const Block* src, uint64_t count) {
+  log(SET, id, count);
+  backing->setRange(id, src, count);
+}
+
+void RecordingStorage::sync() {
+  log(SYNC, 0, 0);
+  backing->sync();
+
+  // A trace that ends at the last sync is still useful after a crash.
+  std::lock_guard<std::mutex> lock(mutex);
+  flush();
+  std::fflush(output);
+}
+
+void RecordingStorage::discard(Block::ID id, uint64_t count) {
+  // Records only have room for 32 bit counts.
+  for(uint64_t done = 0; done < count; done += UINT32_MAX) {
+    log(DISCARD, id + done, std::min<uint64_t>(count - done, UINT32_MAX));
+  }
+
+  backing->discard(id, count);
+}
+
+uint64_t RecordingStorage::capacity() {
+  return backing->capacity();
+}
+
+bool RecordingStorage::resize(uint64_t nblocks) {
+  if(!backing->resize(nblocks)) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  flush();
+  std::fseek(output, offsetof(Header, block_count), SEEK_SET);
+  std::fwrite(&nblocks, sizeof(nblocks), 1, output);
+  std::fseek(output, 0, SEEK_END);
+  return true;
+}
+
+void RecordingStorage::log(Op op, Block::ID id, uint64_t count) {
+  Record record;
+  record.time   = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  record.id     = id;
+  record.count  = count;
+  record.op     = op;
+  record.thread = threadNumber();
+  record.unused = 0;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  buffer.push_back(record);
+  if(buffer.size() >= BATCH) {
+    flush();
+  }
+}
+
+// Called with the lock held (or from the destructor).
+void RecordingStorage::flush() {
+  if(buffer.empty()) return;
+
+  if(std::fwrite(&buffer[0], sizeof(Record), buffer.size(), output) != buffer.size()) {
+    std::cerr << "Block trace write failed; the trace is incomplete.\n";
+  }
+
+  buffer.clear();
+}
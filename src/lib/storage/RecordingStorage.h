@@ -0,0 +1,71 @@
+#pragma once
+
+#include "../Storage.h"
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+// Passes everything through to another Storage and logs each request
+// (when, what, which blocks and from which thread) to a binary trace
+// file, for bin/replay.  Block contents are never recorded.
+//
+// The file is a Header followed by Records in the order the requests
+// were made; all fields are native-endian.
+class RecordingStorage: public Storage {
+public:
+  static const uint32_t VERSION = 1;
+
+  enum Op: uint8_t {
+    GET     = 0, // Reads count blocks starting at id.
+    SET     = 1, // Writes count blocks starting at id.
+    SYNC    = 2, // id and count are zero.
+    DISCARD = 3  // Discards count blocks starting at id.
+  };
+
+  struct Header {
+    char     magic[8];    // "SIGTRACE"
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t block_count; // Of the recorded device.
+  };
+
+  struct Record {
+    uint64_t  time;   // Nanoseconds since recording started.
+    Block::ID id;
+    uint32_t  count;
+    uint8_t   op;
+    uint8_t   thread; // Numbered in order of their first request.
+    uint16_t  unused;
+  };
+
+  RecordingStorage(Storage& backing, const char* path, uint64_t nblocks);
+  ~RecordingStorage();
+
+  // Reads a trace written by this class.  Throws IOError if path isn't one.
+  static void load(const char* path, Header& header, std::vector<Record>& records);
+
+  void get(Block::ID id, Block& dst);
+  void set(Block::ID id, const Block& src);
+  void getRange(Block::ID id, Block* dst, uint64_t count);
+  void setRange(Block::ID id, const Block* src, uint64_t count);
+  void sync();
+  void discard(Block::ID id, uint64_t count);
+
+  // The header's block count follows the device if it grows.
+  uint64_t capacity();
+  bool resize(uint64_t nblocks);
+
+private:
+  static const size_t BATCH = 4096; // Records buffered before writing.
+
+  Storage*            backing;
+  FILE*               output;
+  std::chrono::steady_clock::time_point start;
+  std::vector<Record> buffer;
+  std::mutex          mutex;
+
+  void log(Op op, Block::ID id, uint64_t count);
+  void flush();
+};
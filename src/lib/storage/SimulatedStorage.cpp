@@ -0,0 +1,304 @@
+#include "SimulatedStorage.h"
+#include "../FSExceptions.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
+// Anonymous namespace for file-local helpers:
+namespace {
+  // Sleeping this little overshoots badly, so spin instead.
+  const std::chrono::microseconds SPIN(100);
+
+  // Torn writes keep a whole number of sectors.
+  const uint64_t SECTOR = 512;
+}
+
+bool SimulatedStorage::Profile::get(const std::string& name, Profile& profile) {
+  profile.error_rate  = 0;
+  profile.torn_rate   = 0;
+  profile.crash_after = 0;
+  profile.seed        = 1;
+  profile.sleep       = true;
+
+  if(name == "hdd") {
+    // 7200 RPM: seeks dominate, one request at a time.
+    profile.read_latency  = 100;
+    profile.write_latency = 100;
+    profile.sync_latency  = 10000;
+    profile.seek          = 8000;
+    profile.jitter        = 0.3;
+    profile.bandwidth     = 150;
+    profile.queue_depth   = 1;
+  }
+  else if(name == "sata") {
+    // SATA SSD: no seeks, NCQ, capped by the 6 Gb/s link.
+    profile.read_latency  = 90;
+    profile.write_latency = 60;
+    profile.sync_latency  = 2000;
+    profile.seek          = 0;
+    profile.jitter        = 0.2;
+    profile.bandwidth     = 530;
+    profile.queue_depth   = 32;
+  }
+  else if(name == "nvme") {
+    profile.read_latency  = 20;
+    profile.write_latency = 15;
+    profile.sync_latency  = 200;
+    profile.seek          = 0;
+    profile.jitter        = 0.1;
+    profile.bandwidth     = 3000;
+    profile.queue_depth   = 64;
+  }
+  else if(name == "none") {
+    // As fast as the backing storage; only useful with faults.
+    profile.read_latency  = 0;
+    profile.write_latency = 0;
+    profile.sync_latency  = 0;
+    profile.seek          = 0;
+    profile.jitter        = 0;
+    profile.bandwidth     = 0;
+    profile.queue_depth   = 1;
+  }
+  else {
+    return false;
+  }
+
+  return true;
+}
+
+bool SimulatedStorage::Profile::set(const std::string& option) {
+  size_t split = option.find('=');
+  if(split == std::string::npos) return false;
+
+  std::string name  = option.substr(0, split);
+  std::string value = option.substr(split + 1);
+  double   number   = std::atof(value.c_str());
+  uint64_t count    = std::strtoull(value.c_str(), NULL, 10);
+
+  if(name == "read_latency")       read_latency  = number;
+  else if(name == "write_latency") write_latency = number;
+  else if(name == "sync_latency")  sync_latency  = number;
+  else if(name == "seek")          seek          = number;
+  else if(name == "jitter")        jitter        = number;
+  else if(name == "bandwidth")     bandwidth     = number;
+  else if(name == "queue_depth")   queue_depth   = std::max<uint64_t>(count, 1);
+  else if(name == "error_rate")    error_rate    = number;
+  else if(name == "torn_rate")     torn_rate     = number;
+  else if(name == "crash_after")   crash_after   = count;
+  else if(name == "seed")          seed          = count;
+  else if(name == "sleep")         sleep         = (value == "1" || value == "true");
+  else return false;
+
+  return true;
+}
+
+bool SimulatedStorage::Profile::parse(const std::string& spec, Profile& profile) {
+  std::istringstream stream(spec);
+  std::string part;
+  std::getline(stream, part, ',');
+  if(!get(part, profile)) return false;
+
+  while(std::getline(stream, part, ',')) {
+    if(!profile.set(part)) return false;
+  }
+
+  return true;
+}
+
+SimulatedStorage::SimulatedStorage(Storage& storage, const Profile& profile):
+  backing(&storage),
+  profile(profile),
+  channels(profile.queue_depth, Clock::now()),
+  bus(Clock::now()),
+  next(0),
+  writes(0),
+  crashed(false),
+  rng(profile.seed)
+{
+  std::memset(&counters, 0, sizeof(counters));
+}
+
+void SimulatedStorage::get(Block::ID id, Block& dst) {
+  getRange(id, &dst, 1);
+}
+
+void SimulatedStorage::set(Block::ID id, const Block& src) {
+  setRange(id, &src, 1);
+}
+
+void SimulatedStorage::getRange(Block::ID id, Block* dst, uint64_t count) {
+  Clock::time_point done;
+  if(schedule(profile.read_latency, id, count, false, done) == ERROR) {
+    throw IOError("Simulated read error at block " + std::to_string(id));
+  }
+
+  backing->getRange(id, dst, count);
+  wait(done);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for(uint64_t i = 0; crashed && i < count; ++i) {
+    auto itr = overlay.find(id + i);
+    if(itr != overlay.end()) dst[i] = itr->second;
+  }
+}
+
+void SimulatedStorage::setRange(Block::ID id, const Block* src, uint64_t count) {
+  Clock::time_point done;
+  switch(schedule(profile.write_latency, id, count, true, done)) {
+  case ERROR:
+    throw IOError("Simulated write error at block " + std::to_string(id));
+  case TORN:
+    tear(id, src, count);
+    throw IOError("Simulated torn write at block " + std::to_string(id));
+  case CRASH:
+    tear(id, src, count);
+    remember(id, src, count);
+    break;
+  case LOST:
+    remember(id, src, count);
+    break;
+  default:
+    backing->setRange(id, src, count);
+  }
+
+  wait(done);
+}
+
+void SimulatedStorage::sync() {
+  Clock::time_point done;
+  Fault fault = schedule(profile.sync_latency, 0, 0, true, done);
+  if(fault == ERROR) {
+    throw IOError("Simulated sync error");
+  }
+
+  if(fault == NONE) backing->sync();
+  wait(done);
+}
+
+// Discards take as long as a sync, and are lost in a crash like writes
+// (blocks in the overlay keep what was written to them).
+void SimulatedStorage::discard(Block::ID id, uint64_t count) {
+  Clock::time_point done;
+  Fault fault = schedule(profile.sync_latency, 0, 0, true, done);
+  if(fault == ERROR) {
+    throw IOError("Simulated discard error at block " + std::to_string(id));
+  }
+
+  if(fault == NONE) backing->discard(id, count);
+  wait(done);
+}
+
+uint64_t SimulatedStorage::capacity() {
+  return backing->capacity();
+}
+
+bool SimulatedStorage::resize(uint64_t nblocks) {
+  return backing->resize(nblocks);
+}
+
+SimulatedStorage::Stats SimulatedStorage::stats() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return counters;
+}
+
+// Decides when the request finishes and whether it fails.  Syncs count
+// as writes; they don't move data but they're lost in a crash all the same.
+SimulatedStorage::Fault SimulatedStorage::schedule(double latency, Block::ID id, uint64_t count, bool write, Clock::time_point& done) {
+  std::lock_guard<std::mutex> lock(mutex);
+  counters.requests += 1;
+
+  if(write && crashed) {
+    counters.lost += 1;
+    done = Clock::now();
+    return LOST;
+  }
+
+  if(write && count > 0 && profile.crash_after > 0 && ++writes >= profile.crash_after) {
+    crashed = true;
+    counters.torn += 1;
+    done = Clock::now();
+    return CRASH;
+  }
+
+  Fault fault = NONE;
+  if(profile.error_rate > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < profile.error_rate) {
+    fault = ERROR;
+  }
+  else if(write && count > 0 && profile.torn_rate > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < profile.torn_rate) {
+    fault = TORN;
+  }
+
+  if(fault != NONE) {
+    counters.errors += 1;
+    if(fault == TORN) counters.torn += 1;
+    done = Clock::now();
+    return fault;
+  }
+
+  double service = latency;
+  if(count > 0 && id != next) service += profile.seek;
+  if(profile.jitter > 0) service *= std::lognormal_distribution<double>(0, profile.jitter)(rng);
+  if(count > 0) next = id + count;
+
+  // The channel that frees up first takes the request.
+  Clock::time_point now   = Clock::now();
+  Clock::time_point& slot = *std::min_element(channels.begin(), channels.end());
+  Clock::time_point start = std::max(now, slot);
+  done = start + std::chrono::nanoseconds(uint64_t(service * 1000));
+
+  if(profile.bandwidth > 0 && count > 0) {
+    double transfer = count * Block::SIZE / profile.bandwidth * 1000; // MB/s -> ns.
+    bus  = std::max(bus, start) + std::chrono::nanoseconds(uint64_t(transfer));
+    done = std::max(done, bus);
+  }
+
+  slot = done;
+  counters.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(done - start).count();
+  return NONE;
+}
+
+void SimulatedStorage::wait(Clock::time_point done) {
+  if(!profile.sleep) return;
+
+  if(done - Clock::now() > SPIN) {
+    std::this_thread::sleep_until(done - SPIN);
+  }
+
+  while(Clock::now() < done) {
+    std::this_thread::yield();
+  }
+}
+
+void SimulatedStorage::remember(Block::ID id, const Block* src, uint64_t count) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for(uint64_t i = 0; i < count; ++i) {
+    overlay[id + i] = src[i];
+  }
+}
+
+// Writes some prefix of the request, down to the sector.
+void SimulatedStorage::tear(Block::ID id, const Block* src, uint64_t count) {
+  uint64_t sectors;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    sectors = rng() % (count * Block::SIZE / SECTOR);
+  }
+
+  uint64_t bytes = sectors * SECTOR;
+  uint64_t whole = bytes / Block::SIZE;
+  if(whole > 0) {
+    backing->setRange(id, src, whole);
+  }
+
+  uint64_t rest = bytes % Block::SIZE;
+  if(rest > 0) {
+    Block block;
+    backing->get(id + whole, block);
+    std::memcpy(block.data, src[whole].data, rest);
+    backing->set(id + whole, block);
+  }
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "../Storage.h"
+
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Makes another Storage behave like a slower device: every request is
+// held back until a model of an HDD, SATA SSD or NVMe drive says it
+// would have finished, and requests can be made to fail.
+//
+// The model has queue_depth channels, each serving one request at a
+// time (latency plus a seek when the request isn't sequential), and one
+// shared bus that moves bandwidth bytes per second.  Random draws come
+// from a seeded generator, so a single-threaded run makes the same
+// delays and fails the same requests every time.
+//
+// For crash testing, crash_after=N tears the Nth write, and every write
+// and sync after it only goes to an overlay in memory.  The caller sees
+// all of its writes and carries on (and shuts down cleanly), while the
+// backing storage stays as a power cut would have left it.
+class SimulatedStorage: public Storage {
+public:
+  struct Profile {
+    double   read_latency;  // Microseconds of service time per request.
+    double   write_latency;
+    double   sync_latency;  // Cache flush.
+    double   seek;          // Extra microseconds for non-sequential requests.
+    double   jitter;        // Log-normal sigma of the service time (0 for none).
+    double   bandwidth;     // MB/s over the bus (0 for unlimited).
+    uint32_t queue_depth;   // Requests served at once; the rest wait.
+    double   error_rate;    // Chance any request fails with an IOError.
+    double   torn_rate;     // Chance a write lands only partly, then fails.
+    uint64_t crash_after;   // Power fails during this write (0 for never); see below.
+    uint64_t seed;
+    bool     sleep;         // Wait in real time, or only keep count (sleep=0).
+
+    // Looks up a named profile: "hdd", "sata", "nvme" or "none".
+    static bool get(const std::string& name, Profile& profile);
+
+    // Applies a "name=value" override.
+    bool set(const std::string& option);
+
+    // "<profile>[,name=value...]", as given to -E.
+    static bool parse(const std::string& spec, Profile& profile);
+  };
+
+  struct Stats {
+    uint64_t requests;
+    uint64_t errors;      // Requests failed on purpose (torn ones included).
+    uint64_t torn;        // Writes that partly landed.
+    uint64_t lost;        // Writes and syncs after the crash.
+    uint64_t nanoseconds; // Simulated time the device was busy.
+  };
+
+  SimulatedStorage(Storage& backing, const Profile& profile);
+
+  void get(Block::ID id, Block& dst);
+  void set(Block::ID id, const Block& src);
+  void getRange(Block::ID id, Block* dst, uint64_t count);
+  void setRange(Block::ID id, const Block* src, uint64_t count);
+  void sync();
+  void discard(Block::ID id, uint64_t count);
+  uint64_t capacity();
+  bool resize(uint64_t nblocks);
+
+  Stats stats();
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  enum Fault {
+    NONE,
+    ERROR, // Fail without touching the disk.
+    TORN,  // Write part of it, then fail.
+    CRASH, // Write part of it and pretend it all went well.
+    LOST   // Only write it to the overlay.
+  };
+
+  Storage*                       backing;
+  Profile                        profile;
+  std::vector<Clock::time_point> channels; // When each one is next free.
+  Clock::time_point              bus;      // When the bus is next free.
+  Block::ID                      next;     // Where a sequential request would start.
+  uint64_t                       writes;
+  bool                           crashed;
+  std::unordered_map<Block::ID, Block> overlay; // Written after the crash.
+  std::mt19937_64                rng;
+  Stats                          counters;
+  std::mutex                     mutex;
+
+  Fault schedule(double latency, Block::ID id, uint64_t count, bool write, Clock::time_point& done);
+  void  wait(Clock::time_point done);
+  void  tear(Block::ID id, const Block* src, uint64_t count);
+  void  remember(Block::ID id, const Block* src, uint64_t count);
+};
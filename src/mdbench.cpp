@@ -0,0 +1,350 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// mdtest-style metadata benchmark.  Builds a directory tree on a mounted
+// filesystem, then has each thread create, stat, rename and unlink its
+// own files in every leaf directory, one phase at a time, and prints a
+// CSV line per phase and thread count.  Everything goes through the
+// kernel, so it measures the fuse.cpp entry points as applications see
+// them.
+
+typedef std::chrono::steady_clock Clock;
+
+// Anonymous namespace for file-local helpers:
+namespace {
+  const char* PHASES[4] = {"create", "stat", "rename", "unlink"};
+
+  struct Config {
+    std::string root;    // Scratch directory on the mount.
+    uint64_t    items;   // Files per thread per leaf directory.
+    uint64_t    depth;   // Directory levels below the root.
+    uint64_t    fanout;  // Subdirectories per directory.
+    bool        unique;  // A tree per thread instead of one shared tree.
+  };
+
+  struct Worker {
+    std::vector<uint64_t> latencies; // Nanoseconds.
+    std::exception_ptr    error;
+  };
+
+  void fail(const std::string& what, const std::string& path) {
+    throw std::runtime_error(what + " " + path + ": " + strerror(errno));
+  }
+
+  // Leaf directories of a tree of the given shape, relative to its root.
+  std::vector<std::string> leaves(uint64_t depth, uint64_t fanout) {
+    std::vector<std::string> result(1, "");
+    for(uint64_t level = 0; level < depth; ++level) {
+      std::vector<std::string> next;
+      for(const std::string& parent: result) {
+        for(uint64_t i = 0; i < fanout; ++i) {
+          next.push_back(parent + "/d" + std::to_string(i));
+        }
+      }
+
+      result.swap(next);
+    }
+
+    return result;
+  }
+
+  // Parents before children, so mkdir in this order and rmdir in reverse.
+  std::vector<std::string> tree(const std::string& root, uint64_t depth, uint64_t fanout) {
+    std::vector<std::string> result(1, root);
+    for(uint64_t level = 1; level <= depth; ++level) {
+      for(const std::string& dir: leaves(level, fanout)) {
+        result.push_back(root + dir);
+      }
+    }
+
+    return result;
+  }
+
+  std::vector<std::string> trees(const Config& config, unsigned threads) {
+    if(!config.unique) return tree(config.root + "/shared", config.depth, config.fanout);
+
+    std::vector<std::string> result;
+    for(unsigned t = 0; t < threads; ++t) {
+      std::vector<std::string> dirs = tree(config.root + "/t" + std::to_string(t), config.depth, config.fanout);
+      result.insert(result.end(), dirs.begin(), dirs.end());
+    }
+
+    return result;
+  }
+
+  void run(const Config& config, const std::vector<std::string>& dirs, int phase, unsigned t, Worker* worker) try {
+    std::string prefix = "/f" + std::to_string(t) + ".";
+    for(const std::string& dir: dirs) {
+      for(uint64_t i = 0; i < config.items; ++i) {
+        std::string path = dir + prefix + std::to_string(i);
+        std::string renamed = path + ".r";
+        struct stat info;
+
+        Clock::time_point before = Clock::now();
+        switch(phase) {
+        case 0: {
+          int fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+          if(fd < 0) fail("create", path);
+          close(fd);
+          break;
+        }
+        case 1:
+          if(stat(path.c_str(), &info) != 0) fail("stat", path);
+          break;
+        case 2:
+          if(rename(path.c_str(), renamed.c_str()) != 0) fail("rename", path);
+          break;
+        default:
+          if(unlink(renamed.c_str()) != 0) fail("unlink", renamed);
+          break;
+        }
+
+        worker->latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - before).count());
+      }
+    }
+  }
+  catch(...) {
+    worker->error = std::current_exception();
+  }
+
+  double percentile(const std::vector<uint64_t>& sorted, double q) {
+    if(sorted.empty()) return 0;
+    return sorted[std::min<size_t>(sorted.size() - 1, q * sorted.size())] / 1000.0;
+  }
+
+  // Runs every phase with the given number of threads; the tree is made
+  // and removed around them, untimed.
+  void benchmark(const Config& config, unsigned threads) {
+    std::vector<std::string> dirs = trees(config, threads);
+    for(const std::string& dir: dirs) {
+      if(mkdir(dir.c_str(), 0755) != 0) fail("mkdir", dir);
+    }
+
+    std::vector<std::vector<std::string>> work(threads);
+    std::vector<std::string> relative = leaves(config.depth, config.fanout);
+    for(unsigned t = 0; t < threads; ++t) {
+      std::string root = config.root + (config.unique ? "/t" + std::to_string(t) : std::string("/shared"));
+      for(const std::string& leaf: relative) work[t].push_back(root + leaf);
+    }
+
+    uint64_t entries = config.items * (config.unique ? 1 : threads);
+    for(int phase = 0; phase < 4; ++phase) {
+      std::vector<Worker> workers(threads);
+      std::vector<std::thread> pool;
+      Clock::time_point start = Clock::now();
+      for(unsigned t = 0; t < threads; ++t) {
+        pool.push_back(std::thread(run, std::cref(config), std::cref(work[t]), phase, t, &workers[t]));
+      }
+
+      for(std::thread& thread: pool) thread.join();
+      double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count() / 1e9;
+      for(Worker& worker: workers) {
+        if(worker.error) std::rethrow_exception(worker.error);
+      }
+
+      std::vector<uint64_t> latencies;
+      for(Worker& worker: workers) {
+        latencies.insert(latencies.end(), worker.latencies.begin(), worker.latencies.end());
+      }
+
+      std::sort(latencies.begin(), latencies.end());
+      uint64_t sum = 0;
+      for(uint64_t latency: latencies) sum += latency;
+
+      std::cout << PHASES[phase] << ',' << threads << ',' << entries << ',' << config.depth << ',' << config.fanout << ','
+                << (config.unique ? "unique" : "shared") << ',' << latencies.size() << ',' << seconds << ','
+                << latencies.size() / seconds << ',' << (latencies.empty() ? 0 : sum / 1000.0 / latencies.size()) << ','
+                << percentile(latencies, 0.5) << ',' << percentile(latencies, 0.9) << ',' << percentile(latencies, 0.99) << ','
+                << (latencies.empty() ? 0 : latencies.back() / 1000.0) << std::endl;
+    }
+
+    for(auto itr = dirs.rbegin(); itr != dirs.rend(); ++itr) {
+      if(rmdir(itr->c_str()) != 0) fail("rmdir", *itr);
+    }
+  }
+
+  bool mounted(const std::string& path) {
+    struct stat mount;
+    struct stat parent;
+    if(stat(path.c_str(), &mount) != 0) return false;
+    if(stat((path + "/..").c_str(), &parent) != 0) return false;
+    return mount.st_dev != parent.st_dev;
+  }
+
+  // Starts bin/fuse (next to this binary) on the mount point and waits
+  // for the mount to show up.  Returns its pid.
+  pid_t mount(const char* self, const std::string& arguments, const std::string& path) {
+    std::string program(self);
+    size_t slash = program.rfind('/');
+    program = (slash == std::string::npos ? std::string("") : program.substr(0, slash + 1)) + "fuse";
+
+    std::vector<std::string> words;
+    std::istringstream stream(arguments);
+    for(std::string word; stream >> word;) words.push_back(word);
+    words.push_back(path);
+
+    std::vector<char*> args(1, (char*) program.c_str());
+    for(std::string& word: words) args.push_back((char*) word.c_str());
+    args.push_back(NULL);
+
+    pid_t pid = fork();
+    if(pid < 0) fail("fork", program);
+    if(pid == 0) {
+      execv(program.c_str(), &args[0]);
+      std::cerr << "mdbench: " << program << ": " << strerror(errno) << '\n';
+      _exit(1);
+    }
+
+    for(int i = 0; i < 1000; ++i) {
+      if(mounted(path)) return pid;
+      if(waitpid(pid, NULL, WNOHANG) == pid) {
+        throw std::runtime_error(program + " exited before mounting " + path);
+      }
+
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    throw std::runtime_error("Timed out waiting for " + path + " to be mounted");
+  }
+
+  void unmount(pid_t pid) {
+    // Same as bin/test: SIGTERM makes FUSE unmount and exit.
+    kill(pid, SIGTERM);
+    for(int i = 0; i < 500; ++i) {
+      if(waitpid(pid, NULL, WNOHANG) == pid) return;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+  }
+}
+
+static void usage(const char* message = NULL) {
+  if(message) std::cerr << message << "\n\n";
+  std::cerr << "USAGE: mdbench [options] <mount-point>\n";
+  std::cerr << "  --fuse    -F <str>  Mount with bin/fuse and these arguments first (e.g. \"-n 262144 -p\");\n";
+  std::cerr << "                      otherwise the mount point must already be mounted.\n";
+  std::cerr << "  --threads -t <list> Comma-separated thread counts to run (defaults to 1,2,4,8).\n";
+  std::cerr << "  --items   -n <num>  Files per thread in each leaf directory (defaults to 1000).\n";
+  std::cerr << "  --depth   -d <num>  Directory levels below the root (defaults to 0).\n";
+  std::cerr << "  --fanout  -b <num>  Subdirectories per directory (defaults to 1).\n";
+  std::cerr << "  --unique  -u        Give each thread its own tree instead of sharing one.\n";
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  Config config;
+  config.items  = 1000;
+  config.depth  = 0;
+  config.fanout = 1;
+  config.unique = false;
+
+  const char* fuse_args = NULL;
+  std::vector<unsigned> thread_counts;
+
+  struct option options[] = {
+    {"fuse",    required_argument, 0, 'F'},
+    {"threads", required_argument, 0, 't'},
+    {"items",   required_argument, 0, 'n'},
+    {"depth",   required_argument, 0, 'd'},
+    {"fanout",  required_argument, 0, 'b'},
+    {"unique",        no_argument, 0, 'u'},
+    {0, 0, 0, 0}
+  };
+
+  while(true) {
+    int c = getopt_long(argc, argv, "F:t:n:d:b:u", options, NULL);
+    if(c == -1) break;
+
+    switch(c) {
+    case 'F':
+      fuse_args = optarg;
+      break;
+    case 't': {
+      std::istringstream stream(optarg);
+      for(std::string count; std::getline(stream, count, ',');) {
+        int n = atoi(count.c_str());
+        if(n <= 0) usage("Thread counts must be positive.");
+        thread_counts.push_back(n);
+      }
+      break;
+    }
+    case 'n':
+      config.items = atoll(optarg);
+      break;
+    case 'd':
+      config.depth = atoll(optarg);
+      break;
+    case 'b':
+      config.fanout = atoll(optarg);
+      break;
+    case 'u':
+      config.unique = true;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind != argc - 1) {
+    usage("Expected one mount point.");
+  }
+
+  if(config.fanout == 0) {
+    usage("Fanout must be at least 1.");
+  }
+
+  if(thread_counts.empty()) {
+    thread_counts = {1, 2, 4, 8};
+  }
+
+  std::string mount_point(argv[optind]);
+  pid_t pid = 0;
+  int status = 0;
+  try {
+    if(fuse_args != NULL) {
+      pid = mount(argv[0], fuse_args, mount_point);
+    }
+    else if(!mounted(mount_point)) {
+      usage("Nothing is mounted there; use -F to mount it.");
+    }
+
+    config.root = mount_point + "/mdbench." + std::to_string(getpid());
+    if(mkdir(config.root.c_str(), 0755) != 0) fail("mkdir", config.root);
+
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "phase,threads,entries,depth,fanout,tree,ops,seconds,ops_per_s,mean_us,p50_us,p90_us,p99_us,max_us" << std::endl;
+    for(unsigned threads: thread_counts) {
+      benchmark(config, threads);
+    }
+
+    if(rmdir(config.root.c_str()) != 0) fail("rmdir", config.root);
+  }
+  catch(std::exception& ex) {
+    std::cerr << "mdbench: " << ex.what() << '\n';
+    status = 1;
+  }
+
+  if(pid > 0) unmount(pid);
+  return status;
+}
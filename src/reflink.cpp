@@ -0,0 +1,66 @@
+#include "lib/Ioctl.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Copies a file within a mounted filesystem by sharing its data blocks
+// (like cp --reflink=always).
+
+int main(int argc, char** argv) {
+  if(argc != 3) {
+    std::cerr << "USAGE: reflink <source> <destination>\n";
+    return 1;
+  }
+
+  int src = open(argv[1], O_RDONLY);
+  if(src < 0) {
+    std::cerr << argv[1] << ": " << strerror(errno) << '\n';
+    return 1;
+  }
+
+  struct stat info;
+  if(fstat(src, &info) != 0 || !S_ISREG(info.st_mode)) {
+    std::cerr << argv[1] << ": Not a regular file\n";
+    close(src);
+    return 1;
+  }
+
+  int dst = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, info.st_mode & 0777);
+  if(dst < 0) {
+    std::cerr << argv[2] << ": " << strerror(errno) << '\n';
+    close(src);
+    return 1;
+  }
+
+  struct stat dst_info;
+  if(fstat(dst, &dst_info) != 0 || dst_info.st_dev != info.st_dev) {
+    std::cerr << argv[2] << ": Not on the same filesystem as " << argv[1] << '\n';
+    close(src);
+    close(dst);
+    return 1;
+  }
+
+  CloneRequest request;
+  request.src_ino    = info.st_ino;
+  request.src_offset = 0;
+  request.dst_offset = 0;
+  request.length     = info.st_size;
+
+  int result = 0;
+  if(ioctl(dst, SIGSEGV_IOC_CLONE_RANGE, &request) != 0) {
+    std::cerr << "reflink " << argv[1] << ": " << strerror(errno) << '\n';
+    result = 1;
+  }
+  else if(request.length != (uint64_t) info.st_size) {
+    std::cerr << "reflink " << argv[1] << ": Source changed size\n";
+    result = 1;
+  }
+
+  close(src);
+  close(dst);
+  return result;
+}
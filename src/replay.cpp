@@ -0,0 +1,242 @@
+#include "lib/storage/FileStorage.h"
+#include "lib/storage/MemoryStorage.h"
+#include "lib/storage/PageCache.h"
+#include "lib/storage/RecordingStorage.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Replays a block trace recorded with fuse -R against a storage backend
+// and reports how fast it went.
+
+typedef std::chrono::steady_clock Clock;
+
+struct Worker {
+  std::vector<const RecordingStorage::Record*> records;
+  std::vector<uint64_t> latencies[4]; // Nanoseconds, by op.
+  uint64_t blocks[4];
+  uint64_t lag; // Furthest behind schedule, in nanoseconds.
+  std::thread thread;
+  std::exception_ptr error;
+};
+
+static void usage(const char* message = NULL) {
+  if(message) std::cerr << message << "\n\n";
+  std::cerr << "USAGE: replay [options] <trace>\n";
+  std::cerr << "  --disk-file   -f <str>  Replay against this file (its contents are overwritten).\n";
+  std::cerr << "  --block-count -n <num>  Size of the device (defaults to the recorded size).\n";
+  std::cerr << "  --cache-size  -c <num>  Put a page cache of this many blocks in front.\n";
+  std::cerr << "  --speed       -s <str>  original (keep the recorded timing; default) or max.\n";
+  std::cerr << "  --parallel    -p        Replay each recorded thread on its own thread.\n";
+  exit(1);
+}
+
+static void replay(Storage* storage, Worker* worker, Clock::time_point start, bool timed) try {
+  std::vector<Block> buffer;
+  for(const RecordingStorage::Record* record: worker->records) {
+    if(timed) {
+      Clock::time_point due = start + std::chrono::nanoseconds(record->time);
+      Clock::time_point now = Clock::now();
+      if(due > now) std::this_thread::sleep_until(due);
+      else worker->lag = std::max<uint64_t>(worker->lag, std::chrono::duration_cast<std::chrono::nanoseconds>(now - due).count());
+    }
+
+    if(record->op != RecordingStorage::DISCARD && buffer.size() < record->count) {
+      buffer.resize(record->count);
+    }
+
+    // Written blocks get recognizable (if meaningless) contents.
+    for(uint64_t i = 0; record->op == RecordingStorage::SET && i < record->count; ++i) {
+      Block::ID id = record->id + i;
+      std::memcpy(buffer[i].data, &id, sizeof(id));
+    }
+
+    Clock::time_point before = Clock::now();
+    switch(record->op) {
+    case RecordingStorage::GET:
+      storage->getRange(record->id, &buffer[0], record->count);
+      break;
+    case RecordingStorage::SET:
+      storage->setRange(record->id, &buffer[0], record->count);
+      break;
+    case RecordingStorage::DISCARD:
+      storage->discard(record->id, record->count);
+      break;
+    default:
+      storage->sync();
+      break;
+    }
+
+    uint64_t op = std::min<uint64_t>(record->op, 3);
+    worker->latencies[op].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - before).count());
+    worker->blocks[op] += record->count;
+  }
+}
+catch(...) {
+  worker->error = std::current_exception();
+}
+
+static double percentile(const std::vector<uint64_t>& sorted, double q) {
+  if(sorted.empty()) return 0;
+  return sorted[std::min<size_t>(sorted.size() - 1, q * sorted.size())] / 1000.0;
+}
+
+int main(int argc, char** argv) {
+  const char* disk_file   = NULL;
+  uint64_t    block_count = 0;
+  uint64_t    cache_size  = 0;
+  bool        timed       = true;
+  bool        parallel    = false;
+
+  struct option options[] = {
+    {"disk-file",   required_argument, 0, 'f'},
+    {"block-count", required_argument, 0, 'n'},
+    {"cache-size",  required_argument, 0, 'c'},
+    {"speed",       required_argument, 0, 's'},
+    {"parallel",          no_argument, 0, 'p'},
+    {0, 0, 0, 0}
+  };
+
+  while(true) {
+    int c = getopt_long(argc, argv, "f:n:c:s:p", options, NULL);
+    if(c == -1) break;
+
+    switch(c) {
+    case 'f':
+      disk_file = optarg;
+      break;
+    case 'n':
+      block_count = atoll(optarg);
+      break;
+    case 'c':
+      cache_size = atoll(optarg);
+      break;
+    case 's':
+      if(std::strcmp(optarg, "original") == 0) timed = true;
+      else if(std::strcmp(optarg, "max") == 0) timed = false;
+      else usage("Unknown speed.");
+      break;
+    case 'p':
+      parallel = true;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind != argc - 1) {
+    usage("Expected one trace file.");
+  }
+
+  try {
+    RecordingStorage::Header header;
+    std::vector<RecordingStorage::Record> records;
+    RecordingStorage::load(argv[optind], header, records);
+    if(header.block_size != Block::SIZE) {
+      usage("The trace was recorded with a different block size.");
+    }
+
+    if(block_count == 0) {
+      block_count = header.block_count;
+    }
+
+    for(const RecordingStorage::Record& record: records) {
+      if(record.op != RecordingStorage::SYNC && (record.id >= block_count || record.count > block_count - record.id)) {
+        usage("The trace touches blocks beyond the end of the device.");
+      }
+    }
+
+    Storage* disk = NULL;
+    if(disk_file != NULL) {
+      // Make sure the whole device can be read.
+      Block block;
+      std::memset(block.data, 0, Block::SIZE);
+      disk = new FileStorage(disk_file, block_count);
+      disk->set(block_count - 1, block);
+    }
+    else {
+      disk = new MemoryStorage(block_count);
+    }
+
+    PageCache* cache   = NULL;
+    Storage*   storage = disk;
+    if(cache_size > 0) {
+      cache   = new PageCache(*disk, cache_size);
+      storage = cache;
+    }
+
+    std::vector<Worker> workers(parallel ? 256 : 1);
+    for(const RecordingStorage::Record& record: records) {
+      workers[parallel ? record.thread : 0].records.push_back(&record);
+    }
+
+    Clock::time_point start = Clock::now();
+    for(Worker& worker: workers) {
+      std::memset(worker.blocks, 0, sizeof(worker.blocks));
+      worker.lag = 0;
+      if(!worker.records.empty()) {
+        worker.thread = std::thread(replay, storage, &worker, start, timed);
+      }
+    }
+
+    for(Worker& worker: workers) {
+      if(worker.thread.joinable()) worker.thread.join();
+    }
+
+    for(Worker& worker: workers) {
+      if(worker.error) std::rethrow_exception(worker.error);
+    }
+
+    // Whatever the cache still holds is part of the work.
+    delete cache;
+    delete disk;
+    double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count() / 1e9;
+
+    const char* names[4] = {"get", "set", "sync", "discard"};
+    uint64_t total_blocks = 0;
+    uint64_t lag = 0;
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "op count blocks mean_us p50_us p90_us p99_us p999_us max_us\n";
+    for(int op = 0; op < 4; ++op) {
+      std::vector<uint64_t> latencies;
+      uint64_t blocks = 0;
+      for(const Worker& worker: workers) {
+        latencies.insert(latencies.end(), worker.latencies[op].begin(), worker.latencies[op].end());
+        blocks += worker.blocks[op];
+        lag = std::max(lag, worker.lag);
+      }
+
+      std::sort(latencies.begin(), latencies.end());
+      uint64_t sum = 0;
+      for(uint64_t latency: latencies) sum += latency;
+
+      if(op != RecordingStorage::DISCARD) total_blocks += blocks;
+      std::cout << names[op] << ' ' << latencies.size() << ' ' << blocks << ' '
+                << (latencies.empty() ? 0 : sum / 1000.0 / latencies.size()) << ' '
+                << percentile(latencies, 0.5) << ' ' << percentile(latencies, 0.9) << ' '
+                << percentile(latencies, 0.99) << ' ' << percentile(latencies, 0.999) << ' '
+                << (latencies.empty() ? 0 : latencies.back() / 1000.0) << '\n';
+    }
+
+    std::cout << "Replayed " << records.size() << " requests (" << total_blocks << " blocks) in " << seconds << " s: "
+              << records.size() / seconds << " requests/s, " << total_blocks * Block::SIZE / seconds / 1e6 << " MB/s\n";
+    if(timed) {
+      std::cout << "Recorded duration " << (records.empty() ? 0 : records.back().time / 1e9) << " s; fell behind schedule by up to "
+                << lag / 1e6 << " ms\n";
+    }
+  }
+  catch(std::exception& ex) {
+    std::cerr << "replay: " << ex.what() << '\n';
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,44 @@
+#include "lib/Ioctl.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+static void usage() {
+  std::cerr << "USAGE: resize <mount-point> [<blocks>]\n";
+  std::cerr << "Grows a mounted filesystem to the given number of blocks, or to fill\n";
+  std::cerr << "its device (after the device itself has grown).  Disk files are\n";
+  std::cerr << "extended as needed.\n";
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  if(argc != 2 && argc != 3) usage();
+
+  GrowRequest args;
+  args.block_count = 0;
+  if(argc == 3) {
+    char* end;
+    args.block_count = std::strtoull(argv[2], &end, 10);
+    if(*end != '\0' || args.block_count == 0) usage();
+  }
+
+  int fd = open(argv[1], O_RDONLY);
+  if(fd < 0) {
+    std::cerr << argv[1] << ": " << strerror(errno) << '\n';
+    return 1;
+  }
+
+  if(ioctl(fd, SIGSEGV_IOC_GROW, &args) != 0) {
+    std::cerr << "resize " << argv[1] << ": " << strerror(errno) << '\n';
+    close(fd);
+    return 1;
+  }
+
+  std::cout << argv[1] << ": " << args.block_count << " blocks\n";
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,50 @@
+#include "lib/Ioctl.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+static void usage() {
+  std::cerr << "USAGE: snapshot <mount-point> create <name>\n";
+  std::cerr << "       snapshot <mount-point> delete <name>\n";
+  std::cerr << "Mount a snapshot read-only with: fuse -f <disk-file> -S <name> <mount-point>\n";
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  if(argc != 4) usage();
+
+  std::string command(argv[2]);
+  std::string name(argv[3]);
+  unsigned long request;
+  if(command == "create")      request = SIGSEGV_IOC_SNAPSHOT;
+  else if(command == "delete") request = SIGSEGV_IOC_DELETE_SNAPSHOT;
+  else usage();
+
+  SnapshotRequest args;
+  if(name.empty() || name.size() >= sizeof(args.name)) {
+    std::cerr << "Snapshot names must be 1 to " << sizeof(args.name) - 1 << " characters.\n";
+    return 1;
+  }
+
+  std::memset(&args, 0, sizeof(args));
+  std::memcpy(args.name, name.data(), name.size());
+
+  int fd = open(argv[1], O_RDONLY);
+  if(fd < 0) {
+    std::cerr << argv[1] << ": " << strerror(errno) << '\n';
+    return 1;
+  }
+
+  if(ioctl(fd, request, &args) != 0) {
+    std::cerr << command << ' ' << name << ": " << strerror(errno) << '\n';
+    close(fd);
+    return 1;
+  }
+
+  close(fd);
+  return 0;
+}
@@ -14,8 +14,17 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 
+#include "lib/Ioctl.h"
 
+// copy_file_range(2) has a glibc wrapper since 2.27.
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+  #define HAVE_COPY_FILE_RANGE
+#endif
+
+
+static char basedir[1024];
 static char testfile[1024];
 static char testfile2[1024];
 static char testdir[1024];
@@ -34,6 +43,7 @@ static char testdata2[] = "1234567890-=qwertyuiop[]\asdfghjkl;'zxcvbnm,./";
 static const char *testdir_files[] = { "f1", "f2", NULL};
 static long seekdir_offsets[4];
 static char zerodata[4096];
+static char bigdata[3 * 4096 + 1000];
 static int testdatalen = sizeof(testdata) - 1;
 static int testdata2len = sizeof(testdata2) - 1;
 static unsigned int testnum = 1;
@@ -1238,6 +1248,59 @@ static int test_symlink(void)
   return 0;
 }
 
+static int test_symlink_inline(void)
+{
+  char buf[2048];
+  char target[1001];
+  struct stat stbuf;
+  int lens[2] = { 20, 1000 };
+  int err = 0;
+  int res;
+  int i;
+
+  start_test("symlink targets inline and in a block");
+  for (i = 0; i < 2; i++) {
+    memcpy(target, bigdata, lens[i]);
+    target[lens[i]] = '\0';
+
+    unlink(testfile2);
+    res = symlink(target, testfile2);
+    if (res == -1) {
+      PERROR("symlink");
+      return -1;
+    }
+    res = lstat(testfile2, &stbuf);
+    if (res == -1) {
+      PERROR("lstat");
+      return -1;
+    }
+    /* Short targets fit in the INode */
+    if ((lens[i] < 190) != (stbuf.st_blocks == 0)) {
+      ERROR("%u byte target takes %u blocks", lens[i], (unsigned) stbuf.st_blocks);
+      err--;
+    }
+    res = readlink(testfile2, buf, sizeof(buf));
+    if (res == -1) {
+      PERROR("readlink");
+      err--;
+    }
+    else if (res != lens[i] || memcmp(buf, target, lens[i]) != 0) {
+      ERROR("link mismatch");
+      err--;
+    }
+    res = unlink(testfile2);
+    if (res == -1) {
+      PERROR("unlink");
+      return -1;
+    }
+  }
+  if (err)
+    return -1;
+
+  success();
+  return 0;
+}
+
 static int test_link(void)
 {
   const char *data = testdata;
@@ -1765,6 +1828,601 @@ static int do_test_create_ro_dir(int flags, const char *flags_str)
   return 0;
 }
 
+static int test_inline_data(void)
+{
+  int res;
+  int fd;
+  int err = 0;
+
+  start_test("inline data");
+  res = create_file(testfile, bigdata, 100);
+  if (res == -1)
+    return -1;
+
+  /* Growing past the INode moves the data out into a block */
+  fd = open(testfile, O_WRONLY | O_APPEND);
+  if (fd == -1) {
+    PERROR("open");
+    return -1;
+  }
+  res = write(fd, bigdata + 100, 400);
+  if (res == -1) {
+    PERROR("write");
+    close(fd);
+    return -1;
+  }
+  if (res != 400) {
+    ERROR("write is short: %u instead of %u", res, 400);
+    close(fd);
+    return -1;
+  }
+  res = close(fd);
+  if (res == -1) {
+    PERROR("close");
+    return -1;
+  }
+  err += check_size(testfile, 500);
+  err += check_data(testfile, bigdata, 0, 500);
+
+  /* ...and truncating brings it back */
+  res = truncate(testfile, 50);
+  if (res == -1) {
+    PERROR("truncate");
+    return -1;
+  }
+  err += check_size(testfile, 50);
+  err += check_data(testfile, bigdata, 0, 50);
+
+  res = unlink(testfile);
+  if (res == -1) {
+    PERROR("unlink");
+    return -1;
+  }
+  if (err)
+    return -1;
+
+  success();
+  return 0;
+}
+
+static int test_large_dir(void)
+{
+  static char names[32][32];
+  const char *dir_files[33];
+  int res;
+  int i;
+  int err = 0;
+
+  start_test("directory past the inline size");
+  for (i = 0; i < 32; i++) {
+    sprintf(names[i], "a-rather-long-entry-name-%02i", i);
+    dir_files[i] = names[i];
+  }
+  dir_files[i] = NULL;
+
+  /* Entries are added one at a time, so the directory outgrows the
+     INode part of the way through */
+  res = create_dir(testdir, dir_files);
+  if (res == -1)
+    return -1;
+  err += cleanup_dir(testdir, dir_files, 0);
+  err += check_dir_contents(testdir, dir_files + 32);
+  res = rmdir(testdir);
+  if (res == -1) {
+    PERROR("rmdir");
+    return -1;
+  }
+  res = check_nonexist(testdir);
+  if (res == -1)
+    return -1;
+  if (err)
+    return -1;
+
+  success();
+  return 0;
+}
+
+static int test_packed_tail(void)
+{
+  int len = 4096 + 1000;
+  int len2 = 2 * 4096 + 500;
+  int res;
+  int fd;
+  int err = 0;
+
+  start_test("packed tail");
+  /* Both tails get packed on close, into the same fragment block */
+  res = create_file(testfile, bigdata, len);
+  if (res == -1)
+    return -1;
+  res = create_file(testfile2, bigdata + 7, len2);
+  if (res == -1)
+    return -1;
+  err += check_data(testfile, bigdata, 0, len);
+
+  /* Appending unpacks the tail again */
+  fd = open(testfile, O_RDWR | O_APPEND);
+  if (fd == -1) {
+    PERROR("open");
+    return -1;
+  }
+  res = write(fd, bigdata + len, 300);
+  if (res == -1) {
+    PERROR("write");
+    close(fd);
+    return -1;
+  }
+  if (res != 300) {
+    ERROR("write is short: %u instead of %u", res, 300);
+    close(fd);
+    return -1;
+  }
+  err += fcheck_size(fd, len + 300);
+  err += fcheck_data(fd, bigdata, 0, len + 300);
+  res = close(fd);
+  if (res == -1) {
+    PERROR("close");
+    return -1;
+  }
+  err += check_data(testfile, bigdata, 0, len + 300);
+  err += check_data(testfile2, bigdata + 7, 0, len2);
+
+  res = unlink(testfile);
+  if (res == -1) {
+    PERROR("unlink");
+    return -1;
+  }
+  err += check_data(testfile2, bigdata + 7, 0, len2);
+  res = unlink(testfile2);
+  if (res == -1) {
+    PERROR("unlink");
+    return -1;
+  }
+  if (err)
+    return -1;
+
+  success();
+  return 0;
+}
+
+static int test_background_unlink(void)
+{
+  const int nblocks = 256;
+  struct statvfs before;
+  struct statvfs after;
+  int res;
+  int fd;
+  int i;
+
+  start_test("unlink frees blocks in the background");
+  unlink(testfile);
+  fd = creat(testfile, 0644);
+  if (fd == -1) {
+    PERROR("creat");
+    return -1;
+  }
+  for (i = 0; i < nblocks; i++) {
+    res = write(fd, bigdata, 4096);
+    if (res != 4096) {
+      PERROR("write");
+      close(fd);
+      return -1;
+    }
+  }
+  res = close(fd);
+  if (res == -1) {
+    PERROR("close");
+    return -1;
+  }
+  res = statvfs(basedir, &before);
+  if (res == -1) {
+    PERROR("statvfs");
+    return -1;
+  }
+
+  res = unlink(testfile);
+  if (res == -1) {
+    PERROR("unlink");
+    return -1;
+  }
+  res = check_nonexist(testfile);
+  if (res == -1)
+    return -1;
+
+  /* The blocks come back some time after unlink returns */
+  for (i = 0; i < 100; i++) {
+    res = statvfs(basedir, &after);
+    if (res == -1) {
+      PERROR("statvfs");
+      return -1;
+    }
+    if (after.f_bfree >= before.f_bfree + nblocks)
+      break;
+    usleep(100000);
+  }
+  if (after.f_bfree < before.f_bfree + nblocks) {
+    ERROR("%lu blocks freed instead of %u",
+          (unsigned long) (after.f_bfree - before.f_bfree), nblocks);
+    return -1;
+  }
+
+  success();
+  return 0;
+}
+
+static int test_clone_range(void)
+{
+  int len = 3 * 4096;
+  struct CloneRequest request;
+  struct stat stbuf;
+  int res;
+  int fd_in, fd_out;
+  int err = 0;
+
+  start_test("clone range");
+  res = create_file(testfile, bigdata, len);
+  if (res == -1)
+    return -1;
+  fd_in = open(testfile, O_RDONLY);
+  if (fd_in == -1) {
+    PERROR("open");
+    return -1;
+  }
+  res = fstat(fd_in, &stbuf);
+  close(fd_in);
+  if (res == -1) {
+    PERROR("fstat");
+    return -1;
+  }
+
+  unlink(testfile2);
+  fd_out = creat(testfile2, 0644);
+  if (fd_out == -1) {
+    PERROR("creat");
+    return -1;
+  }
+  request.src_ino = stbuf.st_ino;
+  request.src_offset = 0;
+  request.dst_offset = 0;
+  request.length = len;
+  res = ioctl(fd_out, SIGSEGV_IOC_CLONE_RANGE, &request);
+  if (res == -1) {
+    PERROR("ioctl(CLONE_RANGE)");
+    close(fd_out);
+    return -1;
+  }
+  res = close(fd_out);
+  if (res == -1) {
+    PERROR("close");
+    return -1;
+  }
+  if (request.length != (uint64_t) len) {
+    ERROR("clone is short: %u instead of %u", (unsigned) request.length, len);
+    return -1;
+  }
+
+  /* The kernel only sees the new size once its cached attributes
+     time out */
+  for (res = 0; res < 30; res++) {
+    if (stat(testfile2, &stbuf) == 0 && stbuf.st_size == len)
+      break;
+    usleep(100000);
+  }
+  err += check_size(testfile2, len);
+  err += check_data(testfile2, bigdata, 0, len);
+
+  /* The blocks are shared until either side writes to them */
+  fd_out = open(testfile2, O_WRONLY);
+  if (fd_out == -1) {
+    PERROR("open");
+    return -1;
+  }
+  res = pwrite(fd_out, testdata, testdatalen, 4096);
+  if (res != testdatalen) {
+    PERROR("pwrite");
+    close(fd_out);
+    return -1;
+  }
+  res = close(fd_out);
+  if (res == -1) {
+    PERROR("close");
+    return -1;
+  }
+  err += check_data(testfile2, testdata, 4096, testdatalen);
+  err += check_data(testfile2, bigdata + 4096 + testdatalen,
+                    4096 + testdatalen, len - 4096 - testdatalen);
+  err += check_data(testfile, bigdata, 0, len);
+
+  res = unlink(testfile);
+  if (res == -1) {
+    PERROR("unlink");
+    return -1;
+  }
+  err += check_data(testfile2, bigdata, 0, 4096);
+  res = unlink(testfile2);
+  if (res == -1) {
+    PERROR("unlink");
+    return -1;
+  }
+  if (err)
+    return -1;
+
+  success();
+  return 0;
+}
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+static int test_punch_hole(void)
+{
+  int len = 3 * 4096 + 1000;
+  const int nblocks = 600;
+  struct statvfs before, after;
+  int res;
+  int fd;
+  int i;
+  int err = 0;
+
+  start_test("punch hole");
+  res = create_file(testfile, bigdata, len);
+  if (res == -1)
+    return -1;
+  fd = open(testfile, O_WRONLY);
+  if (fd == -1) {
+    PERROR("open");
+    return -1;
+  }
+  res = statvfs(basedir, &before);
+  if (res == -1) {
+    PERROR("statvfs");
+    close(fd);
+    return -1;
+  }
+
+  /* A whole block goes back to the free list */
+  res = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 4096, 4096);
+  if (res == -1) {
+    PERROR("fallocate");
+    close(fd);
+    return -1;
+  }
+  res = statvfs(basedir, &after);
+  if (res == -1) {
+    PERROR("statvfs");
+    close(fd);
+    return -1;
+  }
+  if (after.f_bfree <= before.f_bfree) {
+    ERROR("no blocks freed: %lu before, %lu after",
+          (unsigned long) before.f_bfree, (unsigned long) after.f_bfree);
+    err--;
+  }
+
+  /* Part of a block is just zeroed */
+  res = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 100, 200);
+  if (res == -1) {
+    PERROR("fallocate");
+    close(fd);
+    return -1;
+  }
+  res = close(fd);
+  if (res == -1) {
+    PERROR("close");
+    return -1;
+  }
+
+  err += check_size(testfile, len);
+  err += check_data(testfile, bigdata, 0, 100);
+  err += check_data(testfile, zerodata, 100, 200);
+  err += check_data(testfile, bigdata + 300, 300, 4096 - 300);
+  err += check_data(testfile, zerodata, 4096, 4096);
+  err += check_data(testfile, bigdata + 2 * 4096, 2 * 4096, len - 2 * 4096);
+  res = unlink(testfile);
+  if (res == -1) {
+    PERROR("unlink");
+    return -1;
+  }
+  if (err)
+    return -1;
+
+  /* A big hole gives back the indirect blocks that mapped it too */
+  fd = open(testfile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    PERROR("open");
+    return -1;
+  }
+  for (i = 0; i < nblocks; i++) {
+    res = write(fd, bigdata, 4096);
+    if (res != 4096) {
+      PERROR("write");
+      close(fd);
+      return -1;
+    }
+  }
+  res = fsync(fd);
+  if (res == -1) {
+    PERROR("fsync");
+    close(fd);
+    return -1;
+  }
+  res = statvfs(basedir, &before);
+  if (res == -1) {
+    PERROR("statvfs");
+    close(fd);
+    return -1;
+  }
+  res = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 4 * 4096, (off_t) (nblocks - 4) * 4096);
+  if (res == -1) {
+    PERROR("fallocate");
+    close(fd);
+    return -1;
+  }
+  res = statvfs(basedir, &after);
+  if (res == -1) {
+    PERROR("statvfs");
+    close(fd);
+    return -1;
+  }
+  /* The single indirect block, and two levels of the double one */
+  if (after.f_bfree < before.f_bfree + (nblocks - 4) + 3) {
+    ERROR("%lu blocks freed by a hole of %i",
+          (unsigned long) (after.f_bfree - before.f_bfree), nblocks - 4);
+    err--;
+  }
+
+  /* Writing into the hole maps it again */
+  res = pwrite(fd, bigdata, 4096, 300 * 4096);
+  if (res != 4096) {
+    PERROR("pwrite");
+    err--;
+  }
+  res = close(fd);
+  if (res == -1) {
+    PERROR("close");
+    return -1;
+  }
+  err += check_size(testfile, nblocks * 4096);
+  err += check_data(testfile, bigdata, 3 * 4096, 4096);
+  err += check_data(testfile, zerodata, 4 * 4096, 4096);
+  err += check_data(testfile, zerodata, 299 * 4096, 4096);
+  err += check_data(testfile, bigdata, 300 * 4096, 4096);
+  err += check_data(testfile, zerodata, 301 * 4096, 4096);
+  err += check_data(testfile, zerodata, (nblocks - 1) * 4096, 4096);
+  res = unlink(testfile);
+  if (res == -1) {
+    PERROR("unlink");
+    return -1;
+  }
+  if (err)
+    return -1;
+
+  success();
+  return 0;
+}
+#else
+static int test_punch_hole(void)
+{
+  return 0;
+}
+#endif
+
+static int test_sparse_write_full(void)
+{
+  const int gap = 2 * 4096;
+  const int len = 8 * 4096;
+  char data[8 * 4096];
+  struct statvfs before, after;
+  struct stat stbuf;
+  int res;
+  int fd, fill;
+  int i;
+  int err = 0;
+
+  start_test("sparse pwrite past EOF on a full filesystem");
+  unlink(testfile);
+  unlink(testfile2);
+  for (i = 0; i < len; i++)
+    data[i] = 'A' + i % 26;
+  res = statvfs(basedir, &before);
+  if (res == -1) {
+    PERROR("statvfs");
+    return -1;
+  }
+  fd = open(testfile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    PERROR("open");
+    return -1;
+  }
+
+  /* Fill the filesystem, then give a few blocks back */
+  fill = creat(testfile2, 0644);
+  if (fill == -1) {
+    PERROR("creat");
+    close(fd);
+    return -1;
+  }
+  for (i = 0; write(fill, bigdata, 4096) == 4096; i++)
+    ;
+  if (errno != ENOSPC) {
+    PERROR("write");
+    err--;
+  }
+  res = ftruncate(fill, (off_t) (i > 5 ? i - 5 : 0) * 4096);
+  if (res == -1) {
+    PERROR("ftruncate");
+    err--;
+  }
+  close(fill);
+
+  /* The gap fits but not all of the data; only the data counts */
+  res = pwrite(fd, data, len, gap);
+  if (res == -1 && errno != ENOSPC) {
+    PERROR("pwrite");
+    err--;
+  } else if (res > len) {
+    ERROR("pwrite of %i bytes returned %i", len, res);
+    err--;
+  } else if (res > 0) {
+    int written = res;
+    res = fstat(fd, &stbuf);
+    if (res == -1) {
+      PERROR("fstat");
+      err--;
+    } else if (stbuf.st_size != gap + written) {
+      ERROR("pwrite returned %i but wrote %i", written, (int) stbuf.st_size - gap);
+      err--;
+    } else {
+      err += fcheck_data(fd, zerodata, 0, 4096);
+      err += fcheck_data(fd, zerodata, 4096, 4096);
+      err += fcheck_data(fd, data, gap, stbuf.st_size - gap);
+    }
+  }
+  close(fd);
+
+  /* Nothing left at all: the error, not the gap */
+  fill = open(testfile2, O_WRONLY | O_APPEND);
+  if (fill != -1) {
+    while (write(fill, bigdata, 4096) > 0)
+      ;
+    close(fill);
+  }
+  fd = open(testfile, O_WRONLY);
+  if (fd == -1) {
+    PERROR("open");
+    return -1;
+  }
+  res = fstat(fd, &stbuf);
+  if (res == -1) {
+    PERROR("fstat");
+    close(fd);
+    return -1;
+  }
+  res = pwrite(fd, data, 4096, stbuf.st_size + 64 * 4096);
+  if (res == -1 && errno != ENOSPC) {
+    PERROR("pwrite");
+    err--;
+  } else if (res > 4096) {
+    ERROR("pwrite of 4096 bytes returned %i", res);
+    err--;
+  }
+  close(fd);
+
+  unlink(testfile);
+  unlink(testfile2);
+
+  /* Let the background unlinks finish before the next test */
+  for (i = 0; i < 100; i++) {
+    res = statvfs(basedir, &after);
+    if (res == -1 || after.f_bfree + 16 >= before.f_bfree)
+      break;
+    usleep(100000);
+  }
+  if (err)
+    return -1;
+
+  success();
+  return 0;
+}
+
 int main(int argc, char *argv[])
 {
   const char *basepath;
@@ -1805,6 +2463,7 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  sprintf(basedir, "%s", basepath);
   sprintf(testfile, "%s/testfile", basepath);
   sprintf(testfile2, "%s/testfile2", basepath);
   sprintf(testdir, "%s/testdir", basepath);
@@ -1818,10 +2477,13 @@ int main(int argc, char *argv[])
   sprintf(subfile_r, "%s/subfile", testdir2_r);
 
   is_root = (geteuid() == 0);
+  for (a = 0; a < (int) sizeof(bigdata); a++)
+    bigdata[a] = 'a' + a % 26;
 
   err += test_create();
   err += test_create_unlink();
   err += test_symlink();
+  err += test_symlink_inline();
   err += test_link();
   err += test_link2();
 #ifndef __FreeBSD__
@@ -1888,6 +2550,13 @@ int main(int argc, char *argv[])
   err += test_create_ro_dir(O_CREAT | O_WRONLY);
   err += test_create_ro_dir(O_CREAT | O_TRUNC);
   err += test_copy_file_range();
+  err += test_inline_data();
+  err += test_large_dir();
+  err += test_packed_tail();
+  err += test_background_unlink();
+  err += test_clone_range();
+  err += test_punch_hole();
+  err += test_sparse_write_full();
 
   unlink(testfile);
   unlink(testfile2);
@@ -0,0 +1,37 @@
+#include "lib/Ioctl.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+static void usage() {
+  std::cerr << "USAGE: trim <mount-point>\n";
+  std::cerr << "Discards every free block of a mounted filesystem, so the device\n";
+  std::cerr << "(or the file holding it) can reclaim the space, like fstrim.\n";
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  if(argc != 2) usage();
+
+  int fd = open(argv[1], O_RDONLY);
+  if(fd < 0) {
+    std::cerr << argv[1] << ": " << strerror(errno) << '\n';
+    return 1;
+  }
+
+  TrimRequest args;
+  args.discarded = 0;
+  if(ioctl(fd, SIGSEGV_IOC_TRIM, &args) != 0) {
+    std::cerr << "trim " << argv[1] << ": " << strerror(errno) << '\n';
+    close(fd);
+    return 1;
+  }
+
+  std::cout << argv[1] << ": " << args.discarded << " blocks discarded\n";
+  close(fd);
+  return 0;
+}